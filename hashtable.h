@@ -25,6 +25,8 @@
  * of the table
  *
  * Limitation: a specific entry (a specific key) can be inserted and deleted by one thread.
+ * DECLARE_HASHTABLE_TAGGED lifts the limitation for the uint32_t keys.
+ * Limitation: the growable mode (max_bits > bits) blocks, see hashtable_resize_t
  *
  * Performance: a core can make above 13M add&remove operations per second, cost of a
  * single operation is under 20nano which is an equivalent of 50-100 opcodes.
@@ -34,8 +36,16 @@
 
 
 #ifdef __KERNEL__
+#   include "linux/types.h"
+#   include "linux/kernel.h"
+#   include "linux/string.h"
+#   include "linux/mm.h"
 #   include "linux/vmalloc.h"
+#   include "linux/version.h"
 #   include "linux/printk.h"
+#   include "linux/percpu.h"
+#   include "linux/sched.h"
+#   include "linux/rcupdate.h"
 #   define DEV_NAME "lockless"
 #   define PRINTF(s, ...) printk(KERN_ALERT DEV_NAME ": %s: " s "\n", __func__, __VA_ARGS__)
 #   define PRIu64 "llu"
@@ -43,6 +53,10 @@
 #   include <stdlib.h>
 #   include <stdio.h>
 #   include <inttypes.h>
+#   include <string.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
 #   define PRINTF(s, ...) printf("%s: " s "\n", __func__, __VA_ARGS__)
 #   define likely(x)      __builtin_expect(!!(x), 1)   // !!(x) will return 1 for any x != 0
 #   define unlikely(x)    __builtin_expect(!!(x), 0)
@@ -75,6 +89,133 @@ static uint32_t hash_none(uint32_t key)
     return key;
 }
 
+/**
+ * Thomas Wang's 64 bits to 32 bits hash from the same page
+ */
+static uint32_t hash6432shift(uint64_t key)
+{
+    key = (~key) + (key << 18); // key = (key << 18) - key - 1;
+    key = key ^ (key >> 31);
+    key = key * 21;             // key = (key + (key << 2)) + (key << 4);
+    key = key ^ (key >> 11);
+    key = key + (key << 6);
+    key = key ^ (key >> 22);
+    return (uint32_t)key;
+}
+
+/**
+ * The functions below can be inlined, see DECLARE_HASHTABLE_HASH
+ * Fibonacci hashing: the high 32 bits of the product by 2^64/phi
+ */
+static inline uint32_t hash_fibonacci(uint32_t key)
+{
+    return (uint32_t)(((uint64_t)key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static inline uint32_t hash64_fibonacci(uint64_t key)
+{
+    key = key * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(key >> 32);
+}
+
+/**
+ * MurmurHash3 finalizers
+ */
+static inline uint32_t hash_murmur3(uint32_t key)
+{
+    key ^= key >> 16;
+    key *= 0x85ebca6b;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35;
+    key ^= key >> 16;
+    return key;
+}
+
+static inline uint32_t hash64_murmur3(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ull;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
+
+/**
+ * CRC32C, a single instruction with SSE4.2 or ARMv8 CRC, a bitwise loop otherwise
+ * Build with -msse4.2 (-march=native) to get the instruction
+ */
+#if !defined(__KERNEL__) && defined(__SSE4_2__)
+#   include <nmmintrin.h>
+#   define HASHTABLE_CRC32C_U32(crc, key) _mm_crc32_u32(crc, key)
+#elif !defined(__KERNEL__) && defined(__ARM_FEATURE_CRC32)
+#   include <arm_acle.h>
+#   define HASHTABLE_CRC32C_U32(crc, key) __crc32cw(crc, key)
+#endif
+
+static inline uint32_t hash_crc32c(uint32_t key)
+{
+#ifdef HASHTABLE_CRC32C_U32
+    return HASHTABLE_CRC32C_U32(~0u, key);
+#else
+    uint32_t crc = ~0u ^ key;
+    int i;
+    for (i = 0;i < 32;i++)
+    {
+        crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    }
+    return crc;
+#endif
+}
+
+static inline uint32_t hash64_crc32c(uint64_t key)
+{
+    return hash_crc32c((uint32_t)key ^ hash_crc32c((uint32_t)(key >> 32)));
+}
+
+/**
+ * Call the hash functions of hashtable_t, see DECLARE_HASHTABLE_HASH
+ * Expands in the scope of a function with a 'hashtable' argument
+ */
+#define HASHTABLE_HASH_DYNAMIC(key)                                                                                               \
+    ((sizeof(key) > sizeof(uint32_t)) ? hashtable->hashfunction64((uint64_t)(key)) : hashtable->hashfunction((uint32_t)(key)))
+
+/**
+ * Instrumentation, set before including the file. Requires the statistics
+ * HASHTABLE_HISTOGRAM 1 - histograms of the probe distance: probe_insert[d] counts
+ *   the inserts which placed the key d slots from the start of the probe window,
+ *   probe_search[d] counts the successful searches. The second TWO_CHOICE window
+ *   starts at max_tries. The growable table does not record the searches
+ * HASHTABLE_LATENCY_SAMPLE N - time one of 2^N calls of insert/remove/find,
+ *   latency_xx[b] counts the calls which took 2^b..2^(b+1)-1 cycles
+ */
+#ifndef HASHTABLE_HISTOGRAM
+#   define HASHTABLE_HISTOGRAM 0
+#endif
+#ifndef HASHTABLE_PROBE_BUCKETS
+#   define HASHTABLE_PROBE_BUCKETS 16
+#endif
+#ifndef HASHTABLE_LATENCY_SAMPLE
+#   define HASHTABLE_LATENCY_SAMPLE 0
+#endif
+#define HASHTABLE_LATENCY_BUCKETS 24
+
+/**
+ * HASHTABLE_RELOCATE 1 - an insert of an existing key to a TWO_CHOICE table moves the key
+ *   to the first free slot of the probe window and removes the old copy. Only the owner of
+ *   the key inserts the key, the other keys are not moved. A key which was pushed further
+ *   by the collisions returns closer to the start of the window when the slots ahead are
+ *   freed. The growable table does not relocate, it rehashes when it grows. The insert
+ *   reserves the free slot with the placeholder HASHTABLE_KEY_FROZEN, writes the data,
+ *   publishes the key and removes the old copy, a find at the same time gets the data of
+ *   the old copy or of the new one. The table does not accept the key HASHTABLE_KEY_FROZEN
+ * A LINEAR insert updates the key in place and does not take a free slot ahead of the key,
+ * a window keeps a single copy of a key
+ */
+#ifndef HASHTABLE_RELOCATE
+#   define HASHTABLE_RELOCATE 0
+#endif
+
 typedef struct
 {
     uint64_t insert;
@@ -86,6 +227,21 @@ typedef struct
     uint64_t remove_err;
     uint64_t search_ok;
     uint64_t search_err;
+    uint64_t relocated;
+    uint64_t expired;
+    uint64_t local;
+    uint64_t filtered;
+    /* The tagged insert did not wait for another writer of the key */
+    uint64_t insert_busy;
+#if HASHTABLE_HISTOGRAM
+    uint64_t probe_insert[HASHTABLE_PROBE_BUCKETS];
+    uint64_t probe_search[HASHTABLE_PROBE_BUCKETS];
+#endif
+#if HASHTABLE_LATENCY_SAMPLE
+    uint64_t latency_insert[HASHTABLE_LATENCY_BUCKETS];
+    uint64_t latency_remove[HASHTABLE_LATENCY_BUCKETS];
+    uint64_t latency_search[HASHTABLE_LATENCY_BUCKETS];
+#endif
 } hashtable_stat_t;
 
 static const char *hashtable_stat_names[] = {
@@ -98,8 +254,139 @@ static const char *hashtable_stat_names[] = {
 									    "Remove_err",
 									    "Search_ok",
 									    "Search_err",
+									    "Relocated",
+									    "Expired",
+									    "Local",
+									    "Filtered",
+									    "Insert_busy",
 };
 
+/* The counters which precede the histograms in hashtable_stat_t */
+#define HASHTABLE_STAT_COUNTERS ARRAY_SIZE(hashtable_stat_names)
+
+/**
+ * Statistics mode, set HASHTABLE_STAT before including the file
+ * HASHTABLE_STAT_NONE   - no statistics, the counters are compiled out
+ * HASHTABLE_STAT_SHARED - all contexts update a single hashtable_stat_t, the
+ *                         cache line bounces between the cores and the counters are racy
+ * HASHTABLE_STAT_PERCPU - every CPU (kernel) or every thread (userspace) updates
+ *                         its own cache line, hashtable_show() aggregates on read
+ */
+#define HASHTABLE_STAT_NONE      0
+#define HASHTABLE_STAT_SHARED    1
+#define HASHTABLE_STAT_PERCPU    2
+
+#ifndef HASHTABLE_STAT
+#   define HASHTABLE_STAT HASHTABLE_STAT_PERCPU
+#endif
+
+#define HASHTABLE_CACHE_LINE 64
+
+#if (HASHTABLE_STAT == HASHTABLE_STAT_PERCPU) && !defined(__KERNEL__)
+/**
+ * Userspace does not have cheap per-CPU variables. A thread picks a shard
+ * the first time it touches a hashtable and keeps it. If there are more
+ * threads than shards the threads share shards and the counters are racy
+ */
+#   define HASHTABLE_STAT_SHARDS 64
+
+typedef struct
+{
+    hashtable_stat_t stat;
+} __attribute__((aligned(HASHTABLE_CACHE_LINE))) hashtable_stat_shard_t;
+
+static __thread int hashtable_stat_shard = -1;
+static int hashtable_stat_shard_next;
+#endif
+
+/**
+ * Growable mode
+ * A table with max_bits > bits doubles when the probe window is full. Every
+ * size is a generation. When a new generation is added the slots of the old
+ * generations migrate to the new one incrementally: the writers move a chunk of slots
+ * on every insert/remove, the owner of a key moves the key itself when it updates the key.
+ * A context moving a key "freezes" the slot (HASHTABLE_KEY_FROZEN) and owns the key
+ * until it marks the slot HASHTABLE_KEY_MOVED. A context which does not find the key
+ * and sees a frozen slot in the probe window tries again.
+ * A key which does not fit the probe window of the new generation stays in the old one.
+ * The next pass starts after a key leaves the old generations or when the table grows
+ * again. Lookups check all generations from the oldest to the current one.
+ * The keys illegal_key-1 and illegal_key-2 mark the slots, the growable table does not
+ * accept them, insert, find and remove return 0.
+ * The operations on a growable table run in a read-side section, rcu_read_lock() in the
+ * kernel, a counter of the thread in userspace. hashtable_grow_reclaim() frees the tables
+ * of the migrated generations after the sections which could see them end, and
+ * hashtable_<tokn>_grow_check() calls it after a migration completes.
+ * The growable mode is not lock-free. A frozen slot hides the key, the lookups and the
+ * writers of the probe window, and the migration of the slot, spin until the context
+ * holding the slot marks it moved or unfreezes it. In the kernel the context holds the
+ * slot with the interrupts disabled (HASHTABLE_MIGRATE_BEGIN()) and the wait is bounded
+ * by the move of one key on another CPU. An NMI handler should not access a growable
+ * table. A migrating context preempted in userspace (HASHTABLE_MIGRATE_BEGIN() is empty)
+ * stalls the other contexts. An insert which finds the table full waits up to
+ * HASHTABLE_GROW_SPIN relaxes for the context adding a generation and fails after that.
+ * The fixed size table does not block.
+ */
+#define HASHTABLE_GENERATIONS 32
+
+#ifndef __KERNEL__
+/**
+ * Userspace read-side sections. A thread picks a shard the first time it reads a
+ * growable table. A section increments the counter of the shard for the current phase,
+ * hashtable_grow_reclaim() flips the phase and waits for the counters of the previous
+ * phase to drain, twice, like SRCU
+ */
+#   define HASHTABLE_GROW_READERS 64
+
+typedef struct
+{
+    volatile size_t count[2];
+} __attribute__((aligned(HASHTABLE_CACHE_LINE))) hashtable_grow_readers_t;
+
+static __thread int hashtable_grow_reader = -1;
+static int hashtable_grow_reader_next;
+#endif
+
+typedef struct
+{
+    void *table;
+    size_t size;
+    size_t memory_size;
+    size_t bits;
+
+    /* Migration of this generation to the next one */
+    volatile size_t migrate_next;
+    volatile size_t migrate_done;
+    volatile size_t migrate_stuck;
+} hashtable_generation_t;
+
+typedef struct
+{
+    hashtable_generation_t generation[HASHTABLE_GENERATIONS];
+    /* Generation accepting inserts */
+    volatile size_t newest;
+    /* Oldest generation which can keep keys, migrates to the current generation */
+    volatile size_t oldest;
+    /* Incremented when newest or oldest changes */
+    volatile size_t seq;
+    volatile uint32_t growing;
+    volatile uint32_t grow_pending;
+    /* A pass of the migration ended with keys which do not fit the current generation */
+    volatile uint32_t stuck;
+    /* Keys removed from the old generations or moved by the owners */
+    volatile size_t departed;
+    /* departed when the pass of the migration started */
+    size_t departed_pass;
+    /* Number of generations freed by hashtable_grow_reclaim() */
+    size_t reclaimed;
+    volatile uint32_t reclaiming;
+    hashtable_stat_t stat_last;
+#ifndef __KERNEL__
+    volatile size_t reader_phase;
+    hashtable_grow_readers_t readers[HASHTABLE_GROW_READERS];
+#endif
+} hashtable_resize_t;
+
 typedef struct
 {
     const char *name;
@@ -107,57 +394,371 @@ typedef struct
 
     uint32_t (*hashfunction)(uint32_t);
 
+    /* Grow up to max_bits, 0 - fixed size */
+    size_t max_bits;
+
+    /* Hash function for 64 bits keys, see DECLARE_HASHTABLE_KEY */
+    uint32_t (*hashfunction64)(uint64_t);
+
+    /* HASHTABLE_ALLOC_xx flags for the memory of the table */
+    unsigned int alloc_flags;
+    /* NUMA node for HASHTABLE_ALLOC_NUMA_BIND */
+    int numa_node;
+
+    /* Keep the epoch of the insert for every slot, see hashtable_<tokn>_expire(), reserves the key illegal_key-1 */
+    int expire;
+
+    /* Counting Bloom filter of 2^filter cache lines in front of find() and remove(), 0 - no filter */
+    int filter;
+
     size_t __size;
     size_t __memory_size;
     hashtable_stat_t __stat;
+#if (HASHTABLE_STAT == HASHTABLE_STAT_PERCPU)
+#   ifdef __KERNEL__
+    hashtable_stat_t __percpu *__stat_percpu;
+#   else
+    hashtable_stat_shard_t *__stat_percpu;
+#   endif
+#endif
     void *__table;
+    hashtable_resize_t *__resize;
+    volatile uint32_t *__epochs;
+    size_t __epochs_size;
+    volatile uint32_t __epoch;
+    size_t __expire_next;
+    volatile uint8_t *__filter;
+    size_t __filter_size;
+    /* HASHTABLE_STORAGE_xx, the memory of the table */
+    int __storage;
 } hashtable_t;
 
+/**
+ * The memory of the table
+ * ALLOC - hashtable_alloc_table()
+ * ZEROED - zeroed pages of hashtable_alloc_table(), the empty slot is zero bytes
+ * FILE - the memory of the file, see hashtable_<tokn>_load_mmap()
+ * CALLER - the memory of the application, see hashtable_<tokn>_init_storage()
+ * A growable table is always ALLOC
+ */
+#define HASHTABLE_STORAGE_ALLOC  0
+#define HASHTABLE_STORAGE_ZEROED 1
+#define HASHTABLE_STORAGE_FILE   2
+#define HASHTABLE_STORAGE_CALLER 3
+
+#if (HASHTABLE_STAT == HASHTABLE_STAT_NONE)
+#   define HASHTABLE_STAT_ADD(hashtable, counter, value)  do {} while (0)
+#elif (HASHTABLE_STAT == HASHTABLE_STAT_SHARED)
+#   define HASHTABLE_STAT_ADD(hashtable, counter, value)  (hashtable)->__stat.counter += (value)
+#elif defined(__KERNEL__)
+#   define HASHTABLE_STAT_ADD(hashtable, counter, value)  this_cpu_add((hashtable)->__stat_percpu->counter, (value))
+#else
+#   define HASHTABLE_STAT_ADD(hashtable, counter, value)  hashtable_stat_local(hashtable)->counter += (value)
+
+static inline hashtable_stat_t *hashtable_stat_local(hashtable_t *hashtable)
+{
+    int shard = hashtable_stat_shard;
+    if (unlikely(shard < 0))
+    {
+        shard = __sync_fetch_and_add(&hashtable_stat_shard_next, 1) % HASHTABLE_STAT_SHARDS;
+        hashtable_stat_shard = shard;
+    }
+    return &hashtable->__stat_percpu[shard].stat;
+}
+#endif
+
+#define HASHTABLE_STAT_INC(hashtable, counter) HASHTABLE_STAT_ADD(hashtable, counter, 1)
+
+#if HASHTABLE_HISTOGRAM
+#   define HASHTABLE_STAT_PROBE(hashtable, histogram, distance)                                                                   \
+        HASHTABLE_STAT_INC(hashtable, histogram[((distance) < HASHTABLE_PROBE_BUCKETS) ? (distance) : (HASHTABLE_PROBE_BUCKETS-1)])
+#else
+#   define HASHTABLE_STAT_PROBE(hashtable, histogram, distance) do {} while (0)
+#endif
+
+#if HASHTABLE_LATENCY_SAMPLE
+#   ifdef __KERNEL__
+#       include "linux/timex.h"
+#       define HASHTABLE_CYCLES() ((uint64_t)get_cycles())
+static DEFINE_PER_CPU(uint32_t, hashtable_latency_tick);
+#       define HASHTABLE_LATENCY_TICK() this_cpu_inc_return(hashtable_latency_tick)
+#   else
+#       if defined(__x86_64__) || defined(__i386__)
+#           define HASHTABLE_CYCLES() ((uint64_t)__builtin_ia32_rdtsc())
+#       else
+#           include <time.h>
+static inline uint64_t hashtable_cycles(void)
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t)tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
+#           define HASHTABLE_CYCLES() hashtable_cycles()
+#       endif
+static __thread uint32_t hashtable_latency_tick;
+#       define HASHTABLE_LATENCY_TICK() (++hashtable_latency_tick)
+#   endif
+/* Returns 0 if the call is not sampled */
+#   define HASHTABLE_LATENCY_START()                                                                                              \
+        ((HASHTABLE_LATENCY_TICK() & ((1u << HASHTABLE_LATENCY_SAMPLE) - 1)) ? 0 : HASHTABLE_CYCLES())
+#   define HASHTABLE_LATENCY_END(hashtable, start, histogram)                                                                     \
+    do {                                                                                                                          \
+        if (unlikely(start))                                                                                                      \
+        {                                                                                                                         \
+            const int bucket = 63 - __builtin_clzll((HASHTABLE_CYCLES() - (start)) | 1);                                          \
+            (void)bucket;                                                                                                         \
+            HASHTABLE_STAT_INC(hashtable,                                                                                         \
+                    histogram[(bucket < HASHTABLE_LATENCY_BUCKETS) ? bucket : (HASHTABLE_LATENCY_BUCKETS-1)]);                    \
+        }                                                                                                                         \
+    } while (0)
+#else
+#   define HASHTABLE_LATENCY_START() 0
+#   define HASHTABLE_LATENCY_END(hashtable, start, histogram) (void)(start)
+#endif
+
+static int hashtable_stat_init(hashtable_t *hashtable)
+{
+#if (HASHTABLE_STAT == HASHTABLE_STAT_PERCPU)
+#   ifdef __KERNEL__
+    hashtable->__stat_percpu = alloc_percpu(hashtable_stat_t);
+#   else
+    void *p = NULL;
+    if (posix_memalign(&p, HASHTABLE_CACHE_LINE, HASHTABLE_STAT_SHARDS*sizeof(hashtable_stat_shard_t)) == 0)
+    {
+        memset(p, 0, HASHTABLE_STAT_SHARDS*sizeof(hashtable_stat_shard_t));
+    }
+    hashtable->__stat_percpu = (hashtable_stat_shard_t *)p;
+#   endif
+    if (!hashtable->__stat_percpu)
+    {
+        PRINTF("Failed to allocate statistics for the hashtable %s", hashtable->name);
+        return 0;
+    }
+#endif
+    memset(&hashtable->__stat, 0, sizeof(hashtable->__stat));
+    return 1;
+}
+
+static void hashtable_stat_close(hashtable_t *hashtable)
+{
+#if (HASHTABLE_STAT == HASHTABLE_STAT_PERCPU)
+#   ifdef __KERNEL__
+    free_percpu(hashtable->__stat_percpu);
+#   else
+    free(hashtable->__stat_percpu);
+#   endif
+    hashtable->__stat_percpu = NULL;
+#endif
+}
+
+/**
+ * Collect the counters of the hashtable into 'stat'
+ * In the per-CPU mode the function sums the shards. The result is not an
+ * atomic snapshot, but every counter is read exactly once
+ */
+static void hashtable_stat_get(const hashtable_t *hashtable, hashtable_stat_t *stat)
+{
+#if (HASHTABLE_STAT == HASHTABLE_STAT_PERCPU)
+    const size_t fieds_in_stat = sizeof(hashtable_stat_t)/sizeof(uint64_t);
+    uint64_t *sum = (uint64_t *)stat;
+    size_t i;
+#   ifdef __KERNEL__
+    int cpu;
+#   endif
+
+    memset(stat, 0, sizeof(*stat));
+    if (!hashtable->__stat_percpu)
+        return;
+#   ifdef __KERNEL__
+    for_each_possible_cpu(cpu)
+    {
+        const uint64_t *shard = (const uint64_t *)per_cpu_ptr(hashtable->__stat_percpu, cpu);
+#   else
+    for (int cpu = 0;cpu < HASHTABLE_STAT_SHARDS;cpu++)
+    {
+        const uint64_t *shard = (const uint64_t *)&hashtable->__stat_percpu[cpu].stat;
+#   endif
+        for (i = 0;i < fieds_in_stat;i++)
+        {
+            sum[i] += __sync_access(&shard[i]);
+        }
+    }
+#else
+    *stat = hashtable->__stat;
+#endif
+}
+
 static hashtable_t *hashtable_registry[64];
 
-static int hashtable_show(char *buf, size_t len)
+/* snprintf() returns the length of the output which did not fit the buffer too */
+#define HASHTABLE_BUF_LEFT(len, chars) (((size_t)(chars) < (len)) ? ((len) - (chars)) : 0)
+
+/* The non-zero buckets of a histogram, 'bucket:count' */
+static inline int hashtable_show_histogram(char *buf, size_t len, const char *name, const uint64_t *histogram,
+        const size_t buckets)
+{
+    size_t i;
+    int chars = snprintf(buf, len, "%-*s", name[0] ? 25 : 0, name);
+    for (i = 0;(i < buckets) && ((size_t)chars < len);i++)
+    {
+        if (histogram[i])
+        {
+            chars += snprintf(buf+chars, HASHTABLE_BUF_LEFT(len, chars), " %zu:%" PRIu64, i, histogram[i]);
+        }
+    }
+    if ((size_t)chars < len)
+    {
+        chars += snprintf(buf+chars, HASHTABLE_BUF_LEFT(len, chars), "\n");
+    }
+    return ((size_t)chars < len) ? chars : (int)len;
+}
+
+static inline int hashtable_show(char *buf, size_t len)
 {
     size_t i;
     int rc;
     size_t chars = 0;
     const char** stat_name = &hashtable_stat_names[0];
-    size_t fieds_in_stat = sizeof(hashtable_stat_t)/sizeof(uint64_t);
-    rc = snprintf(buf+chars, len-chars, "\n%-25s %12s %12s %12s",
+    size_t fieds_in_stat = HASHTABLE_STAT_COUNTERS;
+    rc = snprintf(buf+chars, HASHTABLE_BUF_LEFT(len, chars), "\n%-25s %12s %12s %12s",
             "Name", "Size", "Memory", "Ops");
     chars += rc;
 
     while (fieds_in_stat--)
     {
-        rc = snprintf(buf+chars, len-chars, " %12s", *stat_name);
+        rc = snprintf(buf+chars, HASHTABLE_BUF_LEFT(len, chars), " %12s", *stat_name);
         stat_name++;
         chars += rc;
     }
-    rc = snprintf(buf+chars, len-chars, "\n");
+    rc = snprintf(buf+chars, HASHTABLE_BUF_LEFT(len, chars), "\n");
 
     chars += rc;
     for (i = 0;i < ARRAY_SIZE(hashtable_registry);i++)
     {
         hashtable_t *hashtable = hashtable_registry[i];
-        size_t fieds_in_stat = sizeof(hashtable_stat_t)/sizeof(uint64_t);
+        size_t fieds_in_stat = HASHTABLE_STAT_COUNTERS;
+        hashtable_stat_t hashtable_stat;
         uint64_t *stat;
         if (!hashtable)
             continue;
 
-        rc = snprintf(buf+chars, len-chars, "%-25s %12zu %12zu %12" PRIu64,
+        hashtable_stat_get(hashtable, &hashtable_stat);
+        rc = snprintf(buf+chars, HASHTABLE_BUF_LEFT(len, chars), "%-25s %12zu %12zu %12" PRIu64,
         		hashtable->name, hashtable->__size, hashtable->__memory_size,
-				hashtable->__stat.insert+hashtable->__stat.remove+hashtable->__stat.search);
+				hashtable_stat.insert+hashtable_stat.remove+hashtable_stat.search);
         chars += rc;
-        stat = (uint64_t *)&hashtable->__stat;
+        stat = (uint64_t *)&hashtable_stat;
         while (fieds_in_stat--)
         {
-            rc = snprintf(buf+chars, len-chars, " %12" PRIu64, *stat);
+            rc = snprintf(buf+chars, HASHTABLE_BUF_LEFT(len, chars), " %12" PRIu64, *stat);
             stat++;
             chars += rc;
         }
-        rc = snprintf(buf+chars, len-chars, "\n");
+        rc = snprintf(buf+chars, HASHTABLE_BUF_LEFT(len, chars), "\n");
         chars += rc;
+#if HASHTABLE_HISTOGRAM
+        chars += hashtable_show_histogram(buf+chars, HASHTABLE_BUF_LEFT(len, chars), "Probe_insert",
+                hashtable_stat.probe_insert, HASHTABLE_PROBE_BUCKETS);
+        chars += hashtable_show_histogram(buf+chars, HASHTABLE_BUF_LEFT(len, chars), "Probe_search",
+                hashtable_stat.probe_search, HASHTABLE_PROBE_BUCKETS);
+#endif
+#if HASHTABLE_LATENCY_SAMPLE
+        chars += hashtable_show_histogram(buf+chars, HASHTABLE_BUF_LEFT(len, chars), "Cycles_log2_insert",
+                hashtable_stat.latency_insert, HASHTABLE_LATENCY_BUCKETS);
+        chars += hashtable_show_histogram(buf+chars, HASHTABLE_BUF_LEFT(len, chars), "Cycles_log2_remove",
+                hashtable_stat.latency_remove, HASHTABLE_LATENCY_BUCKETS);
+        chars += hashtable_show_histogram(buf+chars, HASHTABLE_BUF_LEFT(len, chars), "Cycles_log2_search",
+                hashtable_stat.latency_search, HASHTABLE_LATENCY_BUCKETS);
+#endif
+    }
+    return (chars < len) ? chars : len;
+}
+
+/**
+ * Machine readable dump of the registered tables, one 'name.counter=value' per line
+ * A histogram bucket is 'name.histogram.bucket=value'
+ */
+static inline int hashtable_export(char *buf, size_t len)
+{
+    size_t i, j;
+    int chars = 0;
+    for (i = 0;i < ARRAY_SIZE(hashtable_registry);i++)
+    {
+        hashtable_t *hashtable = hashtable_registry[i];
+        hashtable_stat_t hashtable_stat;
+        const uint64_t *stat = (const uint64_t *)&hashtable_stat;
+        if (!hashtable)
+            continue;
+        if ((size_t)chars >= len)
+            break;
+
+        hashtable_stat_get(hashtable, &hashtable_stat);
+        chars += snprintf(buf+chars, len-chars, "%s.size=%zu\n%s.memory=%zu\n", hashtable->name, hashtable->__size,
+                hashtable->name, hashtable->__memory_size);
+        for (j = 0;(j < HASHTABLE_STAT_COUNTERS) && ((size_t)chars < len);j++)
+        {
+            chars += snprintf(buf+chars, len-chars, "%s.%s=%" PRIu64 "\n", hashtable->name, hashtable_stat_names[j],
+                    stat[j]);
+        }
+#if HASHTABLE_HISTOGRAM
+        for (j = 0;(j < HASHTABLE_PROBE_BUCKETS) && ((size_t)chars < len);j++)
+        {
+            chars += snprintf(buf+chars, len-chars, "%s.Probe_insert.%zu=%" PRIu64 "\n%s.Probe_search.%zu=%" PRIu64 "\n",
+                    hashtable->name, j, hashtable_stat.probe_insert[j], hashtable->name, j, hashtable_stat.probe_search[j]);
+        }
+#endif
+#if HASHTABLE_LATENCY_SAMPLE
+        for (j = 0;(j < HASHTABLE_LATENCY_BUCKETS) && ((size_t)chars < len);j++)
+        {
+            chars += snprintf(buf+chars, len-chars, "%s.Cycles_log2_insert.%zu=%" PRIu64 "\n"
+                    "%s.Cycles_log2_remove.%zu=%" PRIu64 "\n%s.Cycles_log2_search.%zu=%" PRIu64 "\n",
+                    hashtable->name, j, hashtable_stat.latency_insert[j], hashtable->name, j,
+                    hashtable_stat.latency_remove[j], hashtable->name, j, hashtable_stat.latency_search[j]);
+        }
+#endif
+    }
+    return ((size_t)chars < len) ? chars : (int)len;
+}
+
+/**
+ * Occupancy of the slots, see hashtable_<tokn>_scan_stats()
+ * A run is a sequence of occupied slots, runs[n] counts the runs of n slots,
+ * runs[HASHTABLE_RUN_BUCKETS-1] counts the runs of HASHTABLE_RUN_BUCKETS-1 slots and longer
+ */
+#define HASHTABLE_RUN_BUCKETS 32
+
+typedef struct
+{
+    /* Next slot to scan, set to 0 to start a new scan */
+    size_t next;
+    size_t size;
+    size_t live;
+    size_t longest_run;
+    /* The run which continues in the next chunk */
+    size_t run;
+    uint64_t runs[HASHTABLE_RUN_BUCKETS];
+} hashtable_scan_t;
+
+static inline void hashtable_scan_run(hashtable_scan_t *scan)
+{
+    if (scan->run)
+    {
+        scan->runs[(scan->run < HASHTABLE_RUN_BUCKETS) ? scan->run : (HASHTABLE_RUN_BUCKETS-1)]++;
+        if (scan->run > scan->longest_run)
+        {
+            scan->longest_run = scan->run;
+        }
+        scan->run = 0;
     }
-    return chars;
+}
+
+static inline int hashtable_scan_show(const hashtable_scan_t *scan, char *buf, size_t len)
+{
+    int chars = snprintf(buf, len, "Live %zu of %zu slots (%zu.%zu%%), longest run %zu, runs",
+            scan->live, scan->size, (scan->live * 100) / scan->size, ((scan->live * 1000) / scan->size) % 10,
+            scan->longest_run);
+    chars += hashtable_show_histogram(buf+chars, HASHTABLE_BUF_LEFT(len, chars), "", scan->runs, HASHTABLE_RUN_BUCKETS);
+    return ((size_t)chars < len) ? chars : (int)len;
 }
 
 static void hashtable_registry_add(hashtable_t *table)
@@ -217,7 +818,12 @@ static void *hashtable_alloc(size_t size)
     }
     return p;
 #else
-    return malloc(size);
+    void *p;
+    if (posix_memalign(&p, HASHTABLE_CACHE_LINE, size) != 0)
+    {
+        return NULL;
+    }
+    return p;
 #endif
 }
 
@@ -239,190 +845,4311 @@ static void hashtable_free(void *p, size_t size)
 #endif
 }
 
-static void hashtable_close(hashtable_t *hashtable)
+/**
+ * Flags for hashtable_t::alloc_flags
+ * HUGEPAGE maps the table with 2MB pages, a random probe of a large table does not
+ * miss the TLB. Userspace tries MAP_HUGETLB first (see /proc/sys/vm/nr_hugepages),
+ * then transparent huge pages. The kernel uses vmalloc_huge() (5.18 and above), the
+ * symbol is exported to the GPL modules only
+ * NUMA_BIND allocates the table on the node hashtable_t::numa_node, NUMA_INTERLEAVE
+ * spreads the pages of the table over all nodes (userspace only)
+ * The table is aligned to a page or a huge page in any case
+ */
+#define HASHTABLE_ALLOC_HUGEPAGE        (1 << 0)
+#define HASHTABLE_ALLOC_NUMA_BIND       (1 << 1)
+#define HASHTABLE_ALLOC_NUMA_INTERLEAVE (1 << 2)
+
+#define HASHTABLE_HUGEPAGE_SIZE (2UL << 20)
+
+#ifndef __KERNEL__
+#   ifndef MAP_HUGETLB
+#       define MAP_HUGETLB 0x40000
+#   endif
+/* Avoid dependency on libnuma, see numaif.h */
+#   define HASHTABLE_MPOL_BIND       2
+#   define HASHTABLE_MPOL_INTERLEAVE 3
+
+static size_t hashtable_alloc_size(const unsigned int flags, size_t size)
+{
+    const size_t page_size = (flags & HASHTABLE_ALLOC_HUGEPAGE) ? HASHTABLE_HUGEPAGE_SIZE : (size_t)getpagesize();
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+static void hashtable_mbind(const hashtable_t *hashtable, void *p, const size_t size)
 {
-    if (hashtable->__table)
+#   ifdef SYS_mbind
+    unsigned long nodemask = ~0UL;
+    int mode = HASHTABLE_MPOL_INTERLEAVE;
+    if (hashtable->alloc_flags & HASHTABLE_ALLOC_NUMA_BIND)
     {
-        hashtable_free(hashtable->__table, hashtable->__memory_size);
+        nodemask = 1UL << hashtable->numa_node;
+        mode = HASHTABLE_MPOL_BIND;
     }
-    else
+    if (syscall(SYS_mbind, p, size, mode, &nodemask, 8 * sizeof(nodemask), 0) != 0)
     {
-        PRINTF("Failed to free null pointer for the hashtable %s", hashtable->name);
+        PRINTF("Failed to bind the hashtable %s to NUMA node %d", hashtable->name, hashtable->numa_node);
     }
-    hashtable_registry_remove(hashtable);
+#   endif
 }
-
-
-
-#ifdef __KERNEL__
-#    define HASHTABLE_CMPXCHG(key, val, new_val) cmpxchg(key, val, new_val)
-#else
-#    define HASHTABLE_CMPXCHG(key, val, new_val) __sync_val_compare_and_swap(key, val, new_val)
 #endif
 
-#if 1
+/**
+ * Allocate the memory for the slots according to hashtable_t::alloc_flags
+ * The memory is zeroed if 'zero' is set, userspace maps anonymous pages
+ */
+static void *hashtable_alloc_table(const hashtable_t *hashtable, size_t size, const int zero)
+{
 #ifdef __KERNEL__
-#   define HASHTABLE_BARRIER() barrier()
-#else
-#   define HASHTABLE_BARRIER() __sync_synchronize()
-#endif
+    const unsigned int flags = hashtable->alloc_flags;
+    void *p = NULL;
+    unsigned long long adr;
+    size = PAGE_ALIGN(size);
+#   if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0))
+    if (flags & HASHTABLE_ALLOC_HUGEPAGE)
+    {
+        p = vmalloc_huge(size, zero ? (GFP_KERNEL | __GFP_ZERO) : GFP_KERNEL);
+    }
+#   endif
+    if (!p && (flags & HASHTABLE_ALLOC_NUMA_BIND))
+    {
+        p = zero ? vzalloc_node(size, hashtable->numa_node) : vmalloc_node(size, hashtable->numa_node);
+    }
+    if (!p)
+    {
+        p = zero ? vzalloc(size) : vmalloc(size);
+    }
+    for (adr = (unsigned long long) p;p && (adr < ((unsigned long long) p + size));adr += PAGE_SIZE)
+    {
+        SetPageReserved(vmalloc_to_page((void *)adr));
+    }
+    return p;
 #else
-#   define HASHTABLE_BARRIER()
+    const unsigned int flags = hashtable->alloc_flags;
+    void *p = MAP_FAILED;
+    /* The anonymous pages are zeroed */
+    if (!flags && !zero)
+    {
+        return hashtable_alloc(size);
+    }
+    size = hashtable_alloc_size(flags, size);
+    if (flags & HASHTABLE_ALLOC_HUGEPAGE)
+    {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (p == MAP_FAILED)
+    {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            return NULL;
+        }
+#   ifdef MADV_HUGEPAGE
+        if (flags & HASHTABLE_ALLOC_HUGEPAGE)
+        {
+            madvise(p, size, MADV_HUGEPAGE);
+        }
+#   endif
+    }
+    /* Before the first access to the pages */
+    if (flags & (HASHTABLE_ALLOC_NUMA_BIND | HASHTABLE_ALLOC_NUMA_INTERLEAVE))
+    {
+        hashtable_mbind(hashtable, p, size);
+    }
+    return p;
 #endif
+}
 
-#define HASHTABLE_SLOT_ADDR(hashtable, tokn, index) &(((hashtable_## tokn ##_slot_t*)hashtable->__table)[index])
+static inline int hashtable_is_zero(const void *p, const size_t size)
+{
+    size_t i;
+    for (i = 0;i < size;i++)
+    {
+        if (((const uint8_t *)p)[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-/**
- * Illegal TID can be (PID_MAX_LIMIT+1)
+/* The table follows the header in the file of hashtable_<tokn>_save() */
+#define HASHTABLE_FILE_HEADER_SIZE 4096
+
+static void hashtable_free_table(const hashtable_t *hashtable, void *p, size_t size)
+{
+    if (hashtable->__storage == HASHTABLE_STORAGE_CALLER)
+    {
+        return;
+    }
+#ifdef __KERNEL__
+    hashtable_free(p, size);
+#else
+    if (hashtable->__storage == HASHTABLE_STORAGE_FILE)
+    {
+        munmap((char *)p - HASHTABLE_FILE_HEADER_SIZE, HASHTABLE_FILE_HEADER_SIZE + size);
+    }
+    else if (!hashtable->alloc_flags && (hashtable->__storage == HASHTABLE_STORAGE_ALLOC))
+    {
+        hashtable_free(p, size);
+    }
+    else if (p)
+    {
+        munmap(p, hashtable_alloc_size(hashtable->alloc_flags, size));
+    }
+#endif
+}
+
+/**
+ * File of hashtable_<tokn>_save(): the header, the padding up to HASHTABLE_FILE_HEADER_SIZE
+ * and the slots. hashtable_<tokn>_load_mmap() maps the file if the header matches the
+ * declaration of the table
+ */
+#define HASHTABLE_FILE_MAGIC   0x48415346
+/* 2 - the TWO_CHOICE windows are aligned buckets, 3 - the hashes of the check keys */
+#define HASHTABLE_FILE_VERSION 3
+/* The header keeps the hashes of the keys of hashtable_file_hash_key() */
+#define HASHTABLE_FILE_HASH_KEYS 4
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t bits;
+    uint32_t tries;
+    uint32_t key_size;
+    uint32_t data_size;
+    /* HASHTABLE_LAYOUT_IS_SOA_xx, HASHTABLE_PROBE_WINDOWS_xx */
+    uint32_t soa;
+    uint32_t windows;
+    /* See hashtable_hash_id() */
+    uint32_t hash_id;
+    uint32_t reserved;
+    /* hashtable_<tokn>_hash() of the check keys, the table is loaded with the same hash */
+    uint32_t hash_check[HASHTABLE_FILE_HASH_KEYS];
+    uint64_t empty_key;
+    uint64_t memory_size;
+} hashtable_file_header_t;
+
+/**
+ * The hash functions of the table are saved as an index in the list of the
+ * hash functions of this file, 0 - the application sets the hash function
+ */
+typedef uint32_t (*hashtable_hash32_t)(uint32_t);
+typedef uint32_t (*hashtable_hash64_t)(uint64_t);
+
+static inline hashtable_hash32_t hashtable_hash_by_id(const uint32_t id)
+{
+    static const hashtable_hash32_t functions[] = {NULL, hash32shift, hash_none, hash_fibonacci, hash_murmur3, hash_crc32c};
+    return (id < ARRAY_SIZE(functions)) ? functions[id] : NULL;
+}
+
+static inline hashtable_hash64_t hashtable_hash64_by_id(const uint32_t id)
+{
+    static const hashtable_hash64_t functions[] = {NULL, hash6432shift, hash64_fibonacci, hash64_murmur3, hash64_crc32c};
+    return (id < ARRAY_SIZE(functions)) ? functions[id] : NULL;
+}
+
+static inline uint32_t hashtable_hash_id(const hashtable_t *hashtable)
+{
+    uint32_t id = 0, id64 = 0, i;
+    for (i = 1;hashtable_hash_by_id(i);i++)
+    {
+        id = (hashtable->hashfunction == hashtable_hash_by_id(i)) ? i : id;
+    }
+    for (i = 1;hashtable_hash64_by_id(i);i++)
+    {
+        id64 = (hashtable->hashfunction64 == hashtable_hash64_by_id(i)) ? i : id64;
+    }
+    return id | (id64 << 8);
+}
+
+/**
+ * Set the hash functions which the application did not set, the functions
+ * of hashtable_init() if the file does not know them
+ */
+static inline void hashtable_hash_set(hashtable_t *hashtable, const uint32_t hash_id)
+{
+    if (!hashtable->hashfunction)
+    {
+        hashtable->hashfunction = hashtable_hash_by_id(hash_id & 0xff);
+    }
+    if (!hashtable->hashfunction)
+    {
+        hashtable->hashfunction = hash32shift;
+    }
+    if (!hashtable->hashfunction64)
+    {
+        hashtable->hashfunction64 = hashtable_hash64_by_id(hash_id >> 8);
+    }
+    if (!hashtable->hashfunction64)
+    {
+        hashtable->hashfunction64 = hash6432shift;
+    }
+}
+
+/**
+ * The hash_id tells which functions of the list the table used, an inlined
+ * 'hashfunc' or a function of the application is not in the list. The header
+ * keeps the hashes of these keys, a table with another hash does not load the file
+ */
+static inline uint64_t hashtable_file_hash_key(const uint32_t i)
+{
+    static const uint64_t keys[HASHTABLE_FILE_HASH_KEYS] = {1, 0x9e3779b9, 0x7fffffff, 0xfedcba9876543210ull};
+    return keys[i];
+}
+
+#ifdef __KERNEL__
+static inline int hashtable_file_save(const char *path, const hashtable_file_header_t *header, const void *table)
+{
+    PRINTF("Failed to save %s, not supported in the kernel", path);
+    return 0;
+}
+
+static inline void *hashtable_file_map(const char *path, hashtable_file_header_t *header)
+{
+    PRINTF("Failed to map %s, not supported in the kernel", path);
+    return NULL;
+}
+#else
+#   include <fcntl.h>
+
+/**
+ * Write to a temporary file and rename, a crash does not leave a partial file
+ * Returns 1 on success
+ */
+static inline int hashtable_file_save(const char *path, const hashtable_file_header_t *header, const void *table)
+{
+    char tmp[256];
+    int rc = 1;
+    int fd;
+    /* A truncated name would replace another file */
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+    {
+        PRINTF("Failed to save %s, the path is too long", path);
+        return 0;
+    }
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        PRINTF("Failed to create %s", tmp);
+        return 0;
+    }
+    rc = rc && (pwrite(fd, header, sizeof(*header), 0) == (ssize_t)sizeof(*header));
+    rc = rc && (pwrite(fd, table, header->memory_size, HASHTABLE_FILE_HEADER_SIZE) == (ssize_t)header->memory_size);
+    rc = rc && (fsync(fd) == 0);
+    close(fd);
+    rc = rc && (rename(tmp, path) == 0);
+    if (!rc)
+    {
+        PRINTF("Failed to write %s", path);
+        unlink(tmp);
+    }
+    return rc;
+}
+
+/**
+ * Map the file shared, copy the header of the file to 'header'
+ * Returns the slots or NULL
+ */
+static inline void *hashtable_file_map(const char *path, hashtable_file_header_t *header)
+{
+    void *p;
+    off_t size;
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        PRINTF("Failed to open %s", path);
+        return NULL;
+    }
+    size = lseek(fd, 0, SEEK_END);
+    if ((pread(fd, header, sizeof(*header), 0) != (ssize_t)sizeof(*header)) || (header->magic != HASHTABLE_FILE_MAGIC) ||
+        (header->version != HASHTABLE_FILE_VERSION) || (size != (off_t)(HASHTABLE_FILE_HEADER_SIZE + header->memory_size)))
+    {
+        PRINTF("%s is not a hashtable file", path);
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        PRINTF("Failed to map %s", path);
+        return NULL;
+    }
+    return (char *)p + HASHTABLE_FILE_HEADER_SIZE;
+}
+#endif
+
+static void hashtable_close(hashtable_t *hashtable)
+{
+    if (hashtable->__resize)
+    {
+        hashtable_resize_t *resize = hashtable->__resize;
+        size_t i;
+        for (i = resize->reclaimed;i <= resize->newest;i++)
+        {
+            hashtable_free_table(hashtable, resize->generation[i].table, resize->generation[i].memory_size);
+        }
+        hashtable_free(resize, sizeof(*resize));
+        hashtable->__resize = NULL;
+    }
+    else if (hashtable->__table)
+    {
+        hashtable_free_table(hashtable, hashtable->__table, hashtable->__memory_size);
+        hashtable->__storage = HASHTABLE_STORAGE_ALLOC;
+    }
+    else
+    {
+        PRINTF("Failed to free null pointer for the hashtable %s", hashtable->name);
+    }
+    if (hashtable->__epochs)
+    {
+        hashtable_free((void *)hashtable->__epochs, hashtable->__epochs_size);
+        hashtable->__epochs = NULL;
+    }
+    if (hashtable->__filter)
+    {
+        hashtable_free((void *)hashtable->__filter, hashtable->__filter_size);
+        hashtable->__filter = NULL;
+    }
+    hashtable_registry_remove(hashtable);
+    hashtable_stat_close(hashtable);
+}
+
+
+
+/**
+ * HASHTABLE_ACQUIRE_RELEASE 1 - remove publishes the free slot with a release store
+ *   instead of a full barrier and a store, find, remove and contains read the key with
+ *   an acquire load, the compare-and-swap in userspace is acq_rel instead of seq_cst
+ *   An acquire of the key orders the read of the data after the key, a reader never
+ *   gets the data of the previous key of the slot. The kernel uses smp_store_release()
+ *   and smp_load_acquire(), cmpxchg() is fully ordered. The resize of the growable
+ *   table orders the sequence of the resize and the moved slots with smp_rmb()/smp_wmb()/
+ *   smp_mb(), see HASHTABLE_RESIZE_RMB()
+ */
+#ifndef HASHTABLE_ACQUIRE_RELEASE
+#   define HASHTABLE_ACQUIRE_RELEASE 0
+#endif
+
+#ifdef __KERNEL__
+#    define HASHTABLE_CMPXCHG(key, val, new_val) cmpxchg(key, val, new_val)
+#elif HASHTABLE_ACQUIRE_RELEASE
+#    define HASHTABLE_CMPXCHG(key, val, new_val)                                                                                  \
+    ({                                                                                                                            \
+        __typeof__((__typeof__(*(key)))0) __old = (val);                                                                          \
+        __atomic_compare_exchange_n(key, &__old, new_val, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);                                 \
+        __old;                                                                                                                    \
+    })
+#else
+#    define HASHTABLE_CMPXCHG(key, val, new_val) __sync_val_compare_and_swap(key, val, new_val)
+#endif
+
+#if 1
+#ifdef __KERNEL__
+#   define HASHTABLE_BARRIER() barrier()
+#else
+#   define HASHTABLE_BARRIER() __sync_synchronize()
+#endif
+#else
+#   define HASHTABLE_BARRIER()
+#endif
+
+#if !HASHTABLE_ACQUIRE_RELEASE
+#   define HASHTABLE_STORE_RELEASE(p, v) do { HASHTABLE_BARRIER(); __sync_access(p) = (v); } while (0)
+#   define HASHTABLE_LOAD_ACQUIRE(p) __sync_access(p)
+#elif defined(__KERNEL__)
+#   define HASHTABLE_STORE_RELEASE(p, v) smp_store_release(p, v)
+#   define HASHTABLE_LOAD_ACQUIRE(p) smp_load_acquire(p)
+#else
+#   define HASHTABLE_STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#   define HASHTABLE_LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#endif
+
+/**
+ * Binary page of the counters for the monitoring tools
+ * hashtable_stats_publish() copies the counters of the registered tables to the
+ * page, a reader polls the page without formatting and system calls. Userspace maps
+ * a file, for example in /dev/shm, the kernel exposes the page as the debugfs blob
+ * <debugfs>/<name>/stats and the output of hashtable_show() as <debugfs>/<name>/show
+ * Call hashtable_stats_publish() periodically from a single context
+ */
+#define HASHTABLE_REGISTRY_SIZE     ARRAY_SIZE(hashtable_registry)
+#define HASHTABLE_STATS_MAGIC       0x48415354
+#define HASHTABLE_STATS_VERSION     1
+#define HASHTABLE_STATS_NAME        32
+
+/* The sequence of the page and the counters are ordered on the weakly ordered CPUs */
+#ifdef __KERNEL__
+#   define HASHTABLE_STATS_RMB() smp_rmb()
+#   define HASHTABLE_STATS_WMB() smp_wmb()
+#else
+#   define HASHTABLE_STATS_RMB() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#   define HASHTABLE_STATS_WMB() __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+typedef struct
+{
+    /* Empty string if the registry slot is free */
+    char name[HASHTABLE_STATS_NAME];
+    uint64_t size;
+    uint64_t memory_size;
+    hashtable_stat_t stat;
+} hashtable_stats_entry_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    /* Number of uint64_t in hashtable_stat_t, the histograms follow the counters */
+    uint32_t counters;
+    uint32_t tables;
+    /* Odd while hashtable_stats_publish() updates the page */
+    volatile uint64_t seq;
+    hashtable_stats_entry_t table[HASHTABLE_REGISTRY_SIZE];
+} hashtable_stats_page_t;
+
+static hashtable_stats_page_t *hashtable_stats_page;
+
+static inline void hashtable_stats_publish(void)
+{
+    hashtable_stats_page_t *page = hashtable_stats_page;
+    size_t i;
+    if (!page)
+        return;
+    page->seq++;
+    HASHTABLE_STATS_WMB();
+    for (i = 0;i < HASHTABLE_REGISTRY_SIZE;i++)
+    {
+        const hashtable_t *hashtable = hashtable_registry[i];
+        hashtable_stats_entry_t *entry = &page->table[i];
+        if (!hashtable)
+        {
+            entry->name[0] = 0;
+            continue;
+        }
+        snprintf(entry->name, sizeof(entry->name), "%s", hashtable->name);
+        entry->size = hashtable->__size;
+        entry->memory_size = hashtable->__memory_size;
+        hashtable_stat_get(hashtable, &entry->stat);
+    }
+    HASHTABLE_STATS_WMB();
+    page->seq++;
+}
+
+/**
+ * A consistent copy of a published page, for the readers in userspace
+ * Returns 0 if the page is not a stats page of this version
+ */
+static inline int hashtable_stats_read(const hashtable_stats_page_t *page, hashtable_stats_page_t *copy)
+{
+    uint64_t seq;
+    if ((page->magic != HASHTABLE_STATS_MAGIC) || (page->version != HASHTABLE_STATS_VERSION) ||
+        (page->counters != (sizeof(hashtable_stat_t) / sizeof(uint64_t))))
+    {
+        return 0;
+    }
+    do
+    {
+        seq = page->seq;
+        HASHTABLE_STATS_RMB();
+        memcpy(copy, (const void *)page, sizeof(*copy));
+        HASHTABLE_STATS_RMB();
+    }
+    while ((seq & 1) || (seq != page->seq));
+    copy->seq = seq;
+    return 1;
+}
+
+static inline void hashtable_stats_init_page(hashtable_stats_page_t *page)
+{
+    memset(page, 0, sizeof(*page));
+    page->magic = HASHTABLE_STATS_MAGIC;
+    page->version = HASHTABLE_STATS_VERSION;
+    page->counters = sizeof(hashtable_stat_t) / sizeof(uint64_t);
+    page->tables = HASHTABLE_REGISTRY_SIZE;
+    hashtable_stats_page = page;
+    hashtable_stats_publish();
+}
+
+#ifdef __KERNEL__
+#   include "linux/err.h"
+#   include "linux/module.h"
+#   include "linux/debugfs.h"
+#   include "linux/seq_file.h"
+
+#define HASHTABLE_STATS_SHOW_SIZE (64*1024)
+
+static struct dentry *hashtable_stats_dir;
+static struct debugfs_blob_wrapper hashtable_stats_blob;
+
+static int hashtable_stats_text_show(struct seq_file *m, void *v)
+{
+    char *buf = vmalloc(HASHTABLE_STATS_SHOW_SIZE);
+    if (!buf)
+        return -ENOMEM;
+    seq_write(m, buf, hashtable_show(buf, HASHTABLE_STATS_SHOW_SIZE));
+    vfree(buf);
+    return 0;
+}
+
+/* DEFINE_SHOW_ATTRIBUTE() is not available before 4.16 */
+static int hashtable_stats_text_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hashtable_stats_text_show, inode->i_private);
+}
+
+static const struct file_operations hashtable_stats_text_fops = {
+    .owner = THIS_MODULE,
+    .open = hashtable_stats_text_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/**
+ * Create the debugfs folder 'name' with the files 'stats' and 'show'
+ * Returns 1 on success
+ */
+static inline int hashtable_stats_open(const char *name)
+{
+    hashtable_stats_page_t *page;
+    if (hashtable_stats_page)
+    {
+        PRINTF("Failed to create debugfs folder %s, the stats page is already open", name);
+        return 0;
+    }
+    page = vmalloc(sizeof(*page));
+    if (!page)
+    {
+        PRINTF("Failed to allocate %zu bytes for the stats page", sizeof(*page));
+        return 0;
+    }
+    hashtable_stats_init_page(page);
+    hashtable_stats_blob.data = page;
+    hashtable_stats_blob.size = sizeof(*page);
+    hashtable_stats_dir = debugfs_create_dir(name, NULL);
+    if (IS_ERR_OR_NULL(hashtable_stats_dir))
+    {
+        PRINTF("Failed to create debugfs folder %s", name);
+        hashtable_stats_page = NULL;
+        vfree(page);
+        return 0;
+    }
+    debugfs_create_blob("stats", 0444, hashtable_stats_dir, &hashtable_stats_blob);
+    debugfs_create_file("show", 0444, hashtable_stats_dir, NULL, &hashtable_stats_text_fops);
+    return 1;
+}
+
+static inline void hashtable_stats_close(void)
+{
+    hashtable_stats_page_t *page = hashtable_stats_page;
+    if (!page)
+        return;
+    debugfs_remove_recursive(hashtable_stats_dir);
+    hashtable_stats_dir = NULL;
+    hashtable_stats_page = NULL;
+    vfree(page);
+}
+#else
+#   include <fcntl.h>
+
+static inline void hashtable_stats_close(void)
+{
+    hashtable_stats_page_t *page = hashtable_stats_page;
+    if (!page)
+        return;
+    hashtable_stats_page = NULL;
+    munmap(page, sizeof(*page));
+}
+
+/**
+ * Map the file 'path' shared, a reader maps the same file read only
+ * The page is built in 'path'.tmp and renamed over 'path', a reader which
+ * still maps the previous file keeps its pages
+ * Returns 1 on success
+ */
+static inline int hashtable_stats_open(const char *path)
+{
+    const size_t size = sizeof(hashtable_stats_page_t);
+    char tmp[256];
+    void *p;
+    int fd;
+    if (hashtable_stats_page)
+    {
+        PRINTF("Failed to open %s, the stats page is already open", path);
+        return 0;
+    }
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+    {
+        PRINTF("Failed to open %s, the path is too long", path);
+        return 0;
+    }
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        PRINTF("Failed to open %s", tmp);
+        return 0;
+    }
+    if (ftruncate(fd, size) != 0)
+    {
+        PRINTF("Failed to resize %s", tmp);
+        close(fd);
+        unlink(tmp);
+        return 0;
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        PRINTF("Failed to map %s", tmp);
+        unlink(tmp);
+        return 0;
+    }
+    hashtable_stats_init_page((hashtable_stats_page_t *)p);
+    if (rename(tmp, path) != 0)
+    {
+        PRINTF("Failed to rename %s", tmp);
+        hashtable_stats_close();
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
+}
+#endif
+
+/**
+ * Lockfree pool of fixed size objects, see DECLARE_HASHTABLE_POOLED
+ * The objects are preallocated by hashtable_pool_init(). The free objects are
+ * a list linked by the indexes, the head carries a tag which protects the CAS
+ * against ABA
+ */
+#define HASHTABLE_POOL_NONE ((uint32_t)~0u)
+
+typedef struct
+{
+    const char *name;
+    size_t object_size;
+    /* Number of the objects, below HASHTABLE_POOL_NONE */
+    size_t count;
+
+    size_t __stride;
+    size_t __memory_size;
+    void *__objects;
+    volatile uint32_t *__next;
+    /* Tag in the high 32 bits, index of the first free object in the low 32 bits */
+    volatile uint64_t __head;
+} hashtable_pool_t;
+
+static inline void *hashtable_pool_object(const hashtable_pool_t *pool, const uint32_t index)
+{
+    return (char *)pool->__objects + (size_t)index * pool->__stride;
+}
+
+/**
+ * Returns an index of a free object or HASHTABLE_POOL_NONE if the pool is empty
+ */
+static inline uint32_t hashtable_pool_get(hashtable_pool_t *pool)
+{
+    while (1)
+    {
+        const uint64_t head = pool->__head;
+        const uint32_t index = (uint32_t)head;
+        uint64_t new_head;
+        if (index == HASHTABLE_POOL_NONE)
+        {
+            return HASHTABLE_POOL_NONE;
+        }
+        new_head = (((head >> 32) + 1) << 32) | pool->__next[index];
+        if (HASHTABLE_CMPXCHG(&pool->__head, head, new_head) == head)
+        {
+            return index;
+        }
+    }
+}
+
+static inline void hashtable_pool_put(hashtable_pool_t *pool, const uint32_t index)
+{
+    while (1)
+    {
+        const uint64_t head = pool->__head;
+        const uint64_t new_head = (((head >> 32) + 1) << 32) | index;
+        pool->__next[index] = (uint32_t)head;
+        HASHTABLE_BARRIER();
+        if (HASHTABLE_CMPXCHG(&pool->__head, head, new_head) == head)
+        {
+            return;
+        }
+    }
+}
+
+static inline int hashtable_pool_init(hashtable_pool_t *pool)
+{
+    size_t i;
+    if ((pool->count == 0) || (pool->count >= HASHTABLE_POOL_NONE))
+    {
+        PRINTF("Bad size %zu of the pool %s", pool->count, pool->name);
+        return 0;
+    }
+    pool->__stride = (pool->object_size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    pool->__memory_size = pool->count * (pool->__stride + sizeof(uint32_t));
+    pool->__objects = hashtable_alloc(pool->__memory_size);
+    if (!pool->__objects)
+    {
+        PRINTF("Failed to allocate %zu bytes for the pool %s", pool->__memory_size, pool->name);
+        return 0;
+    }
+    memset(pool->__objects, 0, pool->__memory_size);
+    pool->__next = (volatile uint32_t *)((char *)pool->__objects + pool->count * pool->__stride);
+    for (i = 0;i < pool->count;i++)
+    {
+        pool->__next[i] = ((i + 1) < pool->count) ? (uint32_t)(i + 1) : HASHTABLE_POOL_NONE;
+    }
+    pool->__head = 0;
+    return 1;
+}
+
+static inline void hashtable_pool_close(hashtable_pool_t *pool)
+{
+    if (pool->__objects)
+    {
+        hashtable_free(pool->__objects, pool->__memory_size);
+        pool->__objects = NULL;
+    }
+}
+
+/**
+ * Task-local tier in front of a table, see DECLARE_HASHTABLE_LOCAL
+ * Every task (kernel, HASHTABLE_LOCAL_CPUS() shards) or every thread (userspace,
+ * HASHTABLE_LOCAL_SHARDS shards) has a direct mapped array of 2^bits slots. The
+ * shard follows the task when the task migrates: a shard of the CPU would lose the
+ * keys of a migrated task. The tasks on different CPUs (in userspace more threads
+ * than shards) share a shard, a new key claims a free slot of the shard with a fully
+ * ordered compare-and-set, cmpxchg_local() is not enough. The owner of the key updates
+ * and removes the key with plain stores. A lookup by a context which is not the owner
+ * misses its own shard and the shared table, and reads the slot of the key in every shard
+ */
+#ifdef __KERNEL__
+#   define HASHTABLE_LOCAL_CPUS() nr_cpu_ids
+#   define HASHTABLE_LOCAL_GET() ((int)((unsigned int)task_pid_nr(current) % nr_cpu_ids))
+#   define HASHTABLE_LOCAL_PUT() do {} while (0)
+#else
+#   define HASHTABLE_LOCAL_SHARDS 64
+#   define HASHTABLE_LOCAL_CPUS() HASHTABLE_LOCAL_SHARDS
+#   define HASHTABLE_LOCAL_GET() hashtable_local_shard_get()
+#   define HASHTABLE_LOCAL_PUT() do {} while (0)
+
+static __thread int hashtable_local_shard = -1;
+static int hashtable_local_shard_next;
+
+static inline int hashtable_local_shard_get(void)
+{
+    int shard = hashtable_local_shard;
+    if (unlikely(shard < 0))
+    {
+        shard = __sync_fetch_and_add(&hashtable_local_shard_next, 1) % HASHTABLE_LOCAL_SHARDS;
+        hashtable_local_shard = shard;
+    }
+    return shard;
+}
+#endif
+
+/**
+ * The low 16 bits of hashtable_<tokn>_local_slot_t::spilled count the spilled keys, the
+ * high bits are the version of the count. Every change of the count changes the version,
+ * a context sharing the shard reads the count, the record of the spilled key and the count
+ * again, and gets the record and the count of the same moment
+ */
+#define HASHTABLE_LOCAL_SPILLED(spilled) ((spilled) & 0xffff)
+#define HASHTABLE_LOCAL_SPILL_INC 0x10001
+#define HASHTABLE_LOCAL_SPILL_DEC 0xffff
+
+#ifdef __KERNEL__
+#   define HASHTABLE_LOCAL_RMB() smp_rmb()
+#else
+#   define HASHTABLE_LOCAL_RMB() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+typedef struct
+{
+    /* 2^bits slots for every shard */
+    size_t bits;
+
+    size_t __shards;
+    /* Bytes of the slots of a shard, a multiple of the cache line */
+    size_t __stride;
+    size_t __memory_size;
+    void *__slots;
+} hashtable_local_t;
+
+static inline void hashtable_local_close(hashtable_local_t *tier)
+{
+    if (tier->__slots)
+    {
+        hashtable_free(tier->__slots, tier->__memory_size);
+        tier->__slots = NULL;
+    }
+}
+
+/**
+ * Vector comparison of the probe window, SOA layout only
+ * The kernel does not allow FPU/SIMD registers without kernel_fpu_begin()
+ * and the kernel build always uses the scalar loop
+ */
+#ifndef HASHTABLE_SIMD
+#   if !defined(__KERNEL__) && (defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__)))
+#       define HASHTABLE_SIMD 1
+#   else
+#       define HASHTABLE_SIMD 0
+#   endif
+#endif
+
+#if HASHTABLE_SIMD
+#   if defined(__SSE2__)
+#       include <immintrin.h>
+#   else
+#       include <arm_neon.h>
+#   endif
+#endif
+
+/**
+ * Compare up to 32 consecutive keys against 'key' and 'empty_key'
+ * Bit N of the returned mask is set if keys[N] == key, bit N of the
+ * 'empty_mask' is set if keys[N] == empty_key
+ * A key is loaded once and compared twice
+ */
+static inline uint32_t hashtable_match_keys(const volatile uint32_t *keys, const size_t count,
+        const uint32_t key, const uint32_t empty_key, uint32_t *empty_mask)
+{
+    uint32_t mask = 0;
+    uint32_t mask_empty = 0;
+    size_t i = 0;
+#if HASHTABLE_SIMD
+#   if defined(__AVX2__)
+    {
+        const __m256i key8 = _mm256_set1_epi32(key);
+        const __m256i empty8 = _mm256_set1_epi32(empty_key);
+        for (;(i + 8) <= count;i += 8)
+        {
+            const __m256i v = _mm256_loadu_si256((const __m256i *)(keys + i));
+            mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, key8))) << i;
+            mask_empty |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, empty8))) << i;
+        }
+    }
+#   endif
+#   if defined(__SSE2__)
+    {
+        const __m128i key4 = _mm_set1_epi32(key);
+        const __m128i empty4 = _mm_set1_epi32(empty_key);
+        for (;(i + 4) <= count;i += 4)
+        {
+            const __m128i v = _mm_loadu_si128((const __m128i *)(keys + i));
+            mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, key4))) << i;
+            mask_empty |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, empty4))) << i;
+        }
+    }
+#   else
+    {
+        static const uint32_t lanes[4] = {1, 2, 4, 8};
+        const uint32x4_t lane_bits = vld1q_u32(lanes);
+        const uint32x4_t key4 = vdupq_n_u32(key);
+        const uint32x4_t empty4 = vdupq_n_u32(empty_key);
+        for (;(i + 4) <= count;i += 4)
+        {
+            const uint32x4_t v = vld1q_u32((const uint32_t *)(keys + i));
+            mask |= vaddvq_u32(vandq_u32(vceqq_u32(v, key4), lane_bits)) << i;
+            mask_empty |= vaddvq_u32(vandq_u32(vceqq_u32(v, empty4), lane_bits)) << i;
+        }
+    }
+#   endif
+#endif
+    for (;i < count;i++)
+    {
+        const uint32_t k = keys[i];
+        mask |= (uint32_t)(k == key) << i;
+        mask_empty |= (uint32_t)(k == empty_key) << i;
+    }
+    if (empty_mask)
+    {
+        *empty_mask = mask_empty;
+    }
+    return mask;
+}
+
+/**
+ * hashtable_match_keys() for 64 bits keys
+ */
+static inline uint32_t hashtable_match_keys64(const volatile uint64_t *keys, const size_t count,
+        const uint64_t key, const uint64_t empty_key, uint32_t *empty_mask)
+{
+    uint32_t mask = 0;
+    uint32_t mask_empty = 0;
+    size_t i = 0;
+#if HASHTABLE_SIMD
+#   if defined(__AVX2__)
+    {
+        const __m256i key4 = _mm256_set1_epi64x(key);
+        const __m256i empty4 = _mm256_set1_epi64x(empty_key);
+        for (;(i + 4) <= count;i += 4)
+        {
+            const __m256i v = _mm256_loadu_si256((const __m256i *)(keys + i));
+            mask |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, key4))) << i;
+            mask_empty |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(v, empty4))) << i;
+        }
+    }
+#   endif
+#   if defined(__SSE2__)
+    {
+        /* SSE2 compares 32 bits lanes, both halves of the key should match */
+        const __m128i key2 = _mm_set1_epi64x(key);
+        const __m128i empty2 = _mm_set1_epi64x(empty_key);
+        for (;(i + 2) <= count;i += 2)
+        {
+            const __m128i v = _mm_loadu_si128((const __m128i *)(keys + i));
+            __m128i eq = _mm_cmpeq_epi32(v, key2);
+            __m128i eq_empty = _mm_cmpeq_epi32(v, empty2);
+            eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+            eq_empty = _mm_and_si128(eq_empty, _mm_shuffle_epi32(eq_empty, _MM_SHUFFLE(2, 3, 0, 1)));
+            mask |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(eq)) << i;
+            mask_empty |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(eq_empty)) << i;
+        }
+    }
+#   else
+    {
+        static const uint64_t lanes[2] = {1, 2};
+        const uint64x2_t lane_bits = vld1q_u64(lanes);
+        const uint64x2_t key2 = vdupq_n_u64(key);
+        const uint64x2_t empty2 = vdupq_n_u64(empty_key);
+        for (;(i + 2) <= count;i += 2)
+        {
+            const uint64x2_t v = vld1q_u64((const uint64_t *)(keys + i));
+            mask |= (uint32_t)vaddvq_u64(vandq_u64(vceqq_u64(v, key2), lane_bits)) << i;
+            mask_empty |= (uint32_t)vaddvq_u64(vandq_u64(vceqq_u64(v, empty2), lane_bits)) << i;
+        }
+    }
+#   endif
+#endif
+    for (;i < count;i++)
+    {
+        const uint64_t k = keys[i];
+        mask |= (uint32_t)(k == key) << i;
+        mask_empty |= (uint32_t)(k == empty_key) << i;
+    }
+    if (empty_mask)
+    {
+        *empty_mask = mask_empty;
+    }
+    return mask;
+}
+
+/**
+ * True if the probe window of the table can be matched by hashtable_match_keys()
+ */
+#define HASHTABLE_MATCH_KEYS(layout, max_tries) (HASHTABLE_SIMD && HASHTABLE_LAYOUT_IS_SOA_## layout && ((max_tries) <= 32))
+
+/**
+ * Number of keys the batch API hashes and prefetches before probing the table
+ * The CPU can keep about 10-20 outstanding cache misses
+ */
+#ifndef HASHTABLE_BATCH
+#   define HASHTABLE_BATCH 16
+#endif
+
+#define HASHTABLE_PREFETCH(addr, rw) __builtin_prefetch((const void *)(addr), (rw), 3)
+
+#define HASHTABLE_BATCH_MASK(mask, n, rc)                                                                                         \
+    do {                                                                                                                          \
+        if (mask)                                                                                                                 \
+        {                                                                                                                         \
+            const uint64_t bit = (uint64_t)1 << ((n) % 64);                                                                       \
+            (mask)[(n) / 64] = (rc) ? ((mask)[(n) / 64] | bit) : ((mask)[(n) / 64] & ~bit);                                       \
+        }                                                                                                                         \
+    } while (0)
+
+/**
+ * Reserved keys of the growable mode
+ */
+#define HASHTABLE_KEY_FROZEN(key_type, illegal_key) ((key_type)((illegal_key) - 1))
+#define HASHTABLE_KEY_MOVED(key_type, illegal_key)  ((key_type)((illegal_key) - 2))
+
+/**
+ * Composite key of two 32 bits values, for example (pid, fd), for the tables
+ * declared with uint64_t keys. A single 8 bytes compare-and-set updates the pair
+ */
+#define HASHTABLE_KEY_PAIR(hi, lo) ((((uint64_t)(uint32_t)(hi)) << 32) | (uint32_t)(lo))
+#define HASHTABLE_KEY_PAIR_HI(key) ((uint32_t)((uint64_t)(key) >> 32))
+#define HASHTABLE_KEY_PAIR_LO(key) ((uint32_t)(key))
+
+/**
+ * Number of slots an insert/remove migrates while the table grows
+ */
+#ifndef HASHTABLE_MIGRATE_CHUNK
+#   define HASHTABLE_MIGRATE_CHUNK 32
+#endif
+
+/**
+ * Grow if collisions exceed this percentage of inserts, see hashtable_<tokn>_grow_check()
+ */
+#ifndef HASHTABLE_GROW_COLLISIONS
+#   define HASHTABLE_GROW_COLLISIONS 50
+#endif
+
+/**
+ * An insert into the full table waits for another context adding a generation
+ * up to HASHTABLE_GROW_SPIN relaxes and fails, see hashtable_<tokn>_grow_insert()
+ */
+#ifndef HASHTABLE_GROW_SPIN
+#   define HASHTABLE_GROW_SPIN 1024
+#endif
+
+/**
+ * vmalloc() can sleep. In the kernel an insert only sets grow_pending and
+ * hashtable_<tokn>_grow_check() is expected to be called from a process context
+ * A context migrating a slot should not be preempted or interrupted, other contexts
+ * spin while the slot is frozen: an interrupt or a kprobe on the same CPU which touches
+ * the frozen key would spin forever. The kernel disables the interrupts for a chunk of
+ * the migration. The userspace can not disable the preemption, see hashtable_resize_t
+ */
+#ifdef __KERNEL__
+#   define HASHTABLE_GROW_INLINE 0
+#   define HASHTABLE_MIGRATE_BEGIN(flags) local_irq_save(flags)
+#   define HASHTABLE_MIGRATE_END(flags) local_irq_restore(flags)
+#   define HASHTABLE_RELAX() cpu_relax()
+#else
+#   define HASHTABLE_GROW_INLINE 1
+#   define HASHTABLE_MIGRATE_BEGIN(flags) do { (flags) = 0; } while (0)
+#   define HASHTABLE_MIGRATE_END(flags) ((void)(flags))
+#   if defined(__x86_64__) || defined(__i386__)
+#       define HASHTABLE_RELAX() __builtin_ia32_pause()
+#   else
+#       define HASHTABLE_RELAX() HASHTABLE_BARRIER()
+#   endif
+#endif
+
+/**
+ * The new generation and the copy of a key are written before the sequence of the resize
+ * and the moved slot, a reader reads them in the opposite order. A writer reads the sequence
+ * again after its compare-and-swap
+ */
+#ifdef __KERNEL__
+#   define HASHTABLE_RESIZE_RMB() smp_rmb()
+#   define HASHTABLE_RESIZE_WMB() smp_wmb()
+#   define HASHTABLE_RESIZE_MB() smp_mb()
+#else
+#   define HASHTABLE_RESIZE_RMB() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#   define HASHTABLE_RESIZE_WMB() __atomic_thread_fence(__ATOMIC_RELEASE)
+#   define HASHTABLE_RESIZE_MB() __sync_synchronize()
+#endif
+
+/**
+ * BACKYARD probing, the backyard follows the table and the max_tries slots after it.
+ * The backyard is 1/8 of the table, at least a pair of buckets
+ */
+static inline size_t hashtable_backyard_slots(const size_t size, const size_t bucket)
+{
+    const size_t pairs = size / (16 * bucket);
+    return (pairs ? pairs : 1) * 2 * bucket;
+}
+
+/**
+ * The first probe window starts at the hash, the second probe window of the
+ * TWO_CHOICE probing starts at the hash mixed by the Fibonacci multiplier
+ * A window starts at a multiple of 'bucket' slots, see HASHTABLE_BUCKET_xx
+ * The windows 2 and 3 of the BACKYARD probing are a pair of adjacent buckets in the
+ * backyard, the windows 4 and 5 are another pair
+ */
+static inline size_t hashtable_window_index(const size_t size, const uint32_t hash, const size_t window,
+        const size_t bucket)
+{
+    size_t index;
+    if (window == 0)
+    {
+        index = hash & (size - 1);
+    }
+    else if (window == 1)
+    {
+        index = (size_t)(((uint64_t)(uint32_t)(hash * 0x9E3779B1u) * size) >> 32);
+    }
+    else
+    {
+        const size_t pairs = hashtable_backyard_slots(size, bucket) / (2 * bucket);
+        const uint32_t mix = hash * ((window < 4) ? 0x85EBCA77u : 0xC2B2AE3Du);
+        const size_t pair = (size_t)(((uint64_t)mix * pairs) >> 32);
+        return size + bucket + (2 * pair + (window & 1)) * bucket;
+    }
+    return index - (index % bucket);
+}
+
+/* BACKYARD, the insert tries the pair of the backyard windows with more free slots first */
+static inline size_t hashtable_backyard_window(const size_t *free_slots, const size_t n)
+{
+    const size_t pair = ((free_slots[4] + free_slots[5]) > (free_slots[2] + free_slots[3])) ? 4 : 2;
+    return ((n < 2) ? pair : (pair ^ 6)) + (n & 1);
+}
+
+/**
+ * BACKYARD, a counter for every bucket of the table: the number of the keys of the
+ * first window of the bucket in the backyard. The counter is incremented before the
+ * key is visible in the backyard and decremented after the key is removed, a find
+ * of a key which is not in the backyard does not read the backyard if the counter is
+ * zero. A saturated counter is never decremented
+ */
+#define HASHTABLE_OVERFLOW_MAX 0xff
+
+static inline void hashtable_overflow_inc(volatile uint8_t *counter)
+{
+    uint8_t old = *counter;
+    while ((old != HASHTABLE_OVERFLOW_MAX) && (HASHTABLE_CMPXCHG(counter, old, old + 1) != old))
+    {
+        old = *counter;
+    }
+}
+
+static inline void hashtable_overflow_dec(volatile uint8_t *counter)
+{
+    uint8_t old = *counter;
+    while ((old != HASHTABLE_OVERFLOW_MAX) && old && (HASHTABLE_CMPXCHG(counter, old, old - 1) != old))
+    {
+        old = *counter;
+    }
+}
+
+static inline size_t hashtable_resize_seq(const hashtable_resize_t *resize)
+{
+    const size_t seq = resize->seq;
+    HASHTABLE_RESIZE_RMB();
+    return seq;
+}
+
+/**
+ * Read-side section of a growable table, the generations seen in the section are not
+ * freed until the section ends. The kernel section does not sleep
+ * Returns the reader to pass to hashtable_grow_read_unlock()
+ */
+#ifdef __KERNEL__
+static inline size_t hashtable_grow_read_lock(hashtable_resize_t *resize)
+{
+    rcu_read_lock();
+    return 0;
+}
+
+static inline void hashtable_grow_read_unlock(hashtable_resize_t *resize, const size_t reader)
+{
+    rcu_read_unlock();
+}
+
+static inline void hashtable_grow_synchronize(hashtable_resize_t *resize)
+{
+    synchronize_rcu();
+}
+#else
+static inline size_t hashtable_grow_read_lock(hashtable_resize_t *resize)
+{
+    int shard = hashtable_grow_reader;
+    size_t reader;
+    if (unlikely(shard < 0))
+    {
+        shard = __sync_fetch_and_add(&hashtable_grow_reader_next, 1) % HASHTABLE_GROW_READERS;
+        hashtable_grow_reader = shard;
+    }
+    reader = ((size_t)shard << 1) | (resize->reader_phase & 1);
+    /* Full barrier, the generations are read after the counter is visible */
+    __sync_fetch_and_add(&resize->readers[reader >> 1].count[reader & 1], 1);
+    return reader;
+}
+
+static inline void hashtable_grow_read_unlock(hashtable_resize_t *resize, const size_t reader)
+{
+    __sync_fetch_and_sub(&resize->readers[reader >> 1].count[reader & 1], 1);
+}
+
+/**
+ * A section which read the phase before the flip can increment the counter of the
+ * phase after the drain, the second flip waits for it
+ */
+static inline void hashtable_grow_synchronize(hashtable_resize_t *resize)
+{
+    int flip;
+    for (flip = 0;flip < 2;flip++)
+    {
+        const size_t phase = __sync_fetch_and_add(&resize->reader_phase, 1) & 1;
+        size_t i;
+        for (i = 0;i < HASHTABLE_GROW_READERS;i++)
+        {
+            while (resize->readers[i].count[phase])
+            {
+                HASHTABLE_RELAX();
+            }
+        }
+    }
+}
+#endif
+
+/**
+ * Free the tables of the generations which were migrated, wait for the read-side
+ * sections which could see them. Call from a process context, not from a read-side
+ * section, for example, the callback of hashtable_<tokn>_foreach()
+ */
+static inline void hashtable_grow_reclaim(hashtable_t *hashtable)
+{
+    hashtable_resize_t *resize = hashtable->__resize;
+    size_t oldest;
+    if (!resize || (resize->reclaimed == resize->oldest))
+        return;
+    if (HASHTABLE_CMPXCHG(&resize->reclaiming, 0, 1) != 0)
+        return;
+    oldest = resize->oldest;
+    hashtable_grow_synchronize(resize);
+    for (;resize->reclaimed < oldest;resize->reclaimed++)
+    {
+        hashtable_generation_t *generation = &resize->generation[resize->reclaimed];
+        hashtable_free_table(hashtable, generation->table, generation->memory_size);
+        generation->table = NULL;
+    }
+    HASHTABLE_RESIZE_WMB();
+    resize->reclaiming = 0;
+}
+
+static int hashtable_resize_init(hashtable_t *hashtable)
+{
+    hashtable_resize_t *resize = (hashtable_resize_t *)hashtable_alloc(sizeof(*resize));
+    if (!resize)
+    {
+        PRINTF("Failed to allocate %zu for the hashtable %s", sizeof(*resize), hashtable->name);
+        return 0;
+    }
+    memset(resize, 0, sizeof(*resize));
+    resize->generation[0].table = hashtable->__table;
+    resize->generation[0].size = hashtable->__size;
+    resize->generation[0].memory_size = hashtable->__memory_size;
+    resize->generation[0].bits = hashtable->bits;
+    hashtable->__resize = resize;
+    return 1;
+}
+
+/**
+ * Expiry of the stale keys, see hashtable_<tokn>_expire()
+ * The insert stores the epoch of the table in the slot, the epoch is a counter
+ * which hashtable_expire_tick() advances, for example once a second. The table does not
+ * read a clock
+ */
+static int hashtable_epochs_init(hashtable_t *hashtable, const size_t slots)
+{
+    if (!hashtable->expire)
+    {
+        return 1;
+    }
+    if (hashtable->max_bits > hashtable->bits)
+    {
+        PRINTF("Growable hashtable %s does not expire the keys", hashtable->name);
+        return 0;
+    }
+    hashtable->__epochs_size = slots * sizeof(uint32_t);
+    hashtable->__epochs = (volatile uint32_t *)hashtable_alloc(hashtable->__epochs_size);
+    if (!hashtable->__epochs)
+    {
+        PRINTF("Failed to allocate %zu for the hashtable %s", hashtable->__epochs_size, hashtable->name);
+        return 0;
+    }
+    memset((void *)hashtable->__epochs, 0, hashtable->__epochs_size);
+    hashtable->__epoch = 0;
+    hashtable->__expire_next = 0;
+    return 1;
+}
+
+static inline void hashtable_expire_tick(hashtable_t *hashtable)
+{
+    hashtable->__epoch++;
+}
+
+/**
+ * The slot is stamped before the new key is visible, hashtable_<tokn>_expire() can read an
+ * epoch newer than the epoch it started with
+ */
+static inline int hashtable_expire_stale(const uint32_t epoch, const uint32_t stamp, const uint32_t ttl)
+{
+    return (int32_t)(epoch - stamp) >= (int32_t)ttl;
+}
+
+/**
+ * hashtable_<tokn>_expire() reads the epoch of the slot after the key: the epoch of the
+ * previous key of the slot does not pass for the epoch of a new key
+ */
+#ifdef __KERNEL__
+#   define HASHTABLE_EXPIRE_RMB() smp_rmb()
+#else
+#   define HASHTABLE_EXPIRE_RMB() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+/* The insert or remove of the key in the slot 'index', a single branch if the keys do not expire */
+#define HASHTABLE_EXPIRE_STAMP(hashtable, index)                                                                                  \
+    do {                                                                                                                          \
+        if (unlikely((hashtable)->__epochs != NULL))                                                                              \
+        {                                                                                                                         \
+            (hashtable)->__epochs[index] = (hashtable)->__epoch;                                                                  \
+        }                                                                                                                         \
+    } while (0)
+
+
+/**
+ * Counting Bloom filter, see hashtable_t::filter
+ * The counters of a key are in one cache line. A lookup of a missing key in a
+ * big table reads the cache line of the filter and does not read the probe window.
+ * The insert of a key increments HASHTABLE_FILTER_HASHES counters, the remove
+ * decrements them. A saturated counter is never decremented. A growable table
+ * does not support the filter
+ */
+#define HASHTABLE_FILTER_HASHES 3
+#define HASHTABLE_FILTER_MAX    0xff
+
+static int hashtable_filter_init(hashtable_t *hashtable)
+{
+    if (!hashtable->filter)
+    {
+        return 1;
+    }
+    if ((hashtable->max_bits > hashtable->bits) || (hashtable->filter < 0) || (hashtable->filter > 32))
+    {
+        PRINTF("Filter of 2^%d cache lines is not supported by the hashtable %s", hashtable->filter, hashtable->name);
+        return 0;
+    }
+    hashtable->__filter_size = (size_t)HASHTABLE_CACHE_LINE << hashtable->filter;
+    hashtable->__filter = (volatile uint8_t *)hashtable_alloc(hashtable->__filter_size);
+    if (!hashtable->__filter)
+    {
+        PRINTF("Failed to allocate %zu for the hashtable %s", hashtable->__filter_size, hashtable->name);
+        return 0;
+    }
+    memset((void *)hashtable->__filter, 0, hashtable->__filter_size);
+    return 1;
+}
+
+/* The top bits of the mix select the cache line, the low bits select the counters */
+static inline uint64_t hashtable_filter_mix(const uint32_t hash)
+{
+    uint64_t mix = hash;
+    mix ^= mix >> 33;
+    mix *= 0xff51afd7ed558ccdULL;
+    mix ^= mix >> 33;
+    mix *= 0xc4ceb9fe1a85ec53ULL;
+    mix ^= mix >> 33;
+    return mix;
+}
+
+static inline volatile uint8_t *hashtable_filter_line(const hashtable_t *hashtable, const uint64_t mix)
+{
+    return hashtable->__filter + (size_t)(mix >> (64 - hashtable->filter)) * HASHTABLE_CACHE_LINE;
+}
+
+static inline void hashtable_filter_add(hashtable_t *hashtable, const uint32_t hash)
+{
+    const uint64_t mix = hashtable_filter_mix(hash);
+    volatile uint8_t *line = hashtable_filter_line(hashtable, mix);
+    int k;
+    for (k = 0;k < HASHTABLE_FILTER_HASHES;k++)
+    {
+        volatile uint8_t *counter = &line[(mix >> (6 * k)) & (HASHTABLE_CACHE_LINE - 1)];
+        uint8_t old = *counter;
+        while ((old != HASHTABLE_FILTER_MAX) && (HASHTABLE_CMPXCHG(counter, old, old + 1) != old))
+        {
+            old = *counter;
+        }
+    }
+}
+
+static inline void hashtable_filter_remove(hashtable_t *hashtable, const uint32_t hash)
+{
+    const uint64_t mix = hashtable_filter_mix(hash);
+    volatile uint8_t *line = hashtable_filter_line(hashtable, mix);
+    int k;
+    for (k = 0;k < HASHTABLE_FILTER_HASHES;k++)
+    {
+        volatile uint8_t *counter = &line[(mix >> (6 * k)) & (HASHTABLE_CACHE_LINE - 1)];
+        uint8_t old = *counter;
+        while ((old != HASHTABLE_FILTER_MAX) && old && (HASHTABLE_CMPXCHG(counter, old, old - 1) != old))
+        {
+            old = *counter;
+        }
+    }
+}
+
+/* Returns 0 if the key is not in the table, 1 if the key can be in the table */
+static inline int hashtable_filter_test(const hashtable_t *hashtable, const uint32_t hash)
+{
+    const uint64_t mix = hashtable_filter_mix(hash);
+    const volatile uint8_t *line = hashtable_filter_line(hashtable, mix);
+    int k;
+    for (k = 0;k < HASHTABLE_FILTER_HASHES;k++)
+    {
+        if (!line[(mix >> (6 * k)) & (HASHTABLE_CACHE_LINE - 1)])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* A new key in the table, a single branch if there is no filter */
+#define HASHTABLE_FILTER_ADD(hashtable, hash)                                                                                     \
+    do {                                                                                                                          \
+        if (unlikely((hashtable)->__filter != NULL))                                                                              \
+        {                                                                                                                         \
+            hashtable_filter_add(hashtable, hash);                                                                                \
+        }                                                                                                                         \
+    } while (0)
+
+#define HASHTABLE_FILTER_REMOVE(hashtable, hash)                                                                                  \
+    do {                                                                                                                          \
+        if (unlikely((hashtable)->__filter != NULL))                                                                              \
+        {                                                                                                                         \
+            hashtable_filter_remove(hashtable, hash);                                                                             \
+        }                                                                                                                         \
+    } while (0)
+
+/**
+ * The last chunk of the oldest generation is migrated
+ */
+static inline void hashtable_resize_advance(hashtable_t *hashtable)
+{
+    hashtable_resize_t *resize = hashtable->__resize;
+    resize->oldest++;
+    if (resize->oldest == resize->newest)
+    {
+        hashtable_generation_t *generation = &resize->generation[resize->newest];
+        hashtable->__table = generation->table;
+        hashtable->__size = generation->size;
+        hashtable->__memory_size = generation->memory_size;
+        hashtable->bits = generation->bits;
+        PRINTF("Hashtable %s migrated to %zu slots", hashtable->name, generation->size);
+    }
+    HASHTABLE_RESIZE_WMB();
+    resize->seq++;
+}
+
+/**
+ * Start a pass of the migration of the oldest generation, call with resize->growing set
+ */
+static inline void hashtable_resize_restart(hashtable_resize_t *resize)
+{
+    hashtable_generation_t *generation = &resize->generation[resize->oldest];
+    resize->departed_pass = resize->departed;
+    generation->migrate_done = 0;
+    generation->migrate_stuck = 0;
+    HASHTABLE_RESIZE_WMB();
+    generation->migrate_next = 0;
+    resize->stuck = 0;
+}
+
+#define HASHTABLE_ALIGN(x, a) (((x) + ((a) - 1)) & ~((size_t)(a) - 1))
+
+/**
+ * Slot layouts
+ * AOS - an array of slots, every slot keeps the key and the data
+ * SOA - all keys are in one cache line aligned array, all data is in another array.
+ *       find() and remove() compare only keys, and a probe window of max_tries keys
+ *       occupies one cache line instead of max_tries*sizeof(slot)
+ */
+#define HASHTABLE_LAYOUT_IS_SOA_AOS 0
+#define HASHTABLE_LAYOUT_IS_SOA_SOA 1
+
+/**
+ * Probing
+ * LINEAR - the key is in the probe window of max_tries slots starting at the hash
+ * TWO_CHOICE - the key is in one of two probe windows, an insert picks the window with
+ *       more free slots. A window is an aligned bucket of max_tries slots, the buckets
+ *       do not overlap and fill evenly: the first insert fails at ~85% load with max_tries
+ *       16 (the SOA keys of a bucket occupy one cache line), ~70% with max_tries 8 and
+ *       ~45% with max_tries 4, instead of ~20% of the linear probing with max_tries 8. A
+ *       miss costs two windows. Keys are never displaced (Robin Hood, hopscotch) - only
+ *       the context which owns a key writes the key
+ * BACKYARD - TWO_CHOICE and a backyard of 1/8 of the table after the table. A key which
+ *       does not fit its two windows goes to the backyard: one of two pairs of adjacent
+ *       windows, the pair with more free slots. The keys do not move, the first insert
+ *       fails at ~91% load of the table and the backyard with max_tries 4 and ~97% with
+ *       max_tries 8. A miss costs two windows and a byte of the overflow counter of the
+ *       bucket, see hashtable_overflow_inc(), a key in the backyard costs up to six
+ *       windows. The growable table searches the backyard on every miss
+ */
+#define HASHTABLE_PROBE_WINDOWS_LINEAR 1
+#define HASHTABLE_PROBE_WINDOWS_TWO_CHOICE 2
+#define HASHTABLE_PROBE_WINDOWS_BACKYARD 6
+#define HASHTABLE_PROBE_WINDOWS_MAX 6
+/* The windows of the hash, the BACKYARD windows follow them */
+#define HASHTABLE_PROBE_CHOICES_LINEAR 1
+#define HASHTABLE_PROBE_CHOICES_TWO_CHOICE 2
+#define HASHTABLE_PROBE_CHOICES_BACKYARD 2
+#define HASHTABLE_BUCKET_LINEAR(max_tries) 1
+#define HASHTABLE_BUCKET_TWO_CHOICE(max_tries) (max_tries)
+#define HASHTABLE_BUCKET_BACKYARD(max_tries) (max_tries)
+#define HASHTABLE_BACKYARD_LINEAR(size, max_tries) 0
+#define HASHTABLE_BACKYARD_TWO_CHOICE(size, max_tries) 0
+#define HASHTABLE_BACKYARD_BACKYARD(size, max_tries) hashtable_backyard_slots(size, max_tries)
+
+/**
+ * Illegal TID can be (PID_MAX_LIMIT+1)
  * Illegal data is 0 for TID, -1 for FD, etc (this is optional)
+ * A growable table (max_bits > bits) reserves the keys illegal_key-1 and illegal_key-2,
+ * insert, find and remove of these keys return 0
+ */
+#define DECLARE_HASHTABLE(tokn, data_type, max_tries, illegal_key, illegal_data)                                                  \
+    DECLARE_HASHTABLE_EXT(tokn, uint32_t, data_type, max_tries, illegal_key, illegal_data, AOS, LINEAR, HASHTABLE_HASH_DYNAMIC)
+
+#define DECLARE_HASHTABLE_SOA(tokn, data_type, max_tries, illegal_key, illegal_data)                                              \
+    DECLARE_HASHTABLE_EXT(tokn, uint32_t, data_type, max_tries, illegal_key, illegal_data, SOA, LINEAR, HASHTABLE_HASH_DYNAMIC)
+
+#define DECLARE_HASHTABLE_TWO_CHOICE(tokn, data_type, max_tries, illegal_key, illegal_data)                                       \
+    DECLARE_HASHTABLE_EXT(tokn, uint32_t, data_type, max_tries, illegal_key, illegal_data, AOS, TWO_CHOICE, HASHTABLE_HASH_DYNAMIC)
+
+#define DECLARE_HASHTABLE_BACKYARD(tokn, data_type, max_tries, illegal_key, illegal_data)                                         \
+    DECLARE_HASHTABLE_EXT(tokn, uint32_t, data_type, max_tries, illegal_key, illegal_data, AOS, BACKYARD, HASHTABLE_HASH_DYNAMIC)
+
+/**
+ * key_type is uint32_t or uint64_t. The tables with 64 bits keys use hashfunction64
+ * 8 bytes keys in the kernel require a 64 bits kernel (cmpxchg)
+ */
+#define DECLARE_HASHTABLE_KEY(tokn, key_type, data_type, max_tries, illegal_key, illegal_data)                                    \
+    DECLARE_HASHTABLE_EXT(tokn, key_type, data_type, max_tries, illegal_key, illegal_data, AOS, LINEAR, HASHTABLE_HASH_DYNAMIC)
+
+/**
+ * 'hashfunc' is a function or a function-like macro of the key. The compiler inlines
+ * the hash function and hashtable_t::hashfunction is not used. For example
+ * DECLARE_HASHTABLE_HASH(tid, uint32_t, 4, 0, 0, hash_fibonacci)
+ */
+#define DECLARE_HASHTABLE_HASH(tokn, data_type, max_tries, illegal_key, illegal_data, hashfunc)                                   \
+    DECLARE_HASHTABLE_EXT(tokn, uint32_t, data_type, max_tries, illegal_key, illegal_data, AOS, LINEAR, hashfunc)
+
+#define DECLARE_HASHTABLE_EXT(tokn, key_type, data_type, max_tries, illegal_key, illegal_data, layout, probe, hashfunc)           \
+                                                                                                                                  \
+    typedef struct                                                                                                                \
+    {                                                                                                                             \
+        volatile key_type key;                                                                                                    \
+        data_type data;                                                                                                           \
+    } hashtable_## tokn ## _slot_t;                                                                                               \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * The data array follows the keys array in the SOA layout                                                                    \
+     */                                                                                                                           \
+    static inline size_t hashtable_## tokn ##_keys_size(const size_t slots)                                                       \
+    {                                                                                                                             \
+        return HASHTABLE_ALIGN(sizeof(key_type) * slots, HASHTABLE_CACHE_LINE);                                                   \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static inline volatile key_type *hashtable_## tokn ##_key_addr(void *table, const size_t size, const size_t index)            \
+    {                                                                                                                             \
+        if (HASHTABLE_LAYOUT_IS_SOA_## layout)                                                                                    \
+        {                                                                                                                         \
+            return &((volatile key_type *)table)[index];                                                                          \
+        }                                                                                                                         \
+        return &((hashtable_## tokn ## _slot_t *)table)[index].key;                                                               \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static inline uint32_t hashtable_## tokn ##_hash(const hashtable_t *hashtable, const key_type key)                            \
+    {                                                                                                                             \
+        (void)hashtable;                                                                                                          \
+        return hashfunc(key);                                                                                                     \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* Match the keys of a probe window, see hashtable_match_keys() */                                                            \
+    static inline uint32_t hashtable_## tokn ##_match_keys(const volatile key_type *keys, const size_t count,                     \
+            const key_type key, const key_type empty_key, uint32_t *empty_mask)                                                   \
+    {                                                                                                                             \
+        if (sizeof(key_type) > sizeof(uint32_t))                                                                                  \
+        {                                                                                                                         \
+            return hashtable_match_keys64((const volatile uint64_t *)keys, count, (uint64_t)key,                                  \
+                    (uint64_t)empty_key, empty_mask);                                                                             \
+        }                                                                                                                         \
+        return hashtable_match_keys((const volatile uint32_t *)keys, count, (uint32_t)key,                                        \
+                (uint32_t)empty_key, empty_mask);                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* The slots of a table of 'size': the table, max_tries slots after the end and the backyard */                               \
+    static inline size_t hashtable_## tokn ##_slots(const size_t size)                                                            \
+    {                                                                                                                             \
+        return size + max_tries + HASHTABLE_BACKYARD_## probe(size, max_tries);                                                   \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static inline data_type *hashtable_## tokn ##_data_addr(void *table, const size_t size, const size_t index)                   \
+    {                                                                                                                             \
+        if (HASHTABLE_LAYOUT_IS_SOA_## layout)                                                                                    \
+        {                                                                                                                         \
+            char *data = (char *)table + hashtable_## tokn ##_keys_size(hashtable_## tokn ##_slots(size));                        \
+            return &((data_type *)data)[index];                                                                                   \
+        }                                                                                                                         \
+        return &((hashtable_## tokn ## _slot_t *)table)[index].data;                                                              \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static void hashtable_## tokn ## _init_slot(void *table, const size_t size, const size_t index)                               \
+    {                                                                                                                             \
+        *hashtable_## tokn ##_key_addr(table, size, index) = illegal_key;                                                         \
+        *hashtable_## tokn ##_data_addr(table, size, index) = illegal_data;                                                       \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Calculate number of slots in the hash table                                                                                \
+     * I add max_tries on top to ensure that there are max_tries slots after the                                                  \
+     * end of the table                                                                                                           \
+     */                                                                                                                           \
+    static inline size_t hashtable_## tokn ##_slots_size(const size_t size)                                                       \
+    {                                                                                                                             \
+        const size_t slots = hashtable_## tokn ##_slots(size);                                                                    \
+        if (HASHTABLE_LAYOUT_IS_SOA_## layout)                                                                                    \
+        {                                                                                                                         \
+            return hashtable_## tokn ##_keys_size(slots) + (sizeof(data_type) * slots);                                           \
+        }                                                                                                                         \
+        return (sizeof(hashtable_## tokn ## _slot_t) * slots);                                                                    \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* BACKYARD, the overflow counters follow the slots, see hashtable_overflow_inc() */                                          \
+    static inline size_t hashtable_## tokn ##_overflow_size(const size_t size)                                                    \
+    {                                                                                                                             \
+        if (HASHTABLE_PROBE_WINDOWS_## probe > HASHTABLE_PROBE_CHOICES_## probe)                                                  \
+        {                                                                                                                         \
+            return HASHTABLE_ALIGN(size / max_tries + 1, HASHTABLE_CACHE_LINE);                                                   \
+        }                                                                                                                         \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static size_t hashtable_## tokn ##_memory_size(const int bits)                                                                \
+    {                                                                                                                             \
+        const size_t size = (size_t)1 << bits;                                                                                    \
+        return hashtable_## tokn ##_slots_size(size) + hashtable_## tokn ##_overflow_size(size);                                  \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* The overflow counter of the first window of the hash */                                                                    \
+    static inline volatile uint8_t *hashtable_## tokn ##_overflow(void *table, const size_t size, const uint32_t hash)            \
+    {                                                                                                                             \
+        volatile uint8_t *counters = (volatile uint8_t *)table + hashtable_## tokn ##_slots_size(size);                           \
+        return &counters[hashtable_window_index(size, hash, 0, max_tries) / max_tries];                                           \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Returns 1 if the probe of the hash ends before the window 'w': the BACKYARD table                                          \
+     * does not keep a key of the first window of the hash in the backyard                                                        \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_probe_end(void *table, const size_t size, const uint32_t hash, const size_t w)         \
+    {                                                                                                                             \
+        return (w == HASHTABLE_PROBE_CHOICES_## probe) && !*hashtable_## tokn ##_overflow(table, size, hash);                     \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* BACKYARD, a key left the slot 'index' */                                                                                   \
+    static inline void hashtable_## tokn ##_overflow_drop(void *table, const size_t size, const uint32_t hash,                    \
+            const size_t index)                                                                                                   \
+    {                                                                                                                             \
+        if ((HASHTABLE_PROBE_WINDOWS_## probe > HASHTABLE_PROBE_CHOICES_## probe) && (index >= (size + max_tries)))               \
+        {                                                                                                                         \
+            hashtable_overflow_dec(hashtable_## tokn ##_overflow(table, size, hash));                                             \
+        }                                                                                                                         \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* The empty slot is zero bytes, the zeroed memory is an empty table */                                                       \
+    static inline int hashtable_## tokn ##_empty_is_zero(void)                                                                    \
+    {                                                                                                                             \
+        const key_type key = illegal_key;                                                                                         \
+        const data_type data = illegal_data;                                                                                      \
+        return hashtable_is_zero(&key, sizeof(key)) && hashtable_is_zero(&data, sizeof(data));                                    \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static inline void hashtable_## tokn ##_init_table(void *table, const size_t size)                                            \
+    {                                                                                                                             \
+        size_t i;                                                                                                                 \
+        for (i = 0;i < hashtable_## tokn ##_slots(size);i++)                                                                      \
+        {                                                                                                                         \
+            hashtable_## tokn ## _init_slot(table, size, i);                                                                      \
+        }                                                                                                                         \
+        memset((char *)table + hashtable_## tokn ##_slots_size(size), 0, hashtable_## tokn ##_overflow_size(size));               \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Set up the table in 'table', initialize the slots if 'init_slots' is set                                                   \
+     * The caller frees the memory if the function fails                                                                          \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_init_memory(hashtable_t *hashtable, void *table, const size_t memory_size,             \
+            const int init_slots)                                                                                                 \
+    {                                                                                                                             \
+        if (!hashtable_stat_init(hashtable))                                                                                      \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        if (hashtable->hashfunction == NULL)                                                                                      \
+        {                                                                                                                         \
+            hashtable->hashfunction = hash32shift;                                                                                \
+        }                                                                                                                         \
+        if (hashtable->hashfunction64 == NULL)                                                                                    \
+        {                                                                                                                         \
+            hashtable->hashfunction64 = hash6432shift;                                                                            \
+        }                                                                                                                         \
+        hashtable->__size = (1 << hashtable->bits);                                                                               \
+        hashtable->__memory_size = memory_size;                                                                                   \
+        hashtable->__table = table;                                                                                               \
+        if (init_slots)                                                                                                           \
+        {                                                                                                                         \
+            hashtable_## tokn ##_init_table(table, hashtable->__size);                                                            \
+        }                                                                                                                         \
+        if (!hashtable_epochs_init(hashtable, hashtable_## tokn ##_slots(hashtable->__size)) ||                                   \
+            !hashtable_filter_init(hashtable) || ((hashtable->max_bits > hashtable->bits) && !hashtable_resize_init(hashtable)))  \
+        {                                                                                                                         \
+            if (hashtable->__epochs)                                                                                              \
+            {                                                                                                                     \
+                hashtable_free((void *)hashtable->__epochs, hashtable->__epochs_size);                                            \
+                hashtable->__epochs = NULL;                                                                                       \
+            }                                                                                                                     \
+            if (hashtable->__filter)                                                                                              \
+            {                                                                                                                     \
+                hashtable_free((void *)hashtable->__filter, hashtable->__filter_size);                                            \
+                hashtable->__filter = NULL;                                                                                       \
+            }                                                                                                                     \
+            hashtable_stat_close(hashtable);                                                                                      \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        hashtable_registry_add(hashtable);                                                                                        \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * A fixed size table with the empty slot of zero bytes gets the zeroed pages,                                                \
+     * the slots are not initialized                                                                                              \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_init(hashtable_t *hashtable)                                                           \
+    {                                                                                                                             \
+        size_t memory_size = hashtable_## tokn ## _memory_size(hashtable->bits);                                                  \
+        const int zero = hashtable_## tokn ##_empty_is_zero() && (hashtable->max_bits <= hashtable->bits);                        \
+        void *p = hashtable_alloc_table(hashtable, memory_size, zero);                                                            \
+        if (!p)                                                                                                                   \
+        {                                                                                                                         \
+            PRINTF("Failed to allocate %zu for the hashtable %s", memory_size, hashtable->name);                                  \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        hashtable->__storage = zero ? HASHTABLE_STORAGE_ZEROED : HASHTABLE_STORAGE_ALLOC;                                         \
+        if (!hashtable_## tokn ##_init_memory(hashtable, p, memory_size, !zero))                                                  \
+        {                                                                                                                         \
+            hashtable_free_table(hashtable, p, memory_size);                                                                      \
+            hashtable->__storage = HASHTABLE_STORAGE_ALLOC;                                                                       \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * The table in the memory of the application, 'size' bytes aligned to a cache line,                                          \
+     * at least hashtable_<tokn>_memory_size(bits), for example a static array of                                                 \
+     * (1 << bits) + max_tries hashtable_<tokn>_slot_t of a LINEAR or TWO_CHOICE table. The                                       \
+     * BACKYARD table adds the backyard and the overflow counters. hashtable_close() does not free                                \
+     * the memory. The slots are not initialized if the memory is 'zeroed' and the empty                                          \
+     * slot is zero bytes. A growable table allocates the memory                                                                  \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_init_storage(hashtable_t *hashtable, void *storage, const size_t size,                 \
+            const int zeroed)                                                                                                     \
+    {                                                                                                                             \
+        const size_t memory_size = hashtable_## tokn ## _memory_size(hashtable->bits);                                            \
+        if ((size < memory_size) || (hashtable->max_bits > hashtable->bits))                                                      \
+        {                                                                                                                         \
+            PRINTF("Storage of %zu bytes does not fit the hashtable %s", size, hashtable->name);                                  \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        hashtable->__storage = HASHTABLE_STORAGE_CALLER;                                                                          \
+        if (!hashtable_## tokn ##_init_memory(hashtable, storage, memory_size,                                                    \
+                !(zeroed && hashtable_## tokn ##_empty_is_zero())))                                                               \
+        {                                                                                                                         \
+            hashtable->__storage = HASHTABLE_STORAGE_ALLOC;                                                                       \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* The header of the file of the table, see hashtable_file_header_t */                                                        \
+    static inline void hashtable_## tokn ##_file_header(const hashtable_t *hashtable, hashtable_file_header_t *header)            \
+    {                                                                                                                             \
+        uint32_t i;                                                                                                               \
+        memset(header, 0, sizeof(*header));                                                                                       \
+        header->magic = HASHTABLE_FILE_MAGIC;                                                                                     \
+        header->version = HASHTABLE_FILE_VERSION;                                                                                 \
+        header->bits = hashtable->bits;                                                                                           \
+        header->tries = max_tries;                                                                                                \
+        header->key_size = sizeof(key_type);                                                                                      \
+        header->data_size = sizeof(data_type);                                                                                    \
+        header->soa = HASHTABLE_LAYOUT_IS_SOA_## layout;                                                                          \
+        header->windows = HASHTABLE_PROBE_WINDOWS_## probe;                                                                       \
+        header->hash_id = hashtable_hash_id(hashtable);                                                                           \
+        for (i = 0;i < HASHTABLE_FILE_HASH_KEYS;i++)                                                                              \
+        {                                                                                                                         \
+            header->hash_check[i] = hashtable_## tokn ##_hash(hashtable, (key_type)hashtable_file_hash_key(i));                   \
+        }                                                                                                                         \
+        header->empty_key = (uint64_t)(illegal_key);                                                                              \
+        header->memory_size = hashtable_## tokn ##_memory_size(hashtable->bits);                                                  \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Userspace, write the slots to the file 'path', the file is replaced atomically                                             \
+     * The writers should be quiescent. A growable table is not saved                                                             \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_save(const hashtable_t *hashtable, const char *path)                                   \
+    {                                                                                                                             \
+        hashtable_file_header_t header;                                                                                           \
+        if (hashtable->__resize)                                                                                                  \
+        {                                                                                                                         \
+            PRINTF("Growable hashtable %s is not saved", hashtable->name);                                                        \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        hashtable_## tokn ##_file_header(hashtable, &header);                                                                     \
+        return hashtable_file_save(path, &header, hashtable->__table);                                                            \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Userspace, the table is the memory of the file which hashtable_<tokn>_save() wrote,                                        \
+     * the slots are not copied and the updates of the table go to the file. The size of                                          \
+     * the table and the hash functions which the application did not set come from the file                                      \
+     * Call hashtable_close()                                                                                                     \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_load_mmap(hashtable_t *hashtable, const char *path)                                    \
+    {                                                                                                                             \
+        hashtable_file_header_t header, expected;                                                                                 \
+        size_t i;                                                                                                                 \
+        void *p = hashtable_file_map(path, &header);                                                                              \
+        if (!p)                                                                                                                   \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        hashtable->bits = header.bits;                                                                                            \
+        hashtable->__storage = HASHTABLE_STORAGE_FILE;                                                                            \
+        hashtable_hash_set(hashtable, header.hash_id);                                                                            \
+        hashtable_## tokn ##_file_header(hashtable, &expected);                                                                   \
+        if (memcmp(&header, &expected, sizeof(header)) || (hashtable->max_bits > hashtable->bits) ||                              \
+            !hashtable_## tokn ##_init_memory(hashtable, p, header.memory_size, 0))                                               \
+        {                                                                                                                         \
+            PRINTF("File %s does not match the hashtable %s", path, hashtable->name);                                             \
+            hashtable_free_table(hashtable, p, header.memory_size);                                                               \
+            hashtable->__storage = HASHTABLE_STORAGE_ALLOC;                                                                       \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        for (i = 0;hashtable->__filter && (i < hashtable_## tokn ##_slots(hashtable->__size));i++)                                \
+        {                                                                                                                         \
+            const key_type key = *hashtable_## tokn ##_key_addr(p, hashtable->__size, i);                                         \
+            if (key != illegal_key)                                                                                               \
+            {                                                                                                                     \
+                hashtable_filter_add(hashtable, hashtable_## tokn ##_hash(hashtable, key));                                       \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Growable mode, see hashtable_resize_t                                                                                      \
+     * Find the key in a generation                                                                                               \
+     * Returns 1 if found, 0 if not found, -1 if the key can be in a frozen slot                                                  \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_gen_find(const hashtable_generation_t *gen, const uint32_t hash,                       \
+            const key_type key, data_type *data)                                                                                  \
+    {                                                                                                                             \
+        int rc = 0;                                                                                                               \
+        size_t w, i;                                                                                                              \
+        for (w = 0;w < HASHTABLE_PROBE_WINDOWS_## probe;w++)                                                                      \
+        {                                                                                                                         \
+            const size_t index = hashtable_window_index(gen->size, hash, w, HASHTABLE_BUCKET_## probe(max_tries));                \
+            for (i = index;i < (index + max_tries);i++)                                                                           \
+            {                                                                                                                     \
+                const key_type old_key = *hashtable_## tokn ##_key_addr(gen->table, gen->size, i);                                \
+                if (old_key == key)                                                                                               \
+                {                                                                                                                 \
+                    if (data)                                                                                                     \
+                    {                                                                                                             \
+                        *data = *hashtable_## tokn ##_data_addr(gen->table, gen->size, i);                                        \
+                    }                                                                                                             \
+                    return 1;                                                                                                     \
+                }                                                                                                                 \
+                if (old_key == HASHTABLE_KEY_FROZEN(key_type, illegal_key))                                                       \
+                {                                                                                                                 \
+                    rc = -1;                                                                                                      \
+                }                                                                                                                 \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        return rc;                                                                                                                \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * A table with expire, the owner and hashtable_<tokn>_expire() can remove the key at                                         \
+     * the same time. The winner of the compare-and-swap to the tombstone HASHTABLE_KEY_FROZEN                                    \
+     * resets the data and frees the slot, a find does not get the data of the previous key                                       \
+     * of the slot. The table does not accept the key HASHTABLE_KEY_FROZEN                                                        \
+     * Returns 1 if the key was removed                                                                                           \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_free_slot(volatile key_type *slot_key, data_type *slot_data, const key_type key)       \
+    {                                                                                                                             \
+        if (HASHTABLE_CMPXCHG(slot_key, key, HASHTABLE_KEY_FROZEN(key_type, illegal_key)) != key)                                 \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        __sync_access(slot_data) = illegal_data;                                                                                  \
+        HASHTABLE_STORE_RELEASE(slot_key, illegal_key);                                                                           \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* The tombstone of a table with expire, see hashtable_<tokn>_free_slot() */                                                  \
+    static inline int hashtable_## tokn ##_tombstone(const hashtable_t *hashtable, const key_type key)                            \
+    {                                                                                                                             \
+        return unlikely(key == HASHTABLE_KEY_FROZEN(key_type, illegal_key)) && (hashtable->__epochs != NULL);                     \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * HASHTABLE_RELOCATE, the owner of the key moved the key closer to the start of                                              \
+     * the probe window and wrote the data, remove the old copy of the key                                                        \
+     */                                                                                                                           \
+    static inline void hashtable_## tokn ##_drop_copy(hashtable_t *hashtable, void *table, const size_t size,                     \
+            const size_t start, const size_t end, const key_type key)                                                             \
+    {                                                                                                                             \
+        size_t i;                                                                                                                 \
+        for (i = start;i < end;i++)                                                                                               \
+        {                                                                                                                         \
+            volatile key_type *slot_key = hashtable_## tokn ##_key_addr(table, size, i);                                          \
+            if (*slot_key == key)                                                                                                 \
+            {                                                                                                                     \
+                if (unlikely(hashtable->__epochs != NULL))                                                                        \
+                {                                                                                                                 \
+                    /* hashtable_<tokn>_expire() can remove the copy at the same time */                                          \
+                    if (!hashtable_## tokn ##_free_slot(slot_key, hashtable_## tokn ##_data_addr(table, size, i), key))           \
+                    {                                                                                                             \
+                        return;                                                                                                   \
+                    }                                                                                                             \
+                }                                                                                                                 \
+                else                                                                                                              \
+                {                                                                                                                 \
+                    __sync_access(hashtable_## tokn ##_data_addr(table, size, i)) = illegal_data;                                 \
+                    HASHTABLE_STORE_RELEASE(slot_key, illegal_key);                                                               \
+                }                                                                                                                 \
+                HASHTABLE_FILTER_REMOVE(hashtable, hashtable_## tokn ##_hash(hashtable, key));                                    \
+                HASHTABLE_STAT_INC(hashtable, relocated);                                                                         \
+                return;                                                                                                           \
+            }                                                                                                                     \
+        }                                                                                                                         \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Compare-and-set of a free slot to the key. A table with expire stamps the epoch of                                         \
+     * the slot before the key is visible: hashtable_<tokn>_expire() does not see the new key                                     \
+     * with the epoch of the previous key of the slot                                                                             \
+     * Returns the previous key of the slot                                                                                       \
+     */                                                                                                                           \
+    static inline key_type hashtable_## tokn ##_claim(hashtable_t *hashtable, volatile key_type *slot_key, const size_t index,    \
+            const key_type key)                                                                                                   \
+    {                                                                                                                             \
+        if (unlikely(hashtable->__epochs != NULL))                                                                                \
+        {                                                                                                                         \
+            const key_type old_key = *slot_key;                                                                                   \
+            if (old_key != illegal_key)                                                                                           \
+            {                                                                                                                     \
+                return old_key;                                                                                                   \
+            }                                                                                                                     \
+            hashtable->__epochs[index] = hashtable->__epoch;                                                                      \
+        }                                                                                                                         \
+        return HASHTABLE_CMPXCHG(slot_key, illegal_key, key);                                                                     \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * BACKYARD, the windows of the hash are full. The overflow counter is incremented                                            \
+     * before the key is visible in the backyard, see hashtable_<tokn>_probe_end()                                                \
+     * Returns 1 if inserted, 0 if there is no free slot, -1 if a slot of the growable                                            \
+     * table is locked                                                                                                            \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_insert_backyard(hashtable_t *hashtable, void *table, const size_t size,                \
+            const uint32_t hash, const key_type key, const data_type data, size_t *free_slots)                                    \
+    {                                                                                                                             \
+        volatile uint8_t *overflow = hashtable_## tokn ##_overflow(table, size, hash);                                            \
+        size_t n, w, i;                                                                                                           \
+        for (w = HASHTABLE_PROBE_CHOICES_## probe;w < HASHTABLE_PROBE_WINDOWS_## probe;w++)                                       \
+        {                                                                                                                         \
+            const size_t index = hashtable_window_index(size, hash, w, max_tries);                                                \
+            free_slots[w] = 0;                                                                                                    \
+            for (i = index;i < (index + max_tries);i++)                                                                           \
+            {                                                                                                                     \
+                free_slots[w] += (*hashtable_## tokn ##_key_addr(table, size, i) == illegal_key);                                 \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        hashtable_overflow_inc(overflow);                                                                                         \
+        for (n = 0;n < (HASHTABLE_PROBE_WINDOWS_## probe - HASHTABLE_PROBE_CHOICES_## probe);n++)                                 \
+        {                                                                                                                         \
+            size_t index;                                                                                                         \
+            w = hashtable_backyard_window(free_slots, n);                                                                         \
+            index = hashtable_window_index(size, hash, w, max_tries);                                                             \
+            for (i = index;i < (index + max_tries);i++)                                                                           \
+            {                                                                                                                     \
+                volatile key_type *slot_key = hashtable_## tokn ##_key_addr(table, size, i);                                      \
+                const key_type old_key = hashtable_## tokn ##_claim(hashtable, slot_key, i, key);                                 \
+                if (likely(old_key == illegal_key) || (old_key == key))                                                           \
+                {                                                                                                                 \
+                    *hashtable_## tokn ##_data_addr(table, size, i) = data;                                                       \
+                    HASHTABLE_EXPIRE_STAMP(hashtable, i);                                                                         \
+                    if (old_key == key)                                                                                           \
+                    {                                                                                                             \
+                        hashtable_overflow_dec(overflow);                                                                         \
+                        HASHTABLE_STAT_INC(hashtable, overwritten);                                                               \
+                    }                                                                                                             \
+                    else                                                                                                          \
+                    {                                                                                                             \
+                        HASHTABLE_FILTER_ADD(hashtable, hash);                                                                    \
+                    }                                                                                                             \
+                    HASHTABLE_STAT_PROBE(hashtable, probe_insert, w * max_tries + i - index);                                     \
+                    return 1;                                                                                                     \
+                }                                                                                                                 \
+                if (hashtable->__resize && (old_key == HASHTABLE_KEY_FROZEN(key_type, illegal_key)))                              \
+                {                                                                                                                 \
+                    hashtable_overflow_dec(overflow);                                                                             \
+                    return -1;                                                                                                    \
+                }                                                                                                                 \
+                HASHTABLE_STAT_INC(hashtable, collision);                                                                         \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        hashtable_overflow_dec(overflow);                                                                                         \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Insert to a table of 'size' slots. The insert looks for the key in the probe windows                                       \
+     * first, TWO_CHOICE probing inserts to the window with more free slots, BACKYARD                                             \
+     * probing inserts to the backyard if both windows are full                                                                   \
+     * Returns 1 if inserted or overwritten, 0 if there is no free slot, -1 if a slot                                             \
+     * of the growable table is locked, see hashtable_<tokn>_data_lock()                                                          \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_insert_table(hashtable_t *hashtable, void *table, const size_t size,                   \
+            const uint32_t hash, const key_type key, const data_type data)                                                        \
+    {                                                                                                                             \
+        size_t free_slots[HASHTABLE_PROBE_WINDOWS_MAX] = {0};                                                                     \
+        size_t w = 0;                                                                                                             \
+        size_t n, i;                                                                                                              \
+        for (n = 0;(n < HASHTABLE_PROBE_WINDOWS_## probe) && !hashtable_## tokn ##_probe_end(table, size, hash, n);n++)           \
+        {                                                                                                                         \
+            const size_t index = hashtable_window_index(size, hash, n, HASHTABLE_BUCKET_## probe(max_tries));                     \
+            size_t first_free = index + max_tries;                                                                                \
+            for (i = index;i < (index + max_tries);i++)                                                                           \
+            {                                                                                                                     \
+                const key_type old_key = *hashtable_## tokn ##_key_addr(table, size, i);                                          \
+                if (old_key == key)                                                                                               \
+                {                                                                                                                 \
+                    volatile key_type *free_key = hashtable_## tokn ##_key_addr(table, size, first_free);                         \
+                    if (HASHTABLE_RELOCATE && (first_free < i) && !hashtable->__resize &&                                         \
+                        (hashtable_## tokn ##_claim(hashtable, free_key, first_free,                                              \
+                            HASHTABLE_KEY_FROZEN(key_type, illegal_key)) == illegal_key))                                         \
+                    {                                                                                                             \
+                        *hashtable_## tokn ##_data_addr(table, size, first_free) = data;                                          \
+                        HASHTABLE_EXPIRE_STAMP(hashtable, first_free);                                                            \
+                        /* The data is written before the key replaces the placeholder */                                         \
+                        HASHTABLE_STORE_RELEASE(free_key, key);                                                                   \
+                        HASHTABLE_FILTER_ADD(hashtable, hash);                                                                    \
+                        hashtable_## tokn ##_drop_copy(hashtable, table, size, i, i + 1, key);                                    \
+                        HASHTABLE_STAT_INC(hashtable, overwritten);                                                               \
+                        HASHTABLE_STAT_PROBE(hashtable, probe_insert, n * max_tries + first_free - index);                        \
+                        return 1;                                                                                                 \
+                    }                                                                                                             \
+                    *hashtable_## tokn ##_data_addr(table, size, i) = data;                                                       \
+                    HASHTABLE_EXPIRE_STAMP(hashtable, i);                                                                         \
+                    HASHTABLE_STAT_INC(hashtable, overwritten);                                                                   \
+                    HASHTABLE_STAT_PROBE(hashtable, probe_insert, n * max_tries + i - index);                                     \
+                    return 1;                                                                                                     \
+                }                                                                                                                 \
+                if (hashtable->__resize && (old_key == HASHTABLE_KEY_FROZEN(key_type, illegal_key)))                              \
+                {                                                                                                                 \
+                    return -1;                                                                                                    \
+                }                                                                                                                 \
+                if ((old_key == illegal_key) && (first_free == (index + max_tries)))                                              \
+                {                                                                                                                 \
+                    first_free = i;                                                                                               \
+                }                                                                                                                 \
+                free_slots[n] += (old_key == illegal_key);                                                                        \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        /* Both windows fill evenly */                                                                                            \
+        w = (free_slots[1] > free_slots[0]);                                                                                      \
+        for (n = 0;n < HASHTABLE_PROBE_CHOICES_## probe;n++, w ^= 1)                                                              \
+        {                                                                                                                         \
+            const size_t index = hashtable_window_index(size, hash, w, HASHTABLE_BUCKET_## probe(max_tries));                     \
+            for (i = index;i < (index + max_tries);i++)                                                                           \
+            {                                                                                                                     \
+                volatile key_type *slot_key = hashtable_## tokn ##_key_addr(table, size, i);                                      \
+                const key_type old_key = hashtable_## tokn ##_claim(hashtable, slot_key, i, key);                                 \
+                if (likely(old_key == illegal_key) || (old_key == key))                                                           \
+                {                                                                                                                 \
+                    *hashtable_## tokn ##_data_addr(table, size, i) = data;                                                       \
+                    HASHTABLE_EXPIRE_STAMP(hashtable, i);                                                                         \
+                    if (old_key == key)                                                                                           \
+                    {                                                                                                             \
+                        HASHTABLE_STAT_INC(hashtable, overwritten);                                                               \
+                    }                                                                                                             \
+                    else                                                                                                          \
+                    {                                                                                                             \
+                        HASHTABLE_FILTER_ADD(hashtable, hash);                                                                    \
+                    }                                                                                                             \
+                    HASHTABLE_STAT_PROBE(hashtable, probe_insert, w * max_tries + i - index);                                     \
+                    return 1;                                                                                                     \
+                }                                                                                                                 \
+                if (hashtable->__resize && (old_key == HASHTABLE_KEY_FROZEN(key_type, illegal_key)))                              \
+                {                                                                                                                 \
+                    return -1;                                                                                                    \
+                }                                                                                                                 \
+                HASHTABLE_STAT_INC(hashtable, collision);                                                                         \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        if (HASHTABLE_PROBE_WINDOWS_## probe > HASHTABLE_PROBE_CHOICES_## probe)                                                  \
+        {                                                                                                                         \
+            return hashtable_## tokn ##_insert_backyard(hashtable, table, size, hash, key, data, free_slots);                     \
+        }                                                                                                                         \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* Returns 1 if inserted or overwritten, 0 if there is no free slot, -1 - try again */                                        \
+    static inline int hashtable_## tokn ##_gen_insert(hashtable_t *hashtable, const hashtable_generation_t *gen,                  \
+            const uint32_t hash, const key_type key, const data_type data)                                                        \
+    {                                                                                                                             \
+        return hashtable_## tokn ##_insert_table(hashtable, gen->table, gen->size, hash, key, data);                              \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * The slot can be frozen by a migrating context at any time, remove the key using                                            \
+     * compare-and-set. The data is not reset - the migrating context can copy it                                                 \
+     * Returns 1 if removed, 0 if not found, -1 if the key can be in a frozen slot                                                \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_gen_remove(const hashtable_generation_t *gen, const uint32_t hash,                     \
+            const key_type key, data_type *data)                                                                                  \
+    {                                                                                                                             \
+        int rc = 0;                                                                                                               \
+        size_t w, i;                                                                                                              \
+        for (w = 0;w < HASHTABLE_PROBE_WINDOWS_## probe;w++)                                                                      \
+        {                                                                                                                         \
+            const size_t index = hashtable_window_index(gen->size, hash, w, HASHTABLE_BUCKET_## probe(max_tries));                \
+            for (i = index;i < (index + max_tries);i++)                                                                           \
+            {                                                                                                                     \
+                volatile key_type *slot_key = hashtable_## tokn ##_key_addr(gen->table, gen->size, i);                            \
+                const key_type old_key = *slot_key;                                                                               \
+                if (old_key == key)                                                                                               \
+                {                                                                                                                 \
+                    *data = *hashtable_## tokn ##_data_addr(gen->table, gen->size, i);                                            \
+                    if (HASHTABLE_CMPXCHG(slot_key, key, illegal_key) == key)                                                     \
+                    {                                                                                                             \
+                        hashtable_## tokn ##_overflow_drop(gen->table, gen->size, hash, i);                                       \
+                        return 1;                                                                                                 \
+                    }                                                                                                             \
+                    return -1;                                                                                                    \
+                }                                                                                                                 \
+                if (old_key == HASHTABLE_KEY_FROZEN(key_type, illegal_key))                                                       \
+                {                                                                                                                 \
+                    rc = -1;                                                                                                      \
+                }                                                                                                                 \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        return rc;                                                                                                                \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Freeze the slot of the previous generation, store the key in the current generation                                        \
+     * with 'data', mark the slot moved. If there is no room in the current generation                                            \
+     * keep the key in the slot of the previous generation                                                                        \
+     */                                                                                                                           \
+    static inline void hashtable_## tokn ##_gen_move(hashtable_t *hashtable, const hashtable_generation_t *prev,                  \
+            const hashtable_generation_t *cur, const size_t index, const key_type key, const data_type data, int *stuck)          \
+    {                                                                                                                             \
+        volatile key_type *slot_key = hashtable_## tokn ##_key_addr(prev->table, prev->size, index);                              \
+        const uint32_t hash = hashtable_## tokn ##_hash(hashtable, key);                                                          \
+        int rc;                                                                                                                   \
+        while ((rc = hashtable_## tokn ##_gen_insert(hashtable, cur, hash, key, data)) < 0)                                       \
+        {                                                                                                                         \
+            HASHTABLE_RELAX();                                                                                                    \
+        }                                                                                                                         \
+        if (!rc)                                                                                                                  \
+        {                                                                                                                         \
+            *hashtable_## tokn ##_data_addr(prev->table, prev->size, index) = data;                                               \
+            HASHTABLE_RESIZE_WMB();                                                                                               \
+            __sync_access(slot_key) = key;                                                                                        \
+            *stuck = 1;                                                                                                           \
+            return;                                                                                                               \
+        }                                                                                                                         \
+        /* A reader which sees the moved slot finds the copy in the current generation */                                         \
+        HASHTABLE_RESIZE_WMB();                                                                                                   \
+        __sync_access(slot_key) = HASHTABLE_KEY_MOVED(key_type, illegal_key);                                                     \
+        *stuck = 0;                                                                                                               \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Migrate a slot of the previous generation. A free slot is marked moved, and                                                \
+     * a context which started before the migration can not use it anymore                                                        \
+     * Returns 0 if the key is stuck in the previous generation                                                                   \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_gen_migrate_slot(hashtable_t *hashtable, const hashtable_generation_t *prev,           \
+            const hashtable_generation_t *cur, const size_t index)                                                                \
+    {                                                                                                                             \
+        volatile key_type *slot_key = hashtable_## tokn ##_key_addr(prev->table, prev->size, index);                              \
+        key_type old_key = *slot_key;                                                                                             \
+        int stuck = 0;                                                                                                            \
+        while (old_key != HASHTABLE_KEY_MOVED(key_type, illegal_key))                                                             \
+        {                                                                                                                         \
+            key_type key;                                                                                                         \
+            /* The owner of the key moves the key, see gen_update() */                                                            \
+            if (old_key == HASHTABLE_KEY_FROZEN(key_type, illegal_key))                                                           \
+            {                                                                                                                     \
+                HASHTABLE_RELAX();                                                                                                \
+                old_key = *slot_key;                                                                                              \
+                continue;                                                                                                         \
+            }                                                                                                                     \
+            key = HASHTABLE_CMPXCHG(slot_key, old_key, (old_key == illegal_key) ?                                                 \
+                    HASHTABLE_KEY_MOVED(key_type, illegal_key) : HASHTABLE_KEY_FROZEN(key_type, illegal_key));                    \
+            if (key != old_key)                                                                                                   \
+            {                                                                                                                     \
+                old_key = key;                                                                                                    \
+                continue;                                                                                                         \
+            }                                                                                                                     \
+            if (old_key != illegal_key)                                                                                           \
+            {                                                                                                                     \
+                hashtable_## tokn ##_gen_move(hashtable, prev, cur, index, old_key,                                               \
+                        *hashtable_## tokn ##_data_addr(prev->table, prev->size, index), &stuck);                                 \
+            }                                                                                                                     \
+            break;                                                                                                                \
+        }                                                                                                                         \
+        return !stuck;                                                                                                            \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Migrate a chunk of the oldest generation to the current one. If some keys did                                              \
+     * not fit the current generation start another pass after a key leaves the old                                               \
+     * generations, see hashtable_resize_t::departed                                                                              \
+     * Returns 1 if a pass ended with keys stuck in the oldest generation                                                         \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_gen_migrate(hashtable_t *hashtable, const size_t slots)                                \
+    {                                                                                                                             \
+        hashtable_resize_t *resize = hashtable->__resize;                                                                         \
+        const size_t oldest = resize->oldest;                                                                                     \
+        hashtable_generation_t *cur = &resize->generation[resize->newest];                                                        \
+        hashtable_generation_t *prev = &resize->generation[oldest];                                                               \
+        const size_t prev_slots = hashtable_## tokn ##_slots(prev->size);                                                         \
+        size_t start, end, i, done;                                                                                               \
+        size_t stuck = 0;                                                                                                         \
+        unsigned long flags;                                                                                                      \
+        if (prev == cur)                                                                                                          \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        if (resize->stuck)                                                                                                        \
+        {                                                                                                                         \
+            /* Another pass would find the same keys stuck */                                                                     \
+            if ((resize->departed == resize->departed_pass) || (HASHTABLE_CMPXCHG(&resize->growing, 0, 1) != 0))                  \
+            {                                                                                                                     \
+                return 1;                                                                                                         \
+            }                                                                                                                     \
+            if (resize->stuck)                                                                                                    \
+            {                                                                                                                     \
+                hashtable_resize_restart(resize);                                                                                 \
+            }                                                                                                                     \
+            HASHTABLE_RESIZE_WMB();                                                                                               \
+            resize->growing = 0;                                                                                                  \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        start = __sync_fetch_and_add(&prev->migrate_next, slots);                                                                 \
+        if (start >= prev_slots)                                                                                                  \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        end = ((start + slots) < prev_slots) ? (start + slots) : prev_slots;                                                      \
+        HASHTABLE_MIGRATE_BEGIN(flags);                                                                                           \
+        for (i = start;i < end;i++)                                                                                               \
+        {                                                                                                                         \
+            stuck += !hashtable_## tokn ##_gen_migrate_slot(hashtable, prev, cur, i);                                             \
+        }                                                                                                                         \
+        HASHTABLE_MIGRATE_END(flags);                                                                                             \
+        if (stuck)                                                                                                                \
+        {                                                                                                                         \
+            __sync_fetch_and_add(&prev->migrate_stuck, stuck);                                                                    \
+        }                                                                                                                         \
+        done = __sync_add_and_fetch(&prev->migrate_done, end - start);                                                            \
+        if (done == prev_slots)                                                                                                   \
+        {                                                                                                                         \
+            if (prev->migrate_stuck)                                                                                              \
+            {                                                                                                                     \
+                /* hashtable_## tokn ##_grow() can add a larger generation */                                                     \
+                resize->stuck = 1;                                                                                                \
+                return 1;                                                                                                         \
+            }                                                                                                                     \
+            hashtable_resize_advance(hashtable);                                                                                  \
+        }                                                                                                                         \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Complete the ongoing migration. Give up if the keys do not fit the current                                                 \
+     * generation. Every chunk is a read-side section, a long migration does not delay                                            \
+     * the grace periods                                                                                                          \
+     */                                                                                                                           \
+    static inline void hashtable_## tokn ##_gen_migrate_all(hashtable_t *hashtable)                                               \
+    {                                                                                                                             \
+        hashtable_resize_t *resize = hashtable->__resize;                                                                         \
+        while (resize->oldest != resize->newest)                                                                                  \
+        {                                                                                                                         \
+            const size_t reader = hashtable_grow_read_lock(resize);                                                               \
+            const int stop = hashtable_## tokn ##_gen_migrate(hashtable, HASHTABLE_MIGRATE_CHUNK);                                \
+            hashtable_grow_read_unlock(resize, reader);                                                                           \
+            if (stop)                                                                                                             \
+            {                                                                                                                     \
+                break;                                                                                                            \
+            }                                                                                                                     \
+        }                                                                                                                         \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Add a generation twice the size of the current one and start the migration                                                 \
+     * A migration with stuck keys continues to the new generation                                                                \
+     * In the kernel call from a process context, see HASHTABLE_GROW_INLINE                                                       \
+     * Returns 1 if a new generation was added                                                                                    \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_grow(hashtable_t *hashtable)                                                           \
+    {                                                                                                                             \
+        hashtable_resize_t *resize = hashtable->__resize;                                                                         \
+        hashtable_generation_t *cur, *next;                                                                                       \
+        size_t memory_size;                                                                                                       \
+        void *p;                                                                                                                  \
+        if (!resize || ((resize->oldest != resize->newest) && !resize->stuck))                                                    \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        if (HASHTABLE_CMPXCHG(&resize->growing, 0, 1) != 0)                                                                       \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        cur = &resize->generation[resize->newest];                                                                                \
+        if (((resize->oldest != resize->newest) && !resize->stuck) || (cur->bits >= hashtable->max_bits) ||                       \
+            ((resize->newest + 1) >= HASHTABLE_GENERATIONS))                                                                      \
+        {                                                                                                                         \
+            resize->growing = 0;                                                                                                  \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        next = cur + 1;                                                                                                           \
+        memory_size = hashtable_## tokn ##_memory_size(cur->bits + 1);                                                            \
+        p = hashtable_alloc_table(hashtable, memory_size, 0);                                                                     \
+        if (!p)                                                                                                                   \
+        {                                                                                                                         \
+            PRINTF("Failed to allocate %zu for the hashtable %s", memory_size, hashtable->name);                                  \
+            resize->growing = 0;                                                                                                  \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        next->bits = cur->bits + 1;                                                                                               \
+        next->size = (size_t)1 << next->bits;                                                                                     \
+        next->memory_size = memory_size;                                                                                          \
+        next->table = p;                                                                                                          \
+        next->migrate_next = 0;                                                                                                   \
+        next->migrate_done = 0;                                                                                                   \
+        next->migrate_stuck = 0;                                                                                                  \
+        hashtable_## tokn ##_init_table(p, next->size);                                                                           \
+        HASHTABLE_RESIZE_WMB();                                                                                                   \
+        resize->newest++;                                                                                                         \
+        HASHTABLE_RESIZE_WMB();                                                                                                   \
+        hashtable_resize_restart(resize);                                                                                         \
+        HASHTABLE_RESIZE_WMB();                                                                                                   \
+        resize->seq++;                                                                                                            \
+        resize->grow_pending = 0;                                                                                                 \
+        HASHTABLE_RESIZE_WMB();                                                                                                   \
+        resize->growing = 0;                                                                                                      \
+        PRINTF("Hashtable %s grows to %zu slots", hashtable->name, next->size);                                                   \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Call periodically from a process context. Complete the ongoing migration, add                                              \
+     * a generation if an insert failed or collisions are above HASHTABLE_GROW_COLLISIONS                                         \
+     * percent of the inserts since the previous call, free the migrated generations                                              \
+     * Returns 1 if a new generation was added                                                                                    \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_grow_check(hashtable_t *hashtable)                                                     \
+    {                                                                                                                             \
+        hashtable_resize_t *resize = hashtable->__resize;                                                                         \
+        hashtable_stat_t stat;                                                                                                    \
+        uint64_t inserts, collisions, insert_errors;                                                                              \
+        int rc = 0;                                                                                                               \
+        if (!resize)                                                                                                              \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        hashtable_stat_get(hashtable, &stat);                                                                                     \
+        inserts = stat.insert - resize->stat_last.insert;                                                                         \
+        collisions = stat.collision - resize->stat_last.collision;                                                                \
+        insert_errors = stat.insert_err - resize->stat_last.insert_err;                                                           \
+        resize->stat_last = stat;                                                                                                 \
+        hashtable_## tokn ##_gen_migrate_all(hashtable);                                                                          \
+        if (resize->grow_pending || resize->stuck || insert_errors ||                                                             \
+            ((collisions * 100) > (inserts * HASHTABLE_GROW_COLLISIONS)))                                                         \
+        {                                                                                                                         \
+            rc = hashtable_## tokn ##_grow(hashtable);                                                                            \
+            hashtable_## tokn ##_gen_migrate_all(hashtable);                                                                      \
+        }                                                                                                                         \
+        hashtable_grow_reclaim(hashtable);                                                                                        \
+        return rc;                                                                                                                \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * The owner of the key moves the key from an old generation itself                                                           \
+     * Returns 1 if done, 0 if the key is not in the generation, -1 - try again                                                   \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_gen_update(hashtable_t *hashtable, const hashtable_generation_t *prev,                 \
+            const hashtable_generation_t *cur, const uint32_t hash, const key_type key, const data_type data)                     \
+    {                                                                                                                             \
+        int rc = 0;                                                                                                               \
+        size_t w, i;                                                                                                              \
+        for (w = 0;w < HASHTABLE_PROBE_WINDOWS_## probe;w++)                                                                      \
+        {                                                                                                                         \
+            const size_t index = hashtable_window_index(prev->size, hash, w, HASHTABLE_BUCKET_## probe(max_tries));               \
+            for (i = index;i < (index + max_tries);i++)                                                                           \
+            {                                                                                                                     \
+                volatile key_type *slot_key = hashtable_## tokn ##_key_addr(prev->table, prev->size, i);                          \
+                const key_type old_key = *slot_key;                                                                               \
+                if (old_key == key)                                                                                               \
+                {                                                                                                                 \
+                    unsigned long flags;                                                                                          \
+                    int stuck;                                                                                                    \
+                    HASHTABLE_MIGRATE_BEGIN(flags);                                                                               \
+                    if (HASHTABLE_CMPXCHG(slot_key, key, HASHTABLE_KEY_FROZEN(key_type, illegal_key)) != key)                     \
+                    {                                                                                                             \
+                        HASHTABLE_MIGRATE_END(flags);                                                                             \
+                        return -1;                                                                                                \
+                    }                                                                                                             \
+                    hashtable_## tokn ##_gen_move(hashtable, prev, cur, i, key, data, &stuck);                                    \
+                    HASHTABLE_MIGRATE_END(flags);                                                                                 \
+                    if (!stuck)                                                                                                   \
+                    {                                                                                                             \
+                        __sync_fetch_and_add(&hashtable->__resize->departed, 1);                                                  \
+                    }                                                                                                             \
+                    return 1;                                                                                                     \
+                }                                                                                                                 \
+                if (old_key == HASHTABLE_KEY_FROZEN(key_type, illegal_key))                                                       \
+                {                                                                                                                 \
+                    rc = -1;                                                                                                      \
+                }                                                                                                                 \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        return rc;                                                                                                                \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* The markers of the slots in the growable mode, see HASHTABLE_KEY_FROZEN */                                                 \
+    static inline int hashtable_## tokn ##_reserved_key(const key_type key)                                                       \
+    {                                                                                                                             \
+        return (key == HASHTABLE_KEY_FROZEN(key_type, illegal_key)) || (key == HASHTABLE_KEY_MOVED(key_type, illegal_key));       \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * A writer which read the generations before a generation was added or                                                       \
+     * migrated repeats the operation, see hashtable_resize_t                                                                     \
+     */                                                                                                                           \
+    static int hashtable_## tokn ##_grow_insert(hashtable_t *hashtable, const uint32_t hash, const key_type key,                  \
+            const data_type data)                                                                                                 \
+    {                                                                                                                             \
+        hashtable_resize_t *resize = hashtable->__resize;                                                                         \
+        HASHTABLE_STAT_INC(hashtable, insert);                                                                                    \
+        if (unlikely(hashtable_## tokn ##_reserved_key(key)))                                                                     \
+        {                                                                                                                         \
+            HASHTABLE_STAT_INC(hashtable, insert_err);                                                                            \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        while (1)                                                                                                                 \
+        {                                                                                                                         \
+            const size_t seq = hashtable_resize_seq(resize);                                                                      \
+            const size_t oldest = resize->oldest;                                                                                 \
+            const size_t newest = resize->newest;                                                                                 \
+            const hashtable_generation_t *cur = &resize->generation[newest];                                                      \
+            int rc = 0;                                                                                                           \
+            size_t g;                                                                                                             \
+            for (g = oldest;(g < newest) && !rc;g++)                                                                              \
+            {                                                                                                                     \
+                rc = hashtable_## tokn ##_gen_update(hashtable, &resize->generation[g], cur, hash, key, data);                    \
+                HASHTABLE_RESIZE_RMB();                                                                                           \
+            }                                                                                                                     \
+            if (rc < 0)                                                                                                           \
+            {                                                                                                                     \
+                HASHTABLE_RELAX();                                                                                                \
+                continue;                                                                                                         \
+            }                                                                                                                     \
+            if (oldest != newest)                                                                                                 \
+            {                                                                                                                     \
+                hashtable_## tokn ##_gen_migrate(hashtable, HASHTABLE_MIGRATE_CHUNK);                                             \
+            }                                                                                                                     \
+            if (!rc)                                                                                                              \
+            {                                                                                                                     \
+                rc = hashtable_## tokn ##_gen_insert(hashtable, cur, hash, key, data);                                            \
+            }                                                                                                                     \
+            if (rc < 0)                                                                                                           \
+            {                                                                                                                     \
+                HASHTABLE_RELAX();                                                                                                \
+                continue;                                                                                                         \
+            }                                                                                                                     \
+            HASHTABLE_RESIZE_MB();                                                                                                \
+            if (resize->seq != seq)                                                                                               \
+            {                                                                                                                     \
+                continue;                                                                                                         \
+            }                                                                                                                     \
+            if (rc)                                                                                                               \
+            {                                                                                                                     \
+                return 1;                                                                                                         \
+            }                                                                                                                     \
+            /* The migration of the new generation is incremental */                                                              \
+            if (HASHTABLE_GROW_INLINE)                                                                                            \
+            {                                                                                                                     \
+                hashtable_## tokn ##_gen_migrate_all(hashtable);                                                                  \
+                if (hashtable_## tokn ##_grow(hashtable))                                                                         \
+                {                                                                                                                 \
+                    continue;                                                                                                     \
+                }                                                                                                                 \
+                /* Another context can add the generation, do not wait for it forever */                                          \
+                for (g = 0;resize->growing && (g < HASHTABLE_GROW_SPIN);g++)                                                      \
+                {                                                                                                                 \
+                    HASHTABLE_RELAX();                                                                                            \
+                }                                                                                                                 \
+                HASHTABLE_RESIZE_RMB();                                                                                           \
+                if (resize->seq != seq)                                                                                           \
+                {                                                                                                                 \
+                    continue;                                                                                                     \
+                }                                                                                                                 \
+            }                                                                                                                     \
+            resize->grow_pending = 1;                                                                                             \
+            break;                                                                                                                \
+        }                                                                                                                         \
+        HASHTABLE_STAT_INC(hashtable, insert_err);                                                                                \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static int hashtable_## tokn ##_grow_remove(hashtable_t *hashtable, const uint32_t hash, const key_type key,                  \
+            data_type *data)                                                                                                      \
+    {                                                                                                                             \
+        hashtable_resize_t *resize = hashtable->__resize;                                                                         \
+        int found = 0;                                                                                                            \
+        HASHTABLE_STAT_INC(hashtable, remove);                                                                                    \
+        if (unlikely(hashtable_## tokn ##_reserved_key(key)))                                                                     \
+        {                                                                                                                         \
+            HASHTABLE_STAT_INC(hashtable, remove_err);                                                                            \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        while (1)                                                                                                                 \
+        {                                                                                                                         \
+            const size_t seq = hashtable_resize_seq(resize);                                                                      \
+            const size_t oldest = resize->oldest;                                                                                 \
+            const size_t newest = resize->newest;                                                                                 \
+            data_type old_data;                                                                                                   \
+            int retry = 0;                                                                                                        \
+            size_t g;                                                                                                             \
+            /* A key in a newer generation can be half copied while the slot is frozen */                                         \
+            for (g = oldest;(g <= newest) && !retry;g++)                                                                          \
+            {                                                                                                                     \
+                const int rc = hashtable_## tokn ##_gen_remove(&resize->generation[g], hash, key, &old_data);                     \
+                if (rc > 0)                                                                                                       \
+                {                                                                                                                 \
+                    if (data)                                                                                                     \
+                    {                                                                                                             \
+                        *data = old_data;                                                                                         \
+                    }                                                                                                             \
+                    if (g < newest)                                                                                               \
+                    {                                                                                                             \
+                        __sync_fetch_and_add(&resize->departed, 1);                                                               \
+                    }                                                                                                             \
+                    found = 1;                                                                                                    \
+                }                                                                                                                 \
+                retry = (rc < 0);                                                                                                 \
+                HASHTABLE_RESIZE_RMB();                                                                                           \
+            }                                                                                                                     \
+            if (retry)                                                                                                            \
+            {                                                                                                                     \
+                HASHTABLE_RELAX();                                                                                                \
+                continue;                                                                                                         \
+            }                                                                                                                     \
+            if (oldest != newest)                                                                                                 \
+            {                                                                                                                     \
+                hashtable_## tokn ##_gen_migrate(hashtable, HASHTABLE_MIGRATE_CHUNK);                                             \
+            }                                                                                                                     \
+            HASHTABLE_RESIZE_MB();                                                                                                \
+            if (resize->seq == seq)                                                                                               \
+            {                                                                                                                     \
+                break;                                                                                                            \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        if (!found)                                                                                                               \
+        {                                                                                                                         \
+            HASHTABLE_STAT_INC(hashtable, remove_err);                                                                            \
+        }                                                                                                                         \
+        return found;                                                                                                             \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Look in the old generations first - a key moves only from an old generation                                                \
+     * to the current one                                                                                                         \
+     */                                                                                                                           \
+    static int hashtable_## tokn ##_grow_find(hashtable_t *hashtable, const uint32_t hash, const key_type key,                    \
+            data_type *data)                                                                                                      \
+    {                                                                                                                             \
+        hashtable_resize_t *resize = hashtable->__resize;                                                                         \
+        HASHTABLE_STAT_INC(hashtable, search);                                                                                    \
+        if (unlikely(hashtable_## tokn ##_reserved_key(key)))                                                                     \
+        {                                                                                                                         \
+            HASHTABLE_STAT_INC(hashtable, search_err);                                                                            \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        while (1)                                                                                                                 \
+        {                                                                                                                         \
+            const size_t seq = hashtable_resize_seq(resize);                                                                      \
+            const size_t oldest = resize->oldest;                                                                                 \
+            const size_t newest = resize->newest;                                                                                 \
+            int retry = 0;                                                                                                        \
+            size_t g;                                                                                                             \
+            for (g = oldest;(g <= newest) && !retry;g++)                                                                          \
+            {                                                                                                                     \
+                const int rc = hashtable_## tokn ##_gen_find(&resize->generation[g], hash, key, data);                            \
+                if (rc > 0)                                                                                                       \
+                {                                                                                                                 \
+                    HASHTABLE_STAT_INC(hashtable, search_ok);                                                                     \
+                    return 1;                                                                                                     \
+                }                                                                                                                 \
+                retry = (rc < 0);                                                                                                 \
+                /* The slot moved before the copy in the next generation is read */                                               \
+                HASHTABLE_RESIZE_RMB();                                                                                           \
+            }                                                                                                                     \
+            if (retry)                                                                                                            \
+            {                                                                                                                     \
+                HASHTABLE_RELAX();                                                                                                \
+                continue;                                                                                                         \
+            }                                                                                                                     \
+            HASHTABLE_RESIZE_RMB();                                                                                               \
+            if (resize->seq == seq)                                                                                               \
+            {                                                                                                                     \
+                break;                                                                                                            \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        HASHTABLE_STAT_INC(hashtable, search_err);                                                                                \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* Insert to the probe window of the hash */                                                                                  \
+    static inline int hashtable_## tokn ##_insert_hash(hashtable_t *hashtable, const uint32_t hash,                               \
+            const key_type key, const data_type data)                                                                             \
+    {                                                                                                                             \
+        const uint32_t index = hashtable_get_index(hashtable, hash);                                                              \
+        /* I can do this for the last slot too - I allocated max_tries more slots */                                              \
+        const uint32_t index_max = index+max_tries;                                                                               \
+        uint32_t i;                                                                                                               \
+        HASHTABLE_STAT_INC(hashtable, insert);                                                                                    \
+        if (hashtable_## tokn ##_tombstone(hashtable, key))                                                                       \
+        {                                                                                                                         \
+            HASHTABLE_STAT_INC(hashtable, insert_err);                                                                            \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        if (HASHTABLE_PROBE_WINDOWS_## probe > 1)                                                                                 \
+        {                                                                                                                         \
+            if (hashtable_## tokn ##_insert_table(hashtable, hashtable->__table, hashtable->__size, hash, key, data))             \
+            {                                                                                                                     \
+                return 1;                                                                                                         \
+            }                                                                                                                     \
+            HASHTABLE_STAT_INC(hashtable, insert_err);                                                                            \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        if (HASHTABLE_MATCH_KEYS(layout, max_tries))                                                                              \
+        {                                                                                                                         \
+            volatile key_type *keys = hashtable_## tokn ##_key_addr(hashtable->__table, hashtable->__size, index);                \
+            uint32_t empty;                                                                                                       \
+            const uint32_t match = hashtable_## tokn ##_match_keys(keys, max_tries, key, illegal_key, &empty);                    \
+            /* Update the key in place, a new key claims the free slots in the order of the linear probing */                     \
+            uint32_t candidates = match ? (match & (0u - match)) : empty;                                                         \
+            while (candidates)                                                                                                    \
+            {                                                                                                                     \
+                const uint32_t offset = __builtin_ctz(candidates);                                                                \
+                key_type old_key = key;                                                                                           \
+                candidates &= candidates - 1;                                                                                     \
+                i = index + offset;                                                                                               \
+                if (!(match & (1u << offset)))                                                                                    \
+                {                                                                                                                 \
+                    old_key = hashtable_## tokn ##_claim(hashtable, &keys[offset], i, key);                                       \
+                }                                                                                                                 \
+                if (likely(old_key == illegal_key)) /* Success */                                                                 \
+                {                                                                                                                 \
+                    *hashtable_## tokn ##_data_addr(hashtable->__table, hashtable->__size, i) = data;                             \
+                    HASHTABLE_EXPIRE_STAMP(hashtable, i);                                                                         \
+                    HASHTABLE_FILTER_ADD(hashtable, hash);                                                                        \
+                    HASHTABLE_STAT_ADD(hashtable, collision, offset);                                                             \
+                    HASHTABLE_STAT_PROBE(hashtable, probe_insert, offset);                                                        \
+                    return 1;                                                                                                     \
+                }                                                                                                                 \
+                else if (old_key == key)                                                                                          \
+                {                                                                                                                 \
+                    *hashtable_## tokn ##_data_addr(hashtable->__table, hashtable->__size, i) = data;                             \
+                    HASHTABLE_EXPIRE_STAMP(hashtable, i);                                                                         \
+                    HASHTABLE_STAT_INC(hashtable, overwritten);                                                                   \
+                    HASHTABLE_STAT_ADD(hashtable, collision, offset);                                                             \
+                    HASHTABLE_STAT_PROBE(hashtable, probe_insert, offset);                                                        \
+                    return 1;                                                                                                     \
+                }                                                                                                                 \
+            }                                                                                                                     \
+            HASHTABLE_STAT_ADD(hashtable, collision, max_tries);                                                                  \
+            HASHTABLE_STAT_INC(hashtable, insert_err);                                                                            \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        /* Update the key in place, a free slot ahead of the key is not taken: no second copy */                                  \
+        for (i = index;i < index_max;i++)                                                                                         \
+        {                                                                                                                         \
+            if (*hashtable_## tokn ##_key_addr(hashtable->__table, hashtable->__size, i) == key)                                  \
+            {                                                                                                                     \
+                *hashtable_## tokn ##_data_addr(hashtable->__table, hashtable->__size, i) = data;                                 \
+                HASHTABLE_EXPIRE_STAMP(hashtable, i);                                                                             \
+                HASHTABLE_STAT_INC(hashtable, overwritten);                                                                       \
+                HASHTABLE_STAT_ADD(hashtable, collision, i - index);                                                              \
+                HASHTABLE_STAT_PROBE(hashtable, probe_insert, i - index);                                                         \
+                return 1;                                                                                                         \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        for (i = index;i < index_max;i++)                                                                                         \
+        {                                                                                                                         \
+            volatile key_type *slot_key = hashtable_## tokn ##_key_addr(hashtable->__table, hashtable->__size, i);                \
+            key_type old_key = hashtable_## tokn ##_claim(hashtable, slot_key, i, key);                                           \
+            if (likely(old_key == illegal_key)) /* Success */                                                                     \
+            {                                                                                                                     \
+                *hashtable_## tokn ##_data_addr(hashtable->__table, hashtable->__size, i) = data;                                 \
+                HASHTABLE_EXPIRE_STAMP(hashtable, i);                                                                             \
+                HASHTABLE_FILTER_ADD(hashtable, hash);                                                                            \
+                HASHTABLE_STAT_PROBE(hashtable, probe_insert, i - index);                                                         \
+                return 1;                                                                                                         \
+            }                                                                                                                     \
+            else if (old_key == key)                                                                                              \
+			{                                                                                                                     \
+                *hashtable_## tokn ##_data_addr(hashtable->__table, hashtable->__size, i) = data;                                 \
+                HASHTABLE_EXPIRE_STAMP(hashtable, i);                                                                             \
+                HASHTABLE_STAT_INC(hashtable, overwritten);                                                                       \
+                HASHTABLE_STAT_PROBE(hashtable, probe_insert, i - index);                                                         \
+                return 1;                                                                                                         \
+			}                                                                                                                     \
+            else                                                                                                                  \
+            {                                                                                                                     \
+                HASHTABLE_STAT_INC(hashtable, collision);                                                                         \
+            }                                                                                                                     \
+        }                                                                                                                         \
+                                                                                                                                  \
+        HASHTABLE_STAT_INC(hashtable, insert_err);                                                                                \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Hash the key, get an index in the hashtable, try compare-and-set.                                                          \
+     * If fails (not likely) try again with the next slot (linear probing)                                                        \
+     * continue until success or max_tries is hit                                                                                 \
+     */                                                                                                                           \
+    static int hashtable_## tokn ##_insert(hashtable_t *hashtable, const key_type key, const data_type data)                      \
+    {                                                                                                                             \
+        const uint64_t start = HASHTABLE_LATENCY_START();                                                                         \
+        const uint32_t hash = hashtable_## tokn ##_hash(hashtable, key);                                                          \
+        int rc;                                                                                                                   \
+        if (unlikely(hashtable->__resize != NULL))                                                                                \
+        {                                                                                                                         \
+            const size_t reader = hashtable_grow_read_lock(hashtable->__resize);                                                  \
+            rc = hashtable_## tokn ##_grow_insert(hashtable, hash, key, data);                                                    \
+            hashtable_grow_read_unlock(hashtable->__resize, reader);                                                              \
+        }                                                                                                                         \
+        else                                                                                                                      \
+        {                                                                                                                         \
+            rc = hashtable_## tokn ##_insert_hash(hashtable, hash, key, data);                                                    \
+        }                                                                                                                         \
+        HASHTABLE_LATENCY_END(hashtable, start, latency_insert);                                                                  \
+        return rc;                                                                                                                \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* Remove from the probe windows of the hash */                                                                               \
+    static inline int hashtable_## tokn ##_remove_hash(hashtable_t *hashtable, const uint32_t hash,                               \
+            const key_type key, data_type *data)                                                                                  \
+    {                                                                                                                             \
+        size_t w;                                                                                                                 \
+        HASHTABLE_STAT_INC(hashtable, remove);                                                                                    \
+        if (unlikely(hashtable->__filter != NULL) && !hashtable_filter_test(hashtable, hash))                                     \
+        {                                                                                                                         \
+            HASHTABLE_STAT_INC(hashtable, filtered);                                                                              \
+            HASHTABLE_STAT_INC(hashtable, remove_err);                                                                            \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        for (w = 0;(w < HASHTABLE_PROBE_WINDOWS_## probe) && !hashtable_## tokn ##_probe_end(hashtable->__table,                  \
+                hashtable->__size, hash, w);w++)                                                                                  \
+        {                                                                                                                         \
+            /* I can do this for the last slot too - I allocated max_tries more slots */                                          \
+            const uint32_t index = hashtable_window_index(hashtable->__size, hash, w, HASHTABLE_BUCKET_## probe(max_tries));      \
+            const uint32_t index_max = index+max_tries;                                                                           \
+            uint32_t i = index;                                                                                                   \
+            if (HASHTABLE_MATCH_KEYS(layout, max_tries))                                                                          \
+            {                                                                                                                     \
+                /* Skip the slots which do not match */                                                                           \
+                const uint32_t match = hashtable_## tokn ##_match_keys(hashtable_## tokn ##_key_addr(hashtable->__table,          \
+                        hashtable->__size, index), max_tries, key, illegal_key, NULL);                                            \
+                i = match ? (index + __builtin_ctz(match)) : index_max;                                                           \
+            }                                                                                                                     \
+            for (;i < index_max;i++)                                                                                              \
+            {                                                                                                                     \
+                volatile key_type *slot_key = hashtable_## tokn ##_key_addr(hashtable->__table, hashtable->__size, i);            \
+                key_type old_key = HASHTABLE_LOAD_ACQUIRE(slot_key);                                                              \
+                if (likely(old_key == key))                                                                                       \
+                {                                                                                                                 \
+                    data_type *slot_data = hashtable_## tokn ##_data_addr(hashtable->__table, hashtable->__size, i);              \
+                    if (data)                                                                                                     \
+                    {                                                                                                             \
+                        *data = *slot_data;                                                                                       \
+                    }                                                                                                             \
+                    if (unlikely(hashtable->__epochs != NULL))                                                                    \
+                    {                                                                                                             \
+                        /* hashtable_<tokn>_expire() can remove the key at the same time */                                       \
+                        HASHTABLE_EXPIRE_STAMP(hashtable, i);                                                                     \
+                        if (!hashtable_## tokn ##_tombstone(hashtable, key) &&                                                    \
+                            hashtable_## tokn ##_free_slot(slot_key, slot_data, key))                                             \
+                        {                                                                                                         \
+                            hashtable_## tokn ##_overflow_drop(hashtable->__table, hashtable->__size, hash, i);                   \
+                            HASHTABLE_FILTER_REMOVE(hashtable, hash);                                                             \
+                            return 1;                                                                                             \
+                        }                                                                                                         \
+                        continue;                                                                                                 \
+                    }                                                                                                             \
+                    __sync_access(slot_data) = illegal_data;                                                                      \
+                    HASHTABLE_STORE_RELEASE(slot_key, illegal_key);                                                               \
+                    hashtable_## tokn ##_overflow_drop(hashtable->__table, hashtable->__size, hash, i);                           \
+                    HASHTABLE_FILTER_REMOVE(hashtable, hash);                                                                     \
+                    return 1;                                                                                                     \
+                }                                                                                                                 \
+            }                                                                                                                     \
+        }                                                                                                                         \
+                                                                                                                                  \
+        HASHTABLE_STAT_INC(hashtable, remove_err);                                                                                \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Hash the key, get an index in the hashtable, find the relevant entry,                                                      \
+     * read the pointer, remove using atomic operation                                                                            \
+     * Only one context is allowed to remove a specific entry                                                                     \
+     */                                                                                                                           \
+    static int hashtable_## tokn ##_remove(hashtable_t *hashtable, const key_type key, data_type *data)                           \
+    {                                                                                                                             \
+        const uint64_t start = HASHTABLE_LATENCY_START();                                                                         \
+        const uint32_t hash = hashtable_## tokn ##_hash(hashtable, key);                                                          \
+        int rc;                                                                                                                   \
+        if (unlikely(hashtable->__resize != NULL))                                                                                \
+        {                                                                                                                         \
+            const size_t reader = hashtable_grow_read_lock(hashtable->__resize);                                                  \
+            rc = hashtable_## tokn ##_grow_remove(hashtable, hash, key, data);                                                    \
+            hashtable_grow_read_unlock(hashtable->__resize, reader);                                                              \
+        }                                                                                                                         \
+        else                                                                                                                      \
+        {                                                                                                                         \
+            rc = hashtable_## tokn ##_remove_hash(hashtable, hash, key, data);                                                    \
+        }                                                                                                                         \
+        HASHTABLE_LATENCY_END(hashtable, start, latency_remove);                                                                  \
+        return rc;                                                                                                                \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* Find in the probe windows of the hash */                                                                                   \
+    static inline int hashtable_## tokn ##_find_hash(hashtable_t *hashtable, const uint32_t hash,                                 \
+            const key_type key, data_type *data)                                                                                  \
+    {                                                                                                                             \
+        size_t w;                                                                                                                 \
+        HASHTABLE_STAT_INC(hashtable, search);                                                                                    \
+        if (unlikely(hashtable->__filter != NULL) && !hashtable_filter_test(hashtable, hash))                                     \
+        {                                                                                                                         \
+            HASHTABLE_STAT_INC(hashtable, filtered);                                                                              \
+            HASHTABLE_STAT_INC(hashtable, search_err);                                                                            \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        for (w = 0;(w < HASHTABLE_PROBE_WINDOWS_## probe) && !hashtable_## tokn ##_probe_end(hashtable->__table,                  \
+                hashtable->__size, hash, w);w++)                                                                                  \
+        {                                                                                                                         \
+            /* I can do this for the last slot too - I allocated max_tries more slots */                                          \
+            const uint32_t index = hashtable_window_index(hashtable->__size, hash, w, HASHTABLE_BUCKET_## probe(max_tries));      \
+            const uint32_t index_max = index+max_tries;                                                                           \
+            uint32_t i = index;                                                                                                   \
+            if (HASHTABLE_MATCH_KEYS(layout, max_tries))                                                                          \
+            {                                                                                                                     \
+                /* Skip the slots which do not match */                                                                           \
+                const uint32_t match = hashtable_## tokn ##_match_keys(hashtable_## tokn ##_key_addr(hashtable->__table,          \
+                        hashtable->__size, index), max_tries, key, illegal_key, NULL);                                            \
+                i = match ? (index + __builtin_ctz(match)) : index_max;                                                           \
+            }                                                                                                                     \
+            for (;i < index_max;i++)                                                                                              \
+            {                                                                                                                     \
+                volatile key_type *slot_key = hashtable_## tokn ##_key_addr(hashtable->__table, hashtable->__size, i);            \
+                key_type old_key = HASHTABLE_LOAD_ACQUIRE(slot_key);                                                              \
+                if ((old_key == key) && !hashtable_## tokn ##_tombstone(hashtable, key))                                          \
+                {                                                                                                                 \
+                    *data = *hashtable_## tokn ##_data_addr(hashtable->__table, hashtable->__size, i);                            \
+                    HASHTABLE_STAT_INC(hashtable, search_ok);                                                                     \
+                    HASHTABLE_STAT_PROBE(hashtable, probe_search, w * max_tries + i - index);                                     \
+                    return 1;                                                                                                     \
+                }                                                                                                                 \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        HASHTABLE_STAT_INC(hashtable, search_err);                                                                                \
+                                                                                                                                  \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Hash the key, get an index in the hashtable, find the relevant entry,                                                      \
+     * read the pointer                                                                                                           \
+     */                                                                                                                           \
+    static int hashtable_## tokn ##_find(hashtable_t *hashtable, const key_type key, data_type *data)                             \
+    {                                                                                                                             \
+        const uint64_t start = HASHTABLE_LATENCY_START();                                                                         \
+        const uint32_t hash = hashtable_## tokn ##_hash(hashtable, key);                                                          \
+        int rc;                                                                                                                   \
+        if (unlikely(hashtable->__resize != NULL))                                                                                \
+        {                                                                                                                         \
+            const size_t reader = hashtable_grow_read_lock(hashtable->__resize);                                                  \
+            rc = hashtable_## tokn ##_grow_find(hashtable, hash, key, data);                                                      \
+            hashtable_grow_read_unlock(hashtable->__resize, reader);                                                              \
+        }                                                                                                                         \
+        else                                                                                                                      \
+        {                                                                                                                         \
+            rc = hashtable_## tokn ##_find_hash(hashtable, hash, key, data);                                                      \
+        }                                                                                                                         \
+        HASHTABLE_LATENCY_END(hashtable, start, latency_search);                                                                  \
+        return rc;                                                                                                                \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Find the data slot of the key for the atomic operations, see DECLARE_HASHTABLE_ATOMIC                                      \
+     * A growable table locks the slot - freezes the key until hashtable_<tokn>_data_unlock(),                                    \
+     * a migrating context waits and copies the updated data. The interrupts are disabled                                         \
+     * while the slot is locked, see HASHTABLE_MIGRATE_BEGIN()                                                                    \
+     * Returns NULL if the key is not found                                                                                       \
+     */                                                                                                                           \
+    static inline data_type *hashtable_## tokn ##_data_lock(hashtable_t *hashtable, const key_type key,                           \
+            volatile key_type **locked, unsigned long *flags)                                                                     \
+    {                                                                                                                             \
+        const uint32_t hash = hashtable_## tokn ##_hash(hashtable, key);                                                          \
+        hashtable_resize_t *resize = hashtable->__resize;                                                                         \
+        size_t w, i;                                                                                                              \
+        HASHTABLE_STAT_INC(hashtable, search);                                                                                    \
+        *locked = NULL;                                                                                                           \
+        *flags = 0;                                                                                                               \
+        if (unlikely((resize != NULL) && hashtable_## tokn ##_reserved_key(key)))                                                 \
+        {                                                                                                                         \
+            HASHTABLE_STAT_INC(hashtable, search_err);                                                                            \
+            return NULL;                                                                                                          \
+        }                                                                                                                         \
+        while (unlikely(resize != NULL))                                                                                          \
+        {                                                                                                                         \
+            const size_t reader = hashtable_grow_read_lock(resize);                                                               \
+            const size_t seq = hashtable_resize_seq(resize);                                                                      \
+            const size_t newest = resize->newest;                                                                                 \
+            int retry = 0;                                                                                                        \
+            size_t g;                                                                                                             \
+            for (g = resize->oldest;(g <= newest) && !retry;g++)                                                                  \
+            {                                                                                                                     \
+                const hashtable_generation_t *gen = &resize->generation[g];                                                       \
+                for (w = 0;(w < HASHTABLE_PROBE_WINDOWS_## probe) && !retry;w++)                                                  \
+                {                                                                                                                 \
+                    const size_t index = hashtable_window_index(gen->size, hash, w, HASHTABLE_BUCKET_## probe(max_tries));        \
+                    for (i = index;(i < (index + max_tries)) && !retry;i++)                                                       \
+                    {                                                                                                             \
+                        volatile key_type *slot_key = hashtable_## tokn ##_key_addr(gen->table, gen->size, i);                    \
+                        const key_type old_key = *slot_key;                                                                       \
+                        if (old_key == key)                                                                                       \
+                        {                                                                                                         \
+                            HASHTABLE_MIGRATE_BEGIN(*flags);                                                                      \
+                            if (HASHTABLE_CMPXCHG(slot_key, key, HASHTABLE_KEY_FROZEN(key_type, illegal_key)) == key)             \
+                            {                                                                                                     \
+                                /* The frozen slot keeps the generation from being migrated */                                    \
+                                hashtable_grow_read_unlock(resize, reader);                                                       \
+                                *locked = slot_key;                                                                               \
+                                HASHTABLE_STAT_INC(hashtable, search_ok);                                                         \
+                                return hashtable_## tokn ##_data_addr(gen->table, gen->size, i);                                  \
+                            }                                                                                                     \
+                            HASHTABLE_MIGRATE_END(*flags);                                                                        \
+                            retry = 1;                                                                                            \
+                        }                                                                                                         \
+                        retry |= (old_key == HASHTABLE_KEY_FROZEN(key_type, illegal_key));                                        \
+                    }                                                                                                             \
+                }                                                                                                                 \
+                HASHTABLE_RESIZE_RMB();                                                                                           \
+            }                                                                                                                     \
+            hashtable_grow_read_unlock(resize, reader);                                                                           \
+            if (retry)                                                                                                            \
+            {                                                                                                                     \
+                HASHTABLE_RELAX();                                                                                                \
+                continue;                                                                                                         \
+            }                                                                                                                     \
+            HASHTABLE_RESIZE_RMB();                                                                                               \
+            if (resize->seq == seq)                                                                                               \
+            {                                                                                                                     \
+                HASHTABLE_STAT_INC(hashtable, search_err);                                                                        \
+                return NULL;                                                                                                      \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        for (w = 0;(w < HASHTABLE_PROBE_WINDOWS_## probe) && !hashtable_## tokn ##_probe_end(hashtable->__table,                  \
+                hashtable->__size, hash, w);w++)                                                                                  \
+        {                                                                                                                         \
+            const size_t index = hashtable_window_index(hashtable->__size, hash, w, HASHTABLE_BUCKET_## probe(max_tries));        \
+            const size_t index_max = index + max_tries;                                                                           \
+            i = index;                                                                                                            \
+            if (HASHTABLE_MATCH_KEYS(layout, max_tries))                                                                          \
+            {                                                                                                                     \
+                const uint32_t match = hashtable_## tokn ##_match_keys(hashtable_## tokn ##_key_addr(hashtable->__table,          \
+                        hashtable->__size, index), max_tries, key, illegal_key, NULL);                                            \
+                i = match ? (index + __builtin_ctz(match)) : index_max;                                                           \
+            }                                                                                                                     \
+            for (;i < index_max;i++)                                                                                              \
+            {                                                                                                                     \
+                if (*hashtable_## tokn ##_key_addr(hashtable->__table, hashtable->__size, i) == key)                              \
+                {                                                                                                                 \
+                    HASHTABLE_STAT_INC(hashtable, search_ok);                                                                     \
+                    return hashtable_## tokn ##_data_addr(hashtable->__table, hashtable->__size, i);                              \
+                }                                                                                                                 \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        HASHTABLE_STAT_INC(hashtable, search_err);                                                                                \
+        return NULL;                                                                                                              \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* Unlock the slot locked by hashtable_<tokn>_data_lock() */                                                                  \
+    static inline void hashtable_## tokn ##_data_unlock(volatile key_type *locked, const key_type key,                            \
+            const unsigned long flags)                                                                                            \
+    {                                                                                                                             \
+        if (unlikely(locked != NULL))                                                                                             \
+        {                                                                                                                         \
+            /* The data is written before the slot is unlocked, a migrating context copies it */                                  \
+            HASHTABLE_RESIZE_WMB();                                                                                               \
+            __sync_access(locked) = key;                                                                                          \
+            HASHTABLE_MIGRATE_END(flags);                                                                                         \
+        }                                                                                                                         \
+    }                                                                                                                             \
+    /**                                                                                                                           \
+     * Remove the keys inserted 'ttl' or more epochs ago, see hashtable_expire_tick()                                             \
+     * Scan up to 'slots' slots starting where the previous call stopped. Call from a single                                      \
+     * context, for example a timer or a thread. A key which the owner inserts again at the                                       \
+     * moment of the expiry can be removed, 'ttl' should be well above the lifetime of an entry                                   \
+     * Returns the number of the removed keys                                                                                     \
+     */                                                                                                                           \
+    static inline size_t hashtable_## tokn ##_expire(hashtable_t *hashtable, const uint32_t ttl, const size_t slots)              \
+    {                                                                                                                             \
+        volatile uint32_t *epochs = hashtable->__epochs;                                                                          \
+        const size_t table_slots = hashtable_## tokn ##_slots(hashtable->__size);                                                 \
+        const uint32_t epoch = hashtable->__epoch;                                                                                \
+        size_t expired = 0;                                                                                                       \
+        size_t n, i = hashtable->__expire_next;                                                                                   \
+        if (!epochs)                                                                                                              \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        for (n = 0;n < slots;n++, i++)                                                                                            \
+        {                                                                                                                         \
+            volatile key_type *slot_key;                                                                                          \
+            key_type key;                                                                                                         \
+            if (i >= table_slots)                                                                                                 \
+            {                                                                                                                     \
+                i = 0;                                                                                                            \
+            }                                                                                                                     \
+            slot_key = hashtable_## tokn ##_key_addr(hashtable->__table, hashtable->__size, i);                                   \
+            key = *slot_key;                                                                                                      \
+            if ((key == illegal_key) || (key == HASHTABLE_KEY_FROZEN(key_type, illegal_key)))                                     \
+            {                                                                                                                     \
+                continue;                                                                                                         \
+            }                                                                                                                     \
+            /* The insert stamps the slot before the key, see hashtable_<tokn>_claim() */                                         \
+            HASHTABLE_EXPIRE_RMB();                                                                                               \
+            if (hashtable_expire_stale(epoch, epochs[i], ttl) &&                                                                  \
+                hashtable_## tokn ##_free_slot(slot_key, hashtable_## tokn ##_data_addr(hashtable->__table, hashtable->__size, i), key)) \
+            {                                                                                                                     \
+                const uint32_t hash = hashtable_## tokn ##_hash(hashtable, key);                                                  \
+                hashtable_## tokn ##_overflow_drop(hashtable->__table, hashtable->__size, hash, i);                               \
+                HASHTABLE_FILTER_REMOVE(hashtable, hash);                                                                         \
+                expired++;                                                                                                        \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        hashtable->__expire_next = i;                                                                                             \
+        HASHTABLE_STAT_ADD(hashtable, expired, expired);                                                                          \
+        return expired;                                                                                                           \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Iteration, weakly consistent: the keys inserted or removed during the iteration                                            \
+     * can be missed. In the growable mode a key which moves to the current generation                                            \
+     * during the iteration can be missed or visited twice                                                                        \
+     * The keys are read sequentially in the order of the slots, the writers are not blocked                                      \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_live_key(const hashtable_t *hashtable, const key_type key)                             \
+    {                                                                                                                             \
+        if ((key == illegal_key) || hashtable_## tokn ##_tombstone(hashtable, key) ||                                             \
+            (HASHTABLE_RELOCATE && (key == HASHTABLE_KEY_FROZEN(key_type, illegal_key))))                                         \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        return !hashtable->__resize || ((key != HASHTABLE_KEY_MOVED(key_type, illegal_key)) &&                                    \
+            (key != HASHTABLE_KEY_FROZEN(key_type, illegal_key)));                                                                \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Call callback(key, data, ctx) for every key in the table, stop if the callback                                             \
+     * returns 0. The callback of a growable table runs in a read-side section, see                                               \
+     * hashtable_grow_read_lock()                                                                                                 \
+     * Returns the number of the visited keys                                                                                     \
+     */                                                                                                                           \
+    static inline size_t hashtable_## tokn ##_foreach(hashtable_t *hashtable,                                                     \
+            int (*callback)(key_type key, data_type data, void *ctx), void *ctx)                                                  \
+    {                                                                                                                             \
+        hashtable_resize_t *resize = hashtable->__resize;                                                                         \
+        const size_t reader = resize ? hashtable_grow_read_lock(resize) : 0;                                                      \
+        const size_t oldest = resize ? resize->oldest : 0;                                                                        \
+        const size_t newest = resize ? resize->newest : 0;                                                                        \
+        size_t visited = 0;                                                                                                       \
+        int more = 1;                                                                                                             \
+        size_t g, i;                                                                                                              \
+        for (g = oldest;(g <= newest) && more;g++)                                                                                \
+        {                                                                                                                         \
+            void *table = resize ? resize->generation[g].table : hashtable->__table;                                              \
+            const size_t size = resize ? resize->generation[g].size : hashtable->__size;                                          \
+            for (i = 0;(i < hashtable_## tokn ##_slots(size)) && more;i++)                                                        \
+            {                                                                                                                     \
+                const key_type key = *hashtable_## tokn ##_key_addr(table, size, i);                                              \
+                if (hashtable_## tokn ##_live_key(hashtable, key))                                                                \
+                {                                                                                                                 \
+                    visited++;                                                                                                    \
+                    more = callback(key, *hashtable_## tokn ##_data_addr(table, size, i), ctx);                                   \
+                }                                                                                                                 \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        if (resize)                                                                                                               \
+        {                                                                                                                         \
+            hashtable_grow_read_unlock(resize, reader);                                                                           \
+        }                                                                                                                         \
+        return visited;                                                                                                           \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Copy up to 'max' keys to 'keys' and the data to 'data' (optional)                                                          \
+     * Returns the number of copied keys                                                                                          \
+     */                                                                                                                           \
+    static inline size_t hashtable_## tokn ##_snapshot(hashtable_t *hashtable, key_type *keys, data_type *data,                   \
+            const size_t max)                                                                                                     \
+    {                                                                                                                             \
+        hashtable_resize_t *resize = hashtable->__resize;                                                                         \
+        const size_t reader = resize ? hashtable_grow_read_lock(resize) : 0;                                                      \
+        const size_t oldest = resize ? resize->oldest : 0;                                                                        \
+        const size_t newest = resize ? resize->newest : 0;                                                                        \
+        size_t copied = 0;                                                                                                        \
+        size_t g, i;                                                                                                              \
+        for (g = oldest;(g <= newest) && (copied < max);g++)                                                                      \
+        {                                                                                                                         \
+            void *table = resize ? resize->generation[g].table : hashtable->__table;                                              \
+            const size_t size = resize ? resize->generation[g].size : hashtable->__size;                                          \
+            for (i = 0;(i < hashtable_## tokn ##_slots(size)) && (copied < max);i++)                                              \
+            {                                                                                                                     \
+                const key_type key = *hashtable_## tokn ##_key_addr(table, size, i);                                              \
+                if (hashtable_## tokn ##_live_key(hashtable, key))                                                                \
+                {                                                                                                                 \
+                    keys[copied] = key;                                                                                           \
+                    if (data)                                                                                                     \
+                    {                                                                                                             \
+                        data[copied] = *hashtable_## tokn ##_data_addr(table, size, i);                                           \
+                    }                                                                                                             \
+                    copied++;                                                                                                     \
+                }                                                                                                                 \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        if (resize)                                                                                                               \
+        {                                                                                                                         \
+            hashtable_grow_read_unlock(resize, reader);                                                                           \
+        }                                                                                                                         \
+        return copied;                                                                                                            \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Scan up to 'slots' slots of the table, call again until the function returns 1                                             \
+     * The scan reads the keys only, the writers are not blocked. The growable table                                              \
+     * scans the current generation                                                                                               \
+     * Returns 1 when the scan is completed, see hashtable_scan_show()                                                            \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_scan_stats(hashtable_t *hashtable, hashtable_scan_t *scan, const size_t slots)         \
+    {                                                                                                                             \
+        hashtable_resize_t *resize = hashtable->__resize;                                                                         \
+        const size_t reader = resize ? hashtable_grow_read_lock(resize) : 0;                                                      \
+        void *table = hashtable->__table;                                                                                         \
+        size_t size = hashtable->__size;                                                                                          \
+        size_t i, end, slots_end;                                                                                                 \
+        if (resize)                                                                                                               \
+        {                                                                                                                         \
+            const hashtable_generation_t *cur = &resize->generation[resize->newest];                                              \
+            table = cur->table;                                                                                                   \
+            size = cur->size;                                                                                                     \
+        }                                                                                                                         \
+        slots_end = hashtable_## tokn ##_slots(size);                                                                             \
+        if (scan->next == 0)                                                                                                      \
+        {                                                                                                                         \
+            memset(scan, 0, sizeof(*scan));                                                                                       \
+            scan->size = size;                                                                                                    \
+        }                                                                                                                         \
+        end = ((scan->next + slots) < slots_end) ? (scan->next + slots) : slots_end;                                              \
+        for (i = scan->next;i < end;i++)                                                                                          \
+        {                                                                                                                         \
+            const key_type key = *hashtable_## tokn ##_key_addr(table, size, i);                                                  \
+            if ((key != illegal_key) && (!resize || (key != HASHTABLE_KEY_MOVED(key_type, illegal_key))))                         \
+            {                                                                                                                     \
+                scan->live++;                                                                                                     \
+                scan->run++;                                                                                                      \
+            }                                                                                                                     \
+            else                                                                                                                  \
+            {                                                                                                                     \
+                hashtable_scan_run(scan);                                                                                         \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        if (resize)                                                                                                               \
+        {                                                                                                                         \
+            hashtable_grow_read_unlock(resize, reader);                                                                           \
+        }                                                                                                                         \
+        scan->next = end;                                                                                                         \
+        if (end < slots_end)                                                                                                      \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        hashtable_scan_run(scan);                                                                                                 \
+        scan->next = 0;                                                                                                           \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Occupancy map of the table, a character for every 'cells' slots, 64 characters                                             \
+     * in a line. The character is ' ' for an empty cell, '.' for 1-10% full, up to '@'                                           \
+     * for 91-100% full                                                                                                           \
+     * Returns the number of characters                                                                                           \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_heatmap(hashtable_t *hashtable, char *buf, size_t len, size_t cells)                   \
+    {                                                                                                                             \
+        static const char scale[] = " .:-=+*#%&@";                                                                                \
+        hashtable_resize_t *resize = hashtable->__resize;                                                                         \
+        const size_t reader = resize ? hashtable_grow_read_lock(resize) : 0;                                                      \
+        void *table = hashtable->__table;                                                                                         \
+        size_t size = hashtable->__size;                                                                                          \
+        size_t chars = 0;                                                                                                         \
+        size_t cell, i;                                                                                                           \
+        if (resize)                                                                                                               \
+        {                                                                                                                         \
+            const hashtable_generation_t *cur = &resize->generation[resize->newest];                                              \
+            table = cur->table;                                                                                                   \
+            size = cur->size;                                                                                                     \
+        }                                                                                                                         \
+        if (cells == 0)                                                                                                           \
+        {                                                                                                                         \
+            cells = 1;                                                                                                            \
+        }                                                                                                                         \
+        for (cell = 0;(cell < size) && ((chars + 1) < len);cell += cells)                                                         \
+        {                                                                                                                         \
+            size_t live = 0;                                                                                                      \
+            for (i = cell;(i < (cell + cells)) && (i < size);i++)                                                                 \
+            {                                                                                                                     \
+                const key_type key = *hashtable_## tokn ##_key_addr(table, size, i);                                              \
+                live += ((key != illegal_key) && (!resize || (key != HASHTABLE_KEY_MOVED(key_type, illegal_key))));               \
+            }                                                                                                                     \
+            buf[chars++] = scale[(live * 10 + (i - cell) - 1) / (i - cell)];                                                      \
+            if (((cell / cells) % 64) == 63)                                                                                      \
+            {                                                                                                                     \
+                buf[chars++] = '\n';                                                                                              \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        if (resize)                                                                                                               \
+        {                                                                                                                         \
+            hashtable_grow_read_unlock(resize, reader);                                                                           \
+        }                                                                                                                         \
+        if (len)                                                                                                                  \
+        {                                                                                                                         \
+            buf[(chars < len) ? chars : (len - 1)] = 0;                                                                           \
+        }                                                                                                                         \
+        return chars;                                                                                                             \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Batch API                                                                                                                  \
+     * Hash all keys of a chunk, prefetch the probe windows, then probe the table.                                                \
+     * The slots of the chunk are fetched from the memory in parallel, this hides                                                 \
+     * the latency of the DRAM when the table does not fit the cache                                                              \
+     * Bit N in the optional 'mask' array is set if the operation on keys[N] succeeded                                            \
+     * The functions return the number of succeeded operations                                                                    \
+     */                                                                                                                           \
+    static inline size_t hashtable_## tokn ##_insert_batch(hashtable_t *hashtable, const key_type *keys,                          \
+            const data_type *data, const size_t n, uint64_t *mask)                                                                \
+    {                                                                                                                             \
+        uint32_t hash[HASHTABLE_BATCH];                                                                                           \
+        size_t done = 0;                                                                                                          \
+        size_t chunk, i;                                                                                                          \
+        if (unlikely(hashtable->__resize != NULL))                                                                                \
+        {                                                                                                                         \
+            for (i = 0;i < n;i++)                                                                                                 \
+            {                                                                                                                     \
+                const int rc = hashtable_## tokn ##_insert(hashtable, keys[i], data[i]);                                          \
+                HASHTABLE_BATCH_MASK(mask, i, rc);                                                                                \
+                done += rc;                                                                                                       \
+            }                                                                                                                     \
+            return done;                                                                                                          \
+        }                                                                                                                         \
+        for (chunk = 0;chunk < n;chunk += HASHTABLE_BATCH)                                                                        \
+        {                                                                                                                         \
+            const size_t count = ((n - chunk) < HASHTABLE_BATCH) ? (n - chunk) : HASHTABLE_BATCH;                                 \
+            for (i = 0;i < count;i++)                                                                                             \
+            {                                                                                                                     \
+                size_t w;                                                                                                         \
+                hash[i] = hashtable_## tokn ##_hash(hashtable, keys[chunk+i]);                                                    \
+                for (w = 0;w < HASHTABLE_PROBE_CHOICES_## probe;w++)                                                              \
+                {                                                                                                                 \
+                    const size_t index = hashtable_window_index(hashtable->__size, hash[i], w,                                    \
+                            HASHTABLE_BUCKET_## probe(max_tries));                                                                \
+                    HASHTABLE_PREFETCH(hashtable_## tokn ##_key_addr(hashtable->__table, hashtable->__size, index), 1);           \
+                    if (HASHTABLE_LAYOUT_IS_SOA_## layout)                                                                        \
+                    {                                                                                                             \
+                        HASHTABLE_PREFETCH(hashtable_## tokn ##_data_addr(hashtable->__table, hashtable->__size, index), 1);      \
+                    }                                                                                                             \
+                }                                                                                                                 \
+            }                                                                                                                     \
+            for (i = 0;i < count;i++)                                                                                             \
+            {                                                                                                                     \
+                const int rc = hashtable_## tokn ##_insert_hash(hashtable, hash[i], keys[chunk+i], data[chunk+i]);                \
+                HASHTABLE_BATCH_MASK(mask, chunk+i, rc);                                                                          \
+                done += rc;                                                                                                       \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        return done;                                                                                                              \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static inline size_t hashtable_## tokn ##_remove_batch(hashtable_t *hashtable, const key_type *keys,                          \
+            const size_t n, data_type *data, uint64_t *mask)                                                                      \
+    {                                                                                                                             \
+        uint32_t hash[HASHTABLE_BATCH];                                                                                           \
+        size_t done = 0;                                                                                                          \
+        size_t chunk, i;                                                                                                          \
+        if (unlikely(hashtable->__resize != NULL))                                                                                \
+        {                                                                                                                         \
+            for (i = 0;i < n;i++)                                                                                                 \
+            {                                                                                                                     \
+                const int rc = hashtable_## tokn ##_remove(hashtable, keys[i], (data) ? &data[i] : NULL);                         \
+                HASHTABLE_BATCH_MASK(mask, i, rc);                                                                                \
+                done += rc;                                                                                                       \
+            }                                                                                                                     \
+            return done;                                                                                                          \
+        }                                                                                                                         \
+        for (chunk = 0;chunk < n;chunk += HASHTABLE_BATCH)                                                                        \
+        {                                                                                                                         \
+            const size_t count = ((n - chunk) < HASHTABLE_BATCH) ? (n - chunk) : HASHTABLE_BATCH;                                 \
+            for (i = 0;i < count;i++)                                                                                             \
+            {                                                                                                                     \
+                size_t w;                                                                                                         \
+                hash[i] = hashtable_## tokn ##_hash(hashtable, keys[chunk+i]);                                                    \
+                for (w = 0;w < HASHTABLE_PROBE_CHOICES_## probe;w++)                                                              \
+                {                                                                                                                 \
+                    const size_t index = hashtable_window_index(hashtable->__size, hash[i], w,                                    \
+                            HASHTABLE_BUCKET_## probe(max_tries));                                                                \
+                    HASHTABLE_PREFETCH(hashtable_## tokn ##_key_addr(hashtable->__table, hashtable->__size, index), 1);           \
+                    if (HASHTABLE_LAYOUT_IS_SOA_## layout)                                                                        \
+                    {                                                                                                             \
+                        HASHTABLE_PREFETCH(hashtable_## tokn ##_data_addr(hashtable->__table, hashtable->__size, index), 1);      \
+                    }                                                                                                             \
+                }                                                                                                                 \
+            }                                                                                                                     \
+            for (i = 0;i < count;i++)                                                                                             \
+            {                                                                                                                     \
+                const int rc = hashtable_## tokn ##_remove_hash(hashtable, hash[i], keys[chunk+i],                                \
+                        (data) ? &data[chunk+i] : NULL);                                                                          \
+                HASHTABLE_BATCH_MASK(mask, chunk+i, rc);                                                                          \
+                done += rc;                                                                                                       \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        return done;                                                                                                              \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static inline size_t hashtable_## tokn ##_find_batch(hashtable_t *hashtable, const key_type *keys,                            \
+            const size_t n, data_type *data, uint64_t *mask)                                                                      \
+    {                                                                                                                             \
+        uint32_t hash[HASHTABLE_BATCH];                                                                                           \
+        size_t done = 0;                                                                                                          \
+        size_t chunk, i;                                                                                                          \
+        if (unlikely(hashtable->__resize != NULL))                                                                                \
+        {                                                                                                                         \
+            for (i = 0;i < n;i++)                                                                                                 \
+            {                                                                                                                     \
+                const int rc = hashtable_## tokn ##_find(hashtable, keys[i], &data[i]);                                           \
+                HASHTABLE_BATCH_MASK(mask, i, rc);                                                                                \
+                done += rc;                                                                                                       \
+            }                                                                                                                     \
+            return done;                                                                                                          \
+        }                                                                                                                         \
+        for (chunk = 0;chunk < n;chunk += HASHTABLE_BATCH)                                                                        \
+        {                                                                                                                         \
+            const size_t count = ((n - chunk) < HASHTABLE_BATCH) ? (n - chunk) : HASHTABLE_BATCH;                                 \
+            for (i = 0;i < count;i++)                                                                                             \
+            {                                                                                                                     \
+                size_t w;                                                                                                         \
+                hash[i] = hashtable_## tokn ##_hash(hashtable, keys[chunk+i]);                                                    \
+                for (w = 0;w < HASHTABLE_PROBE_CHOICES_## probe;w++)                                                              \
+                {                                                                                                                 \
+                    const size_t index = hashtable_window_index(hashtable->__size, hash[i], w,                                    \
+                            HASHTABLE_BUCKET_## probe(max_tries));                                                                \
+                    HASHTABLE_PREFETCH(hashtable_## tokn ##_key_addr(hashtable->__table, hashtable->__size, index), 0);           \
+                    if (HASHTABLE_LAYOUT_IS_SOA_## layout)                                                                        \
+                    {                                                                                                             \
+                        HASHTABLE_PREFETCH(hashtable_## tokn ##_data_addr(hashtable->__table, hashtable->__size, index), 0);      \
+                    }                                                                                                             \
+                }                                                                                                                 \
+            }                                                                                                                     \
+            for (i = 0;i < count;i++)                                                                                             \
+            {                                                                                                                     \
+                const int rc = hashtable_## tokn ##_find_hash(hashtable, hash[i], keys[chunk+i], &data[chunk+i]);                 \
+                HASHTABLE_BATCH_MASK(mask, chunk+i, rc);                                                                          \
+                done += rc;                                                                                                       \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        return done;                                                                                                              \
+    }                                                                                                                             \
+
+/**
+ * Atomic operations on the data of the key for integral (or pointer) data_type
+ * Declare after DECLARE_HASHTABLE_EXT() with the same tokn, for example
+ * DECLARE_HASHTABLE_ATOMIC(tid, uint32_t, uint32_t)
+ * The operations probe the table once. Any context can update the data, only the owner
+ * of the key inserts and removes the key. An update which races with the remove of
+ * the key can be lost
+ * In the growable mode the slot is locked for the time of the update
  */
-#define DECLARE_HASHTABLE(tokn, data_type, max_tries, illegal_key, illegal_data)                                                  \
+#define DECLARE_HASHTABLE_ATOMIC(tokn, key_type, data_type)                                                                       \
+    /**                                                                                                                           \
+     * Add 'value' to the data, the previous data is stored in 'old'                                                              \
+     * Inserts the key with the data 'value' if the key is not found - only the owner                                             \
+     * of the key can call the function for a missing key                                                                         \
+     * Returns 1 if updated or inserted, 0 if failed to insert                                                                    \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_fetch_add(hashtable_t *hashtable, const key_type key, const data_type value,           \
+            data_type *old)                                                                                                       \
+    {                                                                                                                             \
+        volatile key_type *locked;                                                                                                \
+        unsigned long flags;                                                                                                      \
+        data_type *slot_data = hashtable_## tokn ##_data_lock(hashtable, key, &locked, &flags);                                   \
+        data_type old_data;                                                                                                       \
+        if (!slot_data)                                                                                                           \
+        {                                                                                                                         \
+            return hashtable_## tokn ##_insert(hashtable, key, value);                                                            \
+        }                                                                                                                         \
+        old_data = __sync_fetch_and_add(slot_data, value);                                                                        \
+        hashtable_## tokn ##_data_unlock(locked, key, flags);                                                                     \
+        if (old)                                                                                                                  \
+        {                                                                                                                         \
+            *old = old_data;                                                                                                      \
+        }                                                                                                                         \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Replace the data by 'new_data' if the data is 'expected', the key is not inserted                                          \
+     * Returns 1 if replaced, 0 if the key is not found or the data is not 'expected'                                             \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_cas_data(hashtable_t *hashtable, const key_type key, const data_type expected,         \
+            const data_type new_data)                                                                                             \
+    {                                                                                                                             \
+        volatile key_type *locked;                                                                                                \
+        unsigned long flags;                                                                                                      \
+        data_type *slot_data = hashtable_## tokn ##_data_lock(hashtable, key, &locked, &flags);                                   \
+        int rc;                                                                                                                   \
+        if (!slot_data)                                                                                                           \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        rc = (HASHTABLE_CMPXCHG(slot_data, expected, new_data) == expected);                                                      \
+        hashtable_## tokn ##_data_unlock(locked, key, flags);                                                                     \
+        return rc;                                                                                                                \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Replace the data by fn(data), fn() is called again if the data was modified                                                \
+     * by another context. fn() can not sleep, the key is not inserted                                                            \
+     * Returns 1 if updated, 0 if the key is not found                                                                            \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_update(hashtable_t *hashtable, const key_type key,                                     \
+            data_type (*fn)(data_type))                                                                                           \
+    {                                                                                                                             \
+        volatile key_type *locked;                                                                                                \
+        unsigned long flags;                                                                                                      \
+        data_type *slot_data = hashtable_## tokn ##_data_lock(hashtable, key, &locked, &flags);                                   \
+        data_type old_data;                                                                                                       \
+        if (!slot_data)                                                                                                           \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        do                                                                                                                        \
+        {                                                                                                                         \
+            old_data = __sync_access(slot_data);                                                                                  \
+        }                                                                                                                         \
+        while (HASHTABLE_CMPXCHG(slot_data, old_data, fn(old_data)) != old_data);                                                 \
+        hashtable_## tokn ##_data_unlock(locked, key, flags);                                                                     \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+
+/**
+ * A table of objects larger than a slot can keep
+ * DECLARE_HASHTABLE_POOLED(tid, syscall_args_t, 4, 0)
+ * The slot keeps a 32 bits index of an object in a hashtable_pool_t with
+ * object_size = sizeof(object_type). Only the owner of the key inserts,
+ * updates and removes the object. The object returned by find_object() is valid until
+ * the owner removes or updates the key, an update does not write the object in place
+ */
+#define DECLARE_HASHTABLE_POOLED(tokn, object_type, max_tries, illegal_key)                                                       \
+    DECLARE_HASHTABLE(tokn, uint32_t, max_tries, illegal_key, HASHTABLE_POOL_NONE)                                                \
+                                                                                                                                  \
+    static inline object_type *hashtable_## tokn ##_find_object(hashtable_t *hashtable, hashtable_pool_t *pool,                   \
+            const uint32_t key)                                                                                                   \
+    {                                                                                                                             \
+        uint32_t index;                                                                                                           \
+        if (!hashtable_## tokn ##_find(hashtable, key, &index))                                                                   \
+        {                                                                                                                         \
+            return NULL;                                                                                                          \
+        }                                                                                                                         \
+        return (object_type *)hashtable_pool_object(pool, index);                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Copy the object to the pool and insert the key. An update of the key copies the                                            \
+     * object to a new object of the pool and publishes the index, a reader sees the old                                          \
+     * object or the new one. The old object returns to the pool after the update                                                 \
+     * Returns 1 on success, 0 if the pool is empty or the insert failed                                                          \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_insert_object(hashtable_t *hashtable, hashtable_pool_t *pool,                          \
+            const uint32_t key, const object_type *object)                                                                        \
+    {                                                                                                                             \
+        uint32_t old_index;                                                                                                       \
+        const int update = hashtable_## tokn ##_find(hashtable, key, &old_index);                                                 \
+        const uint32_t index = hashtable_pool_get(pool);                                                                          \
+        if (index == HASHTABLE_POOL_NONE)                                                                                         \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        *(object_type *)hashtable_pool_object(pool, index) = *object;                                                             \
+        /* The object is written before the index is visible */                                                                   \
+        HASHTABLE_BARRIER();                                                                                                      \
+        if (!hashtable_## tokn ##_insert(hashtable, key, index))                                                                  \
+        {                                                                                                                         \
+            hashtable_pool_put(pool, index);                                                                                      \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        if (update)                                                                                                               \
+        {                                                                                                                         \
+            hashtable_pool_put(pool, old_index);                                                                                  \
+        }                                                                                                                         \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
                                                                                                                                   \
+    /**                                                                                                                           \
+     * Remove the key and return the object to the pool, the object is copied to                                                  \
+     * 'object' (optional)                                                                                                        \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_remove_object(hashtable_t *hashtable, hashtable_pool_t *pool,                          \
+            const uint32_t key, object_type *object)                                                                              \
+    {                                                                                                                             \
+        uint32_t index;                                                                                                           \
+        if (!hashtable_## tokn ##_remove(hashtable, key, &index))                                                                 \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        if (object)                                                                                                               \
+        {                                                                                                                         \
+            *object = *(const object_type *)hashtable_pool_object(pool, index);                                                   \
+        }                                                                                                                         \
+        hashtable_pool_put(pool, index);                                                                                          \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+
+/**
+ * Task-local tier in front of the table 'tokn' declared by DECLARE_HASHTABLE_xx
+ * DECLARE_HASHTABLE_LOCAL(tid, uint32_t, uint32_t, 0, 0)
+ * The key which a context inserts, finds and removes stays in the cache of the shard
+ * of the context. If the slot of the shard is taken the key spills to the shared table
+ * and stays there until the owner removes it. The slot records the spilled keys, a
+ * lookup which misses the slot reads the shared table, a remove and an insert touch
+ * the shared table only for a spilled key. The owner of a key is a single context,
+ * local_find() in another context finds a key which is in the shard of the owner after
+ * the miss of the shared table
+ */
+#define DECLARE_HASHTABLE_LOCAL(tokn, key_type, data_type, illegal_key, illegal_data)                                             \
     typedef struct                                                                                                                \
     {                                                                                                                             \
-        volatile uint32_t key;                                                                                                    \
+        volatile key_type key;                                                                                                    \
+        data_type data;                                                                                                           \
+        /* The last key which spilled to the shared table and the number of the spilled keys, see HASHTABLE_LOCAL_SPILLED() */    \
+        volatile key_type spill;                                                                                                  \
+        volatile uint32_t spilled;                                                                                                \
+    } hashtable_## tokn ##_local_slot_t;                                                                                          \
+                                                                                                                                  \
+    static inline hashtable_## tokn ##_local_slot_t *hashtable_## tokn ##_local_slot(const hashtable_local_t *tier,               \
+            const size_t shard, const uint32_t hash)                                                                              \
+    {                                                                                                                             \
+        hashtable_## tokn ##_local_slot_t *slots = (hashtable_## tokn ##_local_slot_t *)((char *)tier->__slots +                  \
+                shard * tier->__stride);                                                                                          \
+        return &slots[hash & ((1 << tier->bits) - 1)];                                                                            \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static inline int hashtable_## tokn ##_local_init(hashtable_local_t *tier)                                                    \
+    {                                                                                                                             \
+        const size_t slots_size = sizeof(hashtable_## tokn ##_local_slot_t) << tier->bits;                                        \
+        size_t shard, i;                                                                                                          \
+        tier->__shards = HASHTABLE_LOCAL_CPUS();                                                                                  \
+        tier->__stride = (slots_size + HASHTABLE_CACHE_LINE - 1) & ~(size_t)(HASHTABLE_CACHE_LINE - 1);                           \
+        tier->__memory_size = tier->__shards * tier->__stride;                                                                    \
+        tier->__slots = hashtable_alloc(tier->__memory_size);                                                                     \
+        if (!tier->__slots)                                                                                                       \
+        {                                                                                                                         \
+            PRINTF("Failed to allocate %zu for the task-local tier", tier->__memory_size);                                        \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        for (shard = 0;shard < tier->__shards;shard++)                                                                            \
+        {                                                                                                                         \
+            for (i = 0;i < ((size_t)1 << tier->bits);i++)                                                                         \
+            {                                                                                                                     \
+                hashtable_## tokn ##_local_slot_t *slot = hashtable_## tokn ##_local_slot(tier, shard, (uint32_t)i);              \
+                slot->key = illegal_key;                                                                                          \
+                slot->data = illegal_data;                                                                                        \
+                slot->spill = illegal_key;                                                                                        \
+                slot->spilled = 0;                                                                                                \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Returns 1 if the key can be in the shared table, 0 if the key did not spill                                                \
+     * A single spilled key is recorded in the slot, the contexts sharing the shard                                               \
+     * can overwrite the record, and several spilled keys need a lookup. The record                                               \
+     * and the count which changed between the reads need a lookup too                                                            \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_local_spilled(hashtable_t *hashtable,                                                  \
+            const hashtable_## tokn ##_local_slot_t *slot, const key_type key)                                                    \
+    {                                                                                                                             \
+        const uint32_t spilled = slot->spilled;                                                                                   \
+        key_type spill;                                                                                                           \
         data_type data;                                                                                                           \
-    } hashtable_## tokn ## _slot_t;                                                                                               \
+        if (likely(!HASHTABLE_LOCAL_SPILLED(spilled)))                                                                            \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        HASHTABLE_LOCAL_RMB();                                                                                                    \
+        spill = slot->spill;                                                                                                      \
+        if (spill == key)                                                                                                         \
+        {                                                                                                                         \
+            return 1;                                                                                                             \
+        }                                                                                                                         \
+        HASHTABLE_LOCAL_RMB();                                                                                                    \
+        if ((HASHTABLE_LOCAL_SPILLED(spilled) == 1) && (spill != illegal_key) && (slot->spilled == spilled))                      \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        return hashtable_## tokn ##_find(hashtable, key, &data);                                                                  \
+    }                                                                                                                             \
                                                                                                                                   \
-    static void hashtable_## tokn ## _init_slot(hashtable_## tokn ## _slot_t *slot)                                               \
+    /**                                                                                                                           \
+     * The owner removed the spilled key from the shared table. The record is cleared                                             \
+     * before the count: a context sharing the shard which reads a single spilled key                                             \
+     * reads the record of the key which is still in the shared table                                                             \
+     */                                                                                                                           \
+    static inline void hashtable_## tokn ##_local_unspill(hashtable_## tokn ##_local_slot_t *slot, const key_type key)            \
     {                                                                                                                             \
-        slot->key = illegal_key;                                                                                                  \
-        slot->data = illegal_data;                                                                                                \
+        HASHTABLE_CMPXCHG(&slot->spill, key, illegal_key);                                                                        \
+        __sync_fetch_and_add(&slot->spilled, HASHTABLE_LOCAL_SPILL_DEC);                                                          \
     }                                                                                                                             \
                                                                                                                                   \
     /**                                                                                                                           \
-     * Calculate number of slots in the hash table                                                                                \
-     * I add max_tries on top to ensure that there are max_tries slots after the                                                  \
-     * end of the table                                                                                                           \
+     * A new key takes the free slot of the shard, or spills to the shared table                                                  \
+     * A spilled key is updated in the shared table. The hit does not write the                                                   \
+     * shared memory                                                                                                              \
      */                                                                                                                           \
-    static size_t hashtable_## tokn ##_memory_size(const int bits)                                                                \
+    static inline int hashtable_## tokn ##_local_insert(hashtable_t *hashtable, hashtable_local_t *tier,                          \
+            const key_type key, const data_type data)                                                                             \
     {                                                                                                                             \
-        size_t slots = (1 << bits) + max_tries;                                                                                   \
-        return (sizeof(hashtable_## tokn ## _slot_t) * slots);                                                                    \
+        const uint32_t hash = hashtable_## tokn ##_hash(hashtable, key);                                                          \
+        const int shard = HASHTABLE_LOCAL_GET();                                                                                  \
+        hashtable_## tokn ##_local_slot_t *slot = hashtable_## tokn ##_local_slot(tier, shard, hash);                             \
+        HASHTABLE_LOCAL_PUT();                                                                                                    \
+        if (slot->key == key)                                                                                                     \
+        {                                                                                                                         \
+            slot->data = data;                                                                                                    \
+            HASHTABLE_STAT_INC(hashtable, local);                                                                                 \
+            return 1;                                                                                                             \
+        }                                                                                                                         \
+        if (hashtable_## tokn ##_local_spilled(hashtable, slot, key))                                                             \
+        {                                                                                                                         \
+            return hashtable_## tokn ##_insert(hashtable, key, data);                                                             \
+        }                                                                                                                         \
+        if ((slot->key == illegal_key) && (HASHTABLE_CMPXCHG(&slot->key, illegal_key, key) == illegal_key))                       \
+        {                                                                                                                         \
+            slot->data = data;                                                                                                    \
+            HASHTABLE_STAT_INC(hashtable, local);                                                                                 \
+            return 1;                                                                                                             \
+        }                                                                                                                         \
+        /* The slot records the key before the key is in the shared table */                                                      \
+        __sync_fetch_and_add(&slot->spilled, HASHTABLE_LOCAL_SPILL_INC);                                                          \
+        slot->spill = key;                                                                                                        \
+        if (hashtable_## tokn ##_insert(hashtable, key, data))                                                                    \
+        {                                                                                                                         \
+            return 1;                                                                                                             \
+        }                                                                                                                         \
+        hashtable_## tokn ##_local_unspill(slot, key);                                                                            \
+        return 0;                                                                                                                 \
     }                                                                                                                             \
                                                                                                                                   \
-    static int hashtable_## tokn ##_init(hashtable_t *hashtable)                                                                  \
+    /**                                                                                                                           \
+     * The slot of the key in every shard, the key of another context stays in the shard                                          \
+     * of the owner. The owner can remove the key while the data is copied, the key is                                            \
+     * read again                                                                                                                 \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_local_lookup(const hashtable_local_t *tier, const uint32_t hash,                       \
+            const key_type key, data_type *data)                                                                                  \
     {                                                                                                                             \
-        size_t memory_size = hashtable_## tokn ## _memory_size(hashtable->bits);                                                  \
-        void *p = hashtable_alloc(memory_size);                                                                                   \
-        size_t i;                                                                                                                 \
-        if (p)                                                                                                                    \
+        size_t shard;                                                                                                             \
+        for (shard = 0;shard < tier->__shards;shard++)                                                                            \
         {                                                                                                                         \
-            if (hashtable->hashfunction == NULL)                                                                                  \
+            const hashtable_## tokn ##_local_slot_t *slot = hashtable_## tokn ##_local_slot(tier, shard, hash);                   \
+            if (HASHTABLE_LOAD_ACQUIRE(&slot->key) == key)                                                                        \
             {                                                                                                                     \
-                hashtable->hashfunction = hash32shift;                                                                            \
+                const data_type copy = slot->data;                                                                                \
+                HASHTABLE_LOCAL_RMB();                                                                                            \
+                if (slot->key == key)                                                                                             \
+                {                                                                                                                 \
+                    *data = copy;                                                                                                 \
+                    return 1;                                                                                                     \
+                }                                                                                                                 \
             }                                                                                                                     \
-            hashtable->__size = (1 << hashtable->bits);                                                                           \
-            hashtable->__memory_size = memory_size;                                                                               \
-            hashtable->__table = p;                                                                                               \
-            for (i = 0;i < (hashtable->__size+max_tries);i++)                                                                     \
+        }                                                                                                                         \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static inline int hashtable_## tokn ##_local_find(hashtable_t *hashtable, hashtable_local_t *tier,                            \
+            const key_type key, data_type *data)                                                                                  \
+    {                                                                                                                             \
+        const uint32_t hash = hashtable_## tokn ##_hash(hashtable, key);                                                          \
+        const int shard = HASHTABLE_LOCAL_GET();                                                                                  \
+        hashtable_## tokn ##_local_slot_t *slot = hashtable_## tokn ##_local_slot(tier, shard, hash);                             \
+        HASHTABLE_LOCAL_PUT();                                                                                                    \
+        if (HASHTABLE_LOAD_ACQUIRE(&slot->key) == key)                                                                            \
+        {                                                                                                                         \
+            *data = slot->data;                                                                                                   \
+            HASHTABLE_STAT_INC(hashtable, local);                                                                                 \
+            return 1;                                                                                                             \
+        }                                                                                                                         \
+        if (hashtable_## tokn ##_find(hashtable, key, data))                                                                      \
+        {                                                                                                                         \
+            return 1;                                                                                                             \
+        }                                                                                                                         \
+        if (hashtable_## tokn ##_local_lookup(tier, hash, key, data))                                                             \
+        {                                                                                                                         \
+            HASHTABLE_STAT_INC(hashtable, local);                                                                                 \
+            return 1;                                                                                                             \
+        }                                                                                                                         \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* A key which did not spill is not in the shared table, the miss does not write the shared table */                          \
+    static inline int hashtable_## tokn ##_local_remove(hashtable_t *hashtable, hashtable_local_t *tier,                          \
+            const key_type key, data_type *data)                                                                                  \
+    {                                                                                                                             \
+        const uint32_t hash = hashtable_## tokn ##_hash(hashtable, key);                                                          \
+        const int shard = HASHTABLE_LOCAL_GET();                                                                                  \
+        hashtable_## tokn ##_local_slot_t *slot = hashtable_## tokn ##_local_slot(tier, shard, hash);                             \
+        HASHTABLE_LOCAL_PUT();                                                                                                    \
+        if (slot->key == key)                                                                                                     \
+        {                                                                                                                         \
+            if (data)                                                                                                             \
             {                                                                                                                     \
-                hashtable_## tokn ## _init_slot(HASHTABLE_SLOT_ADDR(hashtable, tokn, i));                                         \
+                *data = slot->data;                                                                                               \
             }                                                                                                                     \
-			hashtable_registry_add(hashtable);                                                                                    \
+            __sync_access(&slot->data) = illegal_data;                                                                            \
+            HASHTABLE_STORE_RELEASE(&slot->key, illegal_key);                                                                     \
+            HASHTABLE_STAT_INC(hashtable, local);                                                                                 \
             return 1;                                                                                                             \
         }                                                                                                                         \
-        PRINTF("Failed to allocate %zu for the hashtable %s", memory_size, hashtable->name);                                      \
-        return 0;                                                                                                                 \
+        if (!hashtable_## tokn ##_local_spilled(hashtable, slot, key) ||                                                          \
+            !hashtable_## tokn ##_remove(hashtable, key, data))                                                                   \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        hashtable_## tokn ##_local_unspill(slot, key);                                                                            \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+
+
+/**
+ * A set of uint32_t keys, for example the TIDs in a system call
+ * The table is an array of keys: 2^22 slots occupy 16MB, add()/contains()/remove()
+ * touch only the keys, remove() is a single store. The capacity is fixed, the
+ * hashtable_t fields max_bits and expire are not supported. Call hashtable_close()
+ */
+#define DECLARE_HASHSET(tokn, max_tries, illegal_key)                                                                             \
+    static inline uint32_t hashtable_## tokn ##_hash(const hashtable_t *hashtable, const uint32_t key)                            \
+    {                                                                                                                             \
+        return hashtable->hashfunction(key);                                                                                      \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static inline size_t hashtable_## tokn ##_memory_size(const int bits)                                                         \
+    {                                                                                                                             \
+        return sizeof(uint32_t) * ((1 << bits) + max_tries);                                                                      \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static inline int hashtable_## tokn ##_init(hashtable_t *hashtable)                                                           \
+    {                                                                                                                             \
+        const size_t memory_size = hashtable_## tokn ##_memory_size(hashtable->bits);                                             \
+        volatile uint32_t *keys;                                                                                                  \
+        size_t i;                                                                                                                 \
+        if ((hashtable->max_bits > hashtable->bits) || hashtable->expire)                                                         \
+        {                                                                                                                         \
+            PRINTF("The set %s is not growable and does not expire", hashtable->name);                                            \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        keys = (volatile uint32_t *)hashtable_alloc_table(hashtable, memory_size, ((uint32_t)(illegal_key) == 0));                \
+        if (!keys)                                                                                                                \
+        {                                                                                                                         \
+            PRINTF("Failed to allocate %zu for the set %s", memory_size, hashtable->name);                                        \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        hashtable->__storage = ((uint32_t)(illegal_key) == 0) ? HASHTABLE_STORAGE_ZEROED : HASHTABLE_STORAGE_ALLOC;               \
+        if (!hashtable_stat_init(hashtable))                                                                                      \
+        {                                                                                                                         \
+            hashtable_free_table(hashtable, (void *)keys, memory_size);                                                           \
+            hashtable->__storage = HASHTABLE_STORAGE_ALLOC;                                                                       \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        if (hashtable->hashfunction == NULL)                                                                                      \
+        {                                                                                                                         \
+            hashtable->hashfunction = hash32shift;                                                                                \
+        }                                                                                                                         \
+        hashtable->__size = (1 << hashtable->bits);                                                                               \
+        hashtable->__memory_size = memory_size;                                                                                   \
+        hashtable->__table = (void *)keys;                                                                                        \
+        for (i = 0;(hashtable->__storage != HASHTABLE_STORAGE_ZEROED) && (i < (hashtable->__size + max_tries));i++)               \
+        {                                                                                                                         \
+            keys[i] = illegal_key;                                                                                                \
+        }                                                                                                                         \
+        hashtable_registry_add(hashtable);                                                                                        \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /* Offset of the key in the probe window, max_tries if the key is not there */                                                \
+    static inline uint32_t hashtable_## tokn ##_slot(const volatile uint32_t *keys, const uint32_t key)                           \
+    {                                                                                                                             \
+        uint32_t i;                                                                                                               \
+        if (HASHTABLE_SIMD && ((max_tries) <= 32))                                                                                \
+        {                                                                                                                         \
+            const uint32_t match = hashtable_match_keys(keys, max_tries, key, illegal_key, NULL);                                 \
+            return match ? (uint32_t)__builtin_ctz(match) : max_tries;                                                            \
+        }                                                                                                                         \
+        for (i = 0;i < max_tries;i++)                                                                                             \
+        {                                                                                                                         \
+            if (keys[i] == key)                                                                                                   \
+            {                                                                                                                     \
+                break;                                                                                                            \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        return i;                                                                                                                 \
     }                                                                                                                             \
                                                                                                                                   \
     /**                                                                                                                           \
-     * Hash the key, get an index in the hashtable, try compare-and-set.                                                          \
-     * If fails (not likely) try again with the next slot (linear probing)                                                        \
-     * continue until success or max_tries is hit                                                                                 \
+     * Returns 1 if the key is added or is already in the set, 0 if the probe window is full                                      \
      */                                                                                                                           \
-    static int hashtable_## tokn ##_insert(hashtable_t *hashtable, const uint32_t key, const data_type data)                      \
+    static inline int hashtable_## tokn ##_add(hashtable_t *hashtable, const uint32_t key)                                        \
     {                                                                                                                             \
-        const uint32_t hash = hashtable->hashfunction(key);                                                                       \
-        const uint32_t index = hashtable_get_index(hashtable, hash);                                                              \
-        /* I can do this for the last slot too - I allocated max_tries more slots */                                              \
-        const uint32_t index_max = index+max_tries;                                                                               \
-        hashtable_## tokn ##_slot_t *slot = HASHTABLE_SLOT_ADDR(hashtable, tokn, index);                                          \
-        const hashtable_## tokn ##_slot_t *slot_max = HASHTABLE_SLOT_ADDR(hashtable, tokn, index_max);                            \
-        hashtable->__stat.insert++;                                                                                               \
-        for (;slot < slot_max;slot++)                                                                                             \
+        const uint32_t index = hashtable_get_index(hashtable, hashtable_## tokn ##_hash(hashtable, key));                         \
+        volatile uint32_t *keys = (volatile uint32_t *)hashtable->__table + index;                                                \
+        uint32_t i;                                                                                                               \
+        HASHTABLE_STAT_INC(hashtable, insert);                                                                                    \
+        /* A free slot ahead of the key is not taken: no second copy */                                                           \
+        i = hashtable_## tokn ##_slot(keys, key);                                                                                 \
+        if (i < max_tries)                                                                                                        \
         {                                                                                                                         \
-            uint32_t old_key = HASHTABLE_CMPXCHG(&slot->key, illegal_key, key);                                                   \
-            if (likely(old_key == illegal_key)) /* Success */                                                                     \
+            HASHTABLE_STAT_INC(hashtable, overwritten);                                                                           \
+            HASHTABLE_STAT_PROBE(hashtable, probe_insert, i);                                                                     \
+            return 1;                                                                                                             \
+        }                                                                                                                         \
+        for (i = 0;i < max_tries;i++)                                                                                             \
+        {                                                                                                                         \
+            const uint32_t old_key = HASHTABLE_CMPXCHG(&keys[i], illegal_key, key);                                               \
+            if (likely(old_key == (uint32_t)illegal_key))                                                                         \
             {                                                                                                                     \
-                slot->data = data;                                                                                                \
+                HASHTABLE_STAT_PROBE(hashtable, probe_insert, i);                                                                 \
                 return 1;                                                                                                         \
             }                                                                                                                     \
-            else if (old_key == key)                                                                                              \
-			{                                                                                                                     \
-                slot->data = data;                                                                                                \
-                hashtable->__stat.overwritten++;                                                                                  \
-                return 1;                                                                                                         \
-			}                                                                                                                     \
-            else                                                                                                                  \
+            if (old_key == key)                                                                                                   \
             {                                                                                                                     \
-                hashtable->__stat.collision++;                                                                                    \
+                HASHTABLE_STAT_INC(hashtable, overwritten);                                                                       \
+                HASHTABLE_STAT_PROBE(hashtable, probe_insert, i);                                                                 \
+                return 1;                                                                                                         \
             }                                                                                                                     \
+            HASHTABLE_STAT_INC(hashtable, collision);                                                                             \
         }                                                                                                                         \
+        HASHTABLE_STAT_INC(hashtable, insert_err);                                                                                \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
                                                                                                                                   \
-        hashtable->__stat.insert_err++;                                                                                           \
+    static inline int hashtable_## tokn ##_contains(hashtable_t *hashtable, const uint32_t key)                                   \
+    {                                                                                                                             \
+        const uint32_t index = hashtable_get_index(hashtable, hashtable_## tokn ##_hash(hashtable, key));                         \
+        const uint32_t i = hashtable_## tokn ##_slot((volatile uint32_t *)hashtable->__table + index, key);                       \
+        HASHTABLE_STAT_INC(hashtable, search);                                                                                    \
+        if (i < max_tries)                                                                                                        \
+        {                                                                                                                         \
+            HASHTABLE_STAT_INC(hashtable, search_ok);                                                                             \
+            HASHTABLE_STAT_PROBE(hashtable, probe_search, i);                                                                     \
+            return 1;                                                                                                             \
+        }                                                                                                                         \
+        HASHTABLE_STAT_INC(hashtable, search_err);                                                                                \
         return 0;                                                                                                                 \
     }                                                                                                                             \
                                                                                                                                   \
     /**                                                                                                                           \
-     * Hash the key, get an index in the hashtable, find the relevant entry,                                                      \
-     * read the pointer, remove using atomic operation                                                                            \
-     * Only one context is allowed to remove a specific entry                                                                     \
+     * Only one context is allowed to remove a specific key                                                                       \
      */                                                                                                                           \
-    static int hashtable_## tokn ##_remove(hashtable_t *hashtable, const uint32_t key, data_type *data)                           \
+    static inline int hashtable_## tokn ##_remove(hashtable_t *hashtable, const uint32_t key)                                     \
     {                                                                                                                             \
-        const uint32_t hash = hashtable->hashfunction(key);                                                                       \
-        const uint32_t index = hashtable_get_index(hashtable, hash);                                                              \
-        /* I can do this for the last slot too - I allocated max_tries more slots */                                              \
-        const uint32_t index_max = index+max_tries;                                                                               \
-        hashtable_## tokn ##_slot_t *slot = HASHTABLE_SLOT_ADDR(hashtable, tokn, index);                                          \
-        const hashtable_## tokn ##_slot_t *slot_max = HASHTABLE_SLOT_ADDR(hashtable, tokn, index_max);                            \
-        hashtable->__stat.remove++;                                                                                               \
-        for (;slot < slot_max;slot++)                                                                                             \
+        const uint32_t index = hashtable_get_index(hashtable, hashtable_## tokn ##_hash(hashtable, key));                         \
+        volatile uint32_t *keys = (volatile uint32_t *)hashtable->__table + index;                                                \
+        const uint32_t i = hashtable_## tokn ##_slot(keys, key);                                                                  \
+        HASHTABLE_STAT_INC(hashtable, remove);                                                                                    \
+        if (i < max_tries)                                                                                                        \
+        {                                                                                                                         \
+            __sync_access(&keys[i]) = illegal_key;                                                                                \
+            return 1;                                                                                                             \
+        }                                                                                                                         \
+        HASHTABLE_STAT_INC(hashtable, remove_err);                                                                                \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+
+
+/**
+ * The tag of a slot of DECLARE_HASHTABLE_TAGGED: the sequence in the high 32 bits and
+ * the key in the low 32 bits, one compare-and-swap changes both. The two low bits of the
+ * sequence are the state of the slot, the sequence of a slot grows by 4 for every change
+ */
+#define HASHTABLE_TAG(seq, key)     (((uint64_t)(seq) << 32) | (uint32_t)(key))
+#define HASHTABLE_TAG_KEY(tag)      ((uint32_t)(tag))
+#define HASHTABLE_TAG_SEQ(tag)      ((uint32_t)((tag) >> 32))
+#define HASHTABLE_TAG_STATE(tag)    (HASHTABLE_TAG_SEQ(tag) & 3)
+/* The sequence of the next stable state of the slot */
+#define HASHTABLE_TAG_NEXT(tag)     ((HASHTABLE_TAG_SEQ(tag) | 3) + 1)
+
+/* The key and the data are valid */
+#define HASHTABLE_TAG_STABLE        0
+/* An insert of a new key took the free slot and writes the data */
+#define HASHTABLE_TAG_CLAIMED       1
+/* An insert of an existing key writes the data */
+#define HASHTABLE_TAG_WRITING       2
+/**
+ * A lower claim of the same key won, the loser may still write the data. The slot keeps
+ * the key and is not free until the loser frees it
+ */
+#define HASHTABLE_TAG_DROPPED       3
+/* The dropped tag of a claimed tag */
+#define HASHTABLE_TAG_DROP(tag)     ((tag) + HASHTABLE_TAG(HASHTABLE_TAG_DROPPED - HASHTABLE_TAG_CLAIMED, 0))
+
+/**
+ * A find or a remove waits for the write of the data for HASHTABLE_TAGGED_SPIN reads
+ * of the tag, and skips the slot after that, for example if the writer is the interrupted
+ * context on the same CPU. An insert of the key tries HASHTABLE_TAGGED_SPIN times and
+ * returns busy
+ */
+#ifndef HASHTABLE_TAGGED_SPIN
+#   define HASHTABLE_TAGGED_SPIN 64
+#endif
+
+/**
+ * The tests stall an insert of the tagged table: 0 - after the scan for a free slot,
+ * 1 - after the claim of the free slot, before the write of the data
+ */
+#ifndef HASHTABLE_TAGGED_HOOK
+#   define HASHTABLE_TAGGED_HOOK(stage)
+#endif
+
+#ifdef __KERNEL__
+#   define HASHTABLE_TAG_RMB() smp_rmb()
+#   define HASHTABLE_TAG_WMB() smp_wmb()
+#else
+#   define HASHTABLE_TAG_RMB() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#   define HASHTABLE_TAG_WMB() __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+/**
+ * The claim of a slot is visible before the scan for the other claims of the key, a
+ * store-load order. The acq_rel compare-and-swap does not order the store and the load.
+ * A successful cmpxchg() in the kernel is fully ordered, smp_mb__after_atomic() is for
+ * the atomics which do not return a value
+ */
+#ifdef __KERNEL__
+#   define HASHTABLE_TAG_MB() do {} while (0)
+#else
+#   define HASHTABLE_TAG_MB() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/**
+ * A table of uint32_t keys which any context inserts and removes: the inserts and the
+ * removes of the same key on different CPUs are safe. An insert claims a free slot or
+ * locks the slot of the key with a compare-and-swap of the tag, writes the data and
+ * publishes the tag with the next sequence. An insert of a key which another context
+ * writes at the same time overwrites the data if the write ends in HASHTABLE_TAGGED_SPIN
+ * tries, and returns 0 without writing the data otherwise and counts insert_busy, for
+ * example in an interrupt on the CPU of the writer. If two contexts insert a new key at the same time
+ * the claim in the lowest slot wins and marks the other claim dropped, the loser frees its
+ * slot after its write of the data and overwrites the data of the winner.
+ * A remove is a compare-and-swap of the tag it read, it fails if the slot changed.
+ * A find copies the data and reads the tag again
+ * The slot is 64 bits tag and the data, the capacity is fixed, the hashtable_t fields
+ * max_bits, expire and filter are not supported. Call hashtable_close()
+ */
+#define DECLARE_HASHTABLE_TAGGED(tokn, data_type, max_tries, illegal_key)                                                         \
+    typedef struct                                                                                                                \
+    {                                                                                                                             \
+        volatile uint64_t tag;                                                                                                    \
+        data_type data;                                                                                                           \
+    } hashtable_## tokn ##_tagged_slot_t;                                                                                         \
+                                                                                                                                  \
+    static inline uint32_t hashtable_## tokn ##_hash(const hashtable_t *hashtable, const uint32_t key)                            \
+    {                                                                                                                             \
+        return hashtable->hashfunction(key);                                                                                      \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static inline size_t hashtable_## tokn ##_memory_size(const int bits)                                                         \
+    {                                                                                                                             \
+        return sizeof(hashtable_## tokn ##_tagged_slot_t) * ((1 << bits) + max_tries);                                            \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static inline int hashtable_## tokn ##_init(hashtable_t *hashtable)                                                           \
+    {                                                                                                                             \
+        const size_t memory_size = hashtable_## tokn ##_memory_size(hashtable->bits);                                             \
+        const int zero = ((uint32_t)(illegal_key) == 0);                                                                          \
+        hashtable_## tokn ##_tagged_slot_t *slots;                                                                                \
+        size_t i;                                                                                                                 \
+        if ((hashtable->max_bits > hashtable->bits) || hashtable->expire || hashtable->filter)                                    \
+        {                                                                                                                         \
+            PRINTF("The table %s is not growable, does not expire and has no filter", hashtable->name);                           \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        slots = (hashtable_## tokn ##_tagged_slot_t *)hashtable_alloc_table(hashtable, memory_size, zero);                        \
+        if (!slots)                                                                                                               \
+        {                                                                                                                         \
+            PRINTF("Failed to allocate %zu for the hashtable %s", memory_size, hashtable->name);                                  \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        hashtable->__storage = zero ? HASHTABLE_STORAGE_ZEROED : HASHTABLE_STORAGE_ALLOC;                                         \
+        if (!hashtable_stat_init(hashtable))                                                                                      \
+        {                                                                                                                         \
+            hashtable_free_table(hashtable, (void *)slots, memory_size);                                                          \
+            hashtable->__storage = HASHTABLE_STORAGE_ALLOC;                                                                       \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        if (hashtable->hashfunction == NULL)                                                                                      \
+        {                                                                                                                         \
+            hashtable->hashfunction = hash32shift;                                                                                \
+        }                                                                                                                         \
+        hashtable->__size = (1 << hashtable->bits);                                                                               \
+        hashtable->__memory_size = memory_size;                                                                                   \
+        hashtable->__table = (void *)slots;                                                                                       \
+        for (i = 0;!zero && (i < (hashtable->__size + max_tries));i++)                                                            \
+        {                                                                                                                         \
+            slots[i].tag = HASHTABLE_TAG(0, illegal_key);                                                                         \
+        }                                                                                                                         \
+        hashtable_registry_add(hashtable);                                                                                        \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    static inline hashtable_## tokn ##_tagged_slot_t *hashtable_## tokn ##_window(const hashtable_t *hashtable,                   \
+            const uint32_t key)                                                                                                   \
+    {                                                                                                                             \
+        const uint32_t index = hashtable_get_index(hashtable, hashtable_## tokn ##_hash(hashtable, key));                         \
+        return (hashtable_## tokn ##_tagged_slot_t *)hashtable->__table + index;                                                  \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Returns 1 and the tag if the slot keeps the key and the data are valid, waits for                                          \
+     * the write of the data. Returns 0 if the slot keeps another key or a new key which                                          \
+     * is not published yet                                                                                                       \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_stable(const hashtable_## tokn ##_tagged_slot_t *slot, const uint32_t key,             \
+            uint64_t *tag)                                                                                                        \
+    {                                                                                                                             \
+        int spin;                                                                                                                 \
+        for (spin = 0;spin < HASHTABLE_TAGGED_SPIN;spin++)                                                                        \
+        {                                                                                                                         \
+            const uint64_t t = slot->tag;                                                                                         \
+            if ((HASHTABLE_TAG_KEY(t) != key) || (HASHTABLE_TAG_STATE(t) == HASHTABLE_TAG_CLAIMED) ||                             \
+                (HASHTABLE_TAG_STATE(t) == HASHTABLE_TAG_DROPPED))                                                                \
+            {                                                                                                                     \
+                return 0;                                                                                                         \
+            }                                                                                                                     \
+            if (HASHTABLE_TAG_STATE(t) == HASHTABLE_TAG_STABLE)                                                                   \
+            {                                                                                                                     \
+                HASHTABLE_TAG_RMB();                                                                                              \
+                *tag = t;                                                                                                         \
+                return 1;                                                                                                         \
+            }                                                                                                                     \
+            HASHTABLE_RELAX();                                                                                                    \
+        }                                                                                                                         \
+        return 0;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Free the slot of a claim which lost, a lower claim of the key may have dropped it.                                         \
+     * Only the claimer changes a dropped slot, the data is written before the slot is free                                       \
+     */                                                                                                                           \
+    static inline void hashtable_## tokn ##_release(hashtable_## tokn ##_tagged_slot_t *slot, const uint64_t claimed)             \
+    {                                                                                                                             \
+        const uint64_t free_tag = HASHTABLE_TAG(HASHTABLE_TAG_NEXT(claimed), illegal_key);                                        \
+        if (HASHTABLE_CMPXCHG(&slot->tag, claimed, free_tag) != claimed)                                                          \
+        {                                                                                                                         \
+            HASHTABLE_TAG_WMB();                                                                                                  \
+            __sync_access(&slot->tag) = free_tag;                                                                                 \
+        }                                                                                                                         \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Write the data to the slot of the key or to a free slot                                                                    \
+     * Returns 1 if done, 0 if the probe window is full, -1 if another context changed                                            \
+     * the slot at the same time, -2 if another context writes the data of the key                                                \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_try_insert(hashtable_t *hashtable, hashtable_## tokn ##_tagged_slot_t *slots,          \
+            const uint32_t key, const data_type data)                                                                             \
+    {                                                                                                                             \
+        uint64_t free_tag = 0, claimed;                                                                                           \
+        size_t i, free_slot = max_tries;                                                                                          \
+        for (i = 0;i < max_tries;i++)                                                                                             \
         {                                                                                                                         \
-            uint32_t old_key = slot->key;                                                                                         \
-            if (likely(old_key == key))                                                                                           \
+            const uint64_t tag = slots[i].tag;                                                                                    \
+            if ((HASHTABLE_TAG_KEY(tag) == key) && (HASHTABLE_TAG_STATE(tag) != HASHTABLE_TAG_DROPPED))                           \
             {                                                                                                                     \
-                if (data)                                                                                                         \
+                if (HASHTABLE_TAG_STATE(tag) != HASHTABLE_TAG_STABLE)                                                             \
+                {                                                                                                                 \
+                    return -2;                                                                                                    \
+                }                                                                                                                 \
+                if (HASHTABLE_CMPXCHG(&slots[i].tag, tag, tag + HASHTABLE_TAG(HASHTABLE_TAG_WRITING, 0)) != tag)                  \
                 {                                                                                                                 \
-                    *data = slot->data;                                                                                           \
+                    return -1;                                                                                                    \
                 }                                                                                                                 \
-                __sync_access(&slot->data) = illegal_data;                                                                        \
-                HASHTABLE_BARRIER();                                                                                              \
-                __sync_access(&slot->key) = illegal_key;                                                                          \
+                HASHTABLE_TAG_WMB();                                                                                              \
+                slots[i].data = data;                                                                                             \
+                /* The data is written before the tag is published */                                                             \
+                HASHTABLE_TAG_WMB();                                                                                              \
+                __sync_access(&slots[i].tag) = HASHTABLE_TAG(HASHTABLE_TAG_NEXT(tag), key);                                       \
+                HASHTABLE_STAT_INC(hashtable, overwritten);                                                                       \
+                HASHTABLE_STAT_PROBE(hashtable, probe_insert, i);                                                                 \
                 return 1;                                                                                                         \
             }                                                                                                                     \
+            if ((HASHTABLE_TAG_KEY(tag) == (uint32_t)(illegal_key)) && (free_slot == max_tries))                                  \
+            {                                                                                                                     \
+                free_slot = i;                                                                                                    \
+                free_tag = tag;                                                                                                   \
+            }                                                                                                                     \
+            HASHTABLE_STAT_INC(hashtable, collision);                                                                             \
+        }                                                                                                                         \
+        if (free_slot == max_tries)                                                                                               \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        HASHTABLE_TAGGED_HOOK(0);                                                                                                 \
+        claimed = HASHTABLE_TAG(HASHTABLE_TAG_SEQ(free_tag) + HASHTABLE_TAG_CLAIMED, key);                                        \
+        if (HASHTABLE_CMPXCHG(&slots[free_slot].tag, free_tag, claimed) != free_tag)                                              \
+        {                                                                                                                         \
+            return -1;                                                                                                            \
+        }                                                                                                                         \
+        HASHTABLE_TAGGED_HOOK(1);                                                                                                 \
+        HASHTABLE_TAG_MB();                                                                                                       \
+        slots[free_slot].data = data;                                                                                             \
+        /* Another copy of the key: the claim in the lowest slot wins, a published key wins */                                    \
+        for (i = 0;i < max_tries;i++)                                                                                             \
+        {                                                                                                                         \
+            const uint64_t tag = slots[i].tag;                                                                                    \
+            if ((i == free_slot) || (HASHTABLE_TAG_KEY(tag) != key) || (HASHTABLE_TAG_STATE(tag) == HASHTABLE_TAG_DROPPED))       \
+            {                                                                                                                     \
+                continue;                                                                                                         \
+            }                                                                                                                     \
+            if ((i < free_slot) || (HASHTABLE_TAG_STATE(tag) != HASHTABLE_TAG_CLAIMED))                                           \
+            {                                                                                                                     \
+                hashtable_## tokn ##_release(&slots[free_slot], claimed);                                                         \
+                return -1;                                                                                                        \
+            }                                                                                                                     \
+            /* The loser may be writing the data, the loser frees the slot */                                                     \
+            if (HASHTABLE_CMPXCHG(&slots[i].tag, tag, HASHTABLE_TAG_DROP(tag)) == tag)                                            \
+            {                                                                                                                     \
+                HASHTABLE_STAT_INC(hashtable, relocated);                                                                         \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        /* The claim in a lower slot dropped this claim */                                                                        \
+        if (HASHTABLE_CMPXCHG(&slots[free_slot].tag, claimed, HASHTABLE_TAG(HASHTABLE_TAG_NEXT(claimed), key)) != claimed)        \
+        {                                                                                                                         \
+            hashtable_## tokn ##_release(&slots[free_slot], claimed);                                                             \
+            return -1;                                                                                                            \
+        }                                                                                                                         \
+        HASHTABLE_STAT_PROBE(hashtable, probe_insert, free_slot);                                                                 \
+        return 1;                                                                                                                 \
+    }                                                                                                                             \
+                                                                                                                                  \
+    /**                                                                                                                           \
+     * Returns 1 if inserted or overwritten, 0 if the probe window is full or another                                             \
+     * context writes the data of the key (the counter insert_busy), the data is not written                                      \
+     * Any context can insert and remove the key                                                                                  \
+     */                                                                                                                           \
+    static inline int hashtable_## tokn ##_insert(hashtable_t *hashtable, const uint32_t key, const data_type data)               \
+    {                                                                                                                             \
+        hashtable_## tokn ##_tagged_slot_t *slots = hashtable_## tokn ##_window(hashtable, key);                                  \
+        int spin = 0;                                                                                                             \
+        int rc;                                                                                                                   \
+        HASHTABLE_STAT_INC(hashtable, insert);                                                                                    \
+        while ((rc = hashtable_## tokn ##_try_insert(hashtable, slots, key, data)) < 0)                                           \
+        {                                                                                                                         \
+            /* A failed compare-and-swap means that another context made progress */                                              \
+            if ((rc == -2) && (++spin >= HASHTABLE_TAGGED_SPIN))                                                                  \
+            {                                                                                                                     \
+                HASHTABLE_STAT_INC(hashtable, insert_busy);                                                                       \
+                return 0;                                                                                                         \
+            }                                                                                                                     \
+            HASHTABLE_RELAX();                                                                                                    \
         }                                                                                                                         \
+        if (!rc)                                                                                                                  \
+        {                                                                                                                         \
+            HASHTABLE_STAT_INC(hashtable, insert_err);                                                                            \
+        }                                                                                                                         \
+        return rc;                                                                                                                \
+    }                                                                                                                             \
                                                                                                                                   \
-        hashtable->__stat.remove_err++;                                                                                           \
+    static inline int hashtable_## tokn ##_find(hashtable_t *hashtable, const uint32_t key, data_type *data)                      \
+    {                                                                                                                             \
+        const hashtable_## tokn ##_tagged_slot_t *slots = hashtable_## tokn ##_window(hashtable, key);                            \
+        size_t i;                                                                                                                 \
+        HASHTABLE_STAT_INC(hashtable, search);                                                                                    \
+        for (i = 0;i < max_tries;i++)                                                                                             \
+        {                                                                                                                         \
+            uint64_t tag;                                                                                                         \
+            while (hashtable_## tokn ##_stable(&slots[i], key, &tag))                                                             \
+            {                                                                                                                     \
+                const data_type copy = slots[i].data;                                                                             \
+                HASHTABLE_TAG_RMB();                                                                                              \
+                if (slots[i].tag == tag)                                                                                          \
+                {                                                                                                                 \
+                    *data = copy;                                                                                                 \
+                    HASHTABLE_STAT_INC(hashtable, search_ok);                                                                     \
+                    HASHTABLE_STAT_PROBE(hashtable, probe_search, i);                                                             \
+                    return 1;                                                                                                     \
+                }                                                                                                                 \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        HASHTABLE_STAT_INC(hashtable, search_err);                                                                                \
         return 0;                                                                                                                 \
     }                                                                                                                             \
                                                                                                                                   \
     /**                                                                                                                           \
-     * Hash the key, get an index in the hashtable, find the relevant entry,                                                      \
-     * read the pointer                                                                                                           \
+     * Returns 1 and the data if the key was in the table. Any context can remove the key                                         \
      */                                                                                                                           \
-    static int hashtable_## tokn ##_find(hashtable_t *hashtable, const uint32_t key, data_type *data)                             \
+    static inline int hashtable_## tokn ##_remove(hashtable_t *hashtable, const uint32_t key, data_type *data)                    \
     {                                                                                                                             \
-        const uint32_t hash = hashtable->hashfunction(key);                                                                       \
-        const uint32_t index = hashtable_get_index(hashtable, hash);                                                              \
-        /* I can do this for the last slot too - I allocated max_tries more slots */                                              \
-        const uint32_t index_max = index+max_tries;                                                                               \
-        hashtable_## tokn ##_slot_t *slot = HASHTABLE_SLOT_ADDR(hashtable, tokn, index);                                          \
-        const hashtable_## tokn ##_slot_t *slot_max = HASHTABLE_SLOT_ADDR(hashtable, tokn, index_max);                            \
-        hashtable->__stat.search++;                                                                                               \
-        for (;slot < slot_max;slot++)                                                                                             \
+        hashtable_## tokn ##_tagged_slot_t *slots = hashtable_## tokn ##_window(hashtable, key);                                  \
+        size_t i;                                                                                                                 \
+        HASHTABLE_STAT_INC(hashtable, remove);                                                                                    \
+        for (i = 0;i < max_tries;i++)                                                                                             \
         {                                                                                                                         \
-            uint32_t old_key = slot->key;                                                                                         \
-            if (old_key == key)                                                                                                   \
+            uint64_t tag;                                                                                                         \
+            while (hashtable_## tokn ##_stable(&slots[i], key, &tag))                                                             \
             {                                                                                                                     \
-                *data = slot->data;                                                                                               \
-                hashtable->__stat.search_ok++;                                                                                    \
-                return 1;                                                                                                         \
+                const data_type copy = slots[i].data;                                                                             \
+                if (HASHTABLE_CMPXCHG(&slots[i].tag, tag, HASHTABLE_TAG(HASHTABLE_TAG_NEXT(tag), illegal_key)) == tag)            \
+                {                                                                                                                 \
+                    if (data)                                                                                                     \
+                    {                                                                                                             \
+                        *data = copy;                                                                                             \
+                    }                                                                                                             \
+                    return 1;                                                                                                     \
+                }                                                                                                                 \
             }                                                                                                                     \
         }                                                                                                                         \
-        hashtable->__stat.search_err++;                                                                                           \
-                                                                                                                                  \
+        HASHTABLE_STAT_INC(hashtable, remove_err);                                                                                \
         return 0;                                                                                                                 \
     }                                                                                                                             \
+                                                                                                                                  \
 
@@ -0,0 +1,282 @@
+/**
+ *   Lockfree is a set of lockfree containers for Linux and Linux kernel
+ *   Copyright (C) <2017>  Arkady Miasnikov
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * C++11 front end of the hashtable, userspace only
+ *
+ * lockfree::HashTable<Key, Value, MaxTries, Hash, Bits> is a fixed size table of
+ * 2^Bits + MaxTries slots in the layout of DECLARE_HASHTABLE (AOS, LINEAR): the
+ * size, the mask and the probe window are constants, the compiler unrolls the probing
+ * and inlines the hash. The key and the data are std::atomic, a remove is a release
+ * store instead of a full barrier, a find is an acquire load.
+ *
+ * The table registers a hashtable_t: hashtable_show(), hashtable_export() and the stats
+ * page see the counters of the table. DECLARE_HASHTABLE_HASH(tokn, Value, MaxTries,
+ * illegal_key, illegal_data, hashfunc) with the same hash function accesses the same
+ * table via HashTable::table()
+ *
+ * The restrictions of the C table apply: only one context inserts and removes a
+ * specific key.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <type_traits>
+#include "hashtable.h"
+
+namespace lockfree {
+
+/**
+ * The hash functions of hashtable.h for 32 and 64 bits keys, the calls are inlined
+ * function() and function64() go to the hashtable_t, see hashtable_hash_id()
+ */
+struct HashShift
+{
+    uint32_t operator()(const uint32_t key) const { return hash32shift(key); }
+    uint32_t operator()(const uint64_t key) const { return hash6432shift(key); }
+    static hashtable_hash32_t function() { return hash32shift; }
+    static hashtable_hash64_t function64() { return hash6432shift; }
+};
+
+struct HashNone
+{
+    uint32_t operator()(const uint32_t key) const { return hash_none(key); }
+    uint32_t operator()(const uint64_t key) const { return (uint32_t)key; }
+    static hashtable_hash32_t function() { return hash_none; }
+    static hashtable_hash64_t function64() { return NULL; }
+};
+
+struct HashFibonacci
+{
+    uint32_t operator()(const uint32_t key) const { return hash_fibonacci(key); }
+    uint32_t operator()(const uint64_t key) const { return hash64_fibonacci(key); }
+    static hashtable_hash32_t function() { return hash_fibonacci; }
+    static hashtable_hash64_t function64() { return hash64_fibonacci; }
+};
+
+struct HashMurmur3
+{
+    uint32_t operator()(const uint32_t key) const { return hash_murmur3(key); }
+    uint32_t operator()(const uint64_t key) const { return hash64_murmur3(key); }
+    static hashtable_hash32_t function() { return hash_murmur3; }
+    static hashtable_hash64_t function64() { return hash64_murmur3; }
+};
+
+struct HashCrc32c
+{
+    uint32_t operator()(const uint32_t key) const { return hash_crc32c(key); }
+    uint32_t operator()(const uint64_t key) const { return hash64_crc32c(key); }
+    static hashtable_hash32_t function() { return hash_crc32c; }
+    static hashtable_hash64_t function64() { return hash64_crc32c; }
+};
+
+template <class Key, class Value, size_t MaxTries, class Hash = HashShift, unsigned Bits = 16>
+class HashTable
+{
+public:
+    static constexpr size_t size = (size_t)1 << Bits;
+    static constexpr size_t mask = size - 1;
+    static constexpr size_t slots = size + MaxTries;
+
+    /* The layout of hashtable_<tokn>_slot_t */
+    struct Slot
+    {
+        std::atomic<Key> key;
+        std::atomic<Value> data;
+    };
+
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+            "The key and the data are stored in std::atomic");
+    static_assert((sizeof(std::atomic<Key>) == sizeof(Key)) && (sizeof(std::atomic<Value>) == sizeof(Value)),
+            "The slot is not the slot of DECLARE_HASHTABLE");
+    static_assert((MaxTries > 0) && (Bits > 0) && (Bits < 32), "Bad geometry of the table");
+
+    /**
+     * Allocate the table, see valid(). The memory of the table with the empty slot of
+     * zero bytes is zeroed pages
+     */
+    explicit HashTable(const char *name, const Key illegal_key = Key(), const Value illegal_data = Value(),
+            const unsigned int alloc_flags = 0) :
+        illegal_key(illegal_key), illegal_data(illegal_data)
+    {
+        const int zero = hashtable_is_zero(&illegal_key, sizeof(illegal_key)) &&
+                hashtable_is_zero(&illegal_data, sizeof(illegal_data));
+        memset(&hashtable, 0, sizeof(hashtable));
+        hashtable.name = name;
+        hashtable.bits = Bits;
+        hashtable.hashfunction = Hash::function();
+        hashtable.hashfunction64 = Hash::function64();
+        hashtable.alloc_flags = alloc_flags;
+        hashtable.__size = size;
+        hashtable.__memory_size = sizeof(Slot) * slots;
+        hashtable.__storage = zero ? HASHTABLE_STORAGE_ZEROED : HASHTABLE_STORAGE_ALLOC;
+        slot_array = (Slot *)hashtable_alloc_table(&hashtable, hashtable.__memory_size, zero);
+        if (!slot_array)
+        {
+            PRINTF("Failed to allocate %zu for the hashtable %s", hashtable.__memory_size, name);
+            return;
+        }
+        if (!hashtable_stat_init(&hashtable))
+        {
+            hashtable_free_table(&hashtable, slot_array, hashtable.__memory_size);
+            slot_array = NULL;
+            return;
+        }
+        for (size_t i = 0;!zero && (i < slots);i++)
+        {
+            slot_array[i].key.store(illegal_key, std::memory_order_relaxed);
+            slot_array[i].data.store(illegal_data, std::memory_order_relaxed);
+        }
+        hashtable.__table = slot_array;
+        hashtable_registry_add(&hashtable);
+    }
+
+    ~HashTable()
+    {
+        if (slot_array)
+        {
+            hashtable_close(&hashtable);
+        }
+    }
+
+    HashTable(const HashTable &) = delete;
+    HashTable &operator=(const HashTable &) = delete;
+
+    bool valid() const
+    {
+        return slot_array != NULL;
+    }
+
+    /* The hashtable_t of the table for hashtable_stat_get() or a C declaration */
+    hashtable_t *table()
+    {
+        return &hashtable;
+    }
+
+    /**
+     * Returns true if inserted or overwritten, false if the probe window is full
+     */
+    bool insert(const Key key, const Value data)
+    {
+        Slot *window = &slot_array[hash(key) & mask];
+        HASHTABLE_STAT_INC(&hashtable, insert);
+        /* Update the key in place, a free slot ahead of the key is not taken: no second copy */
+        for (size_t i = 0;i < MaxTries;i++)
+        {
+            if (window[i].key.load(std::memory_order_relaxed) == key)
+            {
+                window[i].data.store(data, std::memory_order_release);
+                HASHTABLE_STAT_INC(&hashtable, overwritten);
+                HASHTABLE_STAT_ADD(&hashtable, collision, i);
+                HASHTABLE_STAT_PROBE(&hashtable, probe_insert, i);
+                return true;
+            }
+        }
+        for (size_t i = 0;i < MaxTries;i++)
+        {
+            Key old_key = illegal_key;
+            if (window[i].key.compare_exchange_strong(old_key, key, std::memory_order_acquire,
+                    std::memory_order_acquire))
+            {
+                window[i].data.store(data, std::memory_order_release);
+                HASHTABLE_STAT_PROBE(&hashtable, probe_insert, i);
+                return true;
+            }
+            if (old_key == key)
+            {
+                window[i].data.store(data, std::memory_order_release);
+                HASHTABLE_STAT_INC(&hashtable, overwritten);
+                HASHTABLE_STAT_PROBE(&hashtable, probe_insert, i);
+                return true;
+            }
+            HASHTABLE_STAT_INC(&hashtable, collision);
+        }
+        HASHTABLE_STAT_INC(&hashtable, insert_err);
+        return false;
+    }
+
+    bool find(const Key key, Value *data)
+    {
+        Slot *slot = lookup(key);
+        HASHTABLE_STAT_INC(&hashtable, search);
+        if (slot)
+        {
+            *data = slot->data.load(std::memory_order_acquire);
+            HASHTABLE_STAT_INC(&hashtable, search_ok);
+            HASHTABLE_STAT_PROBE(&hashtable, probe_search, slot - &slot_array[hash(key) & mask]);
+            return true;
+        }
+        HASHTABLE_STAT_INC(&hashtable, search_err);
+        return false;
+    }
+
+    /**
+     * Only one context is allowed to remove a specific key
+     */
+    bool remove(const Key key, Value *data = NULL)
+    {
+        Slot *slot = lookup(key);
+        HASHTABLE_STAT_INC(&hashtable, remove);
+        if (slot)
+        {
+            if (data)
+            {
+                *data = slot->data.load(std::memory_order_relaxed);
+            }
+            drop(slot);
+            return true;
+        }
+        HASHTABLE_STAT_INC(&hashtable, remove_err);
+        return false;
+    }
+
+private:
+    static uint32_t hash(const Key key)
+    {
+        typedef typename std::conditional<(sizeof(Key) > sizeof(uint32_t)), uint64_t, uint32_t>::type hash_key_t;
+        return Hash()((hash_key_t)key);
+    }
+
+    Slot *lookup(const Key key)
+    {
+        Slot *window = &slot_array[hash(key) & mask];
+        for (size_t i = 0;i < MaxTries;i++)
+        {
+            if (window[i].key.load(std::memory_order_acquire) == key)
+            {
+                return &window[i];
+            }
+        }
+        return NULL;
+    }
+
+    /* The release store of the key orders the store of the data, no full barrier */
+    void drop(Slot *slot)
+    {
+        slot->data.store(illegal_data, std::memory_order_relaxed);
+        slot->key.store(illegal_key, std::memory_order_release);
+    }
+
+    hashtable_t hashtable;
+    Slot *slot_array = NULL;
+    const Key illegal_key;
+    const Value illegal_data;
+};
+
+}
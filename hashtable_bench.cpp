@@ -0,0 +1,992 @@
+/**
+ *   Lockfree is a set of lockfree containers for Linux and Linux kernel
+ *   Copyright (C) <2017>  Arkady Miasnikov
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <getopt.h>
+#if defined(__x86_64__) || defined(__i386__)
+#   include <x86intrin.h>
+#endif
+#include <unordered_map>
+#include <mutex>
+#ifdef BENCH_TBB
+#   include <tbb/concurrent_hash_map.h>
+#endif
+#ifdef BENCH_FOLLY
+#   include <folly/AtomicHashMap.h>
+#endif
+#include "hashtable.h"
+#include "linux_utils.h"
+
+
+#define BENCH_BITS 20
+#define BENCH_KEYS (1 << (BENCH_BITS - 2))
+#define BENCH_OPS (32 * 1000 * 1000)
+
+/**
+ * Not static - the compiler can not replace the function pointer of the
+ * table by a direct call
+ */
+hashtable_t hashtable_dynamic = {"dynamic", BENCH_BITS, hash32shift};
+
+DECLARE_HASHTABLE(dynamic, uint32_t, 4, 0, 0);
+DECLARE_HASHTABLE_HASH(shift, uint32_t, 4, 0, 0, hash32shift);
+DECLARE_HASHTABLE_HASH(fibonacci, uint32_t, 4, 0, 0, hash_fibonacci);
+DECLARE_HASHTABLE_HASH(murmur3, uint32_t, 4, 0, 0, hash_murmur3);
+DECLARE_HASHTABLE_HASH(crc32c, uint32_t, 4, 0, 0, hash_crc32c);
+DECLARE_HASHTABLE_HASH(none, uint32_t, 4, 0, 0, hash_none);
+
+static volatile uint32_t bench_sink;
+
+/**
+ * Fill a quarter of the table with sequential keys (like TIDs), measure the
+ * cost of find() and the latency of the hash function alone
+ */
+#define BENCH_HASH(tokn, hashfunc)                                                                                                \
+    static void bench_## tokn(hashtable_t *hashtable)                                                                             \
+    {                                                                                                                             \
+        uint32_t sum = 0;                                                                                                         \
+        int rc = hashtable_## tokn ##_init(hashtable);                                                                            \
+        if (!rc)                                                                                                                  \
+        {                                                                                                                         \
+            return;                                                                                                               \
+        }                                                                                                                         \
+        for (uint32_t key = 1;key <= BENCH_KEYS;key++)                                                                            \
+        {                                                                                                                         \
+            hashtable_## tokn ##_insert(hashtable, key, key);                                                                     \
+        }                                                                                                                         \
+        MeasureTime find_time;                                                                                                    \
+        for (uint32_t i = 0;i < BENCH_OPS;i++)                                                                                    \
+        {                                                                                                                         \
+            uint32_t data = 0;                                                                                                    \
+            hashtable_## tokn ##_find(hashtable, (i % BENCH_KEYS) + 1, &data);                                                    \
+            sum += data;                                                                                                          \
+        }                                                                                                                         \
+        uint64_t find_ms = find_time.diff();                                                                                      \
+        MeasureTime hash_time;                                                                                                    \
+        for (uint32_t i = 0;i < BENCH_OPS;i++)                                                                                    \
+        {                                                                                                                         \
+            sum = hashfunc(sum ^ i);                                                                                              \
+        }                                                                                                                         \
+        uint64_t hash_ms = hash_time.diff();                                                                                      \
+        bench_sink = sum;                                                                                                         \
+        linux_log(LINUX_LOG_INFO, "%-10s find %5.1fns hash %5.1fns", hashtable->name,                                             \
+                (1e6 * find_ms) / BENCH_OPS, (1e6 * hash_ms) / BENCH_OPS);                                                        \
+        hashtable_close(hashtable);                                                                                               \
+    }
+
+BENCH_HASH(dynamic, hashtable_dynamic.hashfunction)
+BENCH_HASH(shift, hash32shift)
+BENCH_HASH(fibonacci, hash_fibonacci)
+BENCH_HASH(murmur3, hash_murmur3)
+BENCH_HASH(crc32c, hash_crc32c)
+BENCH_HASH(none, hash_none)
+
+/**
+ * Random finds in a table of 2^BATCH_BITS slots which does not fit the cache, a key
+ * at a time and BATCH_CHUNK keys in a call to hashtable_batch_find_batch()
+ */
+#define BATCH_BITS 24
+#define BATCH_KEYS (1 << (BATCH_BITS - 2))
+#define BATCH_CHUNK 64
+
+DECLARE_HASHTABLE_HASH(batch, uint32_t, 8, 0, 0, hash_murmur3);
+
+static void bench_batch(hashtable_t *hashtable)
+{
+    uint32_t keys[BATCH_CHUNK], data[BATCH_CHUNK];
+    uint32_t sum = 0;
+    int rc = hashtable_batch_init(hashtable);
+    if (!rc)
+    {
+        return;
+    }
+    for (uint32_t key = 1;key <= BATCH_KEYS;key++)
+    {
+        hashtable_batch_insert(hashtable, key, key);
+    }
+    MeasureTime find_time;
+    for (uint32_t i = 0;i < BENCH_OPS;i++)
+    {
+        uint32_t value = 0;
+        hashtable_batch_find(hashtable, (i % BATCH_KEYS) + 1, &value);
+        sum += value;
+    }
+    uint64_t find_ms = find_time.diff();
+    MeasureTime batch_time;
+    for (uint32_t i = 0;i < BENCH_OPS;i += BATCH_CHUNK)
+    {
+        for (uint32_t j = 0;j < BATCH_CHUNK;j++)
+        {
+            keys[j] = ((i + j) % BATCH_KEYS) + 1;
+        }
+        hashtable_batch_find_batch(hashtable, keys, BATCH_CHUNK, data, NULL);
+        sum += data[0];
+    }
+    uint64_t batch_ms = batch_time.diff();
+    bench_sink = sum;
+    linux_log(LINUX_LOG_INFO, "%-10s find %5.1fns find_batch %5.1fns", hashtable->name,
+            (1e6 * find_ms) / BENCH_OPS, (1e6 * batch_ms) / BENCH_OPS);
+    hashtable_close(hashtable);
+}
+
+/**
+ * Churn of a TWO_CHOICE table: remove a random key, insert a new key, update a random
+ * key. The relocating table moves an updated key to the first free slot of its window.
+ * The probe length of a key is the number of the slots which a find of the key reads
+ */
+#define CHURN_BITS 16
+#define CHURN_KEYS (((1 << CHURN_BITS) * 85) / 100)
+#define CHURN_ROUNDS (4 * 1000 * 1000)
+#define CHURN_TRIES 8
+
+DECLARE_HASHTABLE_TWO_CHOICE(churn, uint32_t, CHURN_TRIES, 0, 0);
+/* HASHTABLE_RELOCATE applies to the tables declared while it is set */
+#undef HASHTABLE_RELOCATE
+#define HASHTABLE_RELOCATE 1
+DECLARE_HASHTABLE_TWO_CHOICE(churn_relocate, uint32_t, CHURN_TRIES, 0, 0);
+#undef HASHTABLE_RELOCATE
+#define HASHTABLE_RELOCATE 0
+
+/* Returns the average probe length of the keys after the churn */
+#define BENCH_CHURN(tokn)                                                                                                         \
+    static double churn_## tokn(hashtable_t *hashtable, uint32_t *keys)                                                           \
+    {                                                                                                                             \
+        uint32_t random = 2463534242u, next = CHURN_KEYS + 1, data;                                                               \
+        uint64_t probes = 0, found = 0;                                                                                           \
+        if (!hashtable_## tokn ##_init(hashtable))                                                                                \
+        {                                                                                                                         \
+            return 0;                                                                                                             \
+        }                                                                                                                         \
+        for (uint32_t i = 0;i < CHURN_KEYS;i++)                                                                                   \
+        {                                                                                                                         \
+            keys[i] = i + 1;                                                                                                      \
+            hashtable_## tokn ##_insert(hashtable, keys[i], keys[i]);                                                             \
+        }                                                                                                                         \
+        for (uint32_t round = 0;round < CHURN_ROUNDS;round++)                                                                     \
+        {                                                                                                                         \
+            random ^= random << 13;                                                                                               \
+            random ^= random >> 17;                                                                                               \
+            random ^= random << 5;                                                                                                \
+            const uint32_t victim = random % CHURN_KEYS, update = (random >> 16) % CHURN_KEYS;                                    \
+            hashtable_## tokn ##_remove(hashtable, keys[victim], &data);                                                          \
+            keys[victim] = next++;                                                                                                \
+            hashtable_## tokn ##_insert(hashtable, keys[victim], keys[victim]);                                                   \
+            hashtable_## tokn ##_insert(hashtable, keys[update], round);                                                          \
+        }                                                                                                                         \
+        for (uint32_t k = 0;k < CHURN_KEYS;k++)                                                                                   \
+        {                                                                                                                         \
+            const uint32_t hash = hashtable_## tokn ##_hash(hashtable, keys[k]);                                                  \
+            for (size_t w = 0;w < 2;w++)                                                                                          \
+            {                                                                                                                     \
+                const size_t index = hashtable_window_index(hashtable->__size, hash, w, CHURN_TRIES);                             \
+                for (size_t i = index;i < (index + CHURN_TRIES);i++)                                                              \
+                {                                                                                                                 \
+                    if (*hashtable_## tokn ##_key_addr(hashtable->__table, hashtable->__size, i) == keys[k])                      \
+                    {                                                                                                             \
+                        probes += w * CHURN_TRIES + (i - index) + 1;                                                              \
+                        found++;                                                                                                  \
+                    }                                                                                                             \
+                }                                                                                                                 \
+            }                                                                                                                     \
+        }                                                                                                                         \
+        hashtable_close(hashtable);                                                                                               \
+        return found ? ((double)probes / found) : 0;                                                                              \
+    }
+
+BENCH_CHURN(churn)
+BENCH_CHURN(churn_relocate)
+
+static void bench_churn()
+{
+    static hashtable_t hashtable_churn = {"churn", CHURN_BITS, NULL};
+    static hashtable_t hashtable_churn_relocate = {"churn_relocate", CHURN_BITS, NULL};
+    uint32_t *keys = (uint32_t *)malloc(CHURN_KEYS * sizeof(*keys));
+    if (!keys)
+    {
+        return;
+    }
+    const double probe = churn_churn(&hashtable_churn, keys);
+    const double probe_relocate = churn_churn_relocate(&hashtable_churn_relocate, keys);
+    linux_log(LINUX_LOG_INFO, "%-10s load %d%% probe length %4.2f, with relocation %4.2f", "churn",
+            (CHURN_KEYS * 100) >> CHURN_BITS, probe, probe_relocate);
+    free(keys);
+}
+
+/**
+ * Multithreaded sweep of threads, table size, load factor, key distribution and
+ * read/write mix. A thread owns the keys with index % threads == thread, only the
+ * owner inserts and removes a key. Every 16th operation is timed with rdtsc
+ * The threads are the workers of linux_pool_t, the workers are pinned to the CPUs of
+ * the process or of a NUMA node (-n node)
+ */
+#define SWEEP_THREADS_MAX 64
+#define SWEEP_OPS (1 << 16)
+#define SWEEP_WRITE (1u << 31)
+#define SWEEP_SAMPLE 16
+#define SWEEP_HISTOGRAM 4096
+
+DECLARE_HASHTABLE_EXT(sweep, uint32_t, uint32_t, 16, 0, 0, AOS, TWO_CHOICE, HASHTABLE_HASH_DYNAMIC);
+DECLARE_HASHTABLE_LOCAL(sweep, uint32_t, uint32_t, 0, 0);
+DECLARE_HASHTABLE_TAGGED(sweep_tagged, uint32_t, 16, 0);
+
+enum sweep_dist_t
+{
+    SWEEP_SEQUENTIAL,
+    SWEEP_COLLISION,
+    SWEEP_RANDOM,
+    SWEEP_ZIPFIAN,
+    SWEEP_DIST_LAST,
+};
+
+static const char *sweep_dist_name[SWEEP_DIST_LAST] = {"sequential", "collision", "random", "zipfian"};
+
+typedef struct
+{
+    int threads;
+    size_t bits;
+    int load;
+    sweep_dist_t dist;
+    int writes;
+    uint64_t duration_ms;
+    int numa_node;
+} sweep_config_t;
+
+typedef struct
+{
+    int idx;
+    void *map;
+    uint32_t ops[SWEEP_OPS];
+    uint32_t histogram[SWEEP_HISTOGRAM];
+} sweep_thread_t;
+
+static uint32_t *sweep_keys;
+static uint8_t *sweep_present;
+
+static inline uint64_t sweep_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t)tp.tv_sec * 1000000000ull + tp.tv_nsec;
+#endif
+}
+
+static double sweep_ns_per_cycle()
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t cycles = sweep_cycles();
+    linux_ms_sleep(100);
+    cycles = sweep_cycles() - cycles;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    return ns / cycles;
+}
+
+static inline uint32_t sweep_random(uint64_t *state)
+{
+    /* xorshift64* */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (uint32_t)((*state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+/**
+ * Unique non-zero keys. COLLISION keys come in groups of 4 keys with the same
+ * hash, the table uses hash_none
+ */
+static uint32_t sweep_key(const sweep_dist_t dist, const size_t bits, const uint32_t i)
+{
+    switch (dist)
+    {
+    case SWEEP_SEQUENTIAL:
+        return i + 1;
+    case SWEEP_COLLISION:
+        return ((i >> 2) + 1) | ((i & 3) << bits);
+    default:
+        /* A multiplication by an odd constant is a bijection */
+        return (i + 1) * 0x9E3779B1u;
+    }
+}
+
+/**
+ * Zipfian with theta 0.99 like in YCSB, see Gray et al. "Quickly generating
+ * billion-record synthetic databases"
+ */
+typedef struct
+{
+    uint32_t n;
+    double theta, alpha, zetan, eta;
+} sweep_zipf_t;
+
+static void sweep_zipf_init(sweep_zipf_t *zipf, const uint32_t n)
+{
+    const double theta = 0.99;
+    double zeta2 = 1.0 + pow(0.5, theta);
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->zetan = 0;
+    for (uint32_t i = 1;i <= n;i++)
+    {
+        zipf->zetan += 1.0 / pow(i, theta);
+    }
+    zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zipf->zetan);
+}
+
+static uint32_t sweep_zipf_next(const sweep_zipf_t *zipf, uint64_t *state)
+{
+    double u = sweep_random(state) / 4294967296.0;
+    double uz = u * zipf->zetan;
+    uint32_t rank;
+    if (uz < 1.0)
+        rank = 0;
+    else if (uz < (1.0 + pow(0.5, zipf->theta)))
+        rank = 1;
+    else
+        rank = (uint32_t)(zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+    if (rank >= zipf->n)
+        rank = zipf->n - 1;
+    /* Spread the hot keys over the table */
+    return (uint32_t)(((uint64_t)rank * 2654435761u) % zipf->n);
+}
+
+static void sweep_ops_init(const sweep_config_t *config, sweep_thread_t *thread, const uint32_t keys,
+        const sweep_zipf_t *zipf)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ull * (thread->idx + 1);
+    uint32_t next = (uint32_t)(((uint64_t)keys * thread->idx) / config->threads);
+    for (uint32_t j = 0;j < SWEEP_OPS;j++)
+    {
+        uint32_t idx;
+        switch (config->dist)
+        {
+        case SWEEP_ZIPFIAN:
+            idx = sweep_zipf_next(zipf, &state);
+            break;
+        case SWEEP_RANDOM:
+            idx = sweep_random(&state) % keys;
+            break;
+        default:
+            idx = next;
+            next = (next + 1) % keys;
+            break;
+        }
+        if ((int)(sweep_random(&state) % 100) < config->writes)
+        {
+            /* The key of this thread */
+            idx = idx - (idx % config->threads) + thread->idx;
+            if (idx >= keys)
+            {
+                idx = thread->idx;
+            }
+            idx |= SWEEP_WRITE;
+        }
+        thread->ops[j] = idx;
+    }
+}
+
+/**
+ * The containers compared in the sweep: the hashtable, the hashtable with the task-local
+ * tier, the hashtable with the filter, the tagged table, std::unordered_map with a mutex,
+ * tbb::concurrent_hash_map (make BENCH_TBB=1) and folly::AtomicHashMap (make BENCH_FOLLY=1)
+ */
+class SweepHashtable
+{
+public:
+    static const char *name() { return "hashtable"; }
+
+    int init(const sweep_config_t *config, const uint32_t keys)
+    {
+        hashtable.name = "sweep";
+        hashtable.bits = config->bits;
+        hashtable.hashfunction = (config->dist == SWEEP_COLLISION) ? hash_none : hash32shift;
+        return hashtable_sweep_init(&hashtable);
+    }
+
+    void close()
+    {
+        hashtable_close(&hashtable);
+    }
+
+    int find(const uint32_t key, uint32_t *data)
+    {
+        return hashtable_sweep_find(&hashtable, key, data);
+    }
+
+    int insert(const uint32_t key, const uint32_t data)
+    {
+        return hashtable_sweep_insert(&hashtable, key, data);
+    }
+
+    int remove(const uint32_t key)
+    {
+        uint32_t data;
+        return hashtable_sweep_remove(&hashtable, key, &data);
+    }
+
+protected:
+    hashtable_t hashtable = {};
+};
+
+/**
+ * The same table behind the task-local tier, 2^(bits-6) slots for every thread shard
+ */
+class SweepLocal : public SweepHashtable
+{
+public:
+    static const char *name() { return "local"; }
+
+    int init(const sweep_config_t *config, const uint32_t keys)
+    {
+        tier.bits = (config->bits > 10) ? (config->bits - 6) : 4;
+        return SweepHashtable::init(config, keys) && hashtable_sweep_local_init(&tier);
+    }
+
+    void close()
+    {
+        hashtable_local_close(&tier);
+        SweepHashtable::close();
+    }
+
+    int find(const uint32_t key, uint32_t *data)
+    {
+        return hashtable_sweep_local_find(&hashtable, &tier, key, data);
+    }
+
+    int insert(const uint32_t key, const uint32_t data)
+    {
+        return hashtable_sweep_local_insert(&hashtable, &tier, key, data);
+    }
+
+    int remove(const uint32_t key)
+    {
+        uint32_t data;
+        return hashtable_sweep_local_remove(&hashtable, &tier, key, &data);
+    }
+
+protected:
+    hashtable_local_t tier = {};
+};
+
+/**
+ * The same table with the counting Bloom filter of 2^(bits-4) cache lines
+ */
+class SweepFilter : public SweepHashtable
+{
+public:
+    static const char *name() { return "filter"; }
+
+    int init(const sweep_config_t *config, const uint32_t keys)
+    {
+        hashtable.filter = (config->bits > 8) ? (config->bits - 4) : 4;
+        return SweepHashtable::init(config, keys);
+    }
+};
+
+/**
+ * The table of DECLARE_HASHTABLE_TAGGED: any thread inserts and removes a key
+ * One probe window of 16 slots, the sweep table has two
+ */
+class SweepTagged : public SweepHashtable
+{
+public:
+    static const char *name() { return "tagged"; }
+
+    int init(const sweep_config_t *config, const uint32_t keys)
+    {
+        hashtable.name = "sweep_tagged";
+        hashtable.bits = config->bits;
+        hashtable.hashfunction = (config->dist == SWEEP_COLLISION) ? hash_none : hash32shift;
+        return hashtable_sweep_tagged_init(&hashtable);
+    }
+
+    int find(const uint32_t key, uint32_t *data)
+    {
+        return hashtable_sweep_tagged_find(&hashtable, key, data);
+    }
+
+    int insert(const uint32_t key, const uint32_t data)
+    {
+        return hashtable_sweep_tagged_insert(&hashtable, key, data);
+    }
+
+    int remove(const uint32_t key)
+    {
+        uint32_t data;
+        return hashtable_sweep_tagged_remove(&hashtable, key, &data);
+    }
+};
+
+class SweepUnorderedMap
+{
+public:
+    static const char *name() { return "std_mutex"; }
+
+    int init(const sweep_config_t *config, const uint32_t keys)
+    {
+        map.reserve(keys);
+        return 1;
+    }
+
+    void close()
+    {
+        map.clear();
+    }
+
+    int find(const uint32_t key, uint32_t *data)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = map.find(key);
+        if (it == map.end())
+        {
+            return 0;
+        }
+        *data = it->second;
+        return 1;
+    }
+
+    int insert(const uint32_t key, const uint32_t data)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        map[key] = data;
+        return 1;
+    }
+
+    int remove(const uint32_t key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return map.erase(key);
+    }
+
+protected:
+    std::unordered_map<uint32_t, uint32_t> map;
+    std::mutex mutex;
+};
+
+#ifdef BENCH_TBB
+class SweepTbb
+{
+public:
+    static const char *name() { return "tbb"; }
+
+    int init(const sweep_config_t *config, const uint32_t keys)
+    {
+        map.rehash(keys);
+        return 1;
+    }
+
+    void close()
+    {
+        map.clear();
+    }
+
+    int find(const uint32_t key, uint32_t *data)
+    {
+        tbb::concurrent_hash_map<uint32_t, uint32_t>::const_accessor accessor;
+        if (!map.find(accessor, key))
+        {
+            return 0;
+        }
+        *data = accessor->second;
+        return 1;
+    }
+
+    int insert(const uint32_t key, const uint32_t data)
+    {
+        tbb::concurrent_hash_map<uint32_t, uint32_t>::accessor accessor;
+        map.insert(accessor, key);
+        accessor->second = data;
+        return 1;
+    }
+
+    int remove(const uint32_t key)
+    {
+        return map.erase(key);
+    }
+
+protected:
+    tbb::concurrent_hash_map<uint32_t, uint32_t> map;
+};
+#endif
+
+#ifdef BENCH_FOLLY
+/* Keys 0, ~0 and ~1 are reserved by AtomicHashMap, the sweep keys are not 0 */
+class SweepFolly
+{
+public:
+    static const char *name() { return "folly"; }
+
+    int init(const sweep_config_t *config, const uint32_t keys)
+    {
+        map = new folly::AtomicHashMap<uint32_t, uint32_t>(keys);
+        return 1;
+    }
+
+    void close()
+    {
+        delete map;
+    }
+
+    int find(const uint32_t key, uint32_t *data)
+    {
+        auto it = map->find(key);
+        if (it == map->end())
+        {
+            return 0;
+        }
+        *data = it->second;
+        return 1;
+    }
+
+    int insert(const uint32_t key, const uint32_t data)
+    {
+        auto rc = map->insert(key, data);
+        if (!rc.second)
+        {
+            rc.first->second = data;
+        }
+        return 1;
+    }
+
+    int remove(const uint32_t key)
+    {
+        return map->erase(key);
+    }
+
+protected:
+    folly::AtomicHashMap<uint32_t, uint32_t> *map = NULL;
+};
+#endif
+
+/**
+ * A round of SWEEP_OPS operations, linux_pool_t calls the function until linux_pool_stop()
+ */
+template <class Map> static int sweep_task(void *task_arg, linux_pool_worker_t *worker)
+{
+    sweep_thread_t *thread = &((sweep_thread_t *)task_arg)[worker->index];
+    Map *map = (Map *)thread->map;
+    for (uint32_t j = 0;j < SWEEP_OPS;j++)
+    {
+        const uint32_t op = thread->ops[j];
+        const uint32_t idx = op & ~SWEEP_WRITE;
+        const uint32_t key = sweep_keys[idx];
+        const int timed = ((j % SWEEP_SAMPLE) == 0);
+        uint64_t start = timed ? sweep_cycles() : 0;
+        uint32_t data;
+        if (!(op & SWEEP_WRITE))
+        {
+            map->find(key, &data);
+        }
+        else if (sweep_present[idx])
+        {
+            map->remove(key);
+            sweep_present[idx] = 0;
+        }
+        else
+        {
+            sweep_present[idx] = map->insert(key, key);
+        }
+        if (timed)
+        {
+            uint64_t cycles = sweep_cycles() - start;
+            thread->histogram[(cycles < SWEEP_HISTOGRAM) ? cycles : (SWEEP_HISTOGRAM - 1)]++;
+        }
+    }
+    worker->counters.ops += SWEEP_OPS;
+    return 1;
+}
+
+static double sweep_percentile(const uint64_t *histogram, const uint64_t total, const double percentile)
+{
+    const uint64_t target = (uint64_t)(total * percentile);
+    uint64_t sum = 0;
+    for (int i = 0;i < SWEEP_HISTOGRAM;i++)
+    {
+        sum += histogram[i];
+        if (sum > target)
+        {
+            return i;
+        }
+    }
+    return SWEEP_HISTOGRAM - 1;
+}
+
+template <class Map> static int sweep_run(const sweep_config_t *config, sweep_thread_t *threads,
+        const double ns_per_cycle)
+{
+    Map map;
+    linux_pool_t pool = {Map::name(), sweep_task<Map>, threads, config->threads, config->numa_node};
+    linux_pool_counters_t total;
+    const uint32_t size = 1u << config->bits;
+    const uint32_t keys = (uint32_t)(((uint64_t)size * config->load) / 100);
+    uint64_t histogram[SWEEP_HISTOGRAM];
+    uint64_t samples = 0;
+    uint32_t inserted = 0;
+    sweep_zipf_t zipf;
+
+    if (!map.init(config, keys))
+    {
+        return 0;
+    }
+    sweep_keys = (uint32_t *)malloc(keys * sizeof(*sweep_keys));
+    sweep_present = (uint8_t *)calloc(keys, sizeof(*sweep_present));
+    for (uint32_t i = 0;i < keys;i++)
+    {
+        sweep_keys[i] = sweep_key(config->dist, config->bits, i);
+        sweep_present[i] = map.insert(sweep_keys[i], sweep_keys[i]);
+        inserted += sweep_present[i];
+    }
+    memset(&zipf, 0, sizeof(zipf));
+    if (config->dist == SWEEP_ZIPFIAN)
+    {
+        sweep_zipf_init(&zipf, keys);
+    }
+
+    for (int t = 0;t < config->threads;t++)
+    {
+        threads[t].idx = t;
+        threads[t].map = &map;
+        memset(threads[t].histogram, 0, sizeof(threads[t].histogram));
+        sweep_ops_init(config, &threads[t], keys, &zipf);
+    }
+    int rc = linux_pool_init(&pool);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (rc)
+    {
+        linux_pool_start(&pool);
+        linux_ms_sleep(config->duration_ms);
+        linux_pool_stop(&pool);
+        rc = linux_pool_join(&pool);
+        linux_pool_counters(&pool, &total);
+        linux_pool_close(&pool);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!rc)
+    {
+        free(sweep_keys);
+        free(sweep_present);
+        map.close();
+        return 0;
+    }
+    memset(histogram, 0, sizeof(histogram));
+    for (int t = 0;t < config->threads;t++)
+    {
+        for (int i = 0;i < SWEEP_HISTOGRAM;i++)
+        {
+            histogram[i] += threads[t].histogram[i];
+            samples += threads[t].histogram[i];
+        }
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    printf("%-10s %7d %4zu %4d%% %5.1f%% %-10s %5d%% %9.2f %8.1f %8.1f %8.1f\n", Map::name(),
+            config->threads, config->bits, config->load, (100.0 * inserted) / size, sweep_dist_name[config->dist],
+            config->writes, total.ops / seconds / 1e6,
+            sweep_percentile(histogram, samples, 0.50) * ns_per_cycle,
+            sweep_percentile(histogram, samples, 0.99) * ns_per_cycle,
+            sweep_percentile(histogram, samples, 0.999) * ns_per_cycle);
+    fflush(stdout);
+
+    free(sweep_keys);
+    free(sweep_present);
+    map.close();
+    return 1;
+}
+
+/**
+ * Every combination of the parameters, a parameter given in the command line
+ * replaces the default list
+ */
+static int sweep(const char *maps, int threads_max, int bits, int load, int dist, int writes, uint64_t duration_ms,
+        int numa_node)
+{
+    static const int threads_list[] = {1, 2, 4, 8, 16, 32, 64};
+    static const int bits_list[] = {16, 22};
+    static const int load_list[] = {25, 50};
+    static const int writes_list[] = {0, 10, 50};
+    sweep_thread_t *threads = (sweep_thread_t *)calloc(SWEEP_THREADS_MAX, sizeof(sweep_thread_t));
+    const double ns_per_cycle = sweep_ns_per_cycle();
+    int rc = 1;
+
+    if (threads_max <= 0)
+    {
+        threads_max = linux_get_number_processors();
+    }
+    if (threads_max > SWEEP_THREADS_MAX)
+    {
+        threads_max = SWEEP_THREADS_MAX;
+    }
+    printf("%-10s threads bits  load  fill  dist       writes    Mops/s  p50(ns)  p99(ns) p999(ns)\n", "map");
+    for (size_t t = 0;(t < ARRAY_SIZE(threads_list)) && (threads_list[t] <= threads_max) && rc;t++)
+    for (size_t b = 0;(b < ARRAY_SIZE(bits_list)) && rc;b++)
+    for (size_t l = 0;(l < ARRAY_SIZE(load_list)) && rc;l++)
+    for (int d = 0;(d < SWEEP_DIST_LAST) && rc;d++)
+    for (size_t w = 0;(w < ARRAY_SIZE(writes_list)) && rc;w++)
+    {
+        sweep_config_t config;
+        if (((bits > 0) && b) || ((load > 0) && l) || ((dist >= 0) && (d != dist)) || ((writes >= 0) && w))
+        {
+            continue;
+        }
+        config.threads = threads_list[t];
+        config.bits = (bits > 0) ? bits : bits_list[b];
+        config.load = (load > 0) ? load : load_list[l];
+        config.dist = (sweep_dist_t)d;
+        config.writes = (writes >= 0) ? writes : writes_list[w];
+        config.duration_ms = duration_ms;
+        config.numa_node = numa_node;
+        if (strstr(maps, SweepHashtable::name()) || !strcmp(maps, "all"))
+        {
+            rc = rc && sweep_run<SweepHashtable>(&config, threads, ns_per_cycle);
+        }
+        if (strstr(maps, SweepLocal::name()) || !strcmp(maps, "all"))
+        {
+            rc = rc && sweep_run<SweepLocal>(&config, threads, ns_per_cycle);
+        }
+        if (strstr(maps, SweepFilter::name()) || !strcmp(maps, "all"))
+        {
+            rc = rc && sweep_run<SweepFilter>(&config, threads, ns_per_cycle);
+        }
+        if (strstr(maps, SweepTagged::name()) || !strcmp(maps, "all"))
+        {
+            rc = rc && sweep_run<SweepTagged>(&config, threads, ns_per_cycle);
+        }
+        if (strstr(maps, SweepUnorderedMap::name()) || !strcmp(maps, "all"))
+        {
+            rc = rc && sweep_run<SweepUnorderedMap>(&config, threads, ns_per_cycle);
+        }
+#ifdef BENCH_TBB
+        if (strstr(maps, SweepTbb::name()) || !strcmp(maps, "all"))
+        {
+            rc = rc && sweep_run<SweepTbb>(&config, threads, ns_per_cycle);
+        }
+#endif
+#ifdef BENCH_FOLLY
+        if (strstr(maps, SweepFolly::name()) || !strcmp(maps, "all"))
+        {
+            rc = rc && sweep_run<SweepFolly>(&config, threads, ns_per_cycle);
+        }
+#endif
+    }
+    free(threads);
+    return rc;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-H] [-S] [-c maps] [-t max threads] [-b bits] [-l load %%] [-d dist] [-w writes %%] [-m ms] [-n node]\n"
+            "  -H  hash functions only\n"
+            "  -S  multithreaded sweep only\n"
+            "  maps is a comma separated list of hashtable, local, filter, tagged, std_mutex, tbb, folly or all\n"
+            "  dist is sequential, collision, random or zipfian\n"
+            "  node is the NUMA node of the threads, the CPUs of the process by default\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    static hashtable_t hashtable_shift = {"shift", BENCH_BITS, NULL};
+    static hashtable_t hashtable_fibonacci = {"fibonacci", BENCH_BITS, NULL};
+    static hashtable_t hashtable_murmur3 = {"murmur3", BENCH_BITS, NULL};
+    static hashtable_t hashtable_crc32c = {"crc32c", BENCH_BITS, NULL};
+    static hashtable_t hashtable_none = {"none", BENCH_BITS, NULL};
+    static hashtable_t hashtable_hugepage = {"hugepage", BENCH_BITS, NULL, 0, NULL, HASHTABLE_ALLOC_HUGEPAGE};
+    static hashtable_t hashtable_batch = {"batch", BATCH_BITS, NULL};
+    const char *maps = "hashtable";
+    int hash_only = 0, sweep_only = 0;
+    int threads_max = 0, bits = 0, load = 0, dist = -1, writes = -1, numa_node = -1;
+    uint64_t duration_ms = 100;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hHSc:t:b:l:d:w:m:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            hash_only = 1;
+            break;
+        case 'S':
+            sweep_only = 1;
+            break;
+        case 'c':
+            maps = optarg;
+            break;
+        case 't':
+            threads_max = atoi(optarg);
+            break;
+        case 'b':
+            bits = atoi(optarg);
+            break;
+        case 'l':
+            load = atoi(optarg);
+            break;
+        case 'd':
+            for (dist = 0;(dist < SWEEP_DIST_LAST) && strcmp(optarg, sweep_dist_name[dist]);dist++);
+            if (dist == SWEEP_DIST_LAST)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'w':
+            writes = atoi(optarg);
+            break;
+        case 'm':
+            duration_ms = atoi(optarg);
+            break;
+        case 'n':
+            numa_node = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!sweep_only)
+    {
+        bench_dynamic(&hashtable_dynamic);
+        bench_shift(&hashtable_shift);
+        bench_fibonacci(&hashtable_fibonacci);
+        bench_murmur3(&hashtable_murmur3);
+        bench_crc32c(&hashtable_crc32c);
+        bench_none(&hashtable_none);
+        bench_shift(&hashtable_hugepage);
+        bench_batch(&hashtable_batch);
+        bench_churn();
+    }
+    if (!hash_only && !sweep(maps, threads_max, bits, load, dist, writes, duration_ms, numa_node))
+    {
+        return 1;
+    }
+
+    return 0;
+}
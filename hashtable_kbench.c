@@ -0,0 +1,242 @@
+/**
+ *   Lockfree is a set of lockfree containers for Linux and Linux kernel
+ *   Copyright (C) <2017>  Arkady Miasnikov
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Benchmark of the hashtable in the kernel
+ * make kmod && sudo insmod hashtable_kbench.ko [bits=22] [keys=1024] [rounds=1000]
+ * A thread on every online CPU inserts, finds and removes its own keys, the preemption
+ * is disabled for a round of 'keys' operations. The module prints ns/op to the kernel
+ * log when insmod returns. The table 'kbench_dynamic' calls the hash function by pointer
+ * (a retpoline with CONFIG_RETPOLINE), the table 'kbench_inline' inlines the same hash
+ * The counters of the tables are in <debugfs>/hashtable_kbench until rmmod
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/math64.h>
+#include <linux/cpumask.h>
+
+#include "hashtable.h"
+
+static int bits = 22;
+module_param(bits, int, 0444);
+MODULE_PARM_DESC(bits, "Size of the tables, 2^bits slots");
+
+static int keys = 1024;
+module_param(keys, int, 0444);
+MODULE_PARM_DESC(keys, "Keys of a CPU in a round, below 2^20");
+
+static int rounds = 1000;
+module_param(rounds, int, 0444);
+MODULE_PARM_DESC(rounds, "Rounds of insert/find/remove");
+
+DECLARE_HASHTABLE(kbench_dynamic, uint32_t, 8, 0, 0);
+DECLARE_HASHTABLE_HASH(kbench_inline, uint32_t, 8, 0, 0, hash_murmur3);
+
+static hashtable_t table_dynamic = {"kbench_dynamic", 0, hash_murmur3};
+static hashtable_t table_inline = {"kbench_inline", 0, hash_murmur3};
+
+enum {
+    KBENCH_DYNAMIC,
+    KBENCH_INLINE,
+    KBENCH_TABLES,
+};
+
+static const char *kbench_names[KBENCH_TABLES] = {"dynamic", "inline"};
+
+typedef struct
+{
+    uint64_t ns_insert;
+    uint64_t ns_find;
+    uint64_t ns_remove;
+    uint64_t ops;
+    uint64_t errors;
+} kbench_result_t;
+
+typedef struct
+{
+    int cpu;
+    int started;
+    struct completion done;
+    kbench_result_t result[KBENCH_TABLES];
+} kbench_cpu_t;
+
+/**
+ * A round of inserts, finds and removes of the keys of the CPU, the keys of
+ * different CPUs do not overlap - a key has a single owner
+ */
+#define KBENCH_ROUND(tokn, table, result, base)                                                                                   \
+    do {                                                                                                                          \
+        uint64_t start, t_insert, t_find, t_remove;                                                                               \
+        uint32_t data;                                                                                                            \
+        int i;                                                                                                                    \
+        preempt_disable();                                                                                                        \
+        start = ktime_get_ns();                                                                                                   \
+        for (i = 0;i < keys;i++)                                                                                                  \
+        {                                                                                                                         \
+            (result)->errors += !hashtable_## tokn ##_insert(table, (base) + i, i);                                               \
+        }                                                                                                                         \
+        t_insert = ktime_get_ns();                                                                                                \
+        for (i = 0;i < keys;i++)                                                                                                  \
+        {                                                                                                                         \
+            (result)->errors += !hashtable_## tokn ##_find(table, (base) + i, &data);                                             \
+        }                                                                                                                         \
+        t_find = ktime_get_ns();                                                                                                  \
+        for (i = 0;i < keys;i++)                                                                                                  \
+        {                                                                                                                         \
+            (result)->errors += !hashtable_## tokn ##_remove(table, (base) + i, NULL);                                            \
+        }                                                                                                                         \
+        t_remove = ktime_get_ns();                                                                                                \
+        preempt_enable();                                                                                                         \
+        (result)->ns_insert += t_insert - start;                                                                                  \
+        (result)->ns_find += t_find - t_insert;                                                                                   \
+        (result)->ns_remove += t_remove - t_find;                                                                                 \
+        (result)->ops += keys;                                                                                                    \
+    } while (0)
+
+static int kbench_thread(void *arg)
+{
+    kbench_cpu_t *state = (kbench_cpu_t *)arg;
+    const uint32_t base = (uint32_t)(state->cpu + 1) << 20;
+    int round;
+    for (round = 0;round < rounds;round++)
+    {
+        KBENCH_ROUND(kbench_dynamic, &table_dynamic, &state->result[KBENCH_DYNAMIC], base);
+        cond_resched();
+    }
+    for (round = 0;round < rounds;round++)
+    {
+        KBENCH_ROUND(kbench_inline, &table_inline, &state->result[KBENCH_INLINE], base);
+        cond_resched();
+    }
+    complete(&state->done);
+    return 0;
+}
+
+static void kbench_show(const char *name, const int cpu, const kbench_result_t *result)
+{
+    const uint64_t ops = result->ops ? result->ops : 1;
+    printk(KERN_INFO DEV_NAME ": %-8s cpu %4d ops %12llu insert %5llu find %5llu remove %5llu ns/op errors %llu\n",
+            name, cpu, (unsigned long long)result->ops,
+            (unsigned long long)div64_u64(result->ns_insert, ops),
+            (unsigned long long)div64_u64(result->ns_find, ops),
+            (unsigned long long)div64_u64(result->ns_remove, ops),
+            (unsigned long long)result->errors);
+}
+
+static int kbench_run(void)
+{
+    kbench_result_t total[KBENCH_TABLES];
+    kbench_cpu_t *states;
+    int cpu, t;
+    states = kcalloc(nr_cpu_ids, sizeof(*states), GFP_KERNEL);
+    if (!states)
+    {
+        return -ENOMEM;
+    }
+    memset(total, 0, sizeof(total));
+    for_each_online_cpu(cpu)
+    {
+        kbench_cpu_t *state = &states[cpu];
+        struct task_struct *task;
+        state->cpu = cpu;
+        init_completion(&state->done);
+        task = kthread_create(kbench_thread, state, "hashtable_kbench/%d", cpu);
+        if (IS_ERR(task))
+        {
+            PRINTF("Failed to start a thread on CPU %d", cpu);
+            continue;
+        }
+        kthread_bind(task, cpu);
+        state->started = 1;
+        wake_up_process(task);
+    }
+    for (cpu = 0;cpu < nr_cpu_ids;cpu++)
+    {
+        if (!states[cpu].started)
+        {
+            continue;
+        }
+        wait_for_completion(&states[cpu].done);
+        for (t = 0;t < KBENCH_TABLES;t++)
+        {
+            const kbench_result_t *result = &states[cpu].result[t];
+            kbench_show(kbench_names[t], cpu, result);
+            total[t].ns_insert += result->ns_insert;
+            total[t].ns_find += result->ns_find;
+            total[t].ns_remove += result->ns_remove;
+            total[t].ops += result->ops;
+            total[t].errors += result->errors;
+        }
+    }
+    for (t = 0;t < KBENCH_TABLES;t++)
+    {
+        kbench_show(kbench_names[t], -1, &total[t]);
+    }
+    kfree(states);
+    return 0;
+}
+
+static int __init kbench_init(void)
+{
+    int rc;
+    if ((bits < 4) || (bits > 30) || (keys <= 0) || (keys >= (1 << 20)) || (rounds <= 0))
+    {
+        PRINTF("Bad parameters bits=%d keys=%d rounds=%d", bits, keys, rounds);
+        return -EINVAL;
+    }
+    table_dynamic.bits = bits;
+    table_inline.bits = bits;
+    if (!hashtable_kbench_dynamic_init(&table_dynamic))
+    {
+        return -ENOMEM;
+    }
+    if (!hashtable_kbench_inline_init(&table_inline))
+    {
+        hashtable_close(&table_dynamic);
+        return -ENOMEM;
+    }
+    rc = kbench_run();
+    if (rc)
+    {
+        hashtable_close(&table_inline);
+        hashtable_close(&table_dynamic);
+        return rc;
+    }
+    /* The tables are idle, the counters are published once */
+    hashtable_stats_open("hashtable_kbench");
+    return 0;
+}
+
+static void __exit kbench_exit(void)
+{
+    hashtable_stats_close();
+    hashtable_close(&table_inline);
+    hashtable_close(&table_dynamic);
+}
+
+module_init(kbench_init);
+module_exit(kbench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Benchmark of the lockfree hashtable");
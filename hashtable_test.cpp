@@ -19,16 +19,61 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+/* two_choice_relocate() */
+#define HASHTABLE_RELOCATE 1
+/* tagged_claim_access() */
+static void tagged_hook(int stage);
+#define HASHTABLE_TAGGED_HOOK(stage) tagged_hook(stage)
 #include "hashtable.h"
+#include "hashtable.hpp"
+#include "ringbuffer.h"
 #include "linux_utils.h"
 
 
 #define HASHTABLE_BITS 8
+#define HASHTABLE_SIZE (1 << HASHTABLE_BITS)
+#define TEST_THREADS_MS 1000
 
 
+typedef struct
+{
+    uint64_t timestamp;
+    int fd;
+    uint32_t flags;
+} syscall_context_t;
+
 static hashtable_t hashtable = {"hash", HASHTABLE_BITS, hash_none};
+static hashtable_t hashtable_soa = {"hash_soa", HASHTABLE_BITS, hash_none};
+static hashtable_t hashtable_two_choice = {"hash_two_choice", HASHTABLE_BITS, hash_none};
+static hashtable_t hashtable_backyard = {"hash_backyard", HASHTABLE_BITS + 4, hash32shift};
+static hashtable_t hashtable_pair = {"hash_pair", HASHTABLE_BITS, NULL, 0, NULL,
+    HASHTABLE_ALLOC_HUGEPAGE | HASHTABLE_ALLOC_NUMA_BIND, 0};
+static hashtable_t hashtable_grow = {"hash_grow", 4, hash32shift, HASHTABLE_BITS + 4};
+static hashtable_t hashtable_stuck = {"hash_stuck", 6, hash_none, 7};
+static hashtable_t hashtable_pooled = {"hash_pooled", HASHTABLE_BITS, hash_none};
+static hashtable_t hashtable_ttl = {"hash_ttl", HASHTABLE_BITS, hash_none, 0, NULL, 0, 0, 1};
+static hashtable_t hashtable_bloom = {"hash_bloom", HASHTABLE_BITS, hash_none, 0, NULL, 0, 0, 0, 2};
+static hashtable_t hashset = {"hashset", HASHTABLE_BITS, hash_none};
+static hashtable_pool_t pool = {"pool", sizeof(syscall_context_t), 4};
+static hashtable_local_t local_tier = {4};
 
 DECLARE_HASHTABLE(uint32, uint32_t, 4, 0, 0);
+DECLARE_HASHTABLE_SOA(soa, uint64_t, 4, 0, 0);
+DECLARE_HASHTABLE_TWO_CHOICE(two_choice, uint32_t, 4, 0, 0);
+DECLARE_HASHTABLE_BACKYARD(backyard, uint32_t, 4, 0, 0);
+DECLARE_HASHTABLE(grow, uint32_t, 4, 0, 0);
+DECLARE_HASHTABLE(stuck, uint32_t, 4, 0, 0);
+DECLARE_HASHTABLE_KEY(pair, uint64_t, uint32_t, 4, 0, 0);
+DECLARE_HASHTABLE(ttl, uint32_t, 4, 0, 0);
+DECLARE_HASHTABLE(bloom, uint32_t, 4, 0, 0);
+DECLARE_HASHTABLE_HASH(tmpl, uint32_t, 4, 0, 0, hash_murmur3);
+DECLARE_HASHTABLE_ATOMIC(uint32, uint32_t, uint32_t);
+DECLARE_HASHTABLE_ATOMIC(grow, uint32_t, uint32_t);
+DECLARE_HASHTABLE_POOLED(pooled, syscall_context_t, 4, 0);
+DECLARE_HASHTABLE_LOCAL(uint32, uint32_t, uint32_t, 0, 0);
+DECLARE_HASHSET(set, 4, 0);
+DECLARE_HASHTABLE_TAGGED(tagged, uint32_t, 8, 0);
 
 /**
  *   The hashtable does 'value & ((1 << HASHTABLE_BITS)-1)'
@@ -45,79 +90,88 @@ static inline uint32_t get_value(int idx)
     return idx;
 }
 
+static volatile int thread_failed;
+
+/**
+ * One round of insert/find/remove, linux_thread_main() calls the function
+ * until linux_thread_exit()
+ * Returns 1 if Ok
+ */
 static int thread_job(void *thread_arg)
 {
     int idx = (int)(size_t)thread_arg;
 
     uint32_t value_to_store = get_value_collision(idx);
 
-
-    while (1)
+    int rc = hashtable_uint32_insert(&hashtable, value_to_store, value_to_store);
+    if (!rc)
     {
-        int rc = hashtable_uint32_insert(&hashtable, value_to_store, value_to_store);
-        if (!rc)
-        {
-            linux_log(LINUX_LOG_ERROR, "Thread %d failed to insert entry %u",
-                    idx, value_to_store);
-            return 1;
-        }
-
-        uint32_t found_value;
-        rc = hashtable_uint32_find(&hashtable, value_to_store, &found_value);
-        if (!rc)
-        {
-            linux_log(LINUX_LOG_ERROR, "Thread %d failed to find entry %u",
-                    idx, value_to_store);
-            return 1;
-        }
-        if (found_value != value_to_store)
-        {
-            linux_log(LINUX_LOG_ERROR, "Thread %d found wrong entry %u vs %u",
-                    idx, value_to_store, found_value);
-            return 1;
-        }
+        linux_log(LINUX_LOG_ERROR, "Thread %d failed to insert entry %u",
+                idx, value_to_store);
+        thread_failed = 1;
+        return 0;
+    }
 
-        rc = hashtable_uint32_find(&hashtable, ~value_to_store, &found_value);
-        if (rc)
-        {
-            linux_log(LINUX_LOG_ERROR, "Thread %d found non-existing key %u",
-                    idx, ~value_to_store);
-            return 1;
-        }
+    uint32_t found_value;
+    rc = hashtable_uint32_find(&hashtable, value_to_store, &found_value);
+    if (!rc)
+    {
+        linux_log(LINUX_LOG_ERROR, "Thread %d failed to find entry %u",
+                idx, value_to_store);
+        thread_failed = 1;
+        return 0;
+    }
+    if (found_value != value_to_store)
+    {
+        linux_log(LINUX_LOG_ERROR, "Thread %d found wrong entry %u vs %u",
+                idx, value_to_store, found_value);
+        thread_failed = 1;
+        return 0;
+    }
 
-        uint32_t deleted_value;
-        rc = hashtable_uint32_remove(&hashtable, value_to_store, &deleted_value);
-        if (!rc)
-        {
-            linux_log(LINUX_LOG_ERROR, "Thread %d failed to remove entry %u",
-                    idx, value_to_store);
-            return 1;
-        }
-        if (deleted_value != value_to_store)
-        {
-            linux_log(LINUX_LOG_ERROR, "Thread %d removed wrong entry %u vs %u",
-                    idx, value_to_store, deleted_value);
-            return 1;
-        }
-        rc = hashtable_uint32_find(&hashtable, value_to_store, &found_value);
-        if (rc)
-        {
-            linux_log(LINUX_LOG_ERROR, "Thread %d found non-existing key %u",
-                    idx, value_to_store);
-            return 1;
-        }
+    rc = hashtable_uint32_find(&hashtable, ~value_to_store, &found_value);
+    if (rc)
+    {
+        linux_log(LINUX_LOG_ERROR, "Thread %d found non-existing key %u",
+                idx, ~value_to_store);
+        thread_failed = 1;
+        return 0;
     }
 
+    uint32_t deleted_value;
+    rc = hashtable_uint32_remove(&hashtable, value_to_store, &deleted_value);
+    if (!rc)
+    {
+        linux_log(LINUX_LOG_ERROR, "Thread %d failed to remove entry %u",
+                idx, value_to_store);
+        thread_failed = 1;
+        return 0;
+    }
+    if (deleted_value != value_to_store)
+    {
+        linux_log(LINUX_LOG_ERROR, "Thread %d removed wrong entry %u vs %u",
+                idx, value_to_store, deleted_value);
+        thread_failed = 1;
+        return 0;
+    }
+    rc = hashtable_uint32_find(&hashtable, value_to_store, &found_value);
+    if (rc)
+    {
+        linux_log(LINUX_LOG_ERROR, "Thread %d found non-existing key %u",
+                idx, value_to_store);
+        thread_failed = 1;
+        return 0;
+    }
 
     return 1;
 }
 
-static int create_threads(int cpus)
+static int create_threads(linux_task_state_t *states, int cpus)
 {
-    int rc;
+    int rc = 1;
     for (int i = 0;i < cpus;i++)
     {
-        linux_task_state_t *state = (linux_task_state_t*)calloc(1, sizeof(linux_task_state_t));
+        linux_task_state_t *state = &states[i];
         char filename[64];
         sprintf(filename, "%d", i);
         state->properties.name = strdup(filename);
@@ -167,42 +221,1938 @@ static int synchronous_access(int cpus)
     return 1;
 }
 
-int main()
+/**
+ * Fill the probe window of the slot 0 with colliding keys, check that keys
+ * and 64 bits data do not overlap in the SOA layout
+ */
+static int soa_access(int cpus)
 {
-    int cpus = 4; //linux_get_number_processors()
-    int rc;
+    for (int i = 0;i < cpus;i++)
+    {
+        uint32_t key = get_value_collision(i);
+        uint64_t data = ((uint64_t)key << 32) | i;
+        int rc = hashtable_soa_insert(&hashtable_soa, key, data);
+        if (!rc)
+        {
+            linux_log(LINUX_LOG_ERROR, "SOA failed to insert entry %u", key);
+            return 0;
+        }
+    }
+    for (int i = 0;i < cpus;i++)
+    {
+        uint32_t key = get_value_collision(i);
+        uint64_t data = ((uint64_t)key << 32) | i;
+        uint64_t found_data;
+        int rc = hashtable_soa_find(&hashtable_soa, key, &found_data);
+        if (!rc || (found_data != data))
+        {
+            linux_log(LINUX_LOG_ERROR, "SOA failed to find entry %u", key);
+            return 0;
+        }
+        rc = hashtable_soa_remove(&hashtable_soa, key, &found_data);
+        if (!rc || (found_data != data))
+        {
+            linux_log(LINUX_LOG_ERROR, "SOA failed to remove entry %u", key);
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    do
+static int batch_access(int cpus)
+{
+    uint32_t keys[64];
+    uint32_t data[64];
+    uint64_t mask[1] = {0};
+    size_t rc;
+    int n = cpus;
+
+    for (int i = 0;i < n;i++)
+    {
+        keys[i] = get_value(i);
+        data[i] = ~keys[i];
+    }
+    rc = hashtable_uint32_insert_batch(&hashtable, keys, data, n, NULL);
+    if (rc != (size_t)n)
     {
+        linux_log(LINUX_LOG_ERROR, "Batch inserted %zu entries instead of %d", rc, n);
+        return 0;
+    }
 
-        rc = hashtable_uint32_init(&hashtable);
-        if (!rc)
+    memset(data, 0, sizeof(data));
+    /* Every other key does not exist */
+    for (int i = 1;i < n;i += 2)
+    {
+        keys[i] = ~keys[i];
+    }
+    rc = hashtable_uint32_find_batch(&hashtable, keys, n, data, mask);
+    for (int i = 0;i < n;i++)
+    {
+        const int found = (mask[0] >> i) & 1;
+        if ((found != !(i & 1)) || (found && (data[i] != ~keys[i])))
         {
-            break;
+            linux_log(LINUX_LOG_ERROR, "Batch find failed for entry %u", keys[i]);
+            return 0;
         }
+    }
 
-        rc = synchronous_access(cpus);
+    for (int i = 1;i < n;i += 2)
+    {
+        keys[i] = ~keys[i];
+    }
+    rc = hashtable_uint32_remove_batch(&hashtable, keys, n, NULL, mask);
+    if (rc != (size_t)n)
+    {
+        linux_log(LINUX_LOG_ERROR, "Batch removed %zu entries instead of %d", rc, n);
+        return 0;
+    }
+    return 1;
+}
+/**
+ * More colliding keys than max_tries fit the table with two probe windows
+ */
+static int two_choice_access(int cpus)
+{
+    for (int i = 0;i < 2*cpus;i++)
+    {
+        uint32_t key = get_value_collision(i);
+        int rc = hashtable_two_choice_insert(&hashtable_two_choice, key, ~key);
         if (!rc)
         {
-            break;
+            linux_log(LINUX_LOG_ERROR, "Two choice failed to insert entry %u", key);
+            return 0;
+        }
+    }
+    for (int i = 0;i < 2*cpus;i++)
+    {
+        uint32_t key = get_value_collision(i);
+        uint32_t data;
+        int rc = hashtable_two_choice_find(&hashtable_two_choice, key, &data);
+        if (!rc || (data != ~key))
+        {
+            linux_log(LINUX_LOG_ERROR, "Two choice failed to find entry %u", key);
+            return 0;
+        }
+        rc = hashtable_two_choice_remove(&hashtable_two_choice, key, &data);
+        if (!rc || (data != ~key))
+        {
+            linux_log(LINUX_LOG_ERROR, "Two choice failed to remove entry %u", key);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * The filler takes the first slot of the second window of the key2, the key2 lands in
+ * the slot after the key1. The insert of the key2 after the key1 is removed moves the
+ * key2 to the slot of the key1
+ */
+static int two_choice_relocate()
+{
+    const uint32_t key1 = 5;
+    const uint32_t key2 = key1 + HASHTABLE_SIZE;
+    const uint32_t filler = hashtable_window_index(HASHTABLE_SIZE, hash_none(key2), 1, HASHTABLE_BUCKET_TWO_CHOICE(4)) + HASHTABLE_SIZE;
+    hashtable_stat_t before, after;
+    uint32_t data;
+    int rc;
+    rc = hashtable_two_choice_insert(&hashtable_two_choice, key1, 1);
+    rc = rc && hashtable_two_choice_insert(&hashtable_two_choice, filler, 0);
+    rc = rc && hashtable_two_choice_insert(&hashtable_two_choice, key2, 2);
+    rc = rc && hashtable_two_choice_remove(&hashtable_two_choice, key1, NULL);
+    hashtable_stat_get(&hashtable_two_choice, &before);
+    rc = rc && hashtable_two_choice_insert(&hashtable_two_choice, key2, 3);
+    hashtable_stat_get(&hashtable_two_choice, &after);
+    rc = rc && hashtable_two_choice_remove(&hashtable_two_choice, key2, &data) && (data == 3);
+    rc = rc && !hashtable_two_choice_find(&hashtable_two_choice, key2, &data);
+    rc = rc && hashtable_two_choice_remove(&hashtable_two_choice, filler, NULL);
+    if (!rc || ((after.relocated - before.relocated) != 1))
+    {
+        linux_log(LINUX_LOG_ERROR, "Two choice failed to relocate entry %u", key2);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * The first insert fails at ~90% load of the table and the backyard. The removed keys
+ * leave no overflow counters behind
+ */
+static int backyard_access()
+{
+    const size_t slots = HASHTABLE_SIZE * 16 + hashtable_backyard_slots(HASHTABLE_SIZE * 16, 4);
+    uint32_t key, data;
+    for (key = 1;hashtable_backyard_insert(&hashtable_backyard, key, ~key);key++)
+    {
+    }
+    if ((key - 1) < (slots * 88 / 100))
+    {
+        linux_log(LINUX_LOG_ERROR, "Backyard failed to insert entry %u of %zu slots", key, slots);
+        return 0;
+    }
+    while (--key)
+    {
+        if (!hashtable_backyard_find(&hashtable_backyard, key, &data) || (data != ~key) ||
+            !hashtable_backyard_remove(&hashtable_backyard, key, &data) || (data != ~key) ||
+            hashtable_backyard_find(&hashtable_backyard, key, &data))
+        {
+            linux_log(LINUX_LOG_ERROR, "Backyard failed to find or remove entry %u", key);
+            return 0;
+        }
+    }
+    for (key = 1;key < slots;key++)
+    {
+        if (*hashtable_backyard_overflow(hashtable_backyard.__table, hashtable_backyard.__size, hash32shift(key)))
+        {
+            linux_log(LINUX_LOG_ERROR, "Backyard overflow counter of entry %u is not zero", key);
+            return 0;
         }
+    }
+    return 1;
+}
 
-        rc = create_threads(cpus);
+/**
+ * (pid, fd) keys with the same fd and different pids do not overlap
+ */
+static int pair_access(int cpus)
+{
+    const uint32_t fd = 3;
+    for (int pid = 1;pid <= cpus;pid++)
+    {
+        uint64_t key = HASHTABLE_KEY_PAIR(pid, fd);
+        int rc = hashtable_pair_insert(&hashtable_pair, key, pid);
         if (!rc)
         {
-            break;
+            linux_log(LINUX_LOG_ERROR, "Pair failed to insert entry (%d, %u)", pid, fd);
+            return 0;
+        }
+    }
+    for (int pid = 1;pid <= cpus;pid++)
+    {
+        uint64_t key = HASHTABLE_KEY_PAIR(pid, fd);
+        uint32_t data;
+        int rc = hashtable_pair_find(&hashtable_pair, HASHTABLE_KEY_PAIR(pid, fd + 1), &data);
+        if (rc)
+        {
+            linux_log(LINUX_LOG_ERROR, "Pair found missing entry (%d, %u)", pid, fd + 1);
+            return 0;
+        }
+        rc = hashtable_pair_remove(&hashtable_pair, key, &data);
+        if (!rc || (data != (uint32_t)pid) || (HASHTABLE_KEY_PAIR_HI(key) != (uint32_t)pid))
+        {
+            linux_log(LINUX_LOG_ERROR, "Pair failed to remove entry (%d, %u)", pid, HASHTABLE_KEY_PAIR_LO(key));
+            return 0;
         }
+    }
+    return 1;
+}
 
-        while (1)
+/**
+ * The table uses hash_none, keys 1..5 occupy slots 1..5 and key 100 is alone
+ * The first cells of the heatmap are 75% and 50% full
+ */
+static int scan_access()
+{
+    static const uint32_t keys[] = {1, 2, 3, 4, 5, 100};
+    hashtable_scan_t scan = {};
+    char buf[1024];
+    int rc;
+    for (size_t i = 0;i < ARRAY_SIZE(keys);i++)
+    {
+        hashtable_uint32_insert(&hashtable, keys[i], keys[i]);
+    }
+    while (!hashtable_uint32_scan_stats(&hashtable, &scan, 7));
+    hashtable_scan_show(&scan, buf, sizeof(buf));
+    linux_log(LINUX_LOG_INFO, "%s", buf);
+    rc = hashtable_uint32_heatmap(&hashtable, buf, sizeof(buf), 4);
+    linux_log(LINUX_LOG_INFO, "\n%s", buf);
+    if ((scan.live != ARRAY_SIZE(keys)) || (scan.longest_run != 5) || (scan.runs[5] != 1) || (scan.runs[1] != 1) ||
+        (rc != (HASHTABLE_SIZE / 4 + HASHTABLE_SIZE / 256)) || (buf[0] != '%') || (buf[1] != '+'))
+    {
+        linux_log(LINUX_LOG_ERROR, "Scan found %zu entries, longest run %zu", scan.live, scan.longest_run);
+        return 0;
+    }
+    for (size_t i = 0;i < ARRAY_SIZE(keys);i++)
+    {
+        hashtable_uint32_remove(&hashtable, keys[i], NULL);
+    }
+    return 1;
+}
+
+static int foreach_sum(uint32_t key, uint32_t data, void *ctx)
+{
+    uint64_t *sum = (uint64_t*)ctx;
+    *sum += key + data;
+    return (key != 3);
+}
+
+/**
+ * Iterate the table, copy the table
+ */
+static int foreach_access()
+{
+    static const uint32_t keys[] = {1, 2, 3, 4, 5, 100};
+    uint32_t snapshot_keys[ARRAY_SIZE(keys)];
+    uint32_t snapshot_data[ARRAY_SIZE(keys)];
+    uint64_t sum = 0;
+    size_t visited, copied;
+    for (size_t i = 0;i < ARRAY_SIZE(keys);i++)
+    {
+        hashtable_uint32_insert(&hashtable, keys[i], 2 * keys[i]);
+    }
+    /* The callback stops the iteration at key 3 */
+    visited = hashtable_uint32_foreach(&hashtable, foreach_sum, &sum);
+    copied = hashtable_uint32_snapshot(&hashtable, snapshot_keys, snapshot_data, ARRAY_SIZE(keys) - 1);
+    if ((visited != 3) || (sum != 18) || (copied != (ARRAY_SIZE(keys) - 1)))
+    {
+        linux_log(LINUX_LOG_ERROR, "Foreach visited %zu entries, sum %lu, snapshot %zu", visited, sum, copied);
+        return 0;
+    }
+    for (size_t i = 0;i < copied;i++)
+    {
+        if (snapshot_data[i] != (2 * snapshot_keys[i]))
         {
-            linux_ms_sleep(1000);
-            char buf[4*1024];
-            hashtable_show(buf, ARRAY_SIZE(buf));
-            linux_log(LINUX_LOG_INFO, "%s", buf);
+            linux_log(LINUX_LOG_ERROR, "Snapshot of entry %u is %u", snapshot_keys[i], snapshot_data[i]);
+            return 0;
         }
-        hashtable_close(&hashtable);
     }
-    while (0);
+    for (size_t i = 0;i < ARRAY_SIZE(keys);i++)
+    {
+        hashtable_uint32_remove(&hashtable, keys[i], NULL);
+    }
+    return 1;
+}
 
-    return 0;
+static hashtable_uint32_slot_t storage[HASHTABLE_SIZE + 4] __attribute__((aligned(HASHTABLE_CACHE_LINE)));
+
+/**
+ * The table in a static array: the slots of the dirty memory are initialized, the
+ * zeroed memory is used as is, hashtable_close() does not free the array
+ * The empty slot of the table 'uint32' is zero bytes, the table gets the zeroed pages
+ */
+static int storage_access()
+{
+    hashtable_t table = {"hash_storage", HASHTABLE_BITS, hash_none};
+    uint32_t data;
+    int rc = !hashtable_uint32_init_storage(&table, storage, sizeof(storage) - 1, 1);
+    memset(storage, 0xff, sizeof(storage));
+    rc = rc && hashtable_uint32_init_storage(&table, storage, sizeof(storage), 0);
+    rc = rc && !hashtable_uint32_find(&table, ~0u, &data) && hashtable_uint32_insert(&table, 5, 10);
+    if (table.__table)
+    {
+        hashtable_close(&table);
+    }
+    rc = rc && (storage[5].key == 5) && (storage[5].data == 10);
+    memset(storage, 0, sizeof(storage));
+    rc = rc && hashtable_uint32_init_storage(&table, storage, sizeof(storage), 1);
+    rc = rc && !hashtable_uint32_find(&table, 5, &data) && hashtable_uint32_insert(&table, 5, 10);
+    rc = rc && hashtable_uint32_find(&table, 5, &data) && (data == 10);
+    if (table.__table)
+    {
+        hashtable_close(&table);
+    }
+    rc = rc && (hashtable.__storage == HASHTABLE_STORAGE_ZEROED) && (hashtable_pooled_empty_is_zero() == 0);
+    if (!rc)
+    {
+        linux_log(LINUX_LOG_ERROR, "Failed to use the storage of %zu bytes", sizeof(storage));
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * The loaded table is the file: the keys of the saved table are in the file, an insert
+ * to the loaded table is in the file. The file of another declaration or another hash
+ * is not loaded
+ */
+static int persist_access()
+{
+    static const char path[] = "/tmp/hashtable_test_table";
+    hashtable_t saved = {"hash_saved", HASHTABLE_BITS, hash_none};
+    hashtable_t loaded = {"hash_loaded"};
+    hashtable_t other = {"hash_other"};
+    uint32_t data = 0;
+    int rc = hashtable_uint32_init(&saved);
+    for (uint32_t key = 1;rc && (key <= 16);key++)
+    {
+        rc = hashtable_uint32_insert(&saved, key, 2 * key);
+    }
+    rc = rc && hashtable_uint32_save(&saved, path);
+    /* The name of the temporary file does not fit, the save fails */
+    char long_path[256] = "/tmp/";
+    memset(long_path + 5, 'a', sizeof(long_path) - 6);
+    rc = rc && !hashtable_uint32_save(&saved, long_path);
+    if (saved.__table)
+    {
+        hashtable_close(&saved);
+    }
+    rc = rc && hashtable_uint32_load_mmap(&loaded, path);
+    rc = rc && (loaded.bits == HASHTABLE_BITS) && (loaded.hashfunction == hash_none);
+    for (uint32_t key = 1;rc && (key <= 16);key++)
+    {
+        rc = hashtable_uint32_find(&loaded, key, &data) && (data == 2 * key);
+    }
+    rc = rc && hashtable_uint32_insert(&loaded, 100, 200);
+    if ((loaded.__storage == HASHTABLE_STORAGE_FILE))
+    {
+        hashtable_close(&loaded);
+    }
+    memset(&loaded, 0, sizeof(loaded));
+    loaded.name = "hash_loaded";
+    rc = rc && hashtable_uint32_load_mmap(&loaded, path) && hashtable_uint32_find(&loaded, 100, &data) && (data == 200);
+    if ((loaded.__storage == HASHTABLE_STORAGE_FILE))
+    {
+        hashtable_close(&loaded);
+    }
+    rc = rc && !hashtable_soa_load_mmap(&other, path);
+    /* The same layout with another inlined hash does not find the saved keys */
+    hashtable_t inlined = {"hash_inlined"};
+    rc = rc && !hashtable_tmpl_load_mmap(&inlined, path);
+    unlink(path);
+    if (!rc)
+    {
+        linux_log(LINUX_LOG_ERROR, "Failed to load the table from %s", path);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * The filter rejects the missing keys, an overwrite does not count the key twice,
+ * the counters are back to zero when the table is empty
+ */
+static int filter_access()
+{
+    hashtable_stat_t stat;
+    uint32_t data;
+    int rc = 1;
+    for (uint32_t key = 1;rc && (key <= 16);key++)
+    {
+        rc = hashtable_bloom_insert(&hashtable_bloom, key, key) && hashtable_bloom_insert(&hashtable_bloom, key, key);
+    }
+    for (uint32_t key = 1;rc && (key <= 16);key++)
+    {
+        rc = hashtable_bloom_find(&hashtable_bloom, key, &data) && (data == key);
+    }
+    for (uint32_t key = 17;rc && (key <= 1000);key++)
+    {
+        rc = !hashtable_bloom_find(&hashtable_bloom, key, &data) && !hashtable_bloom_remove(&hashtable_bloom, key, NULL);
+    }
+    hashtable_stat_get(&hashtable_bloom, &stat);
+    for (uint32_t key = 1;rc && (key <= 16);key++)
+    {
+        rc = hashtable_bloom_remove(&hashtable_bloom, key, NULL);
+    }
+    for (size_t i = 0;rc && (i < hashtable_bloom.__filter_size);i++)
+    {
+        rc = (hashtable_bloom.__filter[i] == 0);
+    }
+    /* Most of the 2*984 lookups do not reach the table */
+    if (!rc || (stat.filtered < 1500) || ((stat.search_err + stat.remove_err) != 2 * 984))
+    {
+        linux_log(LINUX_LOG_ERROR, "Filter failed, filtered %lu lookups", stat.filtered);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * The set keeps a key once, the window of max_tries slots fills up
+ */
+static int hashset_access()
+{
+    int rc = hashtable_set_add(&hashset, 7) && hashtable_set_add(&hashset, 7) && hashtable_set_contains(&hashset, 7);
+    rc = rc && !hashtable_set_contains(&hashset, 8) && (hashset.__memory_size == sizeof(uint32_t) * (HASHTABLE_SIZE + 4));
+    for (int i = 0;rc && (i < 4);i++)
+    {
+        rc = hashtable_set_add(&hashset, get_value_collision(i));
+    }
+    rc = rc && !hashtable_set_add(&hashset, get_value_collision(4));
+    for (int i = 0;rc && (i < 4);i++)
+    {
+        rc = hashtable_set_remove(&hashset, get_value_collision(i)) && !hashtable_set_contains(&hashset, get_value_collision(i));
+    }
+    rc = rc && hashtable_set_remove(&hashset, 7) && !hashtable_set_remove(&hashset, 7) && !hashtable_set_contains(&hashset, 7);
+    if (!rc)
+    {
+        linux_log(LINUX_LOG_ERROR, "Set %s failed", hashset.name);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * The template table and the C declaration with the same hash share the slots,
+ * the window of 4 slots fills up, the empty slot ~0 is not zeroed memory
+ */
+static int template_access()
+{
+    lockfree::HashTable<uint32_t, uint32_t, 4, lockfree::HashMurmur3, HASHTABLE_BITS> table("hash_template");
+    lockfree::HashTable<uint32_t, uint32_t, 4, lockfree::HashNone, HASHTABLE_BITS> collisions("hash_template_none", ~0u);
+    hashtable_stat_t stat;
+    uint32_t data = 0;
+    int rc = table.valid() && collisions.valid() && (table.table()->__storage == HASHTABLE_STORAGE_ZEROED);
+    for (uint32_t key = 1;rc && (key <= 16);key++)
+    {
+        rc = table.insert(key, 2 * key);
+    }
+    rc = rc && table.insert(3, 30) && table.find(3, &data) && (data == 30);
+    rc = rc && hashtable_tmpl_find(table.table(), 5, &data) && (data == 10);
+    rc = rc && hashtable_tmpl_insert(table.table(), 100, 200) && table.find(100, &data) && (data == 200);
+    rc = rc && table.remove(3, &data) && (data == 30) && !table.find(3, &data) && !hashtable_tmpl_find(table.table(), 3, &data);
+    for (int i = 0;rc && (i < 4);i++)
+    {
+        rc = collisions.insert(get_value_collision(i), i);
+    }
+    rc = rc && !collisions.insert(get_value_collision(4), 4) && collisions.remove(get_value_collision(0));
+    rc = rc && collisions.insert(0, 7) && collisions.find(0, &data) && (data == 7);
+    rc = rc && !collisions.insert(get_value_collision(4), 4);
+    hashtable_stat_get(collisions.table(), &stat);
+    if (!rc || (stat.insert_err != 2) || (table.table()->hashfunction != hash_murmur3))
+    {
+        linux_log(LINUX_LOG_ERROR, "Template table failed, insert errors %lu", stat.insert_err);
+        return 0;
+    }
+    return 1;
+}
+
+#define ORDERING_ROUNDS 2000
+
+static hashtable_t hashtable_ordering = {"hash_ordering", HASHTABLE_BITS, hash_none};
+static volatile int ordering_failed;
+
+/**
+ * A reader finds the keys of both sets, the data is the data of the key or the
+ * illegal data of a free slot, never the data of the previous key of the slot
+ */
+static int ordering_reader(void *thread_arg)
+{
+    for (uint32_t key = 1;key < (2 * HASHTABLE_SIZE);key++)
+    {
+        uint32_t data;
+        if (hashtable_uint32_find(&hashtable_ordering, key, &data) && (data != 0) && (data != ~key))
+        {
+            ordering_failed = 1;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * The writer inserts and removes the keys k and k + HASHTABLE_SIZE in turns, the keys
+ * of the two sets share the slots, the readers run on the other CPUs
+ * HASHTABLE_ACQUIRE_RELEASE=1 (make test) checks the release stores of remove
+ */
+static int ordering_access(int cpus)
+{
+    linux_task_state_t *states = (linux_task_state_t*)calloc(cpus + 1, sizeof(linux_task_state_t));
+    int rc = hashtable_uint32_init(&hashtable_ordering);
+    for (int i = 0;(i < cpus) && rc;i++)
+    {
+        states[i].properties.name = "ordering";
+        states[i].properties.task = ordering_reader;
+        rc = linux_thread_start(&states[i]);
+    }
+    for (uint32_t round = 0;rc && !ordering_failed && (round < ORDERING_ROUNDS);round++)
+    {
+        const uint32_t base = (round & 1) * HASHTABLE_SIZE;
+        for (uint32_t key = base + 1;rc && (key < (base + HASHTABLE_SIZE));key++)
+        {
+            rc = hashtable_uint32_insert(&hashtable_ordering, key, ~key);
+        }
+        for (uint32_t key = base + 1;rc && (key < (base + HASHTABLE_SIZE));key++)
+        {
+            rc = hashtable_uint32_remove(&hashtable_ordering, key, NULL);
+        }
+    }
+    linux_thread_exit_all(states);
+    linux_thread_join_all(states);
+    free(states);
+    if (hashtable_ordering.__table)
+    {
+        hashtable_close(&hashtable_ordering);
+    }
+    if (!rc || ordering_failed)
+    {
+        linux_log(LINUX_LOG_ERROR, "Ordering failed, acquire/release %d, readers %s", HASHTABLE_ACQUIRE_RELEASE,
+                ordering_failed ? "got the data of another key" : "ok");
+        return 0;
+    }
+    return 1;
+}
+
+#define TAGGED_KEYS 6
+#define TAGGED_PASSES 20000
+
+static hashtable_t hashtable_tagged = {"hash_tagged", HASHTABLE_BITS, hash_none};
+
+/**
+ * All workers insert, find and remove the same keys, the keys share the probe window
+ * The data of a key is the key and the worker
+ */
+static int tagged_writer(void *task_arg, linux_pool_worker_t *worker)
+{
+    const uint32_t thread = (uint32_t)worker->index;
+    uint32_t random = (uint32_t)worker->counters.ops * 2654435761u + thread;
+    if (worker->counters.ops >= TAGGED_PASSES)
+    {
+        return 0;
+    }
+    for (uint32_t k = 1;k <= TAGGED_KEYS;k++)
+    {
+        const uint32_t key = get_value_collision(k);
+        uint32_t data;
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        if (random & 1)
+        {
+            /* Another worker writes the data of the key, the data is not written */
+            while (!hashtable_tagged_insert(&hashtable_tagged, key, key + thread))
+            {
+                HASHTABLE_RELAX();
+            }
+        }
+        else if (hashtable_tagged_remove(&hashtable_tagged, key, &data))
+        {
+            worker->counters.errors += ((data & ~0xffu) != key);
+        }
+        if (hashtable_tagged_find(&hashtable_tagged, key, &data))
+        {
+            worker->counters.errors += ((data & ~0xffu) != key);
+        }
+    }
+    worker->counters.ops++;
+    return 1;
+}
+
+/**
+ * Any context inserts and removes a key: the data of a key is never the data of
+ * another key, a key is in one slot when the workers are done
+ */
+static int tagged_access(int cpus)
+{
+    const hashtable_tagged_tagged_slot_t *slots = (const hashtable_tagged_tagged_slot_t *)hashtable_tagged.__table;
+    linux_pool_t pool = {"tagged", tagged_writer, NULL, cpus, -1};
+    linux_pool_counters_t total = {};
+    uint32_t data = 0;
+    int rc = (hashtable_tagged_insert(&hashtable_tagged, 1, 10) == 1) && (hashtable_tagged_insert(&hashtable_tagged, 1, 11) == 1);
+    rc = rc && hashtable_tagged_find(&hashtable_tagged, 1, &data) && (data == 11);
+    rc = rc && hashtable_tagged_remove(&hashtable_tagged, 1, &data) && (data == 11);
+    rc = rc && !hashtable_tagged_find(&hashtable_tagged, 1, &data) && !hashtable_tagged_remove(&hashtable_tagged, 1, NULL);
+    for (int i = 0;rc && (i < 8);i++)
+    {
+        rc = (hashtable_tagged_insert(&hashtable_tagged, get_value_collision(i), i) == 1);
+    }
+    rc = rc && (hashtable_tagged_insert(&hashtable_tagged, get_value_collision(8), 8) == 0);
+    for (int i = 0;rc && (i < 8);i++)
+    {
+        rc = hashtable_tagged_remove(&hashtable_tagged, get_value_collision(i), NULL);
+    }
+    if (rc && linux_pool_init(&pool))
+    {
+        linux_pool_start(&pool);
+        rc = linux_pool_join(&pool);
+        linux_pool_counters(&pool, &total);
+        linux_pool_close(&pool);
+    }
+    for (uint32_t k = 1;rc && (k <= TAGGED_KEYS);k++)
+    {
+        int copies = 0;
+        for (int i = 0;i < 8;i++)
+        {
+            copies += (HASHTABLE_TAG_KEY(slots[i].tag) == get_value_collision(k));
+            rc = rc && (HASHTABLE_TAG_STATE(slots[i].tag) == HASHTABLE_TAG_STABLE);
+        }
+        rc = rc && (copies <= 1);
+    }
+    if (!rc || total.errors || (total.ops != (uint64_t)cpus * TAGGED_PASSES))
+    {
+        linux_log(LINUX_LOG_ERROR, "Tagged table failed, passes %lu, data of another key %lu", total.ops, total.errors);
+        return 0;
+    }
+    return 1;
+}
+
+static volatile int tagged_writing;
+static volatile int tagged_busy;
+
+/**
+ * Worker 0 writes the data of the key 1 the way an insert does and stalls in the
+ * WRITING state until the insert of worker 1 returns
+ */
+static int tagged_stall_worker(void *task_arg, linux_pool_worker_t *worker)
+{
+    hashtable_tagged_tagged_slot_t *slot = (hashtable_tagged_tagged_slot_t *)task_arg;
+    if (worker->index == 0)
+    {
+        const uint64_t tag = slot->tag;
+        slot->tag = tag + HASHTABLE_TAG(HASHTABLE_TAG_WRITING, 0);
+        tagged_writing = 1;
+        while (!tagged_busy)
+        {
+            linux_ms_sleep(1);
+        }
+        slot->data = 20;
+        HASHTABLE_STORE_RELEASE(&slot->tag, HASHTABLE_TAG(HASHTABLE_TAG_NEXT(tag), HASHTABLE_TAG_KEY(tag)));
+    }
+    else
+    {
+        while (!tagged_writing)
+        {
+            HASHTABLE_RELAX();
+        }
+        worker->counters.errors += (hashtable_tagged_insert(&hashtable_tagged, 1, 21) != 0);
+        tagged_busy = 1;
+    }
+    return 0;
+}
+
+/**
+ * An insert of a key which another context writes does not wait for the stalled
+ * writer, the insert fails and counts insert_busy. The insert after the write overwrites
+ * the data
+ */
+static int tagged_stall_access()
+{
+    hashtable_tagged_tagged_slot_t *slots = hashtable_tagged_window(&hashtable_tagged, 1);
+    linux_pool_counters_t total = {};
+    hashtable_stat_t before, after;
+    uint32_t data = 0;
+    int i = 0;
+    int rc = (hashtable_tagged_insert(&hashtable_tagged, 1, 10) == 1);
+    hashtable_stat_get(&hashtable_tagged, &before);
+    while (rc && (HASHTABLE_TAG_KEY(slots[i].tag) != 1))
+    {
+        i++;
+    }
+    linux_pool_t pool = {"tagged_stall", tagged_stall_worker, &slots[i], 2, -1};
+    if (rc && linux_pool_init(&pool))
+    {
+        linux_pool_start(&pool);
+        rc = linux_pool_join(&pool);
+        linux_pool_counters(&pool, &total);
+        linux_pool_close(&pool);
+    }
+    hashtable_stat_get(&hashtable_tagged, &after);
+    rc = rc && ((after.insert_busy - before.insert_busy) == 1) && (after.insert_err == before.insert_err);
+    rc = rc && hashtable_tagged_find(&hashtable_tagged, 1, &data) && (data == 20);
+    rc = rc && (hashtable_tagged_insert(&hashtable_tagged, 1, 22) == 1);
+    rc = rc && hashtable_tagged_find(&hashtable_tagged, 1, &data) && (data == 22);
+    rc = rc && hashtable_tagged_remove(&hashtable_tagged, 1, NULL);
+    if (!rc || total.errors)
+    {
+        linux_log(LINUX_LOG_ERROR, "Tagged insert waited for the stalled writer, data %u", data);
+        return 0;
+    }
+    return 1;
+}
+
+static hashtable_t hashtable_claim = {"hash_claim", HASHTABLE_BITS, hash_none};
+/* 1 - the stalled claimer, 2 - the winner */
+static __thread int tagged_claim_role;
+static volatile int tagged_claim_stage;
+
+static void tagged_claim_wait(int stage)
+{
+    while (tagged_claim_stage < stage)
+    {
+        linux_ms_sleep(1);
+    }
+}
+
+/**
+ * The claimer scans the window, the winner scans the window, the claimer claims a slot
+ * and stalls before the write of the data, the winner claims a lower slot
+ */
+static void tagged_hook(int stage)
+{
+    if ((tagged_claim_role == 1) && (stage == 0))
+    {
+        tagged_claim_stage = 1;
+        tagged_claim_wait(2);
+    }
+    else if ((tagged_claim_role == 1) && (stage == 1))
+    {
+        tagged_claim_stage = 3;
+        tagged_claim_wait(4);
+        tagged_claim_role = 0;
+    }
+    else if ((tagged_claim_role == 2) && (stage == 0))
+    {
+        tagged_claim_stage = 2;
+        tagged_claim_wait(3);
+    }
+}
+
+/**
+ * Worker 0 inserts the key 2 and stalls after the claim of the slot 1. Worker 1 frees
+ * the slot 0, inserts the key 2 to the slot 0 and the key 3 while worker 0 stalls
+ */
+static int tagged_claim_worker(void *task_arg, linux_pool_worker_t *worker)
+{
+    const uint32_t key = get_value_collision(2), other = get_value_collision(3);
+    if (worker->index == 0)
+    {
+        tagged_claim_role = 1;
+        worker->counters.errors += (hashtable_tagged_insert(&hashtable_claim, key, key + 1) != 1);
+    }
+    else
+    {
+        tagged_claim_wait(1);
+        worker->counters.errors += !hashtable_tagged_remove(&hashtable_claim, get_value_collision(1), NULL);
+        tagged_claim_role = 2;
+        worker->counters.errors += (hashtable_tagged_insert(&hashtable_claim, key, key + 2) != 1);
+        tagged_claim_role = 0;
+        worker->counters.errors += (hashtable_tagged_insert(&hashtable_claim, other, other + 3) != 1);
+        tagged_claim_stage = 4;
+    }
+    return 0;
+}
+
+/**
+ * The winner of two claims of a key does not free the slot of the loser, the loser
+ * writes the data there. The key 3 keeps its data, the key 2 is in one slot
+ */
+static int tagged_claim_access()
+{
+    const uint32_t key = get_value_collision(2), other = get_value_collision(3);
+    linux_pool_t pool = {"tagged_claim", tagged_claim_worker, NULL, 2, -1};
+    linux_pool_counters_t total = {};
+    uint32_t data = 0, other_data = 0;
+    int copies = 0;
+    int rc = hashtable_tagged_init(&hashtable_claim);
+    rc = rc && (hashtable_tagged_insert(&hashtable_claim, get_value_collision(1), 1) == 1);
+    if (rc && linux_pool_init(&pool))
+    {
+        linux_pool_start(&pool);
+        rc = linux_pool_join(&pool);
+        linux_pool_counters(&pool, &total);
+        linux_pool_close(&pool);
+    }
+    rc = rc && hashtable_tagged_find(&hashtable_claim, other, &other_data) && (other_data == other + 3);
+    rc = rc && hashtable_tagged_find(&hashtable_claim, key, &data) && (data == key + 1);
+    for (int i = 0;rc && (i < 8);i++)
+    {
+        const hashtable_tagged_tagged_slot_t *slot = (const hashtable_tagged_tagged_slot_t *)hashtable_claim.__table + i;
+        copies += (HASHTABLE_TAG_KEY(slot->tag) == key);
+        rc = (HASHTABLE_TAG_STATE(slot->tag) == HASHTABLE_TAG_STABLE);
+    }
+    if (hashtable_claim.__table)
+    {
+        hashtable_close(&hashtable_claim);
+    }
+    if (!rc || total.errors || (copies != 1))
+    {
+        linux_log(LINUX_LOG_ERROR, "Tagged claim failed, data %x of %x, data %x of %x, copies %d",
+            data, key, other_data, other, copies);
+        return 0;
+    }
+    return 1;
+}
+
+#define POOL_ROUNDS 1000
+
+/**
+ * A worker runs on its CPU, the counters of a worker are on its own cache line
+ */
+static int pool_worker(void *task_arg, linux_pool_worker_t *worker)
+{
+    if (worker->counters.ops >= POOL_ROUNDS)
+    {
+        return 0;
+    }
+    worker->counters.errors += ((worker->cpu >= 0) && (sched_getcpu() != worker->cpu));
+    worker->counters.ops++;
+    return 1;
+}
+
+/**
+ * More workers than the CPUs of the process, and the workers of the NUMA node 0
+ */
+static int pool_access()
+{
+    const int threads = linux_get_number_processors() + 1;
+    cpu_set_t cpus;
+    for (int node = -1;node < ((linux_get_node_cpus(0, &cpus) > 0) ? 1 : 0);node++)
+    {
+        linux_pool_t pool = {"pool", pool_worker, NULL, threads, node};
+        linux_pool_counters_t total;
+        if (!linux_pool_init(&pool))
+        {
+            return 0;
+        }
+        linux_pool_start(&pool);
+        int rc = linux_pool_join(&pool);
+        linux_pool_counters(&pool, &total);
+        rc = rc && ((((uintptr_t)&pool.workers[1].counters) % LINUX_CACHE_LINE) == 0);
+        linux_pool_close(&pool);
+        if (!rc || total.errors || (total.ops != (uint64_t)threads * POOL_ROUNDS))
+        {
+            linux_log(LINUX_LOG_ERROR, "Pool of node %d failed, ops %lu, wrong CPU %lu", node, total.ops, total.errors);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * The pool of 4 objects runs out, remove returns the object to the pool. An update
+ * needs a free object: a reader which found the object before the update keeps the
+ * old object intact, the table points to the new copy
+ */
+static int pooled_access()
+{
+    syscall_context_t context = {};
+    int rc;
+    for (uint32_t key = 1;key <= (pool.count + 1);key++)
+    {
+        context.timestamp = 1000 * key;
+        context.fd = key;
+        rc = hashtable_pooled_insert_object(&hashtable_pooled, &pool, key, &context);
+        if (rc != (key <= pool.count))
+        {
+            linux_log(LINUX_LOG_ERROR, "Pooled insert of entry %u returned %d", key, rc);
+            return 0;
+        }
+    }
+    const syscall_context_t *old = hashtable_pooled_find_object(&hashtable_pooled, &pool, 2);
+    const syscall_context_t before = *old;
+    context.flags = 1;
+    rc = !hashtable_pooled_insert_object(&hashtable_pooled, &pool, 2, &context);
+    rc = rc && hashtable_pooled_remove_object(&hashtable_pooled, &pool, 1, &context) && (context.fd == 1);
+    context.fd = 2;
+    context.flags = 1;
+    rc = rc && hashtable_pooled_insert_object(&hashtable_pooled, &pool, 2, &context);
+    const syscall_context_t *found = hashtable_pooled_find_object(&hashtable_pooled, &pool, 2);
+    if (!rc || !found || (found == old) || memcmp(old, &before, sizeof(before)) || (found->flags != 1) ||
+        (found->fd != 2) || hashtable_pooled_find_object(&hashtable_pooled, &pool, 1))
+    {
+        linux_log(LINUX_LOG_ERROR, "Pooled table failed to update the objects");
+        return 0;
+    }
+    /* The object of the previous version of the key 2 is free */
+    context.fd = pool.count + 1;
+    rc = hashtable_pooled_insert_object(&hashtable_pooled, &pool, pool.count + 1, &context);
+    if (!rc || (hashtable_pooled_find_object(&hashtable_pooled, &pool, pool.count + 1) != old))
+    {
+        linux_log(LINUX_LOG_ERROR, "Pooled table did not return the old object to the pool");
+        return 0;
+    }
+    for (uint32_t key = 2;key <= (pool.count + 1);key++)
+    {
+        if (!hashtable_pooled_remove_object(&hashtable_pooled, &pool, key, NULL))
+        {
+            linux_log(LINUX_LOG_ERROR, "Pooled table failed to remove entry %u", key);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Two keys with the same home slot, the first key is removed, the insert of the
+ * second key updates the key in place and does not take the home slot. The LINEAR
+ * table keeps a single copy of the key
+ */
+static int single_copy_access()
+{
+    const uint32_t key1 = 5;
+    const uint32_t key2 = key1 + HASHTABLE_SIZE;
+    hashtable_stat_t before, after;
+    uint64_t data;
+    uint32_t data32;
+    int rc;
+    hashtable_stat_get(&hashtable, &before);
+    rc = hashtable_uint32_insert(&hashtable, key1, 1) && hashtable_uint32_insert(&hashtable, key2, 2);
+    rc = rc && hashtable_uint32_remove(&hashtable, key1, NULL) && hashtable_uint32_insert(&hashtable, key2, 3);
+    rc = rc && hashtable_uint32_remove(&hashtable, key2, &data32) && (data32 == 3);
+    rc = rc && !hashtable_uint32_find(&hashtable, key2, &data32);
+    hashtable_stat_get(&hashtable, &after);
+    if (!rc || (after.relocated != before.relocated) || ((after.overwritten - before.overwritten) != 1))
+    {
+        linux_log(LINUX_LOG_ERROR, "Two copies of the entry %u", key2);
+        return 0;
+    }
+    rc = hashtable_soa_insert(&hashtable_soa, key1, 1) && hashtable_soa_insert(&hashtable_soa, key2, 2);
+    rc = rc && hashtable_soa_remove(&hashtable_soa, key1, NULL) && hashtable_soa_insert(&hashtable_soa, key2, 3);
+    rc = rc && hashtable_soa_remove(&hashtable_soa, key2, &data) && (data == 3);
+    rc = rc && !hashtable_soa_find(&hashtable_soa, key2, &data);
+    if (!rc)
+    {
+        linux_log(LINUX_LOG_ERROR, "Two copies of the entry %u in the SOA table", key2);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * The keys 2..10 are not updated for 3 epochs and expire, the key 1 is updated
+ * in the epoch 2. The expiry and the remove reset the data of the slot, the tombstone
+ * key (uint32_t)-1 is not accepted
+ */
+static int expire_access()
+{
+    const uint32_t ttl = 2;
+    uint32_t data;
+    size_t expired;
+    int rc = 1;
+    for (uint32_t key = 1;key <= 10;key++)
+    {
+        rc = rc && hashtable_ttl_insert(&hashtable_ttl, key, key);
+    }
+    hashtable_expire_tick(&hashtable_ttl);
+    hashtable_expire_tick(&hashtable_ttl);
+    rc = rc && hashtable_ttl_insert(&hashtable_ttl, 1, 100) && hashtable_ttl_insert(&hashtable_ttl, 11, 11);
+    hashtable_expire_tick(&hashtable_ttl);
+    /* Two calls complete a pass over the table */
+    expired = hashtable_ttl_expire(&hashtable_ttl, ttl, HASHTABLE_SIZE / 2);
+    expired += hashtable_ttl_expire(&hashtable_ttl, ttl, HASHTABLE_SIZE / 2 + 4);
+    rc = rc && (expired == 9);
+    rc = rc && hashtable_ttl_find(&hashtable_ttl, 1, &data) && (data == 100);
+    rc = rc && !hashtable_ttl_find(&hashtable_ttl, 2, &data) && !hashtable_ttl_remove(&hashtable_ttl, 10, NULL);
+    rc = rc && hashtable_ttl_remove(&hashtable_ttl, 1, NULL) && hashtable_ttl_remove(&hashtable_ttl, 11, NULL);
+    for (uint32_t key = 1;key <= 11;key++)
+    {
+        rc = rc && (*hashtable_ttl_data_addr(hashtable_ttl.__table, hashtable_ttl.__size, key) == 0);
+    }
+    rc = rc && !hashtable_ttl_insert(&hashtable_ttl, (uint32_t)-1, 1) && !hashtable_ttl_find(&hashtable_ttl, (uint32_t)-1, &data);
+    if (!rc)
+    {
+        linux_log(LINUX_LOG_ERROR, "Expired %zu entries", expired);
+        return 0;
+    }
+    return 1;
+}
+
+#define EXPIRE_ROUNDS 20000
+#define EXPIRE_TTL 2
+
+/**
+ * The worker 0 advances the epoch, every free slot of the table is stale, and inserts,
+ * finds and removes a key in the same epoch. The worker 1 expires the table at the same
+ * time and should never see the new key with the stale epoch of the slot
+ */
+static int expire_race_worker(void *task_arg, linux_pool_worker_t *worker)
+{
+    volatile int *done = (volatile int *)task_arg;
+    if (worker->index)
+    {
+        if (*done)
+        {
+            return 0;
+        }
+        worker->counters.errors += hashtable_ttl_expire(&hashtable_ttl, EXPIRE_TTL, HASHTABLE_SIZE + 4);
+        worker->counters.ops++;
+        return 1;
+    }
+    if (worker->counters.ops >= EXPIRE_ROUNDS)
+    {
+        *done = 1;
+        return 0;
+    }
+    const uint32_t key = get_value_collision(worker->counters.ops % 4);
+    uint32_t data;
+    for (int i = 0;i < EXPIRE_TTL;i++)
+    {
+        hashtable_expire_tick(&hashtable_ttl);
+    }
+    worker->counters.errors += !hashtable_ttl_insert(&hashtable_ttl, key, key);
+    worker->counters.errors += !hashtable_ttl_find(&hashtable_ttl, key, &data) || (data != key);
+    worker->counters.errors += !hashtable_ttl_remove(&hashtable_ttl, key, NULL);
+    worker->counters.ops++;
+    return 1;
+}
+
+static int expire_race_access()
+{
+    const uint32_t key = 7;
+    volatile uint32_t *slot_key = hashtable_ttl_key_addr(hashtable_ttl.__table, hashtable_ttl.__size, key);
+    volatile int done = 0;
+    linux_pool_t pool = {"expire", expire_race_worker, (void *)&done, 2, -1};
+    linux_pool_counters_t total = {};
+    /* The key is visible with the epoch of the insert before the insert returns */
+    for (int i = 0;i < EXPIRE_TTL;i++)
+    {
+        hashtable_expire_tick(&hashtable_ttl);
+    }
+    int rc = (hashtable_ttl_claim(&hashtable_ttl, slot_key, key, key) == 0);
+    rc = rc && (hashtable_ttl.__epochs[key] == hashtable_ttl.__epoch);
+    rc = rc && !hashtable_ttl_expire(&hashtable_ttl, EXPIRE_TTL, HASHTABLE_SIZE + 4);
+    rc = rc && hashtable_ttl_remove(&hashtable_ttl, key, NULL);
+    if (!rc)
+    {
+        linux_log(LINUX_LOG_ERROR, "The slot of entry %u is not stamped before the key", key);
+        return 0;
+    }
+    rc = linux_pool_init(&pool);
+    if (rc)
+    {
+        linux_pool_start(&pool);
+        rc = linux_pool_join(&pool);
+        linux_pool_counters(&pool, &total);
+        linux_pool_close(&pool);
+    }
+    if (!rc || total.errors)
+    {
+        linux_log(LINUX_LOG_ERROR, "Expiry removed %lu new entries", total.errors);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * The keys 1 and 17 map to the same slot of the task-local tier, the key 17 spills
+ * to the shared table and stays there until the remove. The slot records the spilled
+ * key, a remove of a key which did not spill does not touch the shared table. A find
+ * in another shard finds the key in the shard of the owner
+ */
+static int local_access()
+{
+    hashtable_stat_t before, after;
+    uint32_t data;
+    int rc;
+    const int shard = hashtable_local_shard_get();
+    const hashtable_uint32_local_slot_t *slot = hashtable_uint32_local_slot(&local_tier, shard, hashtable_uint32_hash(&hashtable, 1));
+    hashtable_stat_get(&hashtable, &before);
+    rc = hashtable_uint32_local_insert(&hashtable, &local_tier, 1, 10) && hashtable_uint32_local_insert(&hashtable, &local_tier, 17, 170);
+    rc = rc && hashtable_uint32_local_insert(&hashtable, &local_tier, 1, 11);
+    rc = rc && hashtable_uint32_local_find(&hashtable, &local_tier, 1, &data) && (data == 11);
+    rc = rc && hashtable_uint32_find(&hashtable, 17, &data) && (data == 170) && !hashtable_uint32_find(&hashtable, 1, &data);
+    rc = rc && (HASHTABLE_LOCAL_SPILLED(slot->spilled) == 1) && (slot->spill == 17);
+    rc = rc && hashtable_uint32_local_remove(&hashtable, &local_tier, 1, NULL);
+    rc = rc && hashtable_uint32_local_insert(&hashtable, &local_tier, 17, 171) && (slot->key == 0);
+    rc = rc && hashtable_uint32_local_find(&hashtable, &local_tier, 17, &data) && (data == 171);
+    rc = rc && hashtable_uint32_local_insert(&hashtable, &local_tier, 1, 12) && (slot->key == 1);
+    rc = rc && !hashtable_uint32_find(&hashtable, 1, &data);
+    /* Another context misses its shard and the shared table */
+    hashtable_local_shard = (shard + 1) % HASHTABLE_LOCAL_SHARDS;
+    rc = rc && hashtable_uint32_local_find(&hashtable, &local_tier, 1, &data) && (data == 12);
+    hashtable_local_shard = shard;
+    rc = rc && hashtable_uint32_local_remove(&hashtable, &local_tier, 17, &data) && (data == 171);
+    rc = rc && (HASHTABLE_LOCAL_SPILLED(slot->spilled) == 0) && (slot->spill == 0) && !hashtable_uint32_find(&hashtable, 17, &data);
+    rc = rc && !hashtable_uint32_local_remove(&hashtable, &local_tier, 5, NULL);
+    rc = rc && hashtable_uint32_local_remove(&hashtable, &local_tier, 1, &data) && (data == 12);
+    rc = rc && !hashtable_uint32_local_find(&hashtable, &local_tier, 1, &data);
+    hashtable_stat_get(&hashtable, &after);
+    if (!rc || ((after.local - before.local) != 7) || ((after.remove - before.remove) != 1) ||
+        (after.remove_err != before.remove_err))
+    {
+        linux_log(LINUX_LOG_ERROR, "Task-local tier failed, %lu local operations, %lu removes",
+            after.local - before.local, after.remove - before.remove);
+        return 0;
+    }
+    return 1;
+}
+
+#define LOCAL_SPILL_ROUNDS 200000
+
+/**
+ * Two workers share the shard 0, the slot of the keys 33 and 49 is taken by the key 1
+ * and both keys spill at the same time. The record of the spilled key of one worker
+ * should never hide the spilled key of the other
+ */
+static int local_spill_worker(void *task_arg, linux_pool_worker_t *worker)
+{
+    const uint32_t key = 33 + 16 * worker->index;
+    uint32_t data;
+    (void)task_arg;
+    if (worker->counters.ops >= LOCAL_SPILL_ROUNDS)
+    {
+        return 0;
+    }
+    hashtable_local_shard = 0;
+    worker->counters.errors += !hashtable_uint32_local_insert(&hashtable, &local_tier, key, key);
+    worker->counters.errors += !hashtable_uint32_local_find(&hashtable, &local_tier, key, &data) || (data != key);
+    worker->counters.errors += !hashtable_uint32_local_remove(&hashtable, &local_tier, key, NULL);
+    worker->counters.ops++;
+    return 1;
+}
+
+static int local_spill_access()
+{
+    const int shard = hashtable_local_shard_get();
+    const hashtable_uint32_local_slot_t *slot = hashtable_uint32_local_slot(&local_tier, 0, hashtable_uint32_hash(&hashtable, 1));
+    linux_pool_t pool = {"local_spill", local_spill_worker, NULL, 2, -1};
+    linux_pool_counters_t total = {};
+    hashtable_local_shard = 0;
+    int rc = hashtable_uint32_local_insert(&hashtable, &local_tier, 1, 1) && (slot->key == 1);
+    rc = rc && linux_pool_init(&pool);
+    if (rc)
+    {
+        linux_pool_start(&pool);
+        rc = linux_pool_join(&pool);
+        linux_pool_counters(&pool, &total);
+        linux_pool_close(&pool);
+    }
+    rc = rc && (HASHTABLE_LOCAL_SPILLED(slot->spilled) == 0) && hashtable_uint32_local_remove(&hashtable, &local_tier, 1, NULL);
+    hashtable_local_shard = shard;
+    if (!rc || total.errors)
+    {
+        linux_log(LINUX_LOG_ERROR, "Spilled keys of the shared shard failed, %lu errors, %u spilled", total.errors,
+                HASHTABLE_LOCAL_SPILLED(slot->spilled));
+        return 0;
+    }
+    return 1;
+}
+
+static uint32_t atomic_double(uint32_t data)
+{
+    return 2 * data;
+}
+
+/**
+ * Count events per key with fetch_add(), the first call inserts the key
+ */
+static int atomic_access(int cpus)
+{
+    for (int i = 0;i < 3;i++)
+    {
+        for (uint32_t key = 1;key <= (uint32_t)cpus;key++)
+        {
+            uint32_t old = 0;
+            int rc = hashtable_uint32_fetch_add(&hashtable, key, key, &old);
+            if (!rc || (i && (old != (i * key))))
+            {
+                linux_log(LINUX_LOG_ERROR, "Failed to add to entry %u, old %u", key, old);
+                return 0;
+            }
+        }
+    }
+    for (uint32_t key = 1;key <= (uint32_t)cpus;key++)
+    {
+        uint32_t data;
+        int rc = hashtable_uint32_cas_data(&hashtable, key, key, 0);
+        if (rc)
+        {
+            linux_log(LINUX_LOG_ERROR, "Replaced unexpected data of entry %u", key);
+            return 0;
+        }
+        rc = hashtable_uint32_cas_data(&hashtable, key, 3 * key, key);
+        rc = rc && hashtable_uint32_update(&hashtable, key, atomic_double);
+        rc = rc && hashtable_uint32_remove(&hashtable, key, &data);
+        if (!rc || (data != (2 * key)))
+        {
+            linux_log(LINUX_LOG_ERROR, "Failed to update entry %u", key);
+            return 0;
+        }
+        rc = hashtable_uint32_update(&hashtable, key, atomic_double);
+        if (rc)
+        {
+            linux_log(LINUX_LOG_ERROR, "Updated removed entry %u", key);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static volatile int grow_reclaim_stage;
+
+static void grow_reclaim_wait(int stage)
+{
+    while (grow_reclaim_stage < stage)
+    {
+        linux_ms_sleep(1);
+    }
+}
+
+static int grow_reclaim_visit(uint32_t key, uint32_t data, void *ctx)
+{
+    if (grow_reclaim_stage == 0)
+    {
+        grow_reclaim_stage = 1;
+        grow_reclaim_wait(3);
+    }
+    return 1;
+}
+
+/**
+ * Worker 0 visits the keys and stalls in the read-side section, worker 1 completes
+ * the migration and reclaims the old generations
+ */
+static int grow_reclaim_worker(void *task_arg, linux_pool_worker_t *worker)
+{
+    if (worker->index == 0)
+    {
+        worker->counters.errors += !hashtable_grow_foreach(&hashtable_grow, grow_reclaim_visit, NULL);
+    }
+    else
+    {
+        grow_reclaim_wait(1);
+        grow_reclaim_stage = 2;
+        hashtable_grow_grow_check(&hashtable_grow);
+    }
+    return 0;
+}
+
+/**
+ * The old generations are not freed while a reader can see them
+ */
+static int grow_reclaim_access()
+{
+    const hashtable_resize_t *resize = hashtable_grow.__resize;
+    const size_t reclaimed = resize->reclaimed;
+    linux_pool_t pool = {"grow_reclaim", grow_reclaim_worker, NULL, 2, -1};
+    linux_pool_counters_t total = {};
+    int rc = 0;
+    if (linux_pool_init(&pool))
+    {
+        linux_pool_start(&pool);
+        grow_reclaim_wait(2);
+        linux_ms_sleep(20);
+        rc = (resize->reclaimed == reclaimed) && (resize->generation[reclaimed].table != NULL);
+        grow_reclaim_stage = 3;
+        rc = linux_pool_join(&pool) && rc;
+        linux_pool_counters(&pool, &total);
+        linux_pool_close(&pool);
+    }
+    if (!rc || total.errors || (resize->reclaimed != resize->newest) || (resize->reclaimed == reclaimed))
+    {
+        linux_log(LINUX_LOG_ERROR, "Growable table reclaimed %zu generations of %zu, errors %llu",
+                resize->reclaimed, resize->newest, (unsigned long long)total.errors);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Insert more keys than a 16 slots table can hold, find the keys while the
+ * table migrates to the next generation and after the migration
+ */
+static int grow_access()
+{
+    const uint32_t n = 1 << HASHTABLE_BITS;
+    uint32_t marker;
+    /* The markers of the slots are not keys */
+    if (hashtable_grow_insert(&hashtable_grow, (uint32_t)-1, 1) || hashtable_grow_insert(&hashtable_grow, (uint32_t)-2, 1) ||
+        hashtable_grow_find(&hashtable_grow, (uint32_t)-1, &marker) || hashtable_grow_remove(&hashtable_grow, (uint32_t)-2, NULL))
+    {
+        linux_log(LINUX_LOG_ERROR, "Growable table accepted a reserved key");
+        return 0;
+    }
+    for (uint32_t key = 1;key <= n;key++)
+    {
+        int rc = hashtable_grow_insert(&hashtable_grow, key, ~key);
+        if (!rc)
+        {
+            linux_log(LINUX_LOG_ERROR, "Growable table failed to insert entry %u", key);
+            return 0;
+        }
+        for (uint32_t k = 1;k <= key;k += 7)
+        {
+            uint32_t data;
+            rc = hashtable_grow_find(&hashtable_grow, k, &data);
+            if (!rc || (data != ~k))
+            {
+                linux_log(LINUX_LOG_ERROR, "Growable table failed to find entry %u", k);
+                return 0;
+            }
+        }
+    }
+    /* The slots are locked while the table migrates */
+    for (uint32_t key = 1;key <= n;key++)
+    {
+        uint32_t old;
+        int rc = hashtable_grow_fetch_add(&hashtable_grow, key, 1, &old);
+        if (!rc || (old != ~key))
+        {
+            linux_log(LINUX_LOG_ERROR, "Growable table failed to add to entry %u", key);
+            return 0;
+        }
+    }
+    if (!grow_reclaim_access())
+    {
+        return 0;
+    }
+    hashtable_scan_t scan = {};
+    while (!hashtable_grow_scan_stats(&hashtable_grow, &scan, 64));
+    static uint32_t snapshot_keys[1024];
+    size_t copied = hashtable_grow_snapshot(&hashtable_grow, snapshot_keys, NULL, ARRAY_SIZE(snapshot_keys));
+    if ((scan.live != n) || (copied != n))
+    {
+        linux_log(LINUX_LOG_ERROR, "Growable table scan found %zu entries, snapshot %zu", scan.live, copied);
+        return 0;
+    }
+    for (uint32_t key = 1;key <= n;key++)
+    {
+        uint32_t data;
+        int rc = hashtable_grow_remove(&hashtable_grow, key, &data);
+        if (!rc || (data != (~key + 1)))
+        {
+            linux_log(LINUX_LOG_ERROR, "Growable table failed to remove entry %u", key);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * The keys 40, 168, 296 and 424 share a probe window in both generations of the table,
+ * the key 552 takes a slot of the window in the new generation before the migration and
+ * one key gets stuck. The operations do not restart the pass until a key leaves the old
+ * generation
+ */
+static int stuck_access()
+{
+    static const uint32_t keys[] = {40, 168, 296, 424};
+    hashtable_resize_t *resize = hashtable_stuck.__resize;
+    uint32_t data;
+    int rc = 1;
+    for (size_t i = 0;i < ARRAY_SIZE(keys);i++)
+    {
+        rc = rc && hashtable_stuck_insert(&hashtable_stuck, keys[i], keys[i]);
+    }
+    rc = rc && hashtable_stuck_grow(&hashtable_stuck);
+    rc = rc && hashtable_stuck_insert(&hashtable_stuck, 552, 552);
+    rc = rc && !hashtable_stuck_insert(&hashtable_stuck, 680, 680);
+    if (!rc || !resize->stuck)
+    {
+        linux_log(LINUX_LOG_ERROR, "Expected keys stuck in the old generation, stuck %u", resize->stuck);
+        return 0;
+    }
+    const size_t next = resize->generation[resize->oldest].migrate_next;
+    for (int i = 0;i < 8;i++)
+    {
+        rc = rc && hashtable_stuck_find(&hashtable_stuck, keys[i % ARRAY_SIZE(keys)], &data);
+        rc = rc && !hashtable_stuck_remove(&hashtable_stuck, 1000 + i, NULL);
+    }
+    rc = rc && hashtable_stuck_remove(&hashtable_stuck, 552, NULL);
+    rc = rc && !hashtable_stuck_remove(&hashtable_stuck, 552, NULL);
+    if (!rc || !resize->stuck || (resize->generation[resize->oldest].migrate_next != next))
+    {
+        linux_log(LINUX_LOG_ERROR, "The stuck pass restarted without a departed key");
+        return 0;
+    }
+    rc = hashtable_stuck_remove(&hashtable_stuck, keys[3], NULL);
+    rc = rc && !hashtable_stuck_remove(&hashtable_stuck, 1000, NULL);
+    rc = rc && !hashtable_stuck_remove(&hashtable_stuck, 1001, NULL);
+    rc = rc && !hashtable_stuck_remove(&hashtable_stuck, 1002, NULL);
+    if (!rc || (resize->oldest != resize->newest))
+    {
+        linux_log(LINUX_LOG_ERROR, "The migration did not complete after a key left, oldest %zu, newest %zu",
+                resize->oldest, resize->newest);
+        return 0;
+    }
+    for (size_t i = 0;i < (ARRAY_SIZE(keys) - 1);i++)
+    {
+        rc = rc && hashtable_stuck_remove(&hashtable_stuck, keys[i], &data) && (data == keys[i]);
+    }
+    if (!rc)
+    {
+        linux_log(LINUX_LOG_ERROR, "Lost a key of the stuck migration");
+    }
+    return rc;
+}
+
+/**
+ * The machine readable dump contains the counters, a short buffer truncates
+ * the output
+ */
+static int export_access(char *buf, size_t len)
+{
+    int chars = hashtable_export(buf, len);
+    if ((chars <= 0) || !strstr(buf, "hash.Insert=") || !strstr(buf, "hash_grow.Search_ok="))
+    {
+        linux_log(LINUX_LOG_ERROR, "Failed to export the counters");
+        return 0;
+    }
+    chars = hashtable_show(buf, 64);
+    if ((chars > 64) || (strlen(buf) >= 64))
+    {
+        linux_log(LINUX_LOG_ERROR, "Show overflows the buffer, %d chars", chars);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * A reader maps the published page read only and finds the counters of the table
+ */
+static int stats_page_access()
+{
+    static const char path[] = "/tmp/hashtable_test_stats";
+    hashtable_stats_page_t copy;
+    hashtable_stat_t stat;
+    int found = 0;
+    if (!hashtable_stats_open(path))
+    {
+        linux_log(LINUX_LOG_ERROR, "Failed to open the stats page %s", path);
+        return 0;
+    }
+    hashtable_stats_publish();
+    int fd = open(path, O_RDONLY);
+    void *p = (fd >= 0) ? mmap(NULL, sizeof(copy), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if ((p != MAP_FAILED) && hashtable_stats_read((const hashtable_stats_page_t *)p, &copy))
+    {
+        hashtable_stat_get(&hashtable, &stat);
+        for (size_t i = 0;i < copy.tables;i++)
+        {
+            if (!strcmp(copy.table[i].name, hashtable.name))
+            {
+                found = (copy.table[i].stat.insert == stat.insert) && (copy.table[i].size == hashtable.__size);
+            }
+        }
+    }
+    if (hashtable_stats_open(path))
+    {
+        linux_log(LINUX_LOG_ERROR, "Opened the stats page %s twice", path);
+        found = 0;
+    }
+    hashtable_stats_close();
+    /* The reopened page replaces the file, the mapping of the reader stays valid */
+    if (!hashtable_stats_open(path))
+    {
+        linux_log(LINUX_LOG_ERROR, "Failed to reopen the stats page %s", path);
+        found = 0;
+    }
+    if ((p != MAP_FAILED) && !hashtable_stats_read((const hashtable_stats_page_t *)p, &copy))
+    {
+        linux_log(LINUX_LOG_ERROR, "Failed to read the stats page %s after the reopen", path);
+        found = 0;
+    }
+    if (p != MAP_FAILED)
+    {
+        munmap(p, sizeof(copy));
+    }
+    hashtable_stats_close();
+    unlink(path);
+    if (!found)
+    {
+        linux_log(LINUX_LOG_ERROR, "Failed to read the counters of %s from the stats page", hashtable.name);
+        return 0;
+    }
+    return 1;
+}
+
+typedef struct
+{
+    uint32_t producer;
+    uint32_t seq;
+} ring_event_t;
+
+#define RING_EVENTS 20000
+
+static ringbuffer_t ring_mpsc = {"ring_mpsc", sizeof(ring_event_t), 64, RINGBUFFER_MPSC, 16};
+static uint32_t ring_produced[HASHTABLE_SIZE];
+
+/**
+ * A producer pushes RING_EVENTS events, retries when the ring is full
+ */
+static int ring_producer(void *thread_arg)
+{
+    const uint32_t producer = (uint32_t)(size_t)thread_arg;
+    if (ring_produced[producer] >= RING_EVENTS)
+    {
+        return 0;
+    }
+    ring_event_t *event = (ring_event_t *)ringbuffer_reserve(&ring_mpsc);
+    if (!event)
+    {
+        linux_thread_yield();
+        return 1;
+    }
+    event->producer = producer;
+    event->seq = ring_produced[producer];
+    ringbuffer_commit(&ring_mpsc, event);
+    ring_produced[producer]++;
+    return 1;
+}
+
+typedef struct
+{
+    uint32_t expected[HASHTABLE_SIZE];
+    size_t events;
+    int failed;
+} ring_consumer_t;
+
+static void ring_consume(const void *payload, void *ctx)
+{
+    const ring_event_t *event = (const ring_event_t *)payload;
+    ring_consumer_t *consumer = (ring_consumer_t *)ctx;
+    if (event->seq != consumer->expected[event->producer])
+    {
+        consumer->failed = 1;
+    }
+    consumer->expected[event->producer] = event->seq + 1;
+    consumer->events++;
+}
+
+/**
+ * SPSC ring: drops when full, keeps the order; MPSC ring: the events of every
+ * producer arrive in order and none is lost; a second mapping of the file consumes
+ * the events of the first
+ */
+static int ringbuffer_access(int cpus)
+{
+    ringbuffer_t ring = {"ring_spsc", sizeof(uint32_t), 8, RINGBUFFER_SPSC, 1};
+    uint32_t value;
+    if (!ringbuffer_init(&ring))
+    {
+        return 0;
+    }
+    for (uint32_t i = 0;i < ring.count;i++)
+    {
+        ringbuffer_push(&ring, &i);
+    }
+    value = 0;
+    if (ringbuffer_push(&ring, &value) || (ring.__header->drops != 1))
+    {
+        linux_log(LINUX_LOG_ERROR, "Push to the full ring succeeded");
+        ringbuffer_close(&ring);
+        return 0;
+    }
+    for (uint32_t i = 0;i < ring.count;i++)
+    {
+        if (!ringbuffer_pop(&ring, &value) || (value != i))
+        {
+            linux_log(LINUX_LOG_ERROR, "Pop %u from the ring returned %u", i, value);
+            ringbuffer_close(&ring);
+            return 0;
+        }
+    }
+    if (ringbuffer_pop(&ring, &value))
+    {
+        linux_log(LINUX_LOG_ERROR, "Pop from the empty ring succeeded");
+        ringbuffer_close(&ring);
+        return 0;
+    }
+    ringbuffer_close(&ring);
+
+    if (!ringbuffer_init(&ring_mpsc))
+    {
+        return 0;
+    }
+    linux_task_state_t *states = (linux_task_state_t*)calloc(cpus + 1, sizeof(linux_task_state_t));
+    static ring_consumer_t consumer;
+    int rc = 1;
+    for (int i = 0;(i < cpus) && rc;i++)
+    {
+        states[i].properties.name = "ring";
+        states[i].properties.task = ring_producer;
+        states[i].properties.task_arg = (void*)(size_t)i;
+        rc = linux_thread_start(&states[i]);
+    }
+    for (int idle = 0;rc && (consumer.events < (size_t)cpus * RING_EVENTS) && (idle < 1000);)
+    {
+        if (ringbuffer_consume(&ring_mpsc, ring_consume, &consumer, 32))
+        {
+            idle = 0;
+        }
+        else if (ringbuffer_sleep_begin(&ring_mpsc))
+        {
+            linux_ms_sleep(1);
+            ringbuffer_sleep_end(&ring_mpsc);
+            idle++;
+        }
+    }
+    linux_thread_join_all(states);
+    free(states);
+    ringbuffer_close(&ring_mpsc);
+    if (!rc || consumer.failed || (consumer.events != (size_t)cpus * RING_EVENTS))
+    {
+        linux_log(LINUX_LOG_ERROR, "Consumed %zu events of %d, order %s", consumer.events, cpus * RING_EVENTS,
+                consumer.failed ? "broken" : "ok");
+        return 0;
+    }
+
+    static const char path[] = "/tmp/hashtable_test_ring";
+    ringbuffer_t reader = {"ring_reader"};
+    value = 7;
+    rc = ringbuffer_init_path(&ring, path) && ringbuffer_attach(&reader, path);
+    rc = rc && (reader.count == ring.count) && (reader.record_size == ring.record_size);
+    rc = rc && ringbuffer_push(&ring, &value);
+    value = 0;
+    rc = rc && ringbuffer_pop(&reader, &value) && (value == 7) && !ringbuffer_pop(&ring, &value);
+    ringbuffer_close(&reader);
+    ringbuffer_close(&ring);
+    /* The records of a truncated file are not mapped */
+    rc = rc && ringbuffer_init_path(&ring, path) && !truncate(path, RINGBUFFER_HEADER_SIZE) &&
+        !ringbuffer_attach(&reader, path);
+    ringbuffer_close(&ring);
+    unlink(path);
+    if (!rc)
+    {
+        linux_log(LINUX_LOG_ERROR, "Failed to consume from the mapped ring %s", path);
+        return 0;
+    }
+    return 1;
+}
+
+int main()
+{
+    int cpus = 4; //linux_get_number_processors()
+    int rc;
+
+    do
+    {
+
+        rc = hashtable_uint32_init(&hashtable);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = synchronous_access(cpus);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = batch_access(cpus);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = atomic_access(cpus);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = scan_access();
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = foreach_access();
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = storage_access();
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = persist_access();
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = hashtable_bloom_init(&hashtable_bloom);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = filter_access();
+        hashtable_close(&hashtable_bloom);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = hashtable_set_init(&hashset);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = hashset_access();
+        hashtable_close(&hashset);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = template_access();
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = ordering_access(cpus);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = hashtable_tagged_init(&hashtable_tagged);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = tagged_access(cpus) && tagged_stall_access() && tagged_claim_access();
+        hashtable_close(&hashtable_tagged);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = pool_access();
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = hashtable_pooled_init(&hashtable_pooled) && hashtable_pool_init(&pool);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = pooled_access();
+        hashtable_close(&hashtable_pooled);
+        hashtable_pool_close(&pool);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = ringbuffer_access(cpus);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = hashtable_soa_init(&hashtable_soa);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = soa_access(cpus);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = single_copy_access();
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = hashtable_uint32_local_init(&local_tier);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = local_access() && local_spill_access();
+        hashtable_local_close(&local_tier);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = hashtable_ttl_init(&hashtable_ttl);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = expire_access() && expire_race_access();
+        hashtable_close(&hashtable_ttl);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = hashtable_two_choice_init(&hashtable_two_choice);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = two_choice_access(cpus);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = two_choice_relocate();
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = hashtable_backyard_init(&hashtable_backyard);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = backyard_access();
+        hashtable_close(&hashtable_backyard);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = hashtable_pair_init(&hashtable_pair);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = pair_access(cpus);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = hashtable_grow_init(&hashtable_grow);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = grow_access();
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = hashtable_stuck_init(&hashtable_stuck);
+        if (!rc)
+        {
+            break;
+        }
+
+        rc = stuck_access();
+        hashtable_close(&hashtable_stuck);
+        if (!rc)
+        {
+            break;
+        }
+
+        /* The list of the tasks ends with name = NULL */
+        linux_task_state_t *states = (linux_task_state_t*)calloc(cpus + 1, sizeof(linux_task_state_t));
+        rc = create_threads(states, cpus);
+        if (rc)
+        {
+            linux_ms_sleep(TEST_THREADS_MS);
+        }
+        linux_thread_exit_all(states);
+        linux_thread_join_all(states);
+        rc = rc && !thread_failed;
+        for (int i = 0;i < cpus;i++)
+        {
+            free((void*)states[i].properties.name);
+        }
+        free(states);
+
+        char buf[16*1024];
+        hashtable_show(buf, ARRAY_SIZE(buf));
+        linux_log(LINUX_LOG_INFO, "%s", buf);
+        rc = rc && export_access(buf, ARRAY_SIZE(buf));
+        rc = rc && stats_page_access();
+        hashtable_close(&hashtable);
+    }
+    while (0);
+
+    linux_log(rc ? LINUX_LOG_INFO : LINUX_LOG_ERROR, "Test %s", rc ? "passed" : "failed");
+    return rc ? 0 : 1;
 }
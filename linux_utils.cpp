@@ -282,6 +282,204 @@ int linux_thread_force_exit(linux_task_state_t *state) {
 	return 0;
 }
 
+int linux_get_number_processors(void) {
+	long res = sysconf(_SC_NPROCESSORS_ONLN);
+	return (res > 0) ? (int) res : 1;
+}
+
+static bool linux_is_node(int index, const char *name) {
+	int node;
+	return (sscanf(name, "node%d", &node) == 1);
+}
+
+int linux_get_number_nodes(void) {
+	int res = linux_scan_folder("/sys/devices/system/node", linux_is_node, NULL);
+	return (res > 0) ? res : 1;
+}
+
+/**
+ * The list is a comma separated list of the ranges, for example "0-3,8-11"
+ */
+int linux_get_node_cpus(int node, cpu_set_t *cpus) {
+	char path[128];
+	char list[1024];
+	int res = 0;
+
+	CPU_ZERO(cpus);
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return 0;
+	}
+	if (fgets(list, sizeof(list), file) != NULL) {
+		char *p = list;
+		while ((*p >= '0') && (*p <= '9')) {
+			long first = strtol(p, &p, 10);
+			long last = first;
+			if (*p == '-') {
+				last = strtol(p + 1, &p, 10);
+			}
+			for (long cpu = first; (cpu <= last) && (cpu < CPU_SETSIZE); cpu++) {
+				CPU_SET(cpu, cpus);
+				res++;
+			}
+			if (*p == ',') {
+				p++;
+			}
+		}
+	}
+	fclose(file);
+
+	return res;
+}
+
+static void *linux_pool_main(void *args) {
+	linux_pool_worker_t *worker = (linux_pool_worker_t*) args;
+	linux_pool_t *pool = worker->pool;
+	int res;
+
+	if (pool->priority > 0) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = pool->priority;
+		res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (res) {
+			linux_log(LINUX_LOG_WARNING, "Failed to set priority %d for pool %s: %s (%d)",
+					pool->priority, pool->name, strerror(res), res);
+		}
+	}
+	__sync_fetch_and_add(&pool->ready, 1);
+	while (pool->go_flag == 0) {
+		sched_yield();
+	}
+	while (pool->stop_flag == 0) {
+		res = pool->task(pool->task_arg, worker);
+		if (res != 1) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+int linux_pool_init(linux_pool_t *pool) {
+	int res = 0, created = 0, count = 0;
+	int list[CPU_SETSIZE];
+	cpu_set_t cpus;
+	void *workers = NULL;
+
+	do {
+		if (pool->threads <= 0) {
+			linux_log(LINUX_LOG_ERROR, "No threads in pool %s", pool->name);
+			break;
+		}
+		if (pool->numa_node >= 0) {
+			if (!linux_get_node_cpus(pool->numa_node, &cpus)) {
+				linux_log(LINUX_LOG_ERROR, "No CPUs in node %d for pool %s",
+						pool->numa_node, pool->name);
+				break;
+			}
+		} else if (sched_getaffinity(0, sizeof(cpus), &cpus)) {
+			CPU_ZERO(&cpus);
+		}
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &cpus)) {
+				list[count++] = cpu;
+			}
+		}
+
+		if (posix_memalign(&workers, LINUX_CACHE_LINE, pool->threads * sizeof(linux_pool_worker_t))) {
+			linux_log(LINUX_LOG_ERROR, "Failed to allocate %d workers for pool %s",
+					pool->threads, pool->name);
+			break;
+		}
+		memset(workers, 0, pool->threads * sizeof(linux_pool_worker_t));
+		pool->workers = (linux_pool_worker_t*) workers;
+		pool->ready = 0;
+		pool->go_flag = 0;
+		pool->stop_flag = 0;
+
+		for (created = 0; created < pool->threads; created++) {
+			linux_pool_worker_t *worker = &pool->workers[created];
+			pthread_attr_t attr;
+			worker->pool = pool;
+			worker->index = created;
+			worker->cpu = count ? list[created % count] : -1;
+			pthread_attr_init(&attr);
+			if (worker->cpu >= 0) {
+				/* The stack of the thread is allocated on the node of the CPU */
+				cpu_set_t cpu;
+				CPU_ZERO(&cpu);
+				CPU_SET(worker->cpu, &cpu);
+				pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+			}
+			int err = pthread_create(&worker->thread, &attr, linux_pool_main, worker);
+			pthread_attr_destroy(&attr);
+			if (err) {
+				linux_log(LINUX_LOG_ERROR, "Failed to create worker %d of pool %s: %s (%d)",
+						created, pool->name, strerror(err), err);
+				break;
+			}
+		}
+		if (created < pool->threads) {
+			pool->stop_flag = 1;
+			pool->go_flag = 1;
+			for (int i = 0; i < created; i++) {
+				pthread_join(pool->workers[i].thread, NULL);
+			}
+			linux_pool_close(pool);
+			break;
+		}
+
+		linux_log(LINUX_LOG_INFO_EXT, "Pool '%s' of %d threads on %d CPUs",
+				pool->name, pool->threads, count);
+		res = 1;
+	} while (0);
+
+	return res;
+}
+
+void linux_pool_start(linux_pool_t *pool) {
+	while (pool->ready < pool->threads) {
+		sched_yield();
+	}
+	pool->go_flag = 1;
+}
+
+void linux_pool_stop(linux_pool_t *pool) {
+	pool->stop_flag = 1;
+}
+
+int linux_pool_join(linux_pool_t *pool) {
+	int res = 1;
+
+	/* The workers which did not start exit immediately */
+	if (pool->go_flag == 0) {
+		pool->stop_flag = 1;
+		pool->go_flag = 1;
+	}
+	for (int i = 0; i < pool->threads; i++) {
+		if (pthread_join(pool->workers[i].thread, NULL)) {
+			res = 0;
+		}
+	}
+
+	return res;
+}
+
+void linux_pool_close(linux_pool_t *pool) {
+	free(pool->workers);
+	pool->workers = NULL;
+}
+
+void linux_pool_counters(const linux_pool_t *pool, linux_pool_counters_t *total) {
+	memset(total, 0, sizeof(*total));
+	for (int i = 0; i < pool->threads; i++) {
+		total->ops += pool->workers[i].counters.ops;
+		total->errors += pool->workers[i].counters.errors;
+	}
+}
+
 void linux_ms_sleep(unsigned long ms) {
 	usleep(1000 * ms);
 }
@@ -24,6 +24,7 @@
 
 #include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include <semaphore.h>
 #include <unistd.h>
@@ -151,6 +152,122 @@ extern int linux_thread_exit_all(linux_task_state_t *state);
  */
 extern int linux_thread_force_exit(linux_task_state_t *state);
 
+/**
+ * Number of the online CPUs
+ */
+extern int linux_get_number_processors(void);
+
+/**
+ * Number of the NUMA nodes, 1 if the system does not report the nodes
+ */
+extern int linux_get_number_nodes(void);
+
+/**
+ * The CPUs of the NUMA node from /sys/devices/system/node/node<N>/cpulist
+ * @return number of the CPUs, 0 if the node does not exist
+ */
+extern int linux_get_node_cpus(int node, cpu_set_t *cpus);
+
+#define LINUX_CACHE_LINE 64
+
+/**
+ * Counters of a worker, a worker writes only its own cache line
+ */
+typedef struct {
+	uint64_t ops;
+	uint64_t errors;
+} __attribute__((aligned(LINUX_CACHE_LINE))) linux_pool_counters_t;
+
+struct linux_pool_s;
+
+typedef struct {
+	/**
+	 * The first cache line, updated by the worker
+	 */
+	linux_pool_counters_t counters;
+
+	struct linux_pool_s *pool;
+
+	/**
+	 * 0..threads-1
+	 */
+	int index;
+
+	/**
+	 * The CPU of the worker, -1 if the worker is not pinned
+	 */
+	int cpu;
+
+	pthread_t thread;
+} __attribute__((aligned(LINUX_CACHE_LINE))) linux_pool_worker_t;
+
+/**
+ * Call the task in loop until the return value is not 1 or linux_pool_stop()
+ */
+typedef int (*linux_pool_task_t)(void *task_arg, linux_pool_worker_t *worker);
+
+/**
+ * Pool of the worker threads for the scaling tests
+ * The worker N runs on the CPU number N % cpus in the list of the CPUs of 'numa_node',
+ * or of the CPUs of the process if 'numa_node' is -1. The workers spin on a shared start
+ * barrier, linux_pool_start() releases all workers at the same time
+ */
+typedef struct linux_pool_s {
+	/**
+	 * These fields are set by application
+	 */
+	const char *name;
+	linux_pool_task_t task;
+	void *task_arg;
+	int threads;
+	int numa_node;
+
+	/**
+	 * SCHED_FIFO priority of the workers, 0 - the default scheduling class
+	 */
+	int priority;
+
+	/**
+	 * Used by the pool
+	 */
+	linux_pool_worker_t *workers;
+	volatile int ready;
+	volatile int go_flag;
+	volatile int stop_flag;
+} linux_pool_t;
+
+/**
+ * Create the pinned workers, the workers wait for linux_pool_start()
+ * @return 1 if Ok
+ */
+extern int linux_pool_init(linux_pool_t *pool);
+
+/**
+ * Release the workers
+ */
+extern void linux_pool_start(linux_pool_t *pool);
+
+/**
+ * Break the task loop of all workers
+ */
+extern void linux_pool_stop(linux_pool_t *pool);
+
+/**
+ * Wait for all workers to complete
+ * @return 1 if Ok
+ */
+extern int linux_pool_join(linux_pool_t *pool);
+
+/**
+ * Free the workers after linux_pool_join()
+ */
+extern void linux_pool_close(linux_pool_t *pool);
+
+/**
+ * Sum of the counters of the workers
+ */
+extern void linux_pool_counters(const linux_pool_t *pool, linux_pool_counters_t *total);
+
 static inline uint32_t linux_inc_index(uint32_t index, uint32_t max_index) {
 	(index)++;
 	if (index > max_index) {
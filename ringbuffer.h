@@ -0,0 +1,509 @@
+/**
+ *   Lockfree is a set of lockfree containers for Linux and Linux kernel
+ *   Copyright (C) <2017>  Arkady Miasnikov
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Implementation of lockfree ring buffer of fixed size records
+ * The ring buffer ships events, for example the matched entries of the hashtable,
+ * from the probes to a consumer in userspace
+ *
+ * RINGBUFFER_SPSC - a single producer, for example a ring for every CPU in the kernel,
+ *   the producer does not use atomic operations
+ * RINGBUFFER_MPSC - any context can produce, a producer reserves a record with
+ *   compare-and-set
+ *
+ * Every record carries a sequence number. The producer reserves the record,
+ * writes the payload in place and commits the record. The consumer reads the payload
+ * in place and releases the record. The header and the records are in a single memory
+ * area which the consumer can map: a file in userspace, ringbuffer_mmap() in the kernel.
+ * If the ring is full the record is dropped and counted.
+ *
+ * Limitation: a single consumer.
+ */
+
+#pragma once
+
+
+#ifdef __KERNEL__
+#   include "linux/types.h"
+#   include "linux/kernel.h"
+#   include "linux/string.h"
+#   include "linux/mm.h"
+#   include "linux/vmalloc.h"
+#   include "linux/printk.h"
+#   define RINGBUFFER_PRINTF(s, ...) printk(KERN_ALERT "ringbuffer: %s: " s "\n", __func__, __VA_ARGS__)
+#   define RINGBUFFER_CMPXCHG(p, val, new_val) cmpxchg(p, val, new_val)
+/* The payload is written before the sequence, the sequence is read before the payload */
+#   define RINGBUFFER_WMB() smp_wmb()
+#   define RINGBUFFER_RMB() smp_rmb()
+#   define RINGBUFFER_MB() smp_mb()
+#else
+#   include <stdint.h>
+#   include <stdio.h>
+#   include <string.h>
+#   include <unistd.h>
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   define RINGBUFFER_PRINTF(s, ...) printf("%s: " s "\n", __func__, __VA_ARGS__)
+#   define RINGBUFFER_CMPXCHG(p, val, new_val) __sync_val_compare_and_swap(p, val, new_val)
+#   define RINGBUFFER_WMB() __sync_synchronize()
+#   define RINGBUFFER_RMB() __sync_synchronize()
+#   define RINGBUFFER_MB() __sync_synchronize()
+#endif
+
+#define RINGBUFFER_MAGIC      0x52494e47
+#define RINGBUFFER_VERSION    1
+#define RINGBUFFER_CACHE_LINE 64
+
+#define RINGBUFFER_SPSC 0
+#define RINGBUFFER_MPSC 1
+
+/**
+ * The producers and the consumer write different cache lines
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t mode;
+    /* Bytes between the records, the sequence and the payload */
+    uint32_t stride;
+    /* Bytes of payload in a record */
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t memory_size;
+
+    /* Next record to reserve */
+    volatile uint64_t head __attribute__((aligned(RINGBUFFER_CACHE_LINE)));
+    /* Records dropped because the ring was full */
+    volatile uint64_t drops;
+
+    /* Next record to read */
+    volatile uint64_t tail __attribute__((aligned(RINGBUFFER_CACHE_LINE)));
+
+    /* The consumer is about to sleep, see ringbuffer_sleep_begin() */
+    volatile uint32_t sleeping __attribute__((aligned(RINGBUFFER_CACHE_LINE)));
+    uint32_t wakeup_batch;
+} ringbuffer_header_t;
+
+typedef struct
+{
+    /* The record is free for the position 'seq', committed for the position 'seq-1' */
+    volatile uint64_t seq;
+} ringbuffer_record_t;
+
+typedef struct
+{
+    const char *name;
+    /* Bytes of payload in a record */
+    size_t record_size;
+    /* Number of the records, a power of 2 */
+    size_t count;
+    /* RINGBUFFER_SPSC or RINGBUFFER_MPSC */
+    int mode;
+    /* ringbuffer_need_wakeup() returns 1 if at least wakeup_batch records are pending */
+    size_t wakeup_batch;
+
+    ringbuffer_header_t *__header;
+    char *__records;
+    /* The consumer maps the ring of another process */
+    int __attached;
+} ringbuffer_t;
+
+#define RINGBUFFER_HEADER_SIZE                                                                                                    \
+    ((sizeof(ringbuffer_header_t) + RINGBUFFER_CACHE_LINE - 1) & ~(size_t)(RINGBUFFER_CACHE_LINE - 1))
+
+static inline size_t ringbuffer_memory_size(const ringbuffer_t *ringbuffer, uint32_t *stride)
+{
+    const size_t page_size = 4096;
+    *stride = (uint32_t)((sizeof(ringbuffer_record_t) + ringbuffer->record_size + sizeof(uint64_t) - 1) &
+            ~(sizeof(uint64_t) - 1));
+    return (RINGBUFFER_HEADER_SIZE + ringbuffer->count * (*stride) + page_size - 1) & ~(page_size - 1);
+}
+
+static inline ringbuffer_record_t *ringbuffer_record(const ringbuffer_t *ringbuffer, const uint64_t position)
+{
+    const ringbuffer_header_t *header = ringbuffer->__header;
+    return (ringbuffer_record_t *)(ringbuffer->__records + (position & (header->count - 1)) * header->stride);
+}
+
+static inline void *ringbuffer_payload(ringbuffer_record_t *record)
+{
+    return (void *)(record + 1);
+}
+
+/**
+ * Set the header and the sequences of the records in the memory 'p'
+ */
+static inline int ringbuffer_init_memory(ringbuffer_t *ringbuffer, void *p, const size_t memory_size, const uint32_t stride)
+{
+    ringbuffer_header_t *header = (ringbuffer_header_t *)p;
+    size_t i;
+    memset(header, 0, RINGBUFFER_HEADER_SIZE);
+    header->magic = RINGBUFFER_MAGIC;
+    header->version = RINGBUFFER_VERSION;
+    header->mode = ringbuffer->mode;
+    header->stride = stride;
+    header->record_size = ringbuffer->record_size;
+    header->count = ringbuffer->count;
+    header->memory_size = memory_size;
+    header->wakeup_batch = ringbuffer->wakeup_batch ? ringbuffer->wakeup_batch : 1;
+    ringbuffer->__header = header;
+    ringbuffer->__records = (char *)p + RINGBUFFER_HEADER_SIZE;
+    for (i = 0;i < ringbuffer->count;i++)
+    {
+        ringbuffer_record(ringbuffer, i)->seq = i;
+    }
+    return 1;
+}
+
+static inline int ringbuffer_check(const ringbuffer_t *ringbuffer)
+{
+    if ((ringbuffer->count < 2) || (ringbuffer->count & (ringbuffer->count - 1)) || !ringbuffer->record_size)
+    {
+        RINGBUFFER_PRINTF("Bad geometry of the ring %s: %zu records of %zu bytes", ringbuffer->name,
+                ringbuffer->count, ringbuffer->record_size);
+        return 0;
+    }
+    return 1;
+}
+
+#ifdef __KERNEL__
+/**
+ * The memory is zeroed and can be mapped to userspace, see ringbuffer_mmap()
+ */
+static inline int ringbuffer_init(ringbuffer_t *ringbuffer)
+{
+    uint32_t stride;
+    const size_t memory_size = ringbuffer_memory_size(ringbuffer, &stride);
+    void *p;
+    if (!ringbuffer_check(ringbuffer))
+    {
+        return 0;
+    }
+    p = vmalloc_user(memory_size);
+    if (!p)
+    {
+        RINGBUFFER_PRINTF("Failed to allocate %zu for the ring %s", memory_size, ringbuffer->name);
+        return 0;
+    }
+    return ringbuffer_init_memory(ringbuffer, p, memory_size, stride);
+}
+
+/**
+ * Call from the mmap() of a character device or a debugfs file, maps the whole ring
+ * from the offset 0. vmalloc_user() set VM_USERMAP on the area, remap_vmalloc_range()
+ * fails on the memory of vmalloc()
+ * Returns 0 or a negative errno
+ */
+static inline int ringbuffer_mmap(const ringbuffer_t *ringbuffer, struct vm_area_struct *vma)
+{
+    return remap_vmalloc_range(vma, ringbuffer->__header, 0);
+}
+
+static inline void ringbuffer_close(ringbuffer_t *ringbuffer)
+{
+    if (ringbuffer->__header)
+    {
+        vfree(ringbuffer->__header);
+        ringbuffer->__header = NULL;
+    }
+}
+#else
+/**
+ * Allocate the ring in the file 'path', or in anonymous shared memory if path is NULL
+ * The anonymous ring is shared with the children after fork()
+ */
+static inline int ringbuffer_init_path(ringbuffer_t *ringbuffer, const char *path)
+{
+    uint32_t stride;
+    const size_t memory_size = ringbuffer_memory_size(ringbuffer, &stride);
+    int flags = MAP_SHARED;
+    int fd = -1;
+    void *p;
+    if (!ringbuffer_check(ringbuffer))
+    {
+        return 0;
+    }
+    if (path)
+    {
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if ((fd < 0) || (ftruncate(fd, memory_size) != 0))
+        {
+            RINGBUFFER_PRINTF("Failed to create %s", path);
+            if (fd >= 0)
+                close(fd);
+            return 0;
+        }
+    }
+    else
+    {
+        flags |= MAP_ANONYMOUS;
+    }
+    p = mmap(NULL, memory_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (p == MAP_FAILED)
+    {
+        RINGBUFFER_PRINTF("Failed to map %zu bytes for the ring %s", memory_size, ringbuffer->name);
+        return 0;
+    }
+    ringbuffer->__attached = 0;
+    return ringbuffer_init_memory(ringbuffer, p, memory_size, stride);
+}
+
+static inline int ringbuffer_init(ringbuffer_t *ringbuffer)
+{
+    return ringbuffer_init_path(ringbuffer, NULL);
+}
+
+/**
+ * The consumer maps the ring which another process created with ringbuffer_init_path()
+ * The geometry is read from the header
+ */
+static inline int ringbuffer_attach(ringbuffer_t *ringbuffer, const char *path)
+{
+    ringbuffer_header_t header;
+    struct stat st;
+    void *p;
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        RINGBUFFER_PRINTF("Failed to open %s", path);
+        return 0;
+    }
+    if ((read(fd, &header, sizeof(header)) != sizeof(header)) || (header.magic != RINGBUFFER_MAGIC) ||
+        (header.version != RINGBUFFER_VERSION))
+    {
+        RINGBUFFER_PRINTF("%s is not a ring", path);
+        close(fd);
+        return 0;
+    }
+    /* The records fit the mapping and the mapping fits the file */
+    if ((fstat(fd, &st) != 0) || (header.count < 2) || (header.count & (header.count - 1)) ||
+        (header.stride < (sizeof(ringbuffer_record_t) + header.record_size)) ||
+        (header.memory_size < RINGBUFFER_HEADER_SIZE) || (header.memory_size > (uint64_t)st.st_size) ||
+        (header.count > ((header.memory_size - RINGBUFFER_HEADER_SIZE) / header.stride)))
+    {
+        RINGBUFFER_PRINTF("Bad geometry of the ring %s", path);
+        close(fd);
+        return 0;
+    }
+    p = mmap(NULL, header.memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        RINGBUFFER_PRINTF("Failed to map %s", path);
+        return 0;
+    }
+    ringbuffer->__header = (ringbuffer_header_t *)p;
+    ringbuffer->__records = (char *)p + RINGBUFFER_HEADER_SIZE;
+    ringbuffer->count = header.count;
+    ringbuffer->record_size = header.record_size;
+    ringbuffer->mode = header.mode;
+    ringbuffer->wakeup_batch = header.wakeup_batch;
+    ringbuffer->__attached = 1;
+    return 1;
+}
+
+static inline void ringbuffer_close(ringbuffer_t *ringbuffer)
+{
+    if (ringbuffer->__header)
+    {
+        munmap(ringbuffer->__header, ringbuffer->__header->memory_size);
+        ringbuffer->__header = NULL;
+    }
+}
+#endif
+
+/**
+ * Reserve a record, write the payload and call ringbuffer_commit()
+ * Returns the payload or NULL if the ring is full
+ */
+static inline void *ringbuffer_reserve(ringbuffer_t *ringbuffer)
+{
+    ringbuffer_header_t *header = ringbuffer->__header;
+    while (1)
+    {
+        const uint64_t head = header->head;
+        ringbuffer_record_t *record = ringbuffer_record(ringbuffer, head);
+        const int64_t diff = (int64_t)(record->seq - head);
+        if (diff == 0)
+        {
+            if (header->mode == RINGBUFFER_SPSC)
+            {
+                header->head = head + 1;
+                return ringbuffer_payload(record);
+            }
+            if (RINGBUFFER_CMPXCHG(&header->head, head, head + 1) == head)
+            {
+                return ringbuffer_payload(record);
+            }
+        }
+        else if (diff < 0)
+        {
+            /* The consumer did not release the record of the previous lap */
+            if (header->mode == RINGBUFFER_SPSC)
+                header->drops++;
+            else
+                __sync_fetch_and_add(&header->drops, 1);
+            return NULL;
+        }
+        /* Another producer reserved the record */
+    }
+}
+
+static inline void ringbuffer_commit(ringbuffer_t *ringbuffer, void *payload)
+{
+    ringbuffer_record_t *record = (ringbuffer_record_t *)payload - 1;
+    (void)ringbuffer;
+    RINGBUFFER_WMB();
+    record->seq = record->seq + 1;
+}
+
+/**
+ * Returns 1 if the consumer sleeps and there are enough records to wake it up
+ * A producer calls the function after the commit and wakes the consumer up, for
+ * example with wake_up() in the kernel or a futex in userspace
+ */
+static inline int ringbuffer_need_wakeup(const ringbuffer_t *ringbuffer)
+{
+    const ringbuffer_header_t *header = ringbuffer->__header;
+    /* The commit is visible before the read of the flag, see ringbuffer_sleep_begin() */
+    RINGBUFFER_MB();
+    if (!header->sleeping)
+    {
+        return 0;
+    }
+    return (header->head - header->tail) >= header->wakeup_batch;
+}
+
+/**
+ * The consumer reads the payload in place and calls ringbuffer_release()
+ * Returns NULL if the ring is empty
+ */
+static inline const void *ringbuffer_peek(const ringbuffer_t *ringbuffer)
+{
+    const uint64_t tail = ringbuffer->__header->tail;
+    ringbuffer_record_t *record = ringbuffer_record(ringbuffer, tail);
+    if (record->seq != (tail + 1))
+    {
+        return NULL;
+    }
+    RINGBUFFER_RMB();
+    return ringbuffer_payload(record);
+}
+
+static inline void ringbuffer_release(ringbuffer_t *ringbuffer)
+{
+    ringbuffer_header_t *header = ringbuffer->__header;
+    const uint64_t tail = header->tail;
+    ringbuffer_record_t *record = ringbuffer_record(ringbuffer, tail);
+    RINGBUFFER_MB();
+    record->seq = tail + header->count;
+    header->tail = tail + 1;
+}
+
+/**
+ * Call callback() for up to 'max' committed records, the records are released
+ * after the callback returns. The tail is written once for the whole batch
+ * Returns the number of the records
+ */
+static inline size_t ringbuffer_consume(ringbuffer_t *ringbuffer, void (*callback)(const void *payload, void *ctx),
+        void *ctx, const size_t max)
+{
+    ringbuffer_header_t *header = ringbuffer->__header;
+    const uint64_t tail = header->tail;
+    size_t n;
+    for (n = 0;n < max;n++)
+    {
+        ringbuffer_record_t *record = ringbuffer_record(ringbuffer, tail + n);
+        if (record->seq != (tail + n + 1))
+        {
+            break;
+        }
+        RINGBUFFER_RMB();
+        callback(ringbuffer_payload(record), ctx);
+        RINGBUFFER_MB();
+        record->seq = tail + n + header->count;
+    }
+    if (n)
+    {
+        header->tail = tail + n;
+    }
+    return n;
+}
+
+/**
+ * Copy the record to the ring
+ * Returns 1 on success, 0 if the ring is full
+ */
+static inline int ringbuffer_push(ringbuffer_t *ringbuffer, const void *data)
+{
+    void *payload = ringbuffer_reserve(ringbuffer);
+    if (!payload)
+    {
+        return 0;
+    }
+    memcpy(payload, data, ringbuffer->record_size);
+    ringbuffer_commit(ringbuffer, payload);
+    return 1;
+}
+
+/**
+ * Copy the oldest record from the ring
+ * Returns 1 on success, 0 if the ring is empty
+ */
+static inline int ringbuffer_pop(ringbuffer_t *ringbuffer, void *data)
+{
+    const void *payload = ringbuffer_peek(ringbuffer);
+    if (!payload)
+    {
+        return 0;
+    }
+    memcpy(data, payload, ringbuffer->record_size);
+    ringbuffer_release(ringbuffer);
+    return 1;
+}
+
+/**
+ * The consumer calls ringbuffer_sleep_begin() before it waits for the producers
+ * and does not wait if the function returns 0 - the records arrived. The waiting
+ * should be limited by a timeout, a producer wakes the consumer only after a batch
+ */
+static inline int ringbuffer_sleep_begin(ringbuffer_t *ringbuffer)
+{
+    ringbuffer_header_t *header = ringbuffer->__header;
+    header->sleeping = 1;
+    RINGBUFFER_MB();
+    if ((header->head - header->tail) >= header->wakeup_batch)
+    {
+        header->sleeping = 0;
+        return 0;
+    }
+    return 1;
+}
+
+static inline void ringbuffer_sleep_end(ringbuffer_t *ringbuffer)
+{
+    ringbuffer->__header->sleeping = 0;
+}
@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# Compare the cost of the dup_probe.stp probes with the hashtable (USE_HASHTABLE 1)
+# and with the SystemTap associative array (USE_HASHTABLE 0)
+# Every variant runs echo_test.sh, 'stap -t' collects the cycles spent in the probes
+# Usage: sudo ./stap_compare.sh [output folder]
+
+STAP_FLAGS="-g -t -k --suppress-time-limits -D MAXSKIPPED=0"
+OUTPUT=${1:-stap_compare_`date +%s`}
+mkdir -p $OUTPUT
+
+function run_variant()
+{
+  name=$1
+  use_hashtable=$2
+  script=$OUTPUT/dup_probe_$name.stp
+  report=$OUTPUT/stap_$name.txt
+  sed "s/@define USE_HASHTABLE %( [01] %)/@define USE_HASHTABLE %( $use_hashtable %)/" dup_probe.stp > $script
+
+  stap $STAP_FLAGS -o $report $script &
+  stap_pid=$!
+  # The module is ready after the compilation
+  while ! grep -q "is ready" $report 2>/dev/null; do
+    if ! kill -0 $stap_pid 2>/dev/null; then
+      echo "stap failed for $script"
+      return 1
+    fi
+    sleep 1
+  done
+
+  ./echo_test.sh > $OUTPUT/echo_$name.txt
+  kill -INT $stap_pid
+  wait $stap_pid
+}
+
+# Probe hits and average cycles from the 'stap -t' report, the total is weighted by the hits
+function show_variant()
+{
+  name=$1
+  lines=`awk '{sum += $1} END {print sum}' $OUTPUT/echo_$name.txt`
+  echo "$name: echo_test.sh wrote $lines lines"
+  sed -n 's/^\([^ ]*\) .*hits: \([0-9]*\), cycles: \([0-9]*\)min\/\([0-9]*\)avg\/\([0-9]*\)max.*/\1 \2 \4 \5/p' \
+    $OUTPUT/stap_$name.txt | grep "^syscall" | \
+  awk '{printf("  %-32s hits %10d avg %6d max %8d cycles\n", $1, $2, $3, $4); hits += $2; cycles += $2 * $3}
+       END {if (hits) printf("  %-32s hits %10d avg %6d cycles\n", "total", hits, cycles / hits)}'
+}
+
+run_variant hashtable 1 || exit 1
+run_variant array 0 || exit 1
+
+show_variant hashtable
+show_variant array